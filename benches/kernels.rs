@@ -0,0 +1,187 @@
+//! Single-patch throughput of the hydrodynamics kernel variants.
+//!
+//! Each variant of the iso2d advance kernel is run on the same patch of
+//! (perturbed) binary setup initial data, with the fields either interleaved
+//! or in planar layout. The results are checked to be bitwise identical, and
+//! the zone update rates are reported side by side. Rows with masses "no"
+//! use an isothermal equation of state and no point masses, which isolates
+//! the cost of the hydrodynamics from the gravity source terms. The simd
+//! column uses the
+//! widest vector instructions the CPU supports; set SAILFISH_SIMD=avx2 or
+//! SAILFISH_SIMD=scalar to measure the narrower code paths. Run with
+//! OMP_NUM_THREADS=1 for single-core numbers in OMP mode.
+//!
+//! usage: cargo bench --bench kernels -- [resolution] [repetitions]
+
+#[cfg(feature = "omp")]
+extern crate openmp_sys;
+
+use sailfish::iso2d;
+use sailfish::setups;
+use sailfish::{
+    BoundaryCondition, EquationOfState, ExecutionMode, FieldLayout, IndexSpace, Patch,
+    PointMassList, Setup, StructuredMesh,
+};
+use std::time::Instant;
+
+type AdvanceRk = unsafe extern "C" fn(
+    StructuredMesh,
+    *const f64,
+    *const f64,
+    *mut f64,
+    EquationOfState,
+    BoundaryCondition,
+    PointMassList,
+    f64,
+    f64,
+    f64,
+    *mut f64,
+    f64,
+    f64,
+    FieldLayout,
+    ExecutionMode,
+);
+
+fn mzps<F: FnMut()>(mesh: &StructuredMesh, repetitions: usize, mut f: F) -> f64 {
+    f();
+    let start = Instant::now();
+    for _ in 0..repetitions {
+        f()
+    }
+    (mesh.num_total_zones() * repetitions) as f64 / 1e6 / start.elapsed().as_secs_f64()
+}
+
+fn perturbed_primitive(setup: &dyn Setup, mesh: &StructuredMesh) -> Patch {
+    let space = IndexSpace::new(0..mesh.ni, 0..mesh.nj).extend_all(2);
+    Patch::from_slice_function(&space, setup.num_primitives(), |(i, j), prim| {
+        let [x, y] = mesh.cell_coordinates(i, j);
+        setup.initial_primitive(x, y, prim);
+        prim[0] *= 1.0 + 0.1 * (7.0 * x).sin() * (5.0 * y).cos();
+    })
+}
+
+fn iso2d_advance(
+    setup: &dyn Setup,
+    mesh: &StructuredMesh,
+    primitive: &Patch,
+    nu: f64,
+    masses: bool,
+    mode: ExecutionMode,
+    layout: FieldLayout,
+    advance_rk: AdvanceRk,
+    repetitions: usize,
+) -> (f64, Patch) {
+    let primitive = primitive.to_layout(layout);
+    let mut conserved =
+        Patch::zeros(3, &IndexSpace::new(0..mesh.ni, 0..mesh.nj)).into_layout(layout);
+    let mut result = primitive.clone();
+    let mut sources = vec![0.0; unsafe { iso2d::iso2d_source_sums_len(*mesh) } as usize];
+    let (eos, mass_list) = if masses {
+        (setup.equation_of_state(), setup.masses(0.0))
+    } else {
+        let eos = EquationOfState::Isothermal {
+            sound_speed_squared: 0.01,
+        };
+        (eos, PointMassList::default())
+    };
+
+    unsafe {
+        iso2d::iso2d_primitive_to_conserved(
+            *mesh,
+            primitive.as_ptr(),
+            conserved.as_mut_ptr(),
+            layout,
+            mode,
+        );
+    }
+    let rate = mzps(mesh, repetitions, || unsafe {
+        advance_rk(
+            *mesh,
+            conserved.as_ptr(),
+            primitive.as_ptr(),
+            result.as_mut_ptr(),
+            eos,
+            setup.boundary_condition(),
+            mass_list,
+            nu,
+            0.5,
+            1e-3,
+            sources.as_mut_ptr(),
+            1.0,
+            f64::MAX,
+            layout,
+            mode,
+        )
+    });
+    (rate, result.into_layout(FieldLayout::Interleaved))
+}
+
+fn main() {
+    let args: Vec<String> = std::env::args()
+        .skip(1)
+        .filter(|a| !a.starts_with('-'))
+        .collect();
+    let resolution = args.get(0).map_or(1024, |a| a.parse().unwrap());
+    let repetitions = args.get(1).map_or(10, |a| a.parse().unwrap());
+
+    let setup = setups::make_setup("binary", "").unwrap();
+    let mesh = StructuredMesh::centered_square(12.0, resolution);
+    let primitive = perturbed_primitive(setup.as_ref(), &mesh);
+
+    let mut modes = vec![ExecutionMode::CPU];
+
+    if sailfish::compiled_with_omp() {
+        modes.push(ExecutionMode::OMP)
+    }
+
+    println!(
+        "iso2d_advance_rk on a {0}x{0} patch, {1} repetitions, simd width {2}",
+        resolution,
+        repetitions,
+        unsafe { iso2d::iso2d_simd_width() }
+    );
+    println!(
+        "{:<6} {:<8} {:<7} {:>12} {:>12} {:>12} {:>12} {:>8}",
+        "mode", "nu", "masses", "zone", "tiled", "planar", "simd", "bitwise"
+    );
+
+    for mode in modes {
+        for (nu, masses) in [
+            (0.0, true),
+            (setup.viscosity().unwrap_or(0.0), true),
+            (0.0, false),
+        ] {
+            #[rustfmt::skip]
+            let (zone, a) = iso2d_advance(setup.as_ref(), &mesh, &primitive, nu, masses, mode, FieldLayout::Interleaved, iso2d::iso2d_advance_rk, repetitions);
+            #[rustfmt::skip]
+            let (tiled, b) = iso2d_advance(setup.as_ref(), &mesh, &primitive, nu, masses, mode, FieldLayout::Interleaved, iso2d::iso2d_advance_rk_tiled, repetitions);
+            #[rustfmt::skip]
+            let (planar, c) = iso2d_advance(setup.as_ref(), &mesh, &primitive, nu, masses, mode, FieldLayout::Planar, iso2d::iso2d_advance_rk, repetitions);
+            #[rustfmt::skip]
+            let (simd, d) = iso2d_advance(setup.as_ref(), &mesh, &primitive, nu, masses, mode, FieldLayout::Planar, iso2d::iso2d_advance_rk_simd, repetitions);
+            let bitwise = |x: &Patch, y: &Patch| {
+                x.as_slice()
+                    .unwrap()
+                    .iter()
+                    .zip(y.as_slice().unwrap())
+                    .all(|(x, y)| x.to_bits() == y.to_bits())
+            };
+
+            println!(
+                "{:<6} {:<8} {:<7} {:>7.3} Mzps {:>7.3} Mzps {:>7.3} Mzps {:>7.3} Mzps {:>8}",
+                format!("{:?}", mode),
+                nu,
+                if masses { "yes" } else { "no" },
+                zone,
+                tiled,
+                planar,
+                simd,
+                if bitwise(&a, &b) && bitwise(&a, &c) && bitwise(&a, &d) {
+                    "yes"
+                } else {
+                    "NO"
+                }
+            );
+        }
+    }
+}
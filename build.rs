@@ -20,6 +20,16 @@ fn use_omp() -> bool {
     }
 }
 
+fn use_mpi() -> bool {
+    cfg_if! {
+        if #[cfg(feature = "mpi")] {
+            true
+        } else {
+            false
+        }
+    }
+}
+
 fn main() {
     let plat = sf_build::Platform::discover(use_gpu());
     plat.build_src("src/iso2d/mod", use_omp())
@@ -31,4 +41,9 @@ fn main() {
     plat.build_src("src/sr1d/mod", use_omp())
         .compile("sr1d_mod");
     plat.emit_link_flags();
+
+    if use_mpi() {
+        sf_build::build_mpi("src/mpi/mod").compile("mpi_mod");
+        sf_build::emit_mpi_link_flags();
+    }
 }
@@ -0,0 +1,227 @@
+"""
+Reads sailfish checkpoint files, either in the chunked format (see
+src/checkpoint.rs), or in the older format, which is a single msgpack-encoded
+state. Chunked files are memory-mapped, so reading one field of the patches
+only touches that part of the file. Compressed patch data (written with
+--checkpoint-codec xor) is decoded as it is read, and a delta (written with
+--keyframe) is reconstructed from the chain of files back to its keyframe.
+
+Output products (prods.*.sfp, written with --products, see src/products.rs)
+are read by read_product, and by field, so the plotting scripts accept them
+in place of checkpoints.
+
+Run as a script, this prints the chain of files each given checkpoint is
+reconstructed from, and can save the reconstructed primitive variables:
+
+    python3 checkpoint.py chkpt.0012.sf -o chkpt.0012.npy
+"""
+
+import os
+import numpy as np
+import msgpack
+
+MAGIC = b'SFCHKPT1'
+PRODUCT_MAGIC = b'SFPROD01'
+
+INDEX_ENTRY = np.dtype([
+    ('i0', '<i8'),
+    ('i1', '<i8'),
+    ('j0', '<i8'),
+    ('j1', '<i8'),
+    ('num_fields', '<u8'),
+    ('offset', '<u8'),
+    ('length', '<u8'),
+])
+
+
+def decode(buf, ni, nj, reference=None):
+    """
+    Decodes a field of shape (ni, nj) coded by src/codec.rs: 4-bit counts of
+    the leading zero bytes of each residual, then the remaining residual
+    bytes, where each residual is the XOR of a value with its prediction
+    from the two previous rows. If the field was coded as a delta, the
+    reference field must be given.
+    """
+    n = ni * nj
+    counts = np.frombuffer(buf, dtype='u1', count=(n + 1) // 2)
+    zeros = np.stack([counts & 0xf, counts >> 4], axis=1).ravel()[:n]
+    mask = np.arange(8)[None, :] < (8 - zeros.astype(int))[:, None]
+    residual = np.zeros([n, 8], dtype='u1')
+    residual[mask] = np.frombuffer(buf, dtype='u1', offset=(n + 1) // 2)
+    residual = residual.view('<u8').reshape([ni, nj])
+    values = np.empty([ni, nj])
+
+    for i in range(ni):
+        if reference is not None:
+            change = lambda k: values[k] - reference[k]
+            if i == 0:
+                prediction = reference[0]
+            elif i == 1:
+                prediction = reference[1] + change(0)
+            else:
+                prediction = reference[i] + (2.0 * change(i - 1) - change(i - 2))
+            prediction = np.ascontiguousarray(prediction).view('<u8')
+        elif i == 0:
+            prediction = np.zeros(nj, dtype='<u8')
+        elif i == 1:
+            prediction = values[0].view('<u8')
+        else:
+            prediction = (2.0 * values[i - 1] - values[i - 2]).view('<u8')
+        values[i] = (residual[i] ^ prediction).view('<f8')
+    return values
+
+
+def reference_file(filename, header):
+    """
+    Returns the name of the file a delta checkpoint is a delta against, or
+    None if the given header is not that of a delta.
+    """
+    reference = (header.get('compression') or {}).get('reference')
+    return reference and os.path.join(os.path.dirname(filename), reference)
+
+
+def read_header(filename):
+    """
+    Returns the header of a chunked checkpoint file, which is the state
+    without its patches, and the index of the patch data. Returns (None, None)
+    if the file is in the older format.
+    """
+    with open(filename, 'rb') as f:
+        if f.read(8) != MAGIC:
+            return None, None
+        header_len, num_patches = (int(x) for x in np.frombuffer(f.read(16), dtype='<u8'))
+        header = msgpack.unpackb(f.read(header_len))
+        f.seek((24 + header_len + 7) // 8 * 8)
+        index = np.frombuffer(f.read(INDEX_ENTRY.itemsize * num_patches), dtype=INDEX_ENTRY)
+    return header, index
+
+
+def patches(filename, field=None):
+    """
+    Yields the rectangle ((i0, i1), (j0, j1)) and the data of each patch. The
+    data has shape (i1 - i0, j1 - j0, num_fields), or (i1 - i0, j1 - j0) if a
+    field index is given.
+    """
+    header, index = read_header(filename)
+
+    if header is None:
+        for patch in msgpack.load(open(filename, 'rb'))['primitive_patches']:
+            (i0, i1), (j0, j1) = ((r['start'], r['end']) for r in patch['rect'])
+            data = np.frombuffer(patch['data']).reshape([i1 - i0, j1 - j0, patch['num_fields']])
+            yield ((i0, i1), (j0, j1)), data if field is None else data[..., field]
+        return
+
+    mm = np.memmap(filename, dtype='u1', mode='r')
+    compressed = (header.get('compression') or {}).get('codec', 'none') != 'none'
+    reference = reference_file(filename, header)
+    reference = reference and dict(patches(reference, field))
+
+    for entry in index:
+        i0, i1, j0, j1 = (int(entry[k]) for k in ('i0', 'i1', 'j0', 'j1'))
+        nq, nz = int(entry['num_fields']), (i1 - i0) * (j1 - j0)
+        if compressed:
+            start = int(entry['offset'])
+            lengths = np.frombuffer(mm, dtype='<u8', count=nq, offset=start).astype(int)
+            starts = start + 8 * nq + np.concatenate([[0], np.cumsum(lengths)])
+            r = reference and reference[((i0, i1), (j0, j1))]
+            plane = lambda q: None if r is None else r if field is not None else r[..., q]
+            fields = [field] if field is not None else range(nq)
+            planes = [decode(mm[starts[q]:starts[q + 1]], i1 - i0, j1 - j0, plane(q)) for q in fields]
+            data = planes[0] if field is not None else np.stack(planes, axis=-1)
+        elif field is None:
+            planes = np.frombuffer(mm, dtype='<f8', count=nq * nz, offset=int(entry['offset']))
+            data = np.moveaxis(planes.reshape([nq, i1 - i0, j1 - j0]), 0, -1)
+        else:
+            offset = int(entry['offset']) + field * nz * 8
+            data = np.frombuffer(mm, dtype='<f8', count=nz, offset=offset).reshape([i1 - i0, j1 - j0])
+        yield ((i0, i1), (j0, j1)), data
+
+
+def load(filename):
+    """
+    Loads a whole checkpoint, and returns the state as a dict. The patches
+    under 'primitive_patches' hold their data as bytes, with the fields
+    interleaved, as they are in the older format.
+    """
+    header, _ = read_header(filename)
+
+    if header is None:
+        return msgpack.load(open(filename, 'rb'))
+
+    header['primitive_patches'] = [
+        dict(rect=[dict(start=i0, end=i1), dict(start=j0, end=j1)],
+             num_fields=data.shape[2],
+             data=np.ascontiguousarray(data).tobytes())
+        for ((i0, i1), (j0, j1)), data in patches(filename)
+    ]
+    return header
+
+
+def read_product(filename):
+    """
+    Returns the header of an output product, and its fields as an array of
+    shape (ni, nj, num_fields), on the (possibly downsampled) mesh in the
+    header. Returns (None, None) if the file is not a product.
+    """
+    with open(filename, 'rb') as f:
+        if f.read(8) != PRODUCT_MAGIC:
+            return None, None
+        header_len = int(np.frombuffer(f.read(8), dtype='<u8')[0])
+        header = msgpack.unpackb(f.read(header_len))
+        f.seek((16 + header_len + 63) // 64 * 64)
+        ni, nj, nq = header['mesh']['ni'], header['mesh']['nj'], header['num_fields']
+        dtype = '<f4' if header['format'] == 'f32' else '<u2'
+        planes = np.frombuffer(f.read(), dtype=dtype, count=nq * ni * nj).reshape([nq, ni, nj])
+
+    if header['format'] == 'u16':
+        offset = np.array(header['offset'])[:, None, None]
+        step = np.array(header['step'])[:, None, None]
+        planes = offset + step * planes
+    return header, np.moveaxis(planes.astype(float), 0, -1)
+
+
+def field(filename, n):
+    """
+    Returns one field of the primitive variables over the whole mesh, as an
+    array of shape (ni, nj), along with the mesh. The file may be a
+    checkpoint or an output product.
+    """
+    product, data = read_product(filename)
+    if product is not None:
+        return data[..., n], product['mesh']
+
+    header, _ = read_header(filename)
+    mesh = (header or msgpack.load(open(filename, 'rb')))['mesh']
+    result = np.zeros([mesh['ni'], mesh['nj']])
+
+    for ((i0, i1), (j0, j1)), data in patches(filename, field=n):
+        result[i0:i1, j0:j1] = data
+    return result, mesh
+
+
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(description='Reconstructs a checkpoint, following any deltas back to the keyframe')
+    parser.add_argument('filename')
+    parser.add_argument('-o', '--output', help='save the primitive variables, of shape (ni, nj, num_fields), to this .npy file')
+    args = parser.parse_args()
+
+    chain, name = [], args.filename
+    while name:
+        header, _ = read_header(name)
+        chain.append((name, (header or {}).get('compression') or {}))
+        name = header and reference_file(name, header)
+
+    for name, compression in chain:
+        print('{}: {} (ratio {:.2f})'.format(name, compression.get('codec', 'none'), compression.get('ratio', 1.0)))
+
+    if args.output:
+        header, _ = read_header(args.filename)
+        mesh = (header or msgpack.load(open(args.filename, 'rb')))['mesh']
+        result = None
+        for ((i0, i1), (j0, j1)), data in patches(args.filename):
+            if result is None:
+                result = np.zeros([mesh['ni'], mesh['nj'], data.shape[2]])
+            result[i0:i1, j0:j1] = data
+        np.save(args.output, result)
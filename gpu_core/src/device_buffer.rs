@@ -232,26 +232,6 @@ impl<T: Copy> Clone for DeviceBuffer<T> {
 unsafe impl<T: Copy> Send for DeviceBuffer<T> {}
 unsafe impl<T: Copy> Sync for DeviceBuffer<T> {}
 
-pub trait Reduce {
-    type Item: Copy;
-    fn maximum(&self) -> Option<Self::Item>;
-}
-
-impl Reduce for DeviceBuffer<f64> {
-    type Item = f64;
-    fn maximum(&self) -> Option<Self::Item> {
-        if self.is_empty() {
-            None
-        } else {
-            let mut result = self.device().buffer_from(&[0.0]);
-            on_device(self.device_id, || unsafe {
-                gpu_vec_max_f64(self.ptr, self.len as c_ulong, result.as_mut_device_ptr())
-            });
-            Some(Vec::from(&result)[0])
-        }
-    }
-}
-
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -285,7 +265,9 @@ mod tests {
                 assert_eq!(
                     dvec.maximum(),
                     if n == 0 { None } else { Some((n - 1) as f64) }
-                )
+                );
+                assert_eq!(dvec.minimum(), hvec.minimum());
+                assert_eq!(dvec.sum(), hvec.sum());
             }
         }
     }
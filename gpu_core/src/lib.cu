@@ -4,6 +4,17 @@
 #define gpuFree cudaFree
 #define gpuMalloc cudaMalloc
 #define gpuMemcpy cudaMemcpy
+#define gpuMemcpyAsync cudaMemcpyAsync
+#define gpuMallocHost cudaMallocHost
+#define gpuFreeHost cudaFreeHost
+#define gpuEvent_t cudaEvent_t
+#define gpuEventCreateWithFlags cudaEventCreateWithFlags
+#define gpuEventDisableTiming cudaEventDisableTiming
+#define gpuEventRecord cudaEventRecord
+#define gpuEventQuery cudaEventQuery
+#define gpuEventSynchronize cudaEventSynchronize
+#define gpuEventDestroy cudaEventDestroy
+#define gpuSuccess cudaSuccess
 #define gpuMemcpyHostToDevice cudaMemcpyHostToDevice
 #define gpuMemcpyDeviceToHost cudaMemcpyDeviceToHost
 #define gpuMemcpyDeviceToDevice cudaMemcpyDeviceToDevice
@@ -13,6 +24,17 @@
 #define gpuFree hipFree
 #define gpuMalloc hipMalloc
 #define gpuMemcpy hipMemcpy
+#define gpuMemcpyAsync hipMemcpyAsync
+#define gpuMallocHost hipHostMalloc
+#define gpuFreeHost hipHostFree
+#define gpuEvent_t hipEvent_t
+#define gpuEventCreateWithFlags hipEventCreateWithFlags
+#define gpuEventDisableTiming hipEventDisableTiming
+#define gpuEventRecord hipEventRecord
+#define gpuEventQuery hipEventQuery
+#define gpuEventSynchronize hipEventSynchronize
+#define gpuEventDestroy hipEventDestroy
+#define gpuSuccess hipSuccess
 #define gpuMemcpyHostToDevice hipMemcpyHostToDevice
 #define gpuMemcpyDeviceToHost hipMemcpyDeviceToHost
 #define gpuMemcpyDeviceToDevice hipMemcpyDeviceToDevice
@@ -32,6 +54,18 @@ extern "C" void gpu_free(void *ptr)
     gpuFree(ptr);
 }
 
+extern "C" void *gpu_malloc_host(ulong size)
+{
+    void *ptr;
+    gpuMallocHost(&ptr, size);
+    return ptr;
+}
+
+extern "C" void gpu_free_host(void *ptr)
+{
+    gpuFreeHost(ptr);
+}
+
 extern "C" void gpu_memcpy_htod(void *dst, const void *src, ulong size)
 {
     gpuMemcpy(dst, src, size, gpuMemcpyHostToDevice);
@@ -223,19 +257,34 @@ extern "C" void gpu_memcpy_3d(
 #define REDUCE_BLOCK_SIZE 1024
 #define REDUCE_GRID_SIZE 24
 
-static __global__ void vec_max_f64_kernel(const double *in, ulong N, double *out)
+// These match the variants of gpu_core::ReduceOp
+#define REDUCE_MAX 0
+#define REDUCE_MIN 1
+#define REDUCE_SUM 2
+
+static __device__ double reduce_op(int op, double a, double b)
+{
+    switch (op)
+    {
+        case REDUCE_MAX: return fmax(a, b);
+        case REDUCE_MIN: return fmin(a, b);
+        default: return a + b;
+    }
+}
+
+static __global__ void vec_reduce_f64_kernel(const double *in, ulong N, int op, double *out)
 {
     __shared__ double lds[REDUCE_BLOCK_SIZE];
 
     ulong start = threadIdx.x + blockIdx.x * REDUCE_BLOCK_SIZE;
     ulong gsize = gridDim.x * REDUCE_BLOCK_SIZE;
-    double max = in[0];
+    double x = op == REDUCE_SUM ? 0.0 : in[0];
 
     for (ulong i = start; i < N; i += gsize)
     {
-        max = fmax(max, in[i]);
+        x = reduce_op(op, x, in[i]);
     }
-    lds[threadIdx.x] = max;
+    lds[threadIdx.x] = x;
 
     __syncthreads();
 
@@ -243,7 +292,7 @@ static __global__ void vec_max_f64_kernel(const double *in, ulong N, double *out
     {
         if (threadIdx.x < size)
         {
-            lds[threadIdx.x] = fmax(lds[threadIdx.x], lds[threadIdx.x + size]);
+            lds[threadIdx.x] = reduce_op(op, lds[threadIdx.x], lds[threadIdx.x + size]);
         }
         __syncthreads();
     }
@@ -253,17 +302,46 @@ static __global__ void vec_max_f64_kernel(const double *in, ulong N, double *out
     }
 }
 
-extern "C" void gpu_vec_max_f64(const double *vec, ulong size, double *result)
+extern "C" ulong gpu_reduce_scratch_len()
 {
-    if (size == 0) {
-        return;
-    }
-    double* block_max;
-    gpuMalloc(&block_max, sizeof(double) * REDUCE_GRID_SIZE);
+    return REDUCE_GRID_SIZE;
+}
+
+/**
+ * Queues a reduction of a non-empty vector on the current device, followed by
+ * a copy of the result to the given host memory, which should be pinned. The
+ * scratch buffer has gpu_reduce_scratch_len() elements. Returns an event
+ * which completes when the result has been copied.
+ */
+extern "C" void *gpu_vec_reduce_f64_async(
+    const double *vec,
+    ulong size,
+    int op,
+    double *scratch,
+    double *result)
+{
+    gpuEvent_t event;
+
+    vec_reduce_f64_kernel<<<REDUCE_GRID_SIZE, REDUCE_BLOCK_SIZE>>>(vec, size, op, scratch);
+    vec_reduce_f64_kernel<<<1, REDUCE_BLOCK_SIZE>>>(scratch, REDUCE_GRID_SIZE, op, scratch);
+
+    gpuMemcpyAsync(result, scratch, sizeof(double), gpuMemcpyDeviceToHost, 0);
+    gpuEventCreateWithFlags(&event, gpuEventDisableTiming);
+    gpuEventRecord(event, 0);
+    return (void *) event;
+}
 
-    vec_max_f64_kernel<<<REDUCE_GRID_SIZE, REDUCE_BLOCK_SIZE>>>(vec, size, block_max);
-    vec_max_f64_kernel<<<1, REDUCE_BLOCK_SIZE>>>(block_max, REDUCE_GRID_SIZE, block_max);
+extern "C" int gpu_event_query(void *event)
+{
+    return gpuEventQuery((gpuEvent_t) event) == gpuSuccess;
+}
 
-    gpuMemcpy(result, block_max, sizeof(double), gpuMemcpyDeviceToDevice);
-    gpuFree(block_max);
+extern "C" void gpu_event_synchronize(void *event)
+{
+    gpuEventSynchronize((gpuEvent_t) event);
+}
+
+extern "C" void gpu_event_destroy(void *event)
+{
+    gpuEventDestroy((gpuEvent_t) event);
 }
@@ -2,14 +2,16 @@ use cfg_if::cfg_if;
 
 pub mod buffer;
 pub mod device;
+pub mod reduce;
 pub use buffer::Buffer;
 pub use device::Device;
+pub use reduce::{Reduce, ReduceOp, Reduction};
 
 cfg_if! {
     if #[cfg(feature = "gpu")] {
         use std::os::raw::{c_int, c_ulong, c_void, c_char};
         pub mod device_buffer;
-        pub use device_buffer::{DeviceBuffer, Reduce};
+        pub use device_buffer::DeviceBuffer;
     }
 }
 
@@ -18,6 +20,8 @@ extern "C" {
     // Memory allocation and transfer
     pub fn gpu_malloc(size: c_ulong) -> *mut c_void;
     pub fn gpu_free(ptr: *mut c_void);
+    pub fn gpu_malloc_host(size: c_ulong) -> *mut c_void;
+    pub fn gpu_free_host(ptr: *mut c_void);
     pub fn gpu_memcpy_htod(dst: *mut c_void, src: *const c_void, size: c_ulong);
     pub fn gpu_memcpy_dtoh(dst: *mut c_void, src: *const c_void, size: c_ulong);
     pub fn gpu_memcpy_dtod(dst: *mut c_void, src: *const c_void, size: c_ulong);
@@ -57,8 +61,20 @@ extern "C" {
     pub fn gpu_set_device(device_id: c_int);
     pub fn gpu_get_last_error() -> *const c_char;
 
+    // Events
+    pub fn gpu_event_query(event: *mut c_void) -> c_int;
+    pub fn gpu_event_synchronize(event: *mut c_void);
+    pub fn gpu_event_destroy(event: *mut c_void);
+
     // Higher level utility functions
-    pub fn gpu_vec_max_f64(vec: *const f64, size: c_ulong, result: *mut f64);
+    pub fn gpu_reduce_scratch_len() -> c_ulong;
+    pub fn gpu_vec_reduce_f64_async(
+        vec: *const f64,
+        size: c_ulong,
+        op: c_int,
+        scratch: *mut f64,
+        result: *mut f64,
+    ) -> *mut c_void;
 }
 
 /// Executes the given closure on a GPU device if `device` is `Some`.
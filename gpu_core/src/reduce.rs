@@ -0,0 +1,245 @@
+//! Exports the `Reduce` trait, for reducing a buffer of `f64` to a single
+//! value, and the `Reduction` handle through which the result is received.
+//!
+//! A reduction of a `DeviceBuffer` is asynchronous: its kernels, and the copy
+//! of its result to the host, are queued on the device, and
+//! `Reduction::wait` blocks until they have completed. This allows many
+//! reductions, on one or several devices, to be in flight at once. The
+//! device scratch memory, and the pinned host memory receiving the results,
+//! are allocated once per device and reused. A reduction of a slice in host
+//! memory is computed immediately, so code written against this API can be
+//! tested without a GPU.
+
+use crate::Buffer;
+
+#[cfg(feature = "gpu")]
+use crate::*;
+
+/// The operation applied by a reduction.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum ReduceOp {
+    Max,
+    Min,
+    Sum,
+}
+
+impl ReduceOp {
+    /// Combines two values with this operation.
+    pub fn apply(self, a: f64, b: f64) -> f64 {
+        match self {
+            ReduceOp::Max => a.max(b),
+            ReduceOp::Min => a.min(b),
+            ReduceOp::Sum => a + b,
+        }
+    }
+
+    /// Returns the result of this operation over no values.
+    pub fn empty(self) -> Option<f64> {
+        match self {
+            ReduceOp::Max | ReduceOp::Min => None,
+            ReduceOp::Sum => Some(0.0),
+        }
+    }
+}
+
+/// A handle to the result of a reduction, which may still be running on a
+/// device. Dropping the handle waits for the reduction to complete.
+pub struct Reduction(Status);
+
+enum Status {
+    Ready(Option<f64>),
+    #[cfg(feature = "gpu")]
+    Pending(Pending),
+}
+
+impl Reduction {
+    /// Returns a reduction whose result is already known.
+    pub fn ready(value: Option<f64>) -> Self {
+        Self(Status::Ready(value))
+    }
+
+    /// Returns whether the result is available, without blocking.
+    pub fn is_ready(&self) -> bool {
+        match &self.0 {
+            Status::Ready(_) => true,
+            #[cfg(feature = "gpu")]
+            Status::Pending(pending) => pending.is_complete(),
+        }
+    }
+
+    /// Blocks until the reduction has completed, and returns its result. The
+    /// result is `None` for the maximum or minimum of an empty buffer.
+    pub fn wait(self) -> Option<f64> {
+        match self.0 {
+            Status::Ready(value) => value,
+            #[cfg(feature = "gpu")]
+            Status::Pending(pending) => Some(pending.wait()),
+        }
+    }
+}
+
+/// Implemented by buffers which can be reduced to a single value.
+pub trait Reduce {
+    /// Starts a reduction of this buffer with the given operation.
+    fn reduce(&self, op: ReduceOp) -> Reduction;
+
+    /// Returns the largest value in the buffer, or `None` if it's empty.
+    fn maximum(&self) -> Option<f64> {
+        self.reduce(ReduceOp::Max).wait()
+    }
+
+    /// Returns the smallest value in the buffer, or `None` if it's empty.
+    fn minimum(&self) -> Option<f64> {
+        self.reduce(ReduceOp::Min).wait()
+    }
+
+    /// Returns the sum of the values in the buffer.
+    fn sum(&self) -> f64 {
+        self.reduce(ReduceOp::Sum).wait().unwrap_or(0.0)
+    }
+}
+
+impl Reduce for [f64] {
+    fn reduce(&self, op: ReduceOp) -> Reduction {
+        let values = self.iter().cloned();
+        Reduction::ready(match op.empty() {
+            Some(zero) => Some(values.fold(zero, |a, b| op.apply(a, b))),
+            None => values.reduce(|a, b| op.apply(a, b)),
+        })
+    }
+}
+
+impl Reduce for Buffer<f64> {
+    fn reduce(&self, op: ReduceOp) -> Reduction {
+        match self {
+            Buffer::Host(data) => data.reduce(op),
+            #[cfg(feature = "gpu")]
+            Buffer::Device(data) => data.reduce(op),
+        }
+    }
+}
+
+#[cfg(feature = "gpu")]
+mod gpu {
+    use super::*;
+    use std::sync::Mutex;
+
+    /// A pinned host allocation for the result of one reduction.
+    struct Slot(*mut f64);
+
+    /// The slots are only written by the device, between the launch of a
+    /// reduction and the completion of its event, while the `Pending` that
+    /// holds the slot is waiting.
+    unsafe impl Send for Slot {}
+
+    /// The memory kept for reductions on one device.
+    struct Scratch {
+        blocks: DeviceBuffer<f64>,
+        slots: Vec<Slot>,
+    }
+
+    /// The scratch memory of each device, indexed by the device ID. The lock
+    /// is held while a reduction is queued, so reductions started from
+    /// different threads use the block scratch one after the other.
+    static SCRATCH: Mutex<Vec<Option<Scratch>>> = Mutex::new(Vec::new());
+
+    pub(super) struct Pending {
+        device_id: i32,
+        event: *mut c_void,
+        slot: Option<Slot>,
+    }
+
+    unsafe impl Send for Pending {}
+
+    impl Pending {
+        pub(super) fn is_complete(&self) -> bool {
+            on_device(self.device_id, || unsafe { gpu_event_query(self.event) }) != 0
+        }
+
+        pub(super) fn wait(self) -> f64 {
+            self.synchronize();
+            unsafe { *self.slot.as_ref().unwrap().0 }
+        }
+
+        fn synchronize(&self) {
+            on_device(self.device_id, || unsafe {
+                gpu_event_synchronize(self.event)
+            })
+        }
+    }
+
+    impl Drop for Pending {
+        fn drop(&mut self) {
+            self.synchronize();
+            on_device(self.device_id, || unsafe { gpu_event_destroy(self.event) });
+
+            let mut scratch = SCRATCH.lock().unwrap();
+            let scratch = scratch[self.device_id as usize].as_mut().unwrap();
+            scratch.slots.extend(self.slot.take());
+        }
+    }
+
+    impl Reduce for DeviceBuffer<f64> {
+        fn reduce(&self, op: ReduceOp) -> Reduction {
+            if self.is_empty() {
+                return Reduction::ready(op.empty());
+            }
+            let id = self.device_id as usize;
+            let mut scratch = SCRATCH.lock().unwrap();
+
+            if scratch.len() <= id {
+                scratch.resize_with(id + 1, || None);
+            }
+            let scratch = scratch[id].get_or_insert_with(|| Scratch {
+                blocks: unsafe {
+                    let len = gpu_reduce_scratch_len() as usize;
+                    self.device().uninit_buffer(len)
+                },
+                slots: vec![],
+            });
+            let slot = scratch.slots.pop().unwrap_or_else(|| {
+                let size = std::mem::size_of::<f64>() as c_ulong;
+                Slot(on_device(self.device_id, || unsafe { gpu_malloc_host(size) }) as *mut f64)
+            });
+            let event = on_device(self.device_id, || unsafe {
+                gpu_vec_reduce_f64_async(
+                    self.ptr,
+                    self.len as c_ulong,
+                    op as c_int,
+                    scratch.blocks.as_mut_device_ptr(),
+                    slot.0,
+                )
+            });
+            Reduction(Status::Pending(Pending {
+                device_id: self.device_id,
+                event,
+                slot: Some(slot),
+            }))
+        }
+    }
+}
+
+#[cfg(feature = "gpu")]
+use gpu::Pending;
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn host_reductions() {
+        let values = vec![3.0, -1.0, 4.0, 1.5];
+        assert_eq!(values.maximum(), Some(4.0));
+        assert_eq!(values.minimum(), Some(-1.0));
+        assert_eq!(values.sum(), 7.5);
+        assert_eq!(values[..1].sum(), 3.0);
+        assert_eq!(Vec::<f64>::new().maximum(), None);
+        assert_eq!(Vec::<f64>::new().sum(), 0.0);
+        assert!(values.reduce(ReduceOp::Max).is_ready());
+        assert_eq!(
+            Buffer::Host(values).reduce(ReduceOp::Min).wait(),
+            Some(-1.0)
+        );
+    }
+}
@@ -2,9 +2,9 @@ import sys
 import math
 import numpy as np
 import matplotlib.pyplot as plt
-import msgpack
+import checkpoint
 
-chkpt = msgpack.load(open(sys.argv[1], 'rb'))
+chkpt = checkpoint.load(sys.argv[1])
 time_series_data = np.array(chkpt['time_series_data'])
 mdot1 = -1.0*time_series_data[:,0]
 mdot2 = -1.0*time_series_data[:,3]
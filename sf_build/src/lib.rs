@@ -67,3 +67,41 @@ impl Platform {
         build.file(src).clone()
     }
 }
+
+fn mpicc() -> String {
+    std::env::var("MPICC").unwrap_or_else(|_| "mpicc".to_owned())
+}
+
+/// Returns a build for a C source which calls the MPI library. It is compiled
+/// with the MPI compiler wrapper, `mpicc` or the one named by the `MPICC`
+/// environment variable.
+pub fn build_mpi(src: &str) -> cc::Build {
+    println!("cargo:rerun-if-env-changed=MPICC");
+    cc::Build::new()
+        .compiler(mpicc())
+        .flag("-std=c99")
+        .file(src.to_owned() + ".c")
+        .clone()
+}
+
+/// Emits the library search paths and libraries that the MPI compiler
+/// wrapper links with. The flags are queried with `-showme:link` (Open MPI),
+/// or `-link_info` (MPICH).
+pub fn emit_mpi_link_flags() {
+    let output = ["-showme:link", "-link_info"].iter().find_map(|query| {
+        std::process::Command::new(mpicc())
+            .arg(query)
+            .output()
+            .ok()
+            .filter(|output| output.status.success())
+    });
+    let output = output.expect("could not get the link flags from the MPI compiler wrapper");
+
+    for flag in String::from_utf8_lossy(&output.stdout).split_whitespace() {
+        if let Some(path) = flag.strip_prefix("-L") {
+            println!("cargo:rustc-link-search=native={}", path)
+        } else if let Some(lib) = flag.strip_prefix("-l") {
+            println!("cargo:rustc-link-lib=dylib={}", lib)
+        }
+    }
+}
@@ -1,6 +1,7 @@
 use anyhow::Result;
+use std::convert::TryInto;
 use std::fs::File;
-use std::io::{BufWriter, Read};
+use std::io::{BufWriter, Read, Seek, SeekFrom};
 use std::ops::Range;
 use std::path::Path;
 use std::process::Command;
@@ -9,6 +10,14 @@ mod matplotlib_cmaps;
 
 type Rectangle<T> = (Range<T>, Range<T>);
 
+/// The first bytes of a chunked checkpoint file (see src/checkpoint.rs in
+/// sailfish).
+const MAGIC: &[u8; 8] = b"SFCHKPT1";
+
+/// The first bytes of an output product file (see src/products.rs in
+/// sailfish).
+const PRODUCT_MAGIC: &[u8; 8] = b"SFPROD01";
+
 #[derive(serde::Deserialize)]
 pub struct StructuredMesh {
     /// Number of zones on the i-axis
@@ -33,25 +42,260 @@ struct Patch {
     num_fields: usize,
 }
 
+#[derive(serde::Deserialize)]
+struct Compression {
+    codec: String,
+    #[serde(default)]
+    reference: Option<String>,
+}
+
 #[derive(serde::Deserialize)]
 struct State {
+    #[serde(default)]
     primitive_patches: Vec<Patch>,
     mesh: StructuredMesh,
+    #[serde(default)]
+    compression: Option<Compression>,
+}
+
+#[derive(serde::Deserialize)]
+struct ProductHeader {
+    mesh: StructuredMesh,
+    num_fields: usize,
+    format: String,
+    offset: Vec<f64>,
+    step: Vec<f64>,
+}
+
+/// One field of the data on a patch, with the zones in row-major order.
+struct PatchField {
+    rect: Rectangle<i64>,
+    values: Vec<f64>,
+}
+
+/// One field of the primitive variables in a checkpoint.
+struct Field {
+    mesh: StructuredMesh,
+    num_fields: usize,
+    patches: Vec<PatchField>,
+}
+
+fn le_f64(b: &[u8]) -> f64 {
+    f64::from_le_bytes(b.try_into().unwrap())
+}
+
+fn le_u64(b: &[u8]) -> u64 {
+    u64::from_le_bytes(b.try_into().unwrap())
+}
+
+/// Decodes a field of `ni` rows with `nj` values each, as coded by the `xor`
+/// checkpoint codec, or by the `delta` codec if a reference field is given
+/// (see src/codec.rs in sailfish).
+fn decode_xor(bytes: &[u8], ni: usize, nj: usize, reference: Option<&[f64]>) -> Result<Vec<f64>> {
+    let n = ni * nj;
+    let corrupt = || anyhow::anyhow!("coded field is corrupt");
+    let counts = bytes.get(..(n + 1) / 2).ok_or_else(corrupt)?;
+    let mut residuals = &bytes[counts.len()..];
+    let mut values = vec![0.0f64; n];
+
+    for k in 0..n {
+        let i = k / nj;
+        let zeros = ((counts[k / 2] >> (4 * (k % 2))) & 0xf) as usize;
+        let len = 8usize.checked_sub(zeros).ok_or_else(corrupt)?;
+        let mut word = [0; 8];
+        word[..len].copy_from_slice(residuals.get(..len).ok_or_else(corrupt)?);
+        residuals = &residuals[len..];
+
+        let prediction = match (reference, i) {
+            (None, 0) => 0,
+            (None, 1) => values[k - nj].to_bits(),
+            (None, _) => (2.0 * values[k - nj] - values[k - 2 * nj]).to_bits(),
+            (Some(r), 0) => r[k].to_bits(),
+            (Some(r), 1) => (r[k] + (values[k - nj] - r[k - nj])).to_bits(),
+            (Some(r), _) => {
+                let change1 = values[k - nj] - r[k - nj];
+                let change2 = values[k - 2 * nj] - r[k - 2 * nj];
+                (r[k] + (2.0 * change1 - change2)).to_bits()
+            }
+        };
+        values[k] = f64::from_bits(u64::from_le_bytes(word) ^ prediction);
+    }
+    Ok(values)
 }
 
-impl State {
-    fn load(filename: &str) -> Result<Self> {
+impl Field {
+    /// Loads one field from a checkpoint file. From a chunked checkpoint,
+    /// only the header, the index, and that field of each patch are read.
+    /// Output products are also accepted. Files in the older format are read
+    /// whole.
+    fn load(filename: &str, field: usize) -> Result<Self> {
         let mut file = File::open(filename)?;
+        let mut preamble = [0; 24];
+
+        if file.read_exact(&mut preamble).is_ok() && &preamble[..8] == MAGIC {
+            return Self::load_chunked(
+                filename,
+                file,
+                le_u64(&preamble[8..16]),
+                le_u64(&preamble[16..]),
+                field,
+            );
+        }
+        if &preamble[..8] == PRODUCT_MAGIC {
+            return Self::load_product(file, le_u64(&preamble[8..16]), field);
+        }
+        file.seek(SeekFrom::Start(0))?;
         let mut bytes = Vec::new();
         file.read_to_end(&mut bytes)?;
-        Ok(rmp_serde::from_read_ref(&bytes)?)
-    }
-    fn num_fields(&self) -> Result<usize> {
-        Ok(self
+        let state: State = rmp_serde::from_read_ref(&bytes)?;
+        let num_fields = state
             .primitive_patches
             .first()
             .ok_or(anyhow::anyhow!("empty patch list"))?
-            .num_fields)
+            .num_fields;
+
+        if field >= num_fields {
+            anyhow::bail!("invalid field index {}/{}", field, num_fields)
+        }
+        let patches = state
+            .primitive_patches
+            .into_iter()
+            .map(|patch| PatchField {
+                rect: patch.rect,
+                values: patch
+                    .data
+                    .chunks_exact(8 * num_fields)
+                    .map(|zone| le_f64(&zone[field * 8..(field + 1) * 8]))
+                    .collect(),
+            })
+            .collect();
+
+        Ok(Self {
+            mesh: state.mesh,
+            num_fields,
+            patches,
+        })
+    }
+
+    fn load_product(mut file: File, header_len: u64, field: usize) -> Result<Self> {
+        let mut header = vec![0; header_len as usize];
+        file.seek(SeekFrom::Start(16))?;
+        file.read_exact(&mut header)?;
+        let header: ProductHeader = rmp_serde::from_read_ref(&header)?;
+
+        if field >= header.num_fields {
+            anyhow::bail!("invalid field index {}/{}", field, header.num_fields)
+        }
+        let (ni, nj) = (header.mesh.ni, header.mesh.nj);
+        let size = match header.format.as_str() {
+            "f32" => 4,
+            "u16" => 2,
+            other => anyhow::bail!("unknown product format {}", other),
+        };
+        let mut bytes = vec![0; (ni * nj) as usize * size];
+        let start = (16 + header_len + 63) / 64 * 64;
+        file.seek(SeekFrom::Start(start + (field * bytes.len()) as u64))?;
+        file.read_exact(&mut bytes)?;
+
+        let values = match size {
+            4 => bytes
+                .chunks_exact(4)
+                .map(|b| f32::from_le_bytes(b.try_into().unwrap()) as f64)
+                .collect(),
+            _ => bytes
+                .chunks_exact(2)
+                .map(|b| u16::from_le_bytes(b.try_into().unwrap()) as f64)
+                .map(|n| header.offset[field] + header.step[field] * n)
+                .collect(),
+        };
+        Ok(Field {
+            mesh: header.mesh,
+            num_fields: header.num_fields,
+            patches: vec![PatchField {
+                rect: (0..ni, 0..nj),
+                values,
+            }],
+        })
+    }
+
+    fn load_chunked(
+        filename: &str,
+        mut file: File,
+        header_len: u64,
+        num_patches: u64,
+        field: usize,
+    ) -> Result<Self> {
+        let mut header = vec![0; header_len as usize];
+        file.read_exact(&mut header)?;
+        let state: State = rmp_serde::from_read_ref(&header)?;
+
+        let mut index = vec![0; 56 * num_patches as usize];
+        file.seek(SeekFrom::Start((24 + header_len + 7) / 8 * 8))?;
+        file.read_exact(&mut index)?;
+
+        let entries: Vec<Vec<u64>> = index
+            .chunks_exact(56)
+            .map(|entry| entry.chunks_exact(8).map(le_u64).collect())
+            .collect();
+        let num_fields = entries.first().ok_or(anyhow::anyhow!("empty patch list"))?[4] as usize;
+
+        if field >= num_fields {
+            anyhow::bail!("invalid field index {}/{}", field, num_fields)
+        }
+        let codec = state.compression.as_ref().map(|c| c.codec.as_str());
+        let reference_name = state
+            .compression
+            .as_ref()
+            .and_then(|c| c.reference.as_ref());
+        let reference = match reference_name {
+            Some(name) => {
+                let path = Path::new(filename).with_file_name(name);
+                Some(Field::load(&path.to_string_lossy(), field)?.patches)
+            }
+            None => None,
+        };
+        let mut patches = Vec::with_capacity(entries.len());
+
+        for e in entries {
+            let rect = (e[0] as i64..e[1] as i64, e[2] as i64..e[3] as i64);
+            let (ni, nj) = ((e[1] - e[0]) as usize, (e[3] - e[2]) as usize);
+
+            let values = match codec {
+                None | Some("none") => {
+                    let mut bytes = vec![0; ni * nj * 8];
+                    file.seek(SeekFrom::Start(e[5] + (field * ni * nj * 8) as u64))?;
+                    file.read_exact(&mut bytes)?;
+                    bytes.chunks_exact(8).map(le_f64).collect()
+                }
+                Some("xor") | Some("delta") => {
+                    let mut lengths = vec![0; num_fields * 8];
+                    file.seek(SeekFrom::Start(e[5]))?;
+                    file.read_exact(&mut lengths)?;
+                    let lengths: Vec<_> = lengths.chunks_exact(8).map(le_u64).collect();
+                    let skip: u64 = lengths[..field].iter().sum();
+                    let mut bytes = vec![0; lengths[field] as usize];
+                    file.seek(SeekFrom::Current(skip as i64))?;
+                    file.read_exact(&mut bytes)?;
+                    let reference = match &reference {
+                        Some(patches) => Some(
+                            patches
+                                .iter()
+                                .find(|p| p.rect == rect)
+                                .ok_or(anyhow::anyhow!("patch is not in the reference"))?,
+                        ),
+                        None => None,
+                    };
+                    decode_xor(&bytes, ni, nj, reference.map(|p| p.values.as_slice()))?
+                }
+                Some(other) => anyhow::bail!("unknown checkpoint codec {}", other),
+            };
+            patches.push(PatchField { rect, values })
+        }
+        Ok(Self {
+            mesh: state.mesh,
+            num_fields,
+            patches,
+        })
     }
 }
 
@@ -117,13 +361,10 @@ impl Scaling {
 }
 
 fn sorted_field(filename: &str, field: usize) -> Result<Vec<f64>> {
-    let state = State::load(filename)?;
+    let loaded = Field::load(filename, field)?;
     let mut data = vec![];
-    for patch in &state.primitive_patches {
-        for b in patch.data.chunks_exact(8 * state.num_fields()?) {
-            let b = &b[field * 8..(field + 1) * 8];
-            let bytes = [b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]];
-            let x = f64::from_le_bytes(bytes);
+    for patch in &loaded.patches {
+        for &x in &patch.values {
             if !x.is_finite() {
                 anyhow::bail!("field contains nan or inf")
             }
@@ -171,37 +412,25 @@ fn make_image(
     colormap: &[[f64; 3]; 256],
     process: &mut Process,
 ) -> Result<()> {
-    let state = State::load(filename)?;
-    let ni = state.mesh.ni as usize;
-    let nj = state.mesh.nj as usize;
-    let num_fields = state.num_fields()?;
+    let field = Field::load(filename, field_index)?;
+    let ni = field.mesh.ni as usize;
+    let nj = field.mesh.nj as usize;
 
-    if field_index >= num_fields {
-        anyhow::bail!("invalid field index {}/{}", field_index, num_fields)
-    }
     if process.first_call {
         println!("mesh shape is [{}, {}]", ni, nj);
-        println!("there are {} patches", state.primitive_patches.len());
-        println!("reading field {}/{}", field_index, num_fields);
+        println!("there are {} patches", field.patches.len());
+        println!("reading field {}/{}", field_index, field.num_fields);
     }
 
     let mut rgba_data = vec![0; ni * nj * 4];
-    for patch in &state.primitive_patches {
+    for patch in &field.patches {
         let i0 = patch.rect.0.start as usize;
         let j0 = patch.rect.1.start as usize;
         let i1 = patch.rect.0.end as usize;
         let j1 = patch.rect.1.end as usize;
-        let sq = 8;
-        let sj = 8 * num_fields;
-        let si = 8 * num_fields * (j1 - j0);
         for i in i0..i1 {
             for j in j0..j1 {
-                let n = (i - i0) * si + (j - j0) * sj + field_index * sq;
-                let mut bytes = [0; 8];
-                for (a, b) in bytes.iter_mut().zip(&patch.data[n..n + 8]) {
-                    *a = *b
-                }
-                let x = f64::from_le_bytes(bytes);
+                let x = patch.values[(i - i0) * (j1 - j0) + (j - j0)];
                 let c = sample_rgba(colormap, scaling.scale(x));
                 let m = (i + (nj - 1 - j) * ni) * 4;
                 rgba_data[m..m + 4].copy_from_slice(&c);
@@ -0,0 +1,142 @@
+//! Ordering of grid patches along a space-filling curve, and assignment of
+//! contiguous curve segments with nearly equal cost to MPI ranks, NUMA
+//! nodes, or GPU devices.
+//!
+//! Patches which are close together on a Hilbert curve are also close
+//! together on the grid, so a contiguous segment of the curve is a compact
+//! region, and most of its guard zone edges are between patches in the same
+//! segment. The cost of a patch is its zone count until it has been
+//! measured; patches with sinks or in a buffer zone are more expensive per
+//! zone than the others.
+
+use gridiron::index_space::IndexSpace;
+use std::ops::Range;
+
+/// Returns the distance along a Hilbert curve which fills a square of side
+/// `2^order`, of the point `(x, y)` in that square.
+pub fn hilbert_index(order: u32, mut x: u64, mut y: u64) -> u64 {
+    let n = 1u64 << order;
+    let mut d = 0;
+    let mut s = n / 2;
+
+    while s > 0 {
+        let rx = (x & s > 0) as u64;
+        let ry = (y & s > 0) as u64;
+        d += s * s * ((3 * rx) ^ ry);
+
+        if ry == 0 {
+            if rx == 1 {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::mem::swap(&mut x, &mut y);
+        }
+        s /= 2;
+    }
+    d
+}
+
+/// Sorts the given items, each of which covers an index space, in the order
+/// their centers are visited by a Hilbert curve.
+pub fn sort_along_curve<T, F>(items: &mut [T], space: F)
+where
+    F: Fn(&T) -> IndexSpace,
+{
+    let rects: Vec<_> = items.iter().map(|item| space(item).to_rect()).collect();
+    let i0 = rects.iter().map(|r| r.0.start).min().unwrap_or(0);
+    let j0 = rects.iter().map(|r| r.1.start).min().unwrap_or(0);
+    let i1 = rects.iter().map(|r| r.0.end).max().unwrap_or(0);
+    let j1 = rects.iter().map(|r| r.1.end).max().unwrap_or(0);
+
+    // Centers are in units of half a zone, so they are integers.
+    let extent = (2 * (i1 - i0).max(j1 - j0)).max(1) as u64;
+    let order = 64 - (extent - 1).leading_zeros();
+
+    items.sort_by_cached_key(|item| {
+        let (di, dj) = space(item).to_rect();
+        let x = (di.start + di.end - 2 * i0) as u64;
+        let y = (dj.start + dj.end - 2 * j0) as u64;
+        hilbert_index(order, x, y)
+    })
+}
+
+/// Splits a sequence of items into `num_parts` contiguous ranges, such that
+/// the sums of their costs are as nearly equal as possible. Each range is
+/// non-empty if there are at least as many items as parts. If none of the
+/// costs are positive, the items are split by count, and if there are no
+/// items, every range is empty.
+pub fn partition(costs: &[f64], num_parts: usize) -> Vec<Range<usize>> {
+    let num_items = costs.len();
+
+    if num_items == 0 {
+        return vec![0..0; num_parts];
+    }
+    if !costs.iter().any(|&c| c > 0.0) {
+        return partition(&vec![1.0; num_items], num_parts);
+    }
+    let mut prefix = vec![0.0];
+    for c in costs {
+        prefix.push(prefix.last().unwrap() + c.max(0.0))
+    }
+    let total = prefix[num_items];
+    let mut bounds = vec![0];
+
+    for k in 1..num_parts {
+        // The first boundary at or beyond the ideal one, or the one before
+        // it if that is closer.
+        let target = total * k as f64 / num_parts as f64;
+        let mut b = prefix.partition_point(|&p| p < target).min(num_items);
+
+        if b > 0 && target - prefix[b - 1] < prefix[b] - target {
+            b -= 1
+        }
+        let lower = bounds[k - 1] + (num_items >= num_parts) as usize;
+        let upper = num_items.saturating_sub(num_parts - k).max(lower);
+        bounds.push(b.clamp(lower, upper));
+    }
+    bounds.push(num_items);
+    bounds.windows(2).map(|b| b[0]..b[1]).collect()
+}
+
+/// Returns the largest of the summed costs of the given ranges.
+pub fn max_cost(costs: &[f64], ranges: &[Range<usize>]) -> f64 {
+    ranges
+        .iter()
+        .map(|r| costs[r.clone()].iter().sum())
+        .fold(0.0, f64::max)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn hilbert_curve_steps_between_neighbors() {
+        let mut cells: Vec<_> = (0..8).flat_map(|i| (0..8).map(move |j| (i, j))).collect();
+        cells.sort_by_key(|&(i, j)| hilbert_index(3, i, j));
+
+        for w in cells.windows(2) {
+            let (a, b) = (w[0], w[1]);
+            assert_eq!(
+                (a.0 as i64 - b.0 as i64).abs() + (a.1 as i64 - b.1 as i64).abs(),
+                1
+            );
+        }
+    }
+
+    #[test]
+    fn partition_balances_costs() {
+        let ranges = partition(&[1.0; 12], 4);
+        assert_eq!(ranges, vec![0..3, 3..6, 6..9, 9..12]);
+
+        let ranges = partition(&[5.0, 1.0, 1.0, 1.0, 1.0, 1.0], 2);
+        assert_eq!(ranges, vec![0..1, 1..6]);
+
+        let ranges = partition(&[0.0; 3], 5);
+        assert_eq!(ranges.iter().map(Range::len).sum::<usize>(), 3);
+        assert_eq!(ranges.len(), 5);
+
+        let ranges = partition(&[], 3);
+        assert_eq!(ranges, vec![0..0, 0..0, 0..0]);
+    }
+}
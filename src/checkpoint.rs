@@ -0,0 +1,813 @@
+//! Checkpoint files, and a background thread which writes them.
+//!
+//! Checkpoints are written in a chunked format, which can be read in pieces:
+//!
+//! | offset     | size   | contents                                         |
+//! |------------|--------|--------------------------------------------------|
+//! | 0          | 8      | the magic bytes `SFCHKPT1`                       |
+//! | 8          | 8      | the length `H` of the header                     |
+//! | 16         | 8      | the number `N` of patches                        |
+//! | 24         | H      | the header: the `State` without its patches      |
+//! | ≥ 24 + H   | 56 N   | the index: one entry per patch                   |
+//! | ≥ ...      | ...    | the patch data                                   |
+//!
+//! The header is encoded with msgpack, like the older checkpoint files, which
+//! are one msgpack-encoded `State`. Each index entry holds seven 64-bit
+//! integers: the patch rectangle `i0, i1, j0, j1`, the number of fields, and
+//! the offset and length in bytes of the patch data. The data of each patch
+//! starts at a multiple of 64 bytes, and is stored with the `Planar` layout,
+//! so each field of a patch is a contiguous array of doubles. All integers
+//! and doubles are little-endian, and the index starts at a multiple of 8
+//! bytes. A reader can thus load the small header first, and then any patch,
+//! or one field of a patch, without touching the rest of the file. Both
+//! formats are read by `State::from_checkpoint`, from a memory mapping of the
+//! file.
+//!
+//! The patch data may instead be compressed, which is recorded in the header
+//! along with the compression ratio. The data of a compressed patch starts
+//! with the length in bytes of each of its fields, as 64-bit integers,
+//! followed by the fields, each coded separately by the `codec` module. The
+//! patches are compressed in parallel, and a single field can still be read
+//! without decoding the others.
+//!
+//! When checkpoints are written often, most of them can be deltas: only
+//! every Nth file the writer writes is a full keyframe, and the others code
+//! each field as a delta against the same field in the previous file. The
+//! header of a delta names the file it is a delta against, and a reader
+//! follows the chain of deltas back to the keyframe, so any file can be read
+//! or restarted from as if it were complete.
+//!
+//! The driver takes a snapshot of the state and the grid patches when a
+//! checkpoint is due, and hands it to the writer, which serializes it and
+//! writes the file while the solvers go on to the next time steps. The
+//! number of snapshots in flight is bounded: if the writer falls behind, the
+//! driver waits for it before handing over another snapshot, so the memory
+//! held by snapshots does not grow without limit. The time the driver spends
+//! waiting is reported at the end of the run, together with the time spent
+//! writing, most of which is then hidden behind the time steps. Output
+//! products (see the `products` module) are written by the same thread, in
+//! the order they are handed to it.
+
+use crate::codec;
+use crate::error::Error;
+use crate::mmap::Mapping;
+use crate::products::Product;
+use crate::state::State;
+use crate::trace;
+use crate::{FieldLayout, IndexSpace, Patch};
+use gridiron::rect_map::Rectangle;
+use rayon::prelude::*;
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{BufWriter, ErrorKind, Read, Write};
+use std::path::Path;
+use std::sync::mpsc::{sync_channel, SyncSender};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+/// The first bytes of a chunked checkpoint file.
+const MAGIC: &[u8; 8] = b"SFCHKPT1";
+
+/// The size in bytes of an entry in the index of a chunked checkpoint file.
+const INDEX_ENTRY_SIZE: u64 = 7 * 8;
+
+/// The alignment in bytes of the patch data in a chunked checkpoint file.
+const CHUNK_ALIGN: u64 = 64;
+
+/// How the patch data in a chunked checkpoint file is stored.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Codec {
+    /// Each field is an array of doubles.
+    None,
+    /// Each field is coded by `codec::encode`.
+    Xor,
+    /// Each field is coded by `codec::encode_delta`, against the same field
+    /// of the same patch in a reference checkpoint.
+    Delta,
+}
+
+impl Codec {
+    fn name(self) -> &'static str {
+        match self {
+            Codec::None => "none",
+            Codec::Xor => "xor",
+            Codec::Delta => "delta",
+        }
+    }
+}
+
+/// The codec which compressed the patch data in a checkpoint file, and the
+/// ratio of the uncompressed size of the data to its size in the file. For
+/// deltas, the reference is the name of the file the data is a delta
+/// against, which is in the same directory.
+#[derive(Clone, Debug, serde::Serialize, serde::Deserialize)]
+pub struct Compression {
+    pub codec: String,
+    pub ratio: f64,
+    #[serde(default)]
+    pub reference: Option<String>,
+}
+
+/// The location of a patch's data in a chunked checkpoint file.
+#[derive(Clone, Debug)]
+pub struct Chunk {
+    pub rect: Rectangle<i64>,
+    pub num_fields: usize,
+    pub offset: u64,
+    pub len: u64,
+}
+
+fn align(offset: u64, alignment: u64) -> u64 {
+    (offset + alignment - 1) / alignment * alignment
+}
+
+/// Returns the last component of a path.
+fn file_name(filename: &str) -> String {
+    Path::new(filename)
+        .file_name()
+        .map_or(filename.into(), |f| f.to_string_lossy().into_owned())
+}
+
+fn invalid(filename: &str, what: &str) -> Error {
+    Error::InvalidCheckpoint(format!("{}: {}", filename, what))
+}
+
+/// Returns whether the given file is a chunked checkpoint, rather than an
+/// older msgpack one.
+pub fn is_chunked(filename: &str) -> Result<bool, Error> {
+    let mut magic = [0; 8];
+    let mut file = File::open(filename).map_err(Error::IOError)?;
+    match file.read_exact(&mut magic) {
+        Ok(()) => Ok(&magic == MAGIC),
+        Err(e) if e.kind() == ErrorKind::UnexpectedEof => Ok(false),
+        Err(e) => Err(Error::IOError(e)),
+    }
+}
+
+/// A file being written sequentially, which keeps track of its position so
+/// that it can be padded to the offsets in the index.
+struct Output {
+    writer: BufWriter<File>,
+    position: u64,
+}
+
+impl Output {
+    fn write(&mut self, bytes: &[u8]) -> Result<(), Error> {
+        self.position += bytes.len() as u64;
+        self.writer.write_all(bytes).map_err(Error::IOError)
+    }
+
+    fn pad_to(&mut self, offset: u64) -> Result<(), Error> {
+        let zeros = vec![0; (offset - self.position) as usize];
+        self.write(&zeros)
+    }
+}
+
+/// Returns a patch whose data is in host memory.
+pub(crate) fn on_host(patch: &Patch) -> Cow<'_, Patch> {
+    match patch.device() {
+        Some(_) => Cow::Owned(patch.to_host()),
+        None => Cow::Borrowed(patch),
+    }
+}
+
+/// Returns one field of a patch in host memory, with the zones in row-major
+/// order.
+pub(crate) fn field_values(patch: &Patch, q: usize) -> Cow<'_, [f64]> {
+    let data = patch.as_slice().unwrap();
+    let nq = patch.num_fields();
+    let nz = patch.index_space().len();
+
+    match patch.layout() {
+        FieldLayout::Interleaved => Cow::Owned(data.iter().skip(q).step_by(nq).cloned().collect()),
+        FieldLayout::Planar => Cow::Borrowed(&data[q * nz..(q + 1) * nz]),
+    }
+}
+
+/// Returns the compressed data of a patch: the length of each coded field,
+/// followed by the fields. If a reference patch is given, the fields are
+/// coded as deltas against it.
+fn compress_patch(patch: &Patch, reference: Option<&Patch>) -> Vec<u8> {
+    let patch = on_host(patch);
+    let reference = reference.map(on_host);
+    let nq = patch.num_fields();
+    let nj = patch.index_space().dim().1;
+    let mut bytes = vec![0; nq * 8];
+
+    for q in 0..nq {
+        let start = bytes.len();
+        let values = field_values(&patch, q);
+        match &reference {
+            Some(r) => codec::encode_delta(&values, &field_values(r, q), nj, &mut bytes),
+            None => codec::encode(&values, nj, &mut bytes),
+        }
+        let len = (bytes.len() - start) as u64;
+        bytes[q * 8..q * 8 + 8].copy_from_slice(&len.to_le_bytes());
+    }
+    bytes
+}
+
+/// Writes a state and the given grid patches to a chunked checkpoint file,
+/// with the patch data stored by the given codec. If a reference is given,
+/// as the name of a checkpoint file and the patches written to it, and it
+/// has a patch with the same rectangle and fields as each of the given
+/// ones, the file is written as a delta against it instead. The state's own
+/// `primitive_patches` are written in the header, so they would normally be
+/// empty. The state's `compression` is set to describe the file.
+pub fn write_chunked(
+    filename: &str,
+    header: &mut State,
+    patches: &[Patch],
+    codec: Codec,
+    reference: Option<(&str, &[Patch])>,
+) -> Result<(), Error> {
+    let reference_patches: Option<Vec<_>> = reference.and_then(|(_, reference)| {
+        let by_rect: HashMap<_, _> = reference.iter().map(|p| (p.rect(), p)).collect();
+        patches
+            .iter()
+            .map(|p| {
+                let r = by_rect.get(&p.rect()).copied();
+                r.filter(|r| r.num_fields() == p.num_fields())
+            })
+            .collect()
+    });
+    let codec = match reference_patches {
+        Some(_) => Codec::Delta,
+        None => codec,
+    };
+    let compressed: Option<Vec<_>> = match (codec, &reference_patches) {
+        (Codec::None, _) => None,
+        (Codec::Delta, Some(r)) => Some(
+            patches
+                .par_iter()
+                .zip(r)
+                .map(|(patch, r)| compress_patch(patch, Some(*r)))
+                .collect(),
+        ),
+        _ => Some(
+            patches
+                .par_iter()
+                .map(|p| compress_patch(p, None))
+                .collect(),
+        ),
+    };
+    let lengths: Vec<_> = match &compressed {
+        Some(compressed) => compressed.iter().map(|b| b.len() as u64).collect(),
+        None => patches.iter().map(|p| p.num_bytes() as u64).collect(),
+    };
+    let raw_bytes: u64 = patches.iter().map(|p| p.num_bytes() as u64).sum();
+    let stored_bytes: u64 = lengths.iter().sum();
+
+    header.compression = compressed.as_ref().map(|_| Compression {
+        codec: codec.name().to_string(),
+        ratio: raw_bytes as f64 / stored_bytes.max(1) as f64,
+        reference: match codec {
+            Codec::Delta => reference.map(|(f, _)| file_name(f)),
+            _ => None,
+        },
+    });
+
+    let header = rmp_serde::to_vec_named(header)
+        .map_err(|e| Error::IOError(std::io::Error::new(ErrorKind::Other, e)))?;
+    let index_offset = align(24 + header.len() as u64, 8);
+    let mut offset = index_offset + INDEX_ENTRY_SIZE * patches.len() as u64;
+    let mut chunks = Vec::with_capacity(patches.len());
+
+    for (patch, &len) in patches.iter().zip(&lengths) {
+        offset = align(offset, CHUNK_ALIGN);
+        chunks.push(Chunk {
+            rect: patch.rect(),
+            num_fields: patch.num_fields(),
+            offset,
+            len,
+        });
+        offset += len;
+    }
+
+    let file = File::create(filename).map_err(Error::IOError)?;
+    let mut output = Output {
+        writer: BufWriter::new(file),
+        position: 0,
+    };
+    output.write(MAGIC)?;
+    output.write(&(header.len() as u64).to_le_bytes())?;
+    output.write(&(patches.len() as u64).to_le_bytes())?;
+    output.write(&header)?;
+    output.pad_to(index_offset)?;
+
+    for c in &chunks {
+        for x in [c.rect.0.start, c.rect.0.end, c.rect.1.start, c.rect.1.end] {
+            output.write(&x.to_le_bytes())?;
+        }
+        for x in [c.num_fields as u64, c.offset, c.len] {
+            output.write(&x.to_le_bytes())?;
+        }
+    }
+
+    if let Some(compressed) = compressed {
+        for (bytes, chunk) in compressed.iter().zip(&chunks) {
+            output.pad_to(chunk.offset)?;
+            output.write(bytes)?;
+        }
+        return output.writer.flush().map_err(Error::IOError);
+    }
+
+    // Uncompressed data is converted to bytes one field of one patch at a
+    // time.
+    let mut bytes = vec![];
+
+    for (patch, chunk) in patches.iter().zip(&chunks) {
+        let patch = on_host(patch);
+        output.pad_to(chunk.offset)?;
+
+        for q in 0..patch.num_fields() {
+            bytes.clear();
+            for x in field_values(&patch, q).iter() {
+                bytes.extend_from_slice(&x.to_le_bytes())
+            }
+            output.write(&bytes)?;
+        }
+    }
+    output.writer.flush().map_err(Error::IOError)
+}
+
+/// Views little-endian doubles in a checkpoint as a slice of `f64`. The
+/// patch data is 64-byte aligned in the file, and mappings are page-aligned,
+/// so on little-endian machines this borrows the mapped pages rather than
+/// copying them.
+fn doubles(bytes: &[u8]) -> Cow<'_, [f64]> {
+    if cfg!(target_endian = "little") && bytes.as_ptr() as usize % 8 == 0 {
+        let len = bytes.len() / 8;
+        Cow::Borrowed(unsafe { std::slice::from_raw_parts(bytes.as_ptr() as *const f64, len) })
+    } else {
+        Cow::Owned(
+            bytes
+                .chunks_exact(8)
+                .map(|b| f64::from_le_bytes(b.try_into().unwrap()))
+                .collect(),
+        )
+    }
+}
+
+/// A chunked checkpoint file, opened for reading. The file is memory-mapped;
+/// the header and index are decoded when it is opened, and the patch data is
+/// copied out of the mapping on request. If the file is a delta, the file it
+/// is a delta against is opened too.
+pub struct Reader {
+    filename: String,
+    map: Mapping,
+    header: State,
+    chunks: Vec<Chunk>,
+    codec: Codec,
+    reference: Option<Box<Reader>>,
+}
+
+impl Reader {
+    pub fn open(filename: &str) -> Result<Self, Error> {
+        let map = Mapping::open(filename)?;
+        let bytes = map.bytes();
+        let truncated = || invalid(filename, "file is truncated");
+        let word = |n: usize| u64::from_le_bytes(bytes[n * 8..n * 8 + 8].try_into().unwrap());
+
+        if bytes.len() < 24 || &bytes[..8] != MAGIC {
+            return Err(invalid(filename, "not a chunked checkpoint"));
+        }
+        let (header_len, num_patches) = (word(1) as usize, word(2) as usize);
+        let index_offset = align(24 + header_len as u64, 8) as usize;
+        let index_end = index_offset + INDEX_ENTRY_SIZE as usize * num_patches;
+
+        let header = bytes.get(24..24 + header_len).ok_or_else(truncated)?;
+        let index = bytes.get(index_offset..index_end).ok_or_else(truncated)?;
+        let header: State = rmp_serde::from_read_ref(header)
+            .map_err(|e| invalid(filename, &format!("header: {}", e)))?;
+        let codec = match header.compression.as_ref().map(|c| c.codec.as_str()) {
+            None | Some("none") => Codec::None,
+            Some("xor") => Codec::Xor,
+            Some("delta") => Codec::Delta,
+            Some(other) => return Err(invalid(filename, &format!("unknown codec {}", other))),
+        };
+        let reference = match codec {
+            Codec::Delta => {
+                let name = header.compression.as_ref().unwrap().reference.as_deref();
+                let name = name.ok_or_else(|| invalid(filename, "delta has no reference"))?;
+                let path = Path::new(filename).with_file_name(name);
+                Some(Box::new(Reader::open(&path.to_string_lossy())?))
+            }
+            _ => None,
+        };
+
+        let chunks: Vec<_> = index
+            .chunks_exact(INDEX_ENTRY_SIZE as usize)
+            .map(|entry| {
+                let x: Vec<_> = entry
+                    .chunks_exact(8)
+                    .map(|b| u64::from_le_bytes(b.try_into().unwrap()))
+                    .collect();
+                Chunk {
+                    rect: (x[0] as i64..x[1] as i64, x[2] as i64..x[3] as i64),
+                    num_fields: x[4] as usize,
+                    offset: x[5],
+                    len: x[6],
+                }
+            })
+            .collect();
+
+        for chunk in &chunks {
+            let nz = IndexSpace::from(&chunk.rect).len();
+            let len = match codec {
+                Codec::None => chunk.num_fields * nz * 8,
+                Codec::Xor | Codec::Delta => chunk.num_fields * 8,
+            };
+            if (codec == Codec::None && chunk.len != len as u64) || chunk.len < len as u64 {
+                return Err(invalid(filename, "patch data has the wrong size"));
+            }
+            if chunk.offset + chunk.len > bytes.len() as u64 {
+                return Err(truncated());
+            }
+        }
+        Ok(Self {
+            filename: filename.to_string(),
+            map,
+            header,
+            chunks,
+            codec,
+            reference,
+        })
+    }
+
+    /// Returns the state stored in the header, which has no grid patches.
+    pub fn header(&self) -> &State {
+        &self.header
+    }
+
+    /// Returns the index entries of the patches, in the order they were
+    /// written.
+    pub fn chunks(&self) -> &[Chunk] {
+        &self.chunks
+    }
+
+    /// Returns one field of the given patch, borrowed from the mapped file
+    /// if the data is not compressed, or decoded otherwise. The field of a
+    /// delta is decoded from the same field in the reference, recursively.
+    fn field_data(&self, patch: usize, field: usize) -> Result<Cow<'_, [f64]>, Error> {
+        let chunk = &self.chunks[patch];
+        let (ni, nj) = IndexSpace::from(&chunk.rect).dim();
+        let data = &self.map.bytes()[chunk.offset as usize..(chunk.offset + chunk.len) as usize];
+
+        if field >= chunk.num_fields {
+            return Err(invalid(&self.filename, "field index out of range"));
+        }
+        if self.codec == Codec::None {
+            let nz = ni * nj;
+            return Ok(doubles(&data[field * nz * 8..(field + 1) * nz * 8]));
+        }
+        let (lengths, mut fields) = data.split_at(chunk.num_fields * 8);
+        let lengths: Vec<_> = lengths
+            .chunks_exact(8)
+            .map(|b| u64::from_le_bytes(b.try_into().unwrap()) as usize)
+            .collect();
+
+        for &len in &lengths[..field] {
+            fields = fields.get(len..).ok_or_else(|| self.truncated())?;
+        }
+        let bytes = fields
+            .get(..lengths[field])
+            .ok_or_else(|| self.truncated())?;
+        let corrupt = |_| invalid(&self.filename, "coded field is corrupt");
+
+        match &self.reference {
+            None => codec::decode(bytes, ni, nj)
+                .map(Cow::Owned)
+                .map_err(corrupt),
+            Some(reference) => {
+                let n = reference
+                    .chunks
+                    .iter()
+                    .position(|c| c.rect == chunk.rect && c.num_fields == chunk.num_fields)
+                    .ok_or_else(|| invalid(&self.filename, "patch is not in the reference"))?;
+                let reference = reference.field_data(n, field)?;
+                codec::decode_delta(bytes, &reference, nj)
+                    .map(Cow::Owned)
+                    .map_err(corrupt)
+            }
+        }
+    }
+
+    fn truncated(&self) -> Error {
+        invalid(&self.filename, "patch data is truncated")
+    }
+
+    /// Reads one field of the given patch, with the zones in row-major order.
+    pub fn read_field(&self, patch: usize, field: usize) -> Result<Vec<f64>, Error> {
+        Ok(self.field_data(patch, field)?.into_owned())
+    }
+
+    /// Reads the given patch, with the fields interleaved. Uncompressed data
+    /// is copied once, from the mapped file into the patch.
+    pub fn read_patch(&self, patch: usize) -> Result<Patch, Error> {
+        let chunk = &self.chunks[patch];
+        let space = IndexSpace::from(&chunk.rect);
+        let nq = chunk.num_fields;
+        let mut data = vec![0.0; nq * space.len()];
+
+        for q in 0..nq {
+            let field = self.field_data(patch, q)?;
+            for (zone, x) in data.chunks_exact_mut(nq).zip(field.iter()) {
+                zone[q] = *x
+            }
+        }
+        Ok(Patch::from_vec(&space, nq, FieldLayout::Interleaved, data))
+    }
+
+    /// Reads the given patches, in parallel. The pages of each patch are
+    /// released once it has been copied, so the file does not add to the
+    /// resident memory once it is loaded.
+    pub fn read_patches(&self, patches: &[usize]) -> Result<Vec<Patch>, Error> {
+        patches
+            .par_iter()
+            .map(|&n| {
+                let patch = self.read_patch(n);
+                let chunk = &self.chunks[n];
+                let start = chunk.offset as usize;
+                self.map.release(start..start + chunk.len as usize);
+                patch
+            })
+            .collect()
+    }
+
+    /// Reads all of the patches, in parallel, and returns the complete state.
+    pub fn into_state(self) -> Result<State, Error> {
+        let all: Vec<_> = (0..self.chunks.len()).collect();
+        let patches = self.read_patches(&all)?;
+        let mut state = self.header;
+        state.primitive_patches = patches;
+        Ok(state)
+    }
+}
+
+/// The default number of snapshots which may be in flight: one being
+/// written, and one waiting to be.
+pub const MAX_IN_FLIGHT: usize = 2;
+
+/// A file for the writer thread to write.
+enum Job {
+    Checkpoint(State, String),
+    Product(Product, String),
+}
+
+/// A background checkpoint writer, which also writes output products.
+pub struct Writer {
+    sender: Option<SyncSender<Job>>,
+    thread: Option<JoinHandle<Result<Report, Error>>>,
+    stalled: Duration,
+}
+
+/// The work done by a writer, as returned by `Writer::finish`.
+pub struct Report {
+    /// The number of checkpoint files written.
+    pub files: usize,
+    /// The number of product files written.
+    pub products: usize,
+    /// The time spent serializing and writing files.
+    pub writing: Duration,
+    /// The time the driver spent waiting for the writer.
+    pub stalled: Duration,
+    /// The uncompressed size of the patch data written, and the size it took
+    /// up in the files.
+    pub raw_bytes: f64,
+    pub stored_bytes: f64,
+}
+
+impl Writer {
+    /// Starts a writer thread, which holds at most `max_in_flight`
+    /// snapshots, including the one it is writing. If deltas are written,
+    /// it also holds the patches of the last file written, which the next
+    /// delta is coded against.
+    pub fn new(max_in_flight: usize) -> Self {
+        assert!(max_in_flight > 0);
+        let (sender, receiver) = sync_channel::<Job>(max_in_flight - 1);
+        let thread = std::thread::spawn(move || {
+            let mut previous: Option<(String, Vec<Patch>)> = None;
+            let mut report = Report {
+                files: 0,
+                products: 0,
+                writing: Duration::ZERO,
+                stalled: Duration::ZERO,
+                raw_bytes: 0.0,
+                stored_bytes: 0.0,
+            };
+
+            for job in receiver {
+                let (mut state, filename) = match job {
+                    Job::Checkpoint(state, filename) => (state, filename),
+                    Job::Product(product, filename) => {
+                        let _span = trace::Span::new("write_product");
+                        let start = Instant::now();
+                        product.write(&filename)?;
+                        report.writing += start.elapsed();
+                        report.products += 1;
+                        continue;
+                    }
+                };
+                let _span = trace::Span::new("write_checkpoint");
+                let start = Instant::now();
+                let keyframe_interval = state.command_line.checkpoint_keyframe();
+                let reference = match &previous {
+                    Some((f, p)) if report.files as u64 % keyframe_interval != 0 => {
+                        Some((f.as_str(), p.as_slice()))
+                    }
+                    _ => None,
+                };
+                state.write_file(&filename, reference)?;
+                report.writing += start.elapsed();
+                report.files += 1;
+
+                let raw: usize = state.primitive_patches.iter().map(Patch::num_bytes).sum();
+                let ratio = state.compression.as_ref().map_or(1.0, |c| c.ratio);
+                report.raw_bytes += raw as f64;
+                report.stored_bytes += raw as f64 / ratio;
+
+                if keyframe_interval > 1 {
+                    previous = Some((filename, std::mem::take(&mut state.primitive_patches)));
+                }
+            }
+            Ok(report)
+        });
+        Self {
+            sender: Some(sender),
+            thread: Some(thread),
+            stalled: Duration::ZERO,
+        }
+    }
+
+    /// Hands a snapshot, as returned by `State::checkpoint_snapshot`, to the
+    /// writer thread. This blocks if the maximum number of snapshots are
+    /// already in flight. If an earlier file could not be written, the
+    /// writer has stopped, and its error is returned.
+    pub fn write(&mut self, snapshot: State, filename: String) -> Result<(), Error> {
+        self.send(Job::Checkpoint(snapshot, filename))
+    }
+
+    /// Hands an output product to the writer thread, like `write`.
+    pub fn write_product(&mut self, product: Product, filename: String) -> Result<(), Error> {
+        self.send(Job::Product(product, filename))
+    }
+
+    fn send(&mut self, job: Job) -> Result<(), Error> {
+        let start = Instant::now();
+        let sent = self.sender.as_ref().unwrap().send(job);
+        self.stalled += start.elapsed();
+
+        match sent {
+            Ok(()) => Ok(()),
+            Err(_) => self.join().map(|_| ()),
+        }
+    }
+
+    /// Waits for all of the snapshots to be written, and stops the writer
+    /// thread.
+    pub fn finish(mut self) -> Result<Report, Error> {
+        let start = Instant::now();
+        let mut report = self.join()?;
+        report.stalled = self.stalled + start.elapsed();
+        Ok(report)
+    }
+
+    fn join(&mut self) -> Result<Report, Error> {
+        self.sender.take();
+        self.thread
+            .take()
+            .expect("checkpoint writer has already stopped")
+            .join()
+            .expect("checkpoint writer thread panicked")
+    }
+}
+
+impl Drop for Writer {
+    /// Lets the writer finish the files it has been given, if it is dropped
+    /// without calling `finish`, e.g. when the driver stops on an error.
+    fn drop(&mut self) {
+        if self.thread.is_some() {
+            self.join().ok();
+        }
+    }
+}
+
+impl Report {
+    /// Returns the time spent writing files which the driver did not have to
+    /// wait for.
+    pub fn hidden(&self) -> Duration {
+        self.writing.saturating_sub(self.stalled)
+    }
+
+    /// Returns the overall compression ratio of the patch data written.
+    pub fn compression_ratio(&self) -> f64 {
+        if self.stored_bytes > 0.0 {
+            self.raw_bytes / self.stored_bytes
+        } else {
+            1.0
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{CommandLine, Mesh, RecurringTask, StructuredMesh};
+
+    #[test]
+    fn chunked_checkpoint_round_trip() {
+        let mesh = StructuredMesh::centered_square(1.0, 8);
+        let patches: Vec<_> = [(0..8, 0..3), (0..8, 3..8)]
+            .iter()
+            .map(|rect| {
+                let space = IndexSpace::from(rect);
+                Patch::from_vector_function(&space, |(i, j)| [i as f64, j as f64, 0.5])
+            })
+            .collect();
+        let mut header = State {
+            command_line: CommandLine::default(),
+            restart_file: None,
+            mesh: Mesh::Structured(mesh),
+            setup_name: "test".to_string(),
+            parameters: String::new(),
+            primitive: vec![],
+            primitive_patches: vec![],
+            time: 1.5,
+            iteration: 10,
+            checkpoint: RecurringTask::new(),
+            time_series: RecurringTask::new(),
+            products: RecurringTask::new(),
+            masses: vec![],
+            time_series_data: vec![],
+            version: String::new(),
+            compression: None,
+            rank_file: None,
+        };
+        let filename = std::env::temp_dir().join(format!("chunked.{}.sf", std::process::id()));
+        let filename = filename.to_str().unwrap();
+
+        for codec in [Codec::None, Codec::Xor] {
+            write_chunked(
+                filename,
+                &mut header,
+                &[
+                    patches[0].to_layout(FieldLayout::Planar),
+                    patches[1].clone(),
+                ],
+                codec,
+                None,
+            )
+            .unwrap();
+
+            assert!(is_chunked(filename).unwrap());
+            let reader = Reader::open(filename).unwrap();
+            assert_eq!(reader.chunks()[1].rect, (0..8, 3..8));
+            assert_eq!(
+                reader.read_field(1, 1).unwrap()[..5],
+                [3.0, 4.0, 5.0, 6.0, 7.0]
+            );
+
+            let state = reader.into_state().unwrap();
+            std::fs::remove_file(filename).unwrap();
+            assert_eq!(state.time, 1.5);
+            assert_eq!(state.compression.is_some(), codec == Codec::Xor);
+
+            for (a, b) in state.primitive_patches.iter().zip(&patches) {
+                assert_eq!(a.rect(), b.rect());
+                assert_eq!(a.as_slice(), b.as_slice());
+            }
+        }
+
+        // A delta, against a keyframe holding slightly different data.
+        let keyframe: Vec<_> = patches
+            .iter()
+            .map(|p| {
+                Patch::from_vector_function(&p.index_space(), |(i, j)| {
+                    [i as f64 * 1.01, j as f64, 0.5]
+                })
+            })
+            .collect();
+        let delta = filename.replace(".sf", ".delta.sf");
+        write_chunked(filename, &mut header, &keyframe, Codec::Xor, None).unwrap();
+        write_chunked(
+            &delta,
+            &mut header,
+            &patches,
+            Codec::None,
+            Some((filename, &keyframe)),
+        )
+        .unwrap();
+
+        let state = Reader::open(&delta).unwrap().into_state().unwrap();
+        std::fs::remove_file(filename).unwrap();
+        std::fs::remove_file(&delta).unwrap();
+        assert_eq!(state.compression.unwrap().codec, "delta");
+
+        for (a, b) in state.primitive_patches.iter().zip(&patches) {
+            assert_eq!(a.as_slice(), b.as_slice());
+        }
+    }
+}
@@ -1,5 +1,7 @@
 use crate::error::Error;
-use crate::{ExecutionMode, Setup, Recurrence};
+use crate::checkpoint::Codec;
+use crate::products::Format;
+use crate::{ExecutionMode, FieldLayout, KernelVariant, Setup, Recurrence};
 use std::fmt::Write;
 
 #[derive(Debug, Clone, serde::Serialize, serde::Deserialize)]
@@ -15,11 +17,27 @@ pub struct CommandLine {
     pub checkpoint_logspace: Option<bool>,
     pub time_series_interval: Option<f64>,
     pub time_series_logspace: Option<bool>,
+    pub products_interval: Option<f64>,
+    pub products_format: Option<String>,
+    pub products_downsample: Option<u32>,
     pub outdir: Option<String>,
     pub end_time: Option<f64>,
     pub rk_order: Option<usize>,
     pub cfl_number: Option<f64>,
     pub recompute_timestep: Option<String>,
+    pub kernel: Option<String>,
+    pub layout: Option<String>,
+    pub patches: Option<usize>,
+    pub patch_shape: Option<String>,
+    pub autotune: Option<bool>,
+    pub hybrid: Option<usize>,
+    pub numa: Option<bool>,
+    pub exchange: Option<String>,
+    pub checkpoint_mode: Option<String>,
+    pub checkpoint_codec: Option<String>,
+    pub checkpoint_keyframe: Option<u64>,
+    pub rebalance: Option<u64>,
+    pub trace: Option<String>,
 }
 
 impl CommandLine {
@@ -34,11 +52,25 @@ impl CommandLine {
             Fold,
             Checkpoint,
             TimeSeries,
+            Products,
+            ProductsFormat,
+            ProductsDownsample,
             EndTime,
             RkOrder,
             Cfl,
             Outdir,
             RecomputeTimestep,
+            Kernel,
+            Layout,
+            Patches,
+            PatchShape,
+            Hybrid,
+            Exchange,
+            CheckpointMode,
+            CheckpointCodec,
+            Keyframe,
+            Rebalance,
+            Trace,
         }
         std::convert::identity(State::Device); // black-box
         let mut state = State::Ready;
@@ -75,6 +107,9 @@ impl CommandLine {
                         writeln!(message, "       -h|--help             display this help message").unwrap();
                         writeln!(message, "       -p|--use-omp          run with OpenMP (reads OMP_NUM_THREADS)").unwrap();
                         writeln!(message, "       -g|--use-gpu          run with GPU acceleration").unwrap();
+                        writeln!(message, "       --hybrid              OpenMP threads per patch, with patches on a thread-pool").unwrap();
+                        writeln!(message, "       --numa                pin pool workers and place patch memory on NUMA nodes").unwrap();
+                        writeln!(message, "       --exchange            guard zone exchange method ([messages]|in-place)").unwrap();
                         writeln!(message, "       -d|--device           a device ID to run on ([0]-#gpus)").unwrap();
                         writeln!(message, "       -u|--upsample         upsample the grid resolution by a factor of 2").unwrap();
                         writeln!(message, "       -n|--resolution       grid resolution [1024]").unwrap();
@@ -82,10 +117,23 @@ impl CommandLine {
                         writeln!(message, "       --timestep            when to recompute time step ([iter]|fold)").unwrap();
                         writeln!(message, "       -c|--checkpoint       amount of time between writing checkpoints [1.0]").unwrap();
                         writeln!(message, "       -t|--timeseries       amount of time between sampling reductions [0=none]").unwrap();
+                        writeln!(message, "       --products            amount of time between writing reduced-precision fields [none]").unwrap();
+                        writeln!(message, "       --products-format     precision of the fields in products ([f32]|u16)").unwrap();
+                        writeln!(message, "       --products-downsample average products onto a coarser mesh by ([1]|2|4)").unwrap();
                         writeln!(message, "       -o|--outdir           data output directory [current]").unwrap();
+                        writeln!(message, "       --checkpoint-mode     checkpoint files under MPI ([per-rank]|collective)").unwrap();
+                        writeln!(message, "       --checkpoint-codec    lossless compression of checkpoint data ([none]|xor)").unwrap();
+                        writeln!(message, "       --keyframe            checkpoints per full keyframe; the others are deltas [1]").unwrap();
                         writeln!(message, "       -e|--end-time         simulation end time [never]").unwrap();
                         writeln!(message, "       -r|--rk-order         Runge-Kutta integration order ([1]|2|3)").unwrap();
                         writeln!(message, "       --cfl                 CFL number [0.2]").unwrap();
+                        writeln!(message, "       --kernel              hydro kernel variant ([zone]|tiled|faces|simd|fused)").unwrap();
+                        writeln!(message, "       --layout              field layout of solver arrays ([interleaved]|planar)").unwrap();
+                        writeln!(message, "       --patches             number of grid patches [512 (CPU), 1 (OMP)]").unwrap();
+                        writeln!(message, "       --patch-shape         zones per grid patch, e.g. 64x128 (overrides --patches)").unwrap();
+                        writeln!(message, "       --autotune            time several patch decompositions and pick the fastest").unwrap();
+                        writeln!(message, "       --rebalance           iterations between balancing measured patch costs [never]").unwrap();
+                        writeln!(message, "       --trace               write a per-patch timeline to this Chrome trace file").unwrap();
                         return Err(PrintUserInformation(message));
                     }
                     "-p" | "--use-omp" => c.use_omp = Some(true),
@@ -97,10 +145,26 @@ impl CommandLine {
                     "--timestep" => state = State::RecomputeTimestep,
                     "-c" | "--checkpoint" => state = State::Checkpoint,
                     "-t" | "--timeseries" => state = State::TimeSeries,
+                    "--products" => state = State::Products,
+                    "--products-format" => state = State::ProductsFormat,
+                    "--products-downsample" => state = State::ProductsDownsample,
                     "-o" | "--outdir" => state = State::Outdir,
                     "-e" | "--end-time" => state = State::EndTime,
                     "-r" | "--rk-order" => state = State::RkOrder,
                     "--cfl" => state = State::Cfl,
+                    "--kernel" => state = State::Kernel,
+                    "--layout" => state = State::Layout,
+                    "--patches" => state = State::Patches,
+                    "--patch-shape" => state = State::PatchShape,
+                    "--autotune" => c.autotune = Some(true),
+                    "--hybrid" => state = State::Hybrid,
+                    "--numa" => c.numa = Some(true),
+                    "--exchange" => state = State::Exchange,
+                    "--checkpoint-mode" => state = State::CheckpointMode,
+                    "--checkpoint-codec" => state = State::CheckpointCodec,
+                    "--keyframe" => state = State::Keyframe,
+                    "--rebalance" => state = State::Rebalance,
+                    "--trace" => state = State::Trace,
                     _ => {
                         if arg.starts_with('-') {
                             return Err(Cmdline(format!("unrecognized option {}", arg)));
@@ -174,6 +238,24 @@ impl CommandLine {
                     };
                     state = State::Ready;
                 }
+                State::Products => {
+                    c.products_interval = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("products {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
+                State::ProductsFormat => {
+                    c.products_format = Some(arg);
+                    state = State::Ready;
+                }
+                State::ProductsDownsample => {
+                    c.products_downsample = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("products-downsample {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
                 State::Outdir => {
                     c.outdir = Some(arg);
                     state = State::Ready;
@@ -199,6 +281,62 @@ impl CommandLine {
                     );
                     state = State::Ready;
                 }
+                State::Kernel => {
+                    c.kernel = Some(arg);
+                    state = State::Ready;
+                }
+                State::Layout => {
+                    c.layout = Some(arg);
+                    state = State::Ready;
+                }
+                State::Patches => {
+                    c.patches = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("patches {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
+                State::PatchShape => {
+                    c.patch_shape = Some(arg);
+                    state = State::Ready;
+                }
+                State::Exchange => {
+                    c.exchange = Some(arg);
+                    state = State::Ready;
+                }
+                State::CheckpointMode => {
+                    c.checkpoint_mode = Some(arg);
+                    state = State::Ready;
+                }
+                State::CheckpointCodec => {
+                    c.checkpoint_codec = Some(arg);
+                    state = State::Ready;
+                }
+                State::Keyframe => {
+                    c.checkpoint_keyframe = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("keyframe {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
+                State::Trace => {
+                    c.trace = Some(arg);
+                    state = State::Ready;
+                }
+                State::Rebalance => {
+                    c.rebalance = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("rebalance {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
+                State::Hybrid => {
+                    c.hybrid = Some(
+                        arg.parse()
+                            .map_err(|e| Cmdline(format!("hybrid {}: {}", arg, e)))?,
+                    );
+                    state = State::Ready;
+                }
             }
         }
 
@@ -214,6 +352,14 @@ impl CommandLine {
         newer.use_omp.map(|x| self.use_omp.insert(x));
         newer.use_gpu.map(|x| self.use_gpu.insert(x));
         newer.device.map(|x| self.device.insert(x));
+        newer.hybrid.map(|x| self.hybrid.insert(x));
+        newer.numa.map(|x| self.numa.insert(x));
+        newer.exchange.as_ref().map(|x| self.exchange.insert(x.to_string()));
+        newer.checkpoint_mode.as_ref().map(|x| self.checkpoint_mode.insert(x.to_string()));
+        newer.checkpoint_codec.as_ref().map(|x| self.checkpoint_codec.insert(x.to_string()));
+        newer.checkpoint_keyframe.map(|x| self.checkpoint_keyframe.insert(x));
+        self.rebalance = newer.rebalance;
+        self.trace = newer.trace.clone();
         self.upsample = newer.upsample;
         // newer.setup.as_ref().map(|x| self.setup.insert(x.to_string()));
         // newer.resolution.map(|x| self.resolution.insert(x));
@@ -222,18 +368,28 @@ impl CommandLine {
         newer.checkpoint_logspace.map(|x| self.checkpoint_logspace.insert(x));
         newer.time_series_interval.map(|x| self.time_series_interval.insert(x));
         newer.time_series_logspace.map(|x| self.time_series_logspace.insert(x));
+        newer.products_interval.map(|x| self.products_interval.insert(x));
+        newer.products_format.as_ref().map(|x| self.products_format.insert(x.to_string()));
+        newer.products_downsample.map(|x| self.products_downsample.insert(x));
         newer.outdir.as_ref().map(|x| self.outdir.insert(x.to_string()));
         newer.end_time.map(|x| self.end_time.insert(x));
         newer.rk_order.map(|x| self.rk_order.insert(x));
         newer.cfl_number.map(|x| self.cfl_number.insert(x));
         newer.recompute_timestep.as_ref().map(|x| self.recompute_timestep.insert(x.to_string()));
+        newer.kernel.as_ref().map(|x| self.kernel.insert(x.to_string()));
+        newer.layout.as_ref().map(|x| self.layout.insert(x.to_string()));
+        if newer.patches.is_some() || newer.patch_shape.is_some() {
+            self.patches = newer.patches;
+            self.patch_shape = newer.patch_shape.clone();
+        }
+        self.autotune = newer.autotune;
         self.validate()
     }
 
     pub fn validate(&self) -> Result<(), Error> {
         use Error::*;
 
-        if self.use_omp() && !crate::compiled_with_omp() {
+        if (self.use_omp() || self.hybrid.is_some()) && !crate::compiled_with_omp() {
             Err(CompiledWithoutOpenMP)
         } else if self.use_gpu() && !crate::compiled_with_gpu() {
             Err(CompiledWithoutGpu)
@@ -241,6 +397,40 @@ impl CommandLine {
             Err(Cmdline(
                 "--use-omp (-p) and --use-gpu (-g) are mutually exclusive".to_string(),
             ))
+        } else if self.hybrid.is_some() && (self.use_omp() || self.use_gpu()) {
+            Err(Cmdline(
+                "--hybrid is exclusive with --use-omp (-p) and --use-gpu (-g)".to_string(),
+            ))
+        } else if self.hybrid == Some(0) {
+            Err(Cmdline("--hybrid must be >0".to_string()))
+        } else if ![None, Some("messages"), Some("in-place")].contains(&self.exchange.as_deref()) {
+            Err(Cmdline(
+                "invalid mode for --exchange, expected (messages|in-place)".to_owned(),
+            ))
+        } else if ![None, Some("collective"), Some("per-rank")].contains(&self.checkpoint_mode.as_deref()) {
+            Err(Cmdline(
+                "invalid mode for --checkpoint-mode, expected (per-rank|collective)".to_owned(),
+            ))
+        } else if ![None, Some("none"), Some("xor")].contains(&self.checkpoint_codec.as_deref()) {
+            Err(Cmdline(
+                "invalid codec for --checkpoint-codec, expected (none|xor)".to_owned(),
+            ))
+        } else if self.checkpoint_keyframe == Some(0) {
+            Err(Cmdline("--keyframe must be >0".to_string()))
+        } else if self.in_place_exchange() && (self.use_omp() || self.use_gpu()) {
+            Err(Cmdline(
+                "--exchange in-place requires CPU or hybrid execution mode".to_string(),
+            ))
+        } else if self.rebalance == Some(0) {
+            Err(Cmdline("--rebalance must be >0".to_string()))
+        } else if self.rebalance.is_some() && self.use_gpu() {
+            Err(Cmdline(
+                "--rebalance is not supported in GPU mode, where kernel times are not measured".to_string(),
+            ))
+        } else if self.use_numa() && (self.use_omp() || self.use_gpu()) {
+            Err(Cmdline(
+                "--numa requires CPU or hybrid execution mode".to_string(),
+            ))
         } else if !(1..=3).contains(&self.rk_order()) {
             Err(Cmdline("rk-order must be 1, 2, or 3".into()))
         } else if self.checkpoint_interval() <= 0.0 {
@@ -251,10 +441,32 @@ impl CommandLine {
             Err(Cmdline(
                 "time series interval --timeseries (-t) must be >0".to_string(),
             ))
+        } else if self.products_interval.map_or(false, |x| x <= 0.0) {
+            Err(Cmdline("products interval --products must be >0".to_string()))
+        } else if ![None, Some("f32"), Some("u16")].contains(&self.products_format.as_deref()) {
+            Err(Cmdline(
+                "invalid format for --products-format, expected (f32|u16)".to_owned(),
+            ))
+        } else if ![None, Some(1), Some(2), Some(4)].contains(&self.products_downsample) {
+            Err(Cmdline("--products-downsample must be 1, 2, or 4".to_string()))
         } else if ![None, Some("iter"), Some("fold")].contains(&self.recompute_timestep.as_deref()) {
             Err(Cmdline(
                 "invalid mode for --timestep, expected (iter|fold)".to_owned(),
             ))
+        } else if let Some(Err(e)) = self.kernel.as_deref().map(str::parse::<KernelVariant>) {
+            Err(e)
+        } else if let Some(Err(e)) = self.layout.as_deref().map(str::parse::<FieldLayout>) {
+            Err(e)
+        } else if self.patches == Some(0) {
+            Err(Cmdline("--patches must be >0".to_owned()))
+        } else if self.patches.is_some() && self.patch_shape.is_some() {
+            Err(Cmdline(
+                "--patches and --patch-shape are mutually exclusive".to_owned(),
+            ))
+        } else if self.patch_shape.is_some() && self.patch_shape().is_none() {
+            Err(Cmdline(
+                "invalid --patch-shape, expected NIxNJ with NI, NJ >0".to_owned(),
+            ))
         } else {
             Ok(())
         }
@@ -285,11 +497,97 @@ impl CommandLine {
             ExecutionMode::GPU
         } else if self.use_omp() {
             ExecutionMode::OMP
+        } else if self.hybrid.is_some() {
+            ExecutionMode::Hybrid
         } else {
             ExecutionMode::CPU
         }
     }
 
+    pub fn kernel_variant(&self) -> KernelVariant {
+        self.kernel
+            .as_deref()
+            .map(|k| k.parse().unwrap())
+            .unwrap_or(KernelVariant::Zone)
+    }
+
+    pub fn field_layout(&self) -> FieldLayout {
+        self.layout
+            .as_deref()
+            .map(|l| l.parse().unwrap())
+            .unwrap_or_default()
+    }
+
+    /// Returns the number of grid patches to decompose the domain into, if
+    /// no patch shape was given.
+    pub fn num_patches(&self) -> usize {
+        self.patches.unwrap_or(match self.execution_mode() {
+            ExecutionMode::CPU => 512,
+            ExecutionMode::OMP => 1,
+            ExecutionMode::GPU => gpu_core::all_devices().count(),
+            ExecutionMode::Hybrid => 4 * self.hybrid_split().0,
+        })
+    }
+
+    /// Returns the number of thread-pool workers, and the number of OpenMP
+    /// threads used by each of them. The product is at most the number of
+    /// available cores, or `RAYON_NUM_THREADS` if it is set. Outside of
+    /// hybrid mode, each worker has a single thread.
+    pub fn hybrid_split(&self) -> (usize, usize) {
+        let num_threads = std::env::var("RAYON_NUM_THREADS")
+            .ok()
+            .and_then(|n| n.parse().ok())
+            .or_else(|| std::thread::available_parallelism().map(usize::from).ok())
+            .unwrap_or(1);
+        let team_size = self.hybrid.unwrap_or(1);
+        (usize::max(num_threads / team_size, 1), team_size)
+    }
+
+    /// Returns the number of zones per grid patch on each axis, if given as
+    /// `--patch-shape NIxNJ`.
+    pub fn patch_shape(&self) -> Option<(usize, usize)> {
+        let mut dims = self.patch_shape.as_deref()?.splitn(2, 'x');
+        let ni: usize = dims.next()?.parse().ok()?;
+        let nj: usize = dims.next()?.parse().ok()?;
+        if ni > 0 && nj > 0 {
+            Some((ni, nj))
+        } else {
+            None
+        }
+    }
+
+    pub fn use_numa(&self) -> bool {
+        self.numa.unwrap_or(false)
+    }
+
+    pub fn in_place_exchange(&self) -> bool {
+        self.exchange.as_deref() == Some("in-place")
+    }
+
+    pub fn per_rank_checkpoints(&self) -> bool {
+        self.checkpoint_mode.as_deref() != Some("collective")
+    }
+
+    pub fn checkpoint_codec(&self) -> Codec {
+        match self.checkpoint_codec.as_deref() {
+            None | Some("none") => Codec::None,
+            Some("xor") => Codec::Xor,
+            _ => panic!(),
+        }
+    }
+
+    pub fn checkpoint_keyframe(&self) -> u64 {
+        self.checkpoint_keyframe.unwrap_or(1)
+    }
+
+    pub fn rebalance_interval(&self) -> Option<u64> {
+        self.rebalance
+    }
+
+    pub fn autotune(&self) -> bool {
+        self.autotune.unwrap_or(false)
+    }
+
     pub fn recompute_dt_each_iteration(&self) -> bool {
         match self.recompute_timestep.as_deref() {
             None => true,
@@ -315,6 +613,23 @@ impl CommandLine {
         }
     }
 
+    pub fn products_rule(&self, setup: &dyn Setup) -> Option<Recurrence> {
+        self.products_interval
+            .map(|interval| Recurrence::Linear(interval * setup.unit_time()))
+    }
+
+    pub fn products_format(&self) -> Format {
+        match self.products_format.as_deref() {
+            None | Some("f32") => Format::F32,
+            Some("u16") => Format::U16,
+            _ => panic!(),
+        }
+    }
+
+    pub fn products_downsample(&self) -> u32 {
+        self.products_downsample.unwrap_or(1)
+    }
+
     pub fn time_series_rule(&self, setup: &dyn Setup) -> Recurrence {
         if self.time_series_logspace.unwrap_or(false) {
             Recurrence::Log(self.time_series_interval())
@@ -356,12 +671,28 @@ impl Default for CommandLine {
             checkpoint_logspace: None,
             time_series_interval: None,
             time_series_logspace: None,
+            products_interval: None,
+            products_format: None,
+            products_downsample: None,
             setup: None,
             outdir: None,
             end_time: None,
             rk_order: None,
             cfl_number: None,
             recompute_timestep: None,
+            kernel: None,
+            layout: None,
+            patches: None,
+            patch_shape: None,
+            autotune: None,
+            hybrid: None,
+            numa: None,
+            exchange: None,
+            checkpoint_mode: None,
+            checkpoint_codec: None,
+            checkpoint_keyframe: None,
+            rebalance: None,
+            trace: None,
         }
     }
 }
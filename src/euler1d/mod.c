@@ -395,7 +395,8 @@ EXTERN_C void euler1d_primitive_to_conserved(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved) {
                 primitive_to_conserved_zone(primitive, conserved, i);
@@ -454,7 +455,8 @@ EXTERN_C void euler1d_advance_rk(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved_rk) {
                 advance_rk_zone(face_positions, conserved_rk, primitive_rd, primitive_wr, bc, coords, a, dt, i);
@@ -498,7 +500,8 @@ EXTERN_C void euler1d_wavespeed(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(wavespeed) {
                 wavespeed_zone(primitive, wavespeed, i);
@@ -542,7 +545,8 @@ EXTERN_C real euler1d_max_wavespeed(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             #pragma omp parallel for reduction(max:a_max)
             for (int i = 0; i < num_zones; ++i)
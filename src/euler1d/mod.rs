@@ -50,7 +50,7 @@ pub fn solver(
             boundary_condition,
             coords,
         ))),
-        ExecutionMode::OMP => {
+        ExecutionMode::OMP | ExecutionMode::Hybrid => {
             cfg_if! {
                 if #[cfg(feature = "omp")] {
                     Ok(Box::new(omp::Solver::new(faces, primitive, boundary_condition, coords)))
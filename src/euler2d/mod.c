@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <math.h>
 #include "../sailfish.h"
 
@@ -172,6 +173,11 @@ static __host__ __device__ void point_mass_source_term(
     }
 }
 
+// Adds the source terms of all the point masses to cons. If sums is not NULL,
+// the source terms of mass p, times the weight, are also added to
+// sums[NCONS * p + q], and their torque about the origin to
+// sums[NCONS * n + p], where n is the number of point masses; the RK stages
+// use this to integrate them over time.
 static __host__ __device__ void point_masses_source_term(
     struct PointMassList *mass_list,
     real x1,
@@ -180,7 +186,9 @@ static __host__ __device__ void point_masses_source_term(
     real *prim,
     real h,
     real *cons,
-    int constant_softening)
+    int constant_softening,
+    real *sums,
+    real weight)
 {
     for (int p = 0; p < mass_list->count; ++p)
     {
@@ -191,6 +199,14 @@ static __host__ __device__ void point_masses_source_term(
         {
             cons[q] += delta_cons[q];
         }
+        if (sums != NULL)
+        {
+            for (int q = 0; q < NCONS; ++q)
+            {
+                sums[NCONS * p + q] += weight * delta_cons[q];
+            }
+            sums[NCONS * mass_list->count + p] += weight * (x1 * delta_cons[2] - y1 * delta_cons[1]);
+        }
     }
 }
 
@@ -420,11 +436,20 @@ _Pragma("omp parallel for") \
     for (int j = p.start[1]; j < p.start[1] + p.count[1]; ++j)
 #define GET(p, i, j) (p.data + p.jumps[0] * ((i) - p.start[0]) + p.jumps[1] * ((j) - p.start[1]))
 
+// The GPU reductions use square blocks of this many threads on a side. The
+// diagnostics integrated by the reductions kernel are listed at
+// num_diagnostics.
+#define REDUCE_BLOCK 16
+#define MAX_DIAGNOSTICS 16
+
+// The jumps are the memory strides along i, j, and between fields. GET
+// returns a pointer to the first field of a zone; the other fields are at
+// multiples of jumps[2] from there.
 struct Patch
 {
     int start[2];
     int count[2];
-    int jumps[2];
+    int jumps[3];
     int num_fields;
     real *data;
 };
@@ -438,11 +463,107 @@ static struct Patch patch(struct Mesh mesh, int num_fields, int num_guard, real
     patch.count[1] = mesh.nj + 2 * num_guard;
     patch.jumps[0] = num_fields * patch.count[1];
     patch.jumps[1] = num_fields;
+    patch.jumps[2] = 1;
     patch.num_fields = num_fields;
     patch.data = data;
     return patch;
 }
 
+static struct Patch patch_layout(struct Mesh mesh, int num_fields, int num_guard, real *data, enum FieldLayout layout)
+{
+    struct Patch p = patch(mesh, num_fields, num_guard, data);
+
+    if (layout == Planar)
+    {
+        p.jumps[0] = p.count[1];
+        p.jumps[1] = 1;
+        p.jumps[2] = p.count[0] * p.count[1];
+    }
+    return p;
+}
+
+// An index space with no data, for iterating over the zones [i0, i1) x
+// [j0, j1) of a patch, where zones = {i0, i1, j0, j1}.
+static struct Patch zone_region(const int *zones)
+{
+    struct Patch p;
+    p.start[0] = zones[0];
+    p.start[1] = zones[2];
+    p.count[0] = zones[1] - zones[0];
+    p.count[1] = zones[3] - zones[2];
+    p.jumps[0] = 0;
+    p.jumps[1] = 0;
+    p.jumps[2] = 0;
+    p.num_fields = 0;
+    p.data = NULL;
+    return p;
+}
+
+static struct Patch face_patch(struct Mesh mesh, int axis, real *data)
+{
+    struct Patch patch;
+    patch.start[0] = 0;
+    patch.start[1] = 0;
+    patch.count[0] = mesh.ni + (axis == 0);
+    patch.count[1] = mesh.nj + (axis == 1);
+    patch.jumps[0] = NCONS * patch.count[1];
+    patch.jumps[1] = NCONS;
+    patch.jumps[2] = 1;
+    patch.num_fields = NCONS;
+    patch.data = data;
+    return patch;
+}
+
+static __host__ __device__ void get_fields(struct Patch p, int i, int j, real *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        y[q] = d[q * p.jumps[2]];
+    }
+}
+
+static __host__ __device__ void set_fields(struct Patch p, int i, int j, const real *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        d[q * p.jumps[2]] = y[q];
+    }
+}
+
+// The point mass source terms are integrated over time by the RK stages into
+// a private array of partial sums in each thread, rather than per zone. The
+// CPU threads add their partial sums to the first MAX_SOURCE_SUMS elements
+// of the sources array when their zones are done. On the GPU, each block of
+// threads reduces its partial sums in shared memory, and block b adds them to
+// the elements at b * MAX_SOURCE_SUMS. There is room for the two point masses
+// of a PointMassList.
+#define MAX_SOURCE_SUMS ((NCONS + 1) * 2)
+
+static __host__ __device__ int num_source_sums(struct PointMassList *mass_list)
+{
+    return (NCONS + 1) * mass_list->count;
+}
+
+static void zero_source_sums(real *sums)
+{
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+}
+
+static void add_source_sums(real *sources, const real *sums, struct PointMassList *mass_list)
+{
+    for (int k = 0; k < num_source_sums(mass_list); ++k)
+    {
+        sources[k] += sums[k];
+    }
+}
+
 
 // ============================ SCHEME ========================================
 // ============================================================================
@@ -452,9 +573,12 @@ static __host__ __device__ void primitive_to_conserved_zone(
     int i,
     int j)
 {
-    real *p = GET(primitive, i, j);
-    real *u = GET(conserved, i, j);
+    real p[NCONS];
+    real u[NCONS];
+
+    get_fields(primitive, i, j, p);
     primitive_to_conserved(p, u);
+    set_fields(conserved, i, j, u);
 }
 
 static __host__ __device__ void advance_rk_zone(
@@ -468,6 +592,8 @@ static __host__ __device__ void advance_rk_zone(
     real alpha,
     real a,
     real dt,
+    real *sums,
+    real source_weight,
     real velocity_ceiling,
     real cooling_coefficient,
     real mach_ceiling,
@@ -505,20 +631,35 @@ static __host__ __device__ void advance_rk_zone(
     //
     //                 kj
     // ------------------------------------------------------------------------
-    real *un = GET(conserved_rk, i, j);
-    real *pcc = GET(primitive_rd, i, j);
-    real *pli = GET(primitive_rd, i - 1, j);
-    real *pri = GET(primitive_rd, i + 1, j);
-    real *plj = GET(primitive_rd, i, j - 1);
-    real *prj = GET(primitive_rd, i, j + 1);
-    real *pki = GET(primitive_rd, i - 2, j);
-    real *pti = GET(primitive_rd, i + 2, j);
-    real *pkj = GET(primitive_rd, i, j - 2);
-    real *ptj = GET(primitive_rd, i, j + 2);
-    real *pll = GET(primitive_rd, i - 1, j - 1);
-    real *plr = GET(primitive_rd, i - 1, j + 1);
-    real *prl = GET(primitive_rd, i + 1, j - 1);
-    real *prr = GET(primitive_rd, i + 1, j + 1);
+    real un[NCONS];
+    real pcc[NCONS];
+    real pli[NCONS];
+    real pri[NCONS];
+    real plj[NCONS];
+    real prj[NCONS];
+    real pki[NCONS];
+    real pti[NCONS];
+    real pkj[NCONS];
+    real ptj[NCONS];
+    real pll[NCONS];
+    real plr[NCONS];
+    real prl[NCONS];
+    real prr[NCONS];
+
+    get_fields(conserved_rk, i, j, un);
+    get_fields(primitive_rd, i, j, pcc);
+    get_fields(primitive_rd, i - 1, j, pli);
+    get_fields(primitive_rd, i + 1, j, pri);
+    get_fields(primitive_rd, i, j - 1, plj);
+    get_fields(primitive_rd, i, j + 1, prj);
+    get_fields(primitive_rd, i - 2, j, pki);
+    get_fields(primitive_rd, i + 2, j, pti);
+    get_fields(primitive_rd, i, j - 2, pkj);
+    get_fields(primitive_rd, i, j + 2, ptj);
+    get_fields(primitive_rd, i - 1, j - 1, pll);
+    get_fields(primitive_rd, i - 1, j + 1, plr);
+    get_fields(primitive_rd, i + 1, j - 1, prl);
+    get_fields(primitive_rd, i + 1, j + 1, prr);
 
     real plip[NCONS];
     real plim[NCONS];
@@ -625,7 +766,7 @@ static __host__ __device__ void advance_rk_zone(
 
     primitive_to_conserved(pcc, ucc);
     buffer_source_term(&bc, xc, yc, dt, ucc);
-    point_masses_source_term(&mass_list, xc, yc, dt, pcc, hcc, ucc, constant_softening);
+    point_masses_source_term(&mass_list, xc, yc, dt, pcc, hcc, ucc, constant_softening, sums, source_weight);
     cooling_term(cooling_coefficient, mach_ceiling, dt, pcc, ucc);
 
     for (int q = 0; q < NCONS; ++q)
@@ -633,8 +774,9 @@ static __host__ __device__ void advance_rk_zone(
         ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
         ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
     }
-    real *pout = GET(primitive_wr, i, j);
+    real pout[NCONS];
     conserved_to_primitive(ucc, pout, velocity_ceiling, density_floor, pressure_floor);
+    set_fields(primitive_wr, i, j, pout);
 }
 
 static __host__ __device__ void advance_rk_zone_inviscid(
@@ -647,6 +789,8 @@ static __host__ __device__ void advance_rk_zone_inviscid(
     struct PointMassList mass_list,
     real a,
     real dt,
+    real *sums,
+    real source_weight,
     real velocity_ceiling,
     real cooling_coefficient,
     real mach_ceiling,
@@ -661,16 +805,27 @@ static __host__ __device__ void advance_rk_zone_inviscid(
     real xc = mesh.x0 + (i + 0.5) * dx;
     real yc = mesh.y0 + (j + 0.5) * dy;
 
-    real *un = GET(conserved_rk, i, j);
-    real *pcc = GET(primitive_rd, i, j);
-    real *pli = GET(primitive_rd, i - 1, j);
-    real *pri = GET(primitive_rd, i + 1, j);
-    real *plj = GET(primitive_rd, i, j - 1);
-    real *prj = GET(primitive_rd, i, j + 1);
-    real *pki = GET(primitive_rd, i - 2, j);
-    real *pti = GET(primitive_rd, i + 2, j);
-    real *pkj = GET(primitive_rd, i, j - 2);
-    real *ptj = GET(primitive_rd, i, j + 2);
+    real un[NCONS];
+    real pcc[NCONS];
+    real pli[NCONS];
+    real pri[NCONS];
+    real plj[NCONS];
+    real prj[NCONS];
+    real pki[NCONS];
+    real pti[NCONS];
+    real pkj[NCONS];
+    real ptj[NCONS];
+
+    get_fields(conserved_rk, i, j, un);
+    get_fields(primitive_rd, i, j, pcc);
+    get_fields(primitive_rd, i - 1, j, pli);
+    get_fields(primitive_rd, i + 1, j, pri);
+    get_fields(primitive_rd, i, j - 1, plj);
+    get_fields(primitive_rd, i, j + 1, prj);
+    get_fields(primitive_rd, i - 2, j, pki);
+    get_fields(primitive_rd, i + 2, j, pti);
+    get_fields(primitive_rd, i, j - 2, pkj);
+    get_fields(primitive_rd, i, j + 2, ptj);
 
     real plip[NCONS];
     real plim[NCONS];
@@ -727,7 +882,7 @@ static __host__ __device__ void advance_rk_zone_inviscid(
     real h = disk_height(&mass_list, xc, yc, pcc);
     primitive_to_conserved(pcc, ucc);
     buffer_source_term(&bc, xc, yc, dt, ucc);
-    point_masses_source_term(&mass_list, xc, yc, dt, pcc, h, ucc, constant_softening);
+    point_masses_source_term(&mass_list, xc, yc, dt, pcc, h, ucc, constant_softening, sums, source_weight);
     cooling_term(cooling_coefficient, mach_ceiling, dt, pcc, ucc);
 
     for (int q = 0; q < NCONS; ++q)
@@ -735,39 +890,216 @@ static __host__ __device__ void advance_rk_zone_inviscid(
         ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
         ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
     }
-    real *pout = GET(primitive_wr, i, j);
+    real pout[NCONS];
     conserved_to_primitive(ucc, pout, velocity_ceiling, density_floor, pressure_floor);
+    set_fields(primitive_wr, i, j, pout);
 }
 
-static __host__ __device__ void point_mass_source_term_zone(
+/**
+ * Computes the flux through the face at index (i, j) of the given axis; the
+ * face lies between zones (i - 1, j) and (i, j) on axis 0, or between zones
+ * (i, j - 1) and (i, j) on axis 1. The flux is computed once per face, so
+ * the zones on either side receive the same value. The HLLE solve uses the
+ * larger of the two zone sound speeds, and each side of the viscous stress is
+ * weighted by that zone's own kinematic viscosity.
+ */
+static __host__ __device__ void face_flux_zone(
     struct Mesh mesh,
-    struct Patch primitive,
-    struct Patch cons_rate,
+    struct Patch primitive_rd,
+    struct Patch flux,
+    struct EquationOfState eos,
     struct PointMassList mass_list,
-    struct PointMass mass,
+    real alpha,
+    int axis,
+    int i,
+    int j)
+{
+    int di = axis == 0;
+    int dj = axis == 1;
+
+    real pk[NCONS];
+    real pl[NCONS];
+    real pr[NCONS];
+    real pt[NCONS];
+
+    get_fields(primitive_rd, i - 2 * di, j - 2 * dj, pk);
+    get_fields(primitive_rd, i - di, j - dj, pl);
+    get_fields(primitive_rd, i, j, pr);
+    get_fields(primitive_rd, i + di, j + dj, pt);
+
+    real gl[NCONS];
+    real gr[NCONS];
+    real pm[NCONS];
+    real pp[NCONS];
+
+    plm_gradient(pk, pl, pr, gl);
+    plm_gradient(pl, pr, pt, gr);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        pm[q] = pl[q] + 0.5 * gl[q];
+        pp[q] = pr[q] - 0.5 * gr[q];
+    }
+
+    real *f = GET(flux, i, j);
+    real cs2l = sound_speed_squared(&eos, pl);
+    real cs2r = sound_speed_squared(&eos, pr);
+
+    riemann_hlle(pm, pp, f, max2(cs2l, cs2r), axis);
+
+    if (alpha != 0.0)
+    {
+        // Gradients transverse to the face, for the off-diagonal strain.
+        real tl[NCONS];
+        real tr[NCONS];
+        real sl[4];
+        real sr[4];
+
+        real pll[NCONS];
+        real plr[NCONS];
+        real prl[NCONS];
+        real prr[NCONS];
+
+        get_fields(primitive_rd, i - di - dj, j - dj - di, pll);
+        get_fields(primitive_rd, i - di + dj, j - dj + di, plr);
+        get_fields(primitive_rd, i - dj, j - di, prl);
+        get_fields(primitive_rd, i + dj, j + di, prr);
+        plm_gradient(pll, pl, plr, tl);
+        plm_gradient(prl, pr, prr, tr);
+
+        if (axis == 0)
+        {
+            shear_strain(gl, tl, mesh.dx, mesh.dy, sl);
+            shear_strain(gr, tr, mesh.dx, mesh.dy, sr);
+        }
+        else
+        {
+            shear_strain(tl, gl, mesh.dx, mesh.dy, sl);
+            shear_strain(tr, gr, mesh.dx, mesh.dy, sr);
+        }
+
+        real xl = mesh.x0 + (i - di + 0.5) * mesh.dx;
+        real yl = mesh.y0 + (j - dj + 0.5) * mesh.dy;
+        real xr = mesh.x0 + (i + 0.5) * mesh.dx;
+        real yr = mesh.y0 + (j + 0.5) * mesh.dy;
+        real nul = alpha * disk_height(&mass_list, xl, yl, pl) * sqrt(cs2l);
+        real nur = alpha * disk_height(&mass_list, xr, yr, pr) * sqrt(cs2r);
+
+        // Components n-x and n-y of the stress, for face normal n.
+        real *sln = sl + 2 * axis;
+        real *srn = sr + 2 * axis;
+
+        f[1] -= 0.5 * (nul * pl[0] * sln[0] + nur * pr[0] * srn[0]);
+        f[2] -= 0.5 * (nul * pl[0] * sln[1] + nur * pr[0] * srn[1]);
+        f[3] -= 0.5 * (nul * pl[0] * sln[0] * pl[1] + nur * pr[0] * srn[0] * pr[1]);
+        f[3] -= 0.5 * (nul * pl[0] * sln[1] * pl[2] + nur * pr[0] * srn[1] * pr[2]);
+    }
+}
+
+/**
+ * Updates zone (i, j) from face fluxes computed by face_flux_zone.
+ */
+static __host__ __device__ void advance_rk_zone_faces(
+    struct Mesh mesh,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct Patch flux_i,
+    struct Patch flux_j,
+    struct BoundaryCondition bc,
+    struct PointMassList mass_list,
+    real a,
+    real dt,
+    real *sums,
+    real source_weight,
+    real velocity_ceiling,
+    real cooling_coefficient,
+    real mach_ceiling,
+    real density_floor,
+    real pressure_floor,
     int constant_softening,
     int i,
     int j)
 {
-    real *pc = GET(primitive, i, j);
-    real *sc = GET(cons_rate, i, j);
+    real dx = mesh.dx;
+    real dy = mesh.dy;
+    real xc = mesh.x0 + (i + 0.5) * dx;
+    real yc = mesh.y0 + (j + 0.5) * dy;
+
+    real un[NCONS];
+    real pcc[NCONS];
+
+    get_fields(conserved_rk, i, j, un);
+    get_fields(primitive_rd, i, j, pcc);
+
+    real *fli = GET(flux_i, i, j);
+    real *fri = GET(flux_i, i + 1, j);
+    real *flj = GET(flux_j, i, j);
+    real *frj = GET(flux_j, i, j + 1);
+    real ucc[NCONS];
+
+    real h = disk_height(&mass_list, xc, yc, pcc);
+    primitive_to_conserved(pcc, ucc);
+    buffer_source_term(&bc, xc, yc, dt, ucc);
+    point_masses_source_term(&mass_list, xc, yc, dt, pcc, h, ucc, constant_softening, sums, source_weight);
+    cooling_term(cooling_coefficient, mach_ceiling, dt, pcc, ucc);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
+        ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
+    }
+    real pout[NCONS];
+    conserved_to_primitive(ucc, pout, velocity_ceiling, density_floor, pressure_floor);
+    set_fields(primitive_wr, i, j, pout);
+}
+
+// The diagnostics are, for each point mass, the conserved quantities (mass,
+// x and y momentum, and energy) added by its source terms since the integrals
+// were last taken, then for each point mass the torque of those source terms
+// about the origin, integrated over the same time, then the total mass,
+// angular momentum about the origin, kinetic energy, and thermal energy.
+#define NUM_GAS_DIAGNOSTICS 4
+
+static __host__ __device__ int num_diagnostics(struct PointMassList *mass_list)
+{
+    return num_source_sums(mass_list) + NUM_GAS_DIAGNOSTICS;
+}
+
+// Writes the NUM_GAS_DIAGNOSTICS integrands of the zone to diagnostics. The
+// source term integrals are not per zone; see euler2d_point_mass_sources.
+static __host__ __device__ void diagnostics_zone(
+    struct Mesh mesh,
+    struct Patch primitive,
+    int i,
+    int j,
+    real *diagnostics)
+{
+    real pc[NCONS];
+    real uc[NCONS];
+
+    get_fields(primitive, i, j, pc);
     real x = mesh.x0 + (i + 0.5) * mesh.dx;
     real y = mesh.y0 + (j + 0.5) * mesh.dy;
-    real h = disk_height(&mass_list, x, y, pc);
-    point_mass_source_term(&mass, x, y, 1.0, pc, h, sc, constant_softening);
+
+    primitive_to_conserved(pc, uc);
+    real kinetic_energy = 0.5 * (uc[1] * pc[1] + uc[2] * pc[2]);
+    diagnostics[0] = uc[0];
+    diagnostics[1] = x * uc[2] - y * uc[1];
+    diagnostics[2] = kinetic_energy;
+    diagnostics[3] = uc[3] - kinetic_energy;
 }
 
-static __host__ __device__ void wavespeed_zone(
+static __host__ __device__ real max_wavespeed_zone(
     struct EquationOfState eos,
     struct Patch primitive,
-    struct Patch wavespeed,
     int i,
     int j)
 {
-    real *pc = GET(primitive, i, j);
+    real pc[NCONS];
+    get_fields(primitive, i, j, pc);
     real cs2 = sound_speed_squared(&eos, pc);
-    real a = primitive_max_wavespeed(pc, cs2);
-    GET(wavespeed, i, j)[0] = a;
+    return primitive_max_wavespeed(pc, cs2);
 }
 
 
@@ -789,8 +1121,40 @@ static void __global__ primitive_to_conserved_kernel(
     }
 }
 
+// Reduces the partial source sums of the threads in a block of REDUCE_BLOCK
+// x REDUCE_BLOCK, and adds them to the block's elements of sources. Every
+// thread of the block needs to call this.
+static __device__ void add_source_sums_block(real *sources, const real *sums, struct PointMassList *mass_list)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+    int b = blockIdx.x + blockIdx.y * gridDim.x;
+
+    for (int k = 0; k < num_source_sums(mass_list); ++k)
+    {
+        lds[t] = sums[k];
+        __syncthreads();
+
+        for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+        {
+            if (t < size)
+            {
+                lds[t] += lds[t + size];
+            }
+            __syncthreads();
+        }
+        if (t == 0)
+        {
+            sources[b * MAX_SOURCE_SUMS + k] += lds[0];
+        }
+        __syncthreads();
+    }
+}
+
 static void __global__ advance_rk_kernel(
     struct Mesh mesh,
+    struct Patch zones,
     struct Patch conserved_rk,
     struct Patch primitive_rd,
     struct Patch primitive_wr,
@@ -800,6 +1164,8 @@ static void __global__ advance_rk_kernel(
     real alpha,
     real a,
     real dt,
+    real *sources,
+    real source_weight,
     real velocity_ceiling,
     real cooling_coefficient,
     real mach_ceiling,
@@ -807,10 +1173,16 @@ static void __global__ advance_rk_kernel(
     real pressure_floor,
     int constant_softening)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int i = zones.start[0] + threadIdx.y + blockIdx.y * blockDim.y;
+    int j = zones.start[1] + threadIdx.x + blockIdx.x * blockDim.x;
+    real sums[MAX_SOURCE_SUMS];
 
-    if (i < mesh.ni && j < mesh.nj)
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+
+    if (i < zones.start[0] + zones.count[0] && j < zones.start[1] + zones.count[1])
     {
         advance_rk_zone(
             mesh,
@@ -823,6 +1195,8 @@ static void __global__ advance_rk_kernel(
             alpha,
             a,
             dt,
+            sums,
+            source_weight,
             velocity_ceiling,
             cooling_coefficient,
             mach_ceiling,
@@ -833,10 +1207,12 @@ static void __global__ advance_rk_kernel(
             j
         );
     }
+    add_source_sums_block(sources, sums, &mass_list);
 }
 
 static void __global__ advance_rk_kernel_inviscid(
     struct Mesh mesh,
+    struct Patch zones,
     struct Patch conserved_rk,
     struct Patch primitive_rd,
     struct Patch primitive_wr,
@@ -845,6 +1221,8 @@ static void __global__ advance_rk_kernel_inviscid(
     struct PointMassList mass_list,
     real a,
     real dt,
+    real *sources,
+    real source_weight,
     real velocity_ceiling,
     real cooling_coefficient,
     real mach_ceiling,
@@ -852,10 +1230,16 @@ static void __global__ advance_rk_kernel_inviscid(
     real pressure_floor,
     int constant_softening)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int i = zones.start[0] + threadIdx.y + blockIdx.y * blockDim.y;
+    int j = zones.start[1] + threadIdx.x + blockIdx.x * blockDim.x;
+    real sums[MAX_SOURCE_SUMS];
 
-    if (i < mesh.ni && j < mesh.nj)
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+
+    if (i < zones.start[0] + zones.count[0] && j < zones.start[1] + zones.count[1])
     {
         advance_rk_zone_inviscid(
             mesh,
@@ -867,6 +1251,8 @@ static void __global__ advance_rk_kernel_inviscid(
             mass_list,
             a,
             dt,
+            sums,
+            source_weight,
             velocity_ceiling,
             cooling_coefficient,
             mach_ceiling,
@@ -877,37 +1263,236 @@ static void __global__ advance_rk_kernel_inviscid(
             j
         );
     }
+    add_source_sums_block(sources, sums, &mass_list);
 }
 
-static void __global__ point_mass_source_term_kernel(
+static void __global__ face_flux_kernel(
     struct Mesh mesh,
-    struct Patch primitive,
-    struct Patch cons_rate,
+    struct Patch primitive_rd,
+    struct Patch flux,
+    struct EquationOfState eos,
+    struct PointMassList mass_list,
+    real alpha,
+    int axis)
+{
+    int i = threadIdx.y + blockIdx.y * blockDim.y;
+    int j = threadIdx.x + blockIdx.x * blockDim.x;
+
+    if (i < flux.count[0] && j < flux.count[1])
+    {
+        face_flux_zone(mesh, primitive_rd, flux, eos, mass_list, alpha, axis, i, j);
+    }
+}
+
+static void __global__ advance_rk_kernel_faces(
+    struct Mesh mesh,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct Patch flux_i,
+    struct Patch flux_j,
+    struct BoundaryCondition bc,
     struct PointMassList mass_list,
-    struct PointMass mass,
+    real a,
+    real dt,
+    real *sources,
+    real source_weight,
+    real velocity_ceiling,
+    real cooling_coefficient,
+    real mach_ceiling,
+    real density_floor,
+    real pressure_floor,
     int constant_softening)
 {
     int i = threadIdx.y + blockIdx.y * blockDim.y;
     int j = threadIdx.x + blockIdx.x * blockDim.x;
+    real sums[MAX_SOURCE_SUMS];
+
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
 
     if (i < mesh.ni && j < mesh.nj)
     {
-        point_mass_source_term_zone(mesh, primitive, cons_rate, mass_list, mass, constant_softening, i, j);
+        advance_rk_zone_faces(
+            mesh,
+            conserved_rk,
+            primitive_rd,
+            primitive_wr,
+            flux_i,
+            flux_j,
+            bc,
+            mass_list,
+            a,
+            dt,
+            sums,
+            source_weight,
+            velocity_ceiling,
+            cooling_coefficient,
+            mach_ceiling,
+            density_floor,
+            pressure_floor,
+            constant_softening,
+            i,
+            j
+        );
     }
+    add_source_sums_block(sources, sums, &mass_list);
 }
 
-static void __global__ wavespeed_kernel(
+// Each block of REDUCE_BLOCK x REDUCE_BLOCK threads writes its sum of each
+// diagnostic of diagnostics_zone to block_sums, which has the sums of all the
+// blocks for the first diagnostic, then for the second, and so on.
+static void __global__ diagnostics_kernel(
+    struct Mesh mesh,
+    struct Patch primitive,
+    real *block_sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int i = threadIdx.y + blockIdx.y * blockDim.y;
+    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+    int b = blockIdx.x + blockIdx.y * gridDim.x;
+    int num_blocks = gridDim.x * gridDim.y;
+    real diagnostics[NUM_GAS_DIAGNOSTICS];
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        diagnostics[k] = 0.0;
+    }
+    if (i < mesh.ni && j < mesh.nj)
+    {
+        diagnostics_zone(mesh, primitive, i, j, diagnostics);
+    }
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        lds[t] = diagnostics[k];
+        __syncthreads();
+
+        for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+        {
+            if (t < size)
+            {
+                lds[t] += lds[t + size];
+            }
+            __syncthreads();
+        }
+        if (t == 0)
+        {
+            block_sums[k * num_blocks + b] = lds[0];
+        }
+        __syncthreads();
+    }
+}
+
+// Block k sums the block sums of diagnostic k, and writes the result, times
+// the zone area, to sums[k].
+static void __global__ diagnostics_finish_kernel(
+    const real *block_sums,
+    int num_blocks,
+    real zone_area,
+    real *sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x;
+    int k = blockIdx.x;
+    real sum = 0.0;
+
+    for (int b = t; b < num_blocks; b += blockDim.x)
+    {
+        sum += block_sums[k * num_blocks + b];
+    }
+    lds[t] = sum;
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] += lds[t + size];
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        sums[k] = lds[0] * zone_area;
+    }
+}
+
+// Block k sums source term k over the elements of all the blocks of the
+// advance kernels, resets them to zero, and writes the result, times the
+// zone area, to sums[k].
+static void __global__ point_mass_sources_kernel(
+    real *sources,
+    int num_blocks,
+    real zone_area,
+    real *sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x;
+    int k = blockIdx.x;
+    real sum = 0.0;
+
+    for (int b = t; b < num_blocks; b += blockDim.x)
+    {
+        sum += sources[b * MAX_SOURCE_SUMS + k];
+        sources[b * MAX_SOURCE_SUMS + k] = 0.0;
+    }
+    lds[t] = sum;
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] += lds[t + size];
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        sums[k] = lds[0] * zone_area;
+    }
+}
+
+// Each block of REDUCE_BLOCK x REDUCE_BLOCK threads writes the maximum
+// wavespeed over its zones to one element of block_max.
+static void __global__ max_wavespeed_kernel(
     struct Mesh mesh,
     struct EquationOfState eos,
     struct Patch primitive,
-    struct Patch wavespeed)
+    real *block_max)
 {
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
     int i = threadIdx.y + blockIdx.y * blockDim.y;
     int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+
+    lds[t] = 0.0;
 
     if (i < mesh.ni && j < mesh.nj)
     {
-        wavespeed_zone(eos, primitive, wavespeed, i, j);
+        lds[t] = max_wavespeed_zone(eos, primitive, i, j);
+    }
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] = max2(lds[t], lds[t + size]);
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        block_max[blockIdx.x + blockIdx.y * gridDim.x] = lds[0];
     }
 }
 
@@ -924,16 +1509,18 @@ static void __global__ wavespeed_kernel(
  * @param mesh               The mesh [ni,     nj]
  * @param primitive_ptr[in]  [-2, -2] [ni + 4, nj + 4] [4]
  * @param conserved_ptr[out] [ 0,  0] [ni,     nj]     [4]
+ * @param layout             The field layout of the multi-field arrays
  * @param mode               The execution mode
  */
 EXTERN_C void euler2d_primitive_to_conserved(
     struct Mesh mesh,
     real *primitive_ptr,
     real *conserved_ptr,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch conserved = patch(mesh, NCONS, 0, conserved_ptr);
+    struct Patch primitive = patch_layout(mesh, NCONS, 2, primitive_ptr, layout);
+    struct Patch conserved = patch_layout(mesh, NCONS, 0, conserved_ptr, layout);
 
     switch (mode) {
         case CPU: {
@@ -943,7 +1530,8 @@ EXTERN_C void euler2d_primitive_to_conserved(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved) {
                 primitive_to_conserved_zone(primitive, conserved, i, j);
@@ -965,8 +1553,10 @@ EXTERN_C void euler2d_primitive_to_conserved(
 
 
 /**
- * Updates an array of primitive data by advancing it a single Runge-Kutta
- * step.
+ * Same as euler2d_advance_rk, but only the zones in the given region are
+ * updated. The zones at least two away from the patch edges do not read
+ * from the guard zones, so they can be updated before the guard zones are
+ * filled, and the remaining strips afterwards.
  * @param mesh                  The mesh [ni,     nj]
  * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [4]
  * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [4]
@@ -977,15 +1567,20 @@ EXTERN_C void euler2d_primitive_to_conserved(
  * @param alpha                 The alpha-viscosity parameter
  * @param a                     The RK averaging parameter
  * @param dt                    The time step
+ * @param sources_ptr[in,out]   [euler2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
  * @param velocity_ceiling      Safety parameters
  * @param cooling_coefficient   Safety parameters
  * @param mach_ceiling          Safety parameters
  * @param density_floor         Safety parameters
  * @param pressure_floor        Safety parameters
  * @param constant_softening    Ignore local disk height (use softening radius only)
+ * @param zones                 The region to update [i0, i1, j0, j1]
+ * @param layout                The field layout of the multi-field arrays
  * @param mode                  The execution mode
  */
-EXTERN_C void euler2d_advance_rk(
+EXTERN_C void euler2d_advance_rk_region(
     struct Mesh mesh,
     real *conserved_rk_ptr,
     real *primitive_rd_ptr,
@@ -996,22 +1591,30 @@ EXTERN_C void euler2d_advance_rk(
     real alpha,
     real a,
     real dt,
+    real *sources_ptr,
+    real source_weight,
     real velocity_ceiling,
     real cooling_coefficient,
     real mach_ceiling,
     real density_floor,
     real pressure_floor,
     int constant_softening,
+    int *zones,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
-    struct Patch conserved_rk = patch(mesh, NCONS, 0, conserved_rk_ptr);
-    struct Patch primitive_rd = patch(mesh, NCONS, 2, primitive_rd_ptr);
-    struct Patch primitive_wr = patch(mesh, NCONS, 2, primitive_wr_ptr);
+    struct Patch conserved_rk = patch_layout(mesh, NCONS, 0, conserved_rk_ptr, layout);
+    struct Patch primitive_rd = patch_layout(mesh, NCONS, 2, primitive_rd_ptr, layout);
+    struct Patch primitive_wr = patch_layout(mesh, NCONS, 2, primitive_wr_ptr, layout);
+    real sums[MAX_SOURCE_SUMS];
+    struct Patch region = zone_region(zones);
+
+    zero_source_sums(sums);
 
     switch (mode) {
         case CPU: {
             if (alpha == 0.0) {
-                FOR_EACH(conserved_rk) {
+                FOR_EACH(region) {
                     advance_rk_zone_inviscid(mesh,
                         conserved_rk,
                         primitive_rd,
@@ -1021,6 +1624,8 @@ EXTERN_C void euler2d_advance_rk(
                         mass_list,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
                         cooling_coefficient,
                         mach_ceiling,
@@ -1031,7 +1636,7 @@ EXTERN_C void euler2d_advance_rk(
                     );
                 }
             } else {
-                FOR_EACH(conserved_rk) {
+                FOR_EACH(region) {
                     advance_rk_zone(mesh,
                         conserved_rk,
                         primitive_rd,
@@ -1042,6 +1647,8 @@ EXTERN_C void euler2d_advance_rk(
                         alpha,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
                         cooling_coefficient,
                         mach_ceiling,
@@ -1052,13 +1659,16 @@ EXTERN_C void euler2d_advance_rk(
                     );
                 }
             }
+            add_source_sums(sources_ptr, sums, &mass_list);
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             if (alpha == 0.0) {
-                FOR_EACH_OMP(conserved_rk) {
+                #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+                FOR_EACH(region) {
                     advance_rk_zone_inviscid(mesh,
                         conserved_rk,
                         primitive_rd,
@@ -1068,6 +1678,8 @@ EXTERN_C void euler2d_advance_rk(
                         mass_list,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
                         cooling_coefficient,
                         mach_ceiling,
@@ -1078,7 +1690,8 @@ EXTERN_C void euler2d_advance_rk(
                     );
                 }
             } else {
-                FOR_EACH_OMP(conserved_rk) {
+                #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+                FOR_EACH(region) {
                     advance_rk_zone(mesh,
                         conserved_rk,
                         primitive_rd,
@@ -1089,6 +1702,8 @@ EXTERN_C void euler2d_advance_rk(
                         alpha,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
                         cooling_coefficient,
                         mach_ceiling,
@@ -1099,6 +1714,7 @@ EXTERN_C void euler2d_advance_rk(
                     );
                 }
             }
+            add_source_sums(sources_ptr, sums, &mass_list);
             break;
             #endif
             break;
@@ -1107,10 +1723,11 @@ EXTERN_C void euler2d_advance_rk(
         case GPU: {
             #if defined(__NVCC__) || defined(__ROCM__)
             dim3 bs = dim3(16, 16);
-            dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
+            dim3 bd = dim3((region.count[1] + bs.x - 1) / bs.x, (region.count[0] + bs.y - 1) / bs.y);
             if (alpha == 0.0) {
                 advance_rk_kernel_inviscid<<<bd, bs>>>(
                     mesh,
+                    region,
                     conserved_rk,
                     primitive_rd,
                     primitive_wr,
@@ -1119,6 +1736,8 @@ EXTERN_C void euler2d_advance_rk(
                     mass_list,
                     a,
                     dt,
+                    sources_ptr,
+                    source_weight,
                     velocity_ceiling,
                     cooling_coefficient,
                     mach_ceiling,
@@ -1129,6 +1748,7 @@ EXTERN_C void euler2d_advance_rk(
             } else {
                 advance_rk_kernel<<<bd, bs>>>(
                     mesh,
+                    region,
                     conserved_rk,
                     primitive_rd,
                     primitive_wr,
@@ -1138,6 +1758,8 @@ EXTERN_C void euler2d_advance_rk(
                     alpha,
                     a,
                     dt,
+                    sources_ptr,
+                    source_weight,
                     velocity_ceiling,
                     cooling_coefficient,
                     mach_ceiling,
@@ -1154,43 +1776,209 @@ EXTERN_C void euler2d_advance_rk(
 
 
 /**
- * Fill a buffer with the source terms that would result from a single point
- * mass. The result is the rate of surface density addition (will be negative
- * for positive sink rate), and the gravitational force surface densities in
- * each zone.
- * @param mesh                The mesh [ni,     nj]
- * @param primitive_ptr[in]   [-2, -2] [ni + 4, nj + 4] [4]
- * @param cons_rate_ptr[out]  [ 0,  0] [ni,     nj]     [1]
- * @param mass_list           A list of point mass objects
- * @param mass                A point mass
- * @param mode                The execution mode
- * @param constant_softening  Ignore local disk height (use softening radius only)
+ * Updates an array of primitive data by advancing it a single Runge-Kutta
+ * step.
+ * @param mesh                  The mesh [ni,     nj]
+ * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [4]
+ * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [4]
+ * @param primitive_wr_ptr[out] [-2, -2] [ni + 4, nj + 4] [4]
+ * @param eos                   The EOS
+ * @param bc                    The boundary condition type
+ * @param mass_list             A list of point mass objects
+ * @param alpha                 The alpha-viscosity parameter
+ * @param a                     The RK averaging parameter
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [euler2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param velocity_ceiling      Safety parameters
+ * @param cooling_coefficient   Safety parameters
+ * @param mach_ceiling          Safety parameters
+ * @param density_floor         Safety parameters
+ * @param pressure_floor        Safety parameters
+ * @param constant_softening    Ignore local disk height (use softening radius only)
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
  */
-EXTERN_C void euler2d_point_mass_source_term(
+EXTERN_C void euler2d_advance_rk(
     struct Mesh mesh,
-    real *primitive_ptr,
-    real *cons_rate_ptr,
+    real *conserved_rk_ptr,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition bc,
     struct PointMassList mass_list,
-    struct PointMass mass,
-    enum ExecutionMode mode,
-    int constant_softening)
+    real alpha,
+    real a,
+    real dt,
+    real *sources_ptr,
+    real source_weight,
+    real velocity_ceiling,
+    real cooling_coefficient,
+    real mach_ceiling,
+    real density_floor,
+    real pressure_floor,
+    int constant_softening,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    int zones[4] = {0, mesh.ni, 0, mesh.nj};
+    euler2d_advance_rk_region(
+        mesh,
+        conserved_rk_ptr,
+        primitive_rd_ptr,
+        primitive_wr_ptr,
+        eos,
+        bc,
+        mass_list,
+        alpha,
+        a,
+        dt,
+        sources_ptr,
+        source_weight,
+        velocity_ceiling,
+        cooling_coefficient,
+        mach_ceiling,
+        density_floor,
+        pressure_floor,
+        constant_softening,
+        zones,
+        layout,
+        mode);
+}
+
+
+/**
+ * Updates an array of primitive data by advancing it a single Runge-Kutta
+ * step, using a two-pass face-centered scheme. The first pass computes the
+ * flux through each x-face and y-face once, into the face flux arrays. The
+ * second pass applies the flux divergence and source terms to each zone. The
+ * parameters are the same as for euler2d_advance_rk, except for the face
+ * flux arrays, which are used as scratch space.
+ * @param mesh                  The mesh [ni,     nj]
+ * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [4]
+ * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [4]
+ * @param primitive_wr_ptr[out] [-2, -2] [ni + 4, nj + 4] [4]
+ * @param flux_i_ptr[out]       [ 0,  0] [ni + 1, nj]     [4]
+ * @param flux_j_ptr[out]       [ 0,  0] [ni,     nj + 1] [4]
+ * @param eos                   The EOS
+ * @param bc                    The boundary condition type
+ * @param mass_list             A list of point mass objects
+ * @param alpha                 The alpha-viscosity parameter
+ * @param a                     The RK averaging parameter
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [euler2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param velocity_ceiling      Safety parameters
+ * @param cooling_coefficient   Safety parameters
+ * @param mach_ceiling          Safety parameters
+ * @param density_floor         Safety parameters
+ * @param pressure_floor        Safety parameters
+ * @param constant_softening    Ignore local disk height (use softening radius only)
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
+ */
+EXTERN_C void euler2d_advance_rk_faces(
+    struct Mesh mesh,
+    real *conserved_rk_ptr,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    real *flux_i_ptr,
+    real *flux_j_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition bc,
+    struct PointMassList mass_list,
+    real alpha,
+    real a,
+    real dt,
+    real *sources_ptr,
+    real source_weight,
+    real velocity_ceiling,
+    real cooling_coefficient,
+    real mach_ceiling,
+    real density_floor,
+    real pressure_floor,
+    int constant_softening,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
 {
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch cons_rate = patch(mesh, NCONS, 0, cons_rate_ptr);
+    struct Patch conserved_rk = patch_layout(mesh, NCONS, 0, conserved_rk_ptr, layout);
+    struct Patch primitive_rd = patch_layout(mesh, NCONS, 2, primitive_rd_ptr, layout);
+    struct Patch primitive_wr = patch_layout(mesh, NCONS, 2, primitive_wr_ptr, layout);
+    real sums[MAX_SOURCE_SUMS];
+    struct Patch flux_i = face_patch(mesh, 0, flux_i_ptr);
+    struct Patch flux_j = face_patch(mesh, 1, flux_j_ptr);
+
+    zero_source_sums(sums);
 
     switch (mode) {
         case CPU: {
-            FOR_EACH(cons_rate) {
-                point_mass_source_term_zone(mesh, primitive, cons_rate, mass_list, mass, constant_softening, i, j);
+            FOR_EACH(flux_i) {
+                face_flux_zone(mesh, primitive_rd, flux_i, eos, mass_list, alpha, 0, i, j);
             }
+            FOR_EACH(flux_j) {
+                face_flux_zone(mesh, primitive_rd, flux_j, eos, mass_list, alpha, 1, i, j);
+            }
+            FOR_EACH(conserved_rk) {
+                advance_rk_zone_faces(mesh,
+                    conserved_rk,
+                    primitive_rd,
+                    primitive_wr,
+                    flux_i,
+                    flux_j,
+                    bc,
+                    mass_list,
+                    a,
+                    dt,
+                    sums,
+                    source_weight,
+                    velocity_ceiling,
+                    cooling_coefficient,
+                    mach_ceiling,
+                    density_floor,
+                    pressure_floor,
+                    constant_softening,
+                    i, j
+                );
+            }
+            add_source_sums(sources_ptr, sums, &mass_list);
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
-            FOR_EACH_OMP(cons_rate) {
-                point_mass_source_term_zone(mesh, primitive, cons_rate, mass_list, mass, constant_softening, i, j);
+            FOR_EACH_OMP(flux_i) {
+                face_flux_zone(mesh, primitive_rd, flux_i, eos, mass_list, alpha, 0, i, j);
             }
+            FOR_EACH_OMP(flux_j) {
+                face_flux_zone(mesh, primitive_rd, flux_j, eos, mass_list, alpha, 1, i, j);
+            }
+            #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+            FOR_EACH(conserved_rk) {
+                advance_rk_zone_faces(mesh,
+                    conserved_rk,
+                    primitive_rd,
+                    primitive_wr,
+                    flux_i,
+                    flux_j,
+                    bc,
+                    mass_list,
+                    a,
+                    dt,
+                    sums,
+                    source_weight,
+                    velocity_ceiling,
+                    cooling_coefficient,
+                    mach_ceiling,
+                    density_floor,
+                    pressure_floor,
+                    constant_softening,
+                    i, j
+                );
+            }
+            add_source_sums(sources_ptr, sums, &mass_list);
             #endif
             break;
         }
@@ -1198,8 +1986,31 @@ EXTERN_C void euler2d_point_mass_source_term(
         case GPU: {
             #if defined(__NVCC__) || defined(__ROCM__)
             dim3 bs = dim3(16, 16);
+            dim3 bi = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + 1 + bs.y - 1) / bs.y);
+            dim3 bj = dim3((mesh.nj + 1 + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
             dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
-            point_mass_source_term_kernel<<<bd, bs>>>(mesh, primitive, cons_rate, mass_list, mass, constant_softening);
+            face_flux_kernel<<<bi, bs>>>(mesh, primitive_rd, flux_i, eos, mass_list, alpha, 0);
+            face_flux_kernel<<<bj, bs>>>(mesh, primitive_rd, flux_j, eos, mass_list, alpha, 1);
+            advance_rk_kernel_faces<<<bd, bs>>>(
+                mesh,
+                conserved_rk,
+                primitive_rd,
+                primitive_wr,
+                flux_i,
+                flux_j,
+                bc,
+                mass_list,
+                a,
+                dt,
+                sources_ptr,
+                source_weight,
+                velocity_ceiling,
+                cooling_coefficient,
+                mach_ceiling,
+                density_floor,
+                pressure_floor,
+                constant_softening
+            );
             #endif
             break;
         }
@@ -1207,36 +2018,48 @@ EXTERN_C void euler2d_point_mass_source_term(
 }
 
 
+
+
 /**
- * Fill a buffer with the maximum wavespeed in each zone.
+ * Return the maximum wavespeed over all zones of a patch. The wavespeed of
+ * each zone is computed and reduced in the same pass, without writing it to
+ * an array. In GPU mode, each block of REDUCE_BLOCK x REDUCE_BLOCK zones
+ * writes its maximum to block_max_ptr, and the
+ * return value is zero; the caller reduces the block maxima on the device.
+ * The block_max_ptr may be NULL in the other modes.
  * @param mesh                The mesh [ni,     nj]
  * @param primitive_ptr[in]   [-2, -2] [ni + 4, nj + 4] [4]
- * @param wavespeed_ptr[out]  [ 0,  0] [ni,     nj]     [1]
+ * @param block_max_ptr[out]  [euler2d_max_wavespeed_num_blocks(mesh)]
  * @param eos                 The EOS
+ * @param layout              The field layout of the multi-field arrays
  * @param mode                The execution mode
  */
-EXTERN_C void euler2d_wavespeed(
+EXTERN_C real euler2d_max_wavespeed(
     struct Mesh mesh,
     real *primitive_ptr,
-    real *wavespeed_ptr,
+    real *block_max_ptr,
     struct EquationOfState eos,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch wavespeed = patch(mesh, 1,     0, wavespeed_ptr);
+    struct Patch primitive = patch_layout(mesh, NCONS, 2, primitive_ptr, layout);
+    struct Patch interior = patch(mesh, 1, 0, NULL);
+    real a_max = 0.0;
 
     switch (mode) {
         case CPU: {
-            FOR_EACH(wavespeed) {
-                wavespeed_zone(eos, primitive, wavespeed, i, j);
+            FOR_EACH(interior) {
+                a_max = max2(a_max, max_wavespeed_zone(eos, primitive, i, j));
             }
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
-            FOR_EACH_OMP(wavespeed) {
-                wavespeed_zone(eos, primitive, wavespeed, i, j);
+            #pragma omp parallel for reduction(max:a_max)
+            FOR_EACH(interior) {
+                a_max = max2(a_max, max_wavespeed_zone(eos, primitive, i, j));
             }
             #endif
             break;
@@ -1244,53 +2067,188 @@ EXTERN_C void euler2d_wavespeed(
 
         case GPU: {
             #if defined(__NVCC__) || defined(__ROCM__)
-            dim3 bs = dim3(16, 16);
+            dim3 bs = dim3(REDUCE_BLOCK, REDUCE_BLOCK);
             dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
-            wavespeed_kernel<<<bd, bs>>>(mesh, eos, primitive, wavespeed);
+            max_wavespeed_kernel<<<bd, bs>>>(mesh, eos, primitive, block_max_ptr);
+            #else
+            (void) block_max_ptr;
             #endif
             break;
         }
     }
+    return a_max;
+}
+
+
+/**
+ * Return the number of block maxima written by euler2d_max_wavespeed in GPU
+ * mode.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long euler2d_max_wavespeed_num_blocks(struct Mesh mesh)
+{
+    unsigned long bi = (mesh.ni + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    unsigned long bj = (mesh.nj + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    return bi * bj;
 }
 
 
 /**
- * Obtain the maximum value in an array of double's, using either a sequential
- * or an OpenMP reduction. Not implemented for GPU execution.
- * 
- * @param data          The data [size]
- * @param size          The number of elements
- * @param mode          The execution mode
+ * Take the point mass source terms integrated by the RK stages since they
+ * were last taken, and reset them to zero. For each point mass, these are
+ * the conserved quantities (mass, x and y momentum, and energy) added to the
+ * gas by its source terms, then for each point mass their torque about the
+ * origin. The partial sums of the CPU threads or GPU blocks are reduced where
+ * they live, and the totals are written to sums_ptr, which is on the device
+ * in GPU mode. Returns the number of totals.
+ * @param mesh                The mesh [ni,     nj]
+ * @param sources_ptr[in,out] [euler2d_source_sums_len(mesh)]
+ * @param sums_ptr[out]       [5 * mass_list.count]
+ * @param mass_list           A list of point mass objects
+ * @param mode                The execution mode
  */
-EXTERN_C real euler2d_maximum(
-    real *data,
-    unsigned long size,
+EXTERN_C int euler2d_point_mass_sources(
+    struct Mesh mesh,
+    real *sources_ptr,
+    real *sums_ptr,
+    struct PointMassList mass_list,
     enum ExecutionMode mode)
 {
-    real a_max = 0.0;
+    int n = num_source_sums(&mass_list);
+    real zone_area = mesh.dx * mesh.dy;
 
     switch (mode) {
-        case CPU: {
-            for (unsigned long i = 0; i < size; ++i)
+        case CPU:
+        case OMP:
+        case Hybrid: {
+            for (int k = 0; k < n; ++k)
             {
-                a_max = max2(a_max, data[i]);
+                sums_ptr[k] = sources_ptr[k] * zone_area;
+                sources_ptr[k] = 0.0;
             }
             break;
         }
 
-        case OMP: {
-            #ifdef _OPENMP
-            #pragma omp parallel for reduction(max:a_max)
-            for (unsigned long i = 0; i < size; ++i)
+        case GPU: {
+            #if defined(__NVCC__) || defined(__ROCM__)
+            if (n > 0)
             {
-                a_max = max2(a_max, data[i]);
+                int num_blocks = euler2d_max_wavespeed_num_blocks(mesh);
+                point_mass_sources_kernel<<<n, REDUCE_BLOCK * REDUCE_BLOCK>>>(sources_ptr, num_blocks, zone_area, sums_ptr);
             }
             #endif
             break;
         }
+    }
+    return n;
+}
+
+
+/**
+ * Return the number of elements in the sources array of the
+ * euler2d_advance_rk functions, which has room for the partial sums of each
+ * GPU thread block.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long euler2d_source_sums_len(struct Mesh mesh)
+{
+    return euler2d_max_wavespeed_num_blocks(mesh) * MAX_SOURCE_SUMS;
+}
 
-        case GPU: break; // Not implemented, use euler2d_wavespeed
-                         // followed by a GPU reduction.
+
+/**
+ * Integrate diagnostic quantities over the zones of a patch (see
+ * num_diagnostics), in a single pass which reduces them as they are computed.
+ * The integrals are written to the start of the scratch buffer, which is on
+ * the device in GPU mode, so that only they need to be copied to the host.
+ * The rest of the scratch buffer holds the partial sums of the GPU blocks.
+ * The point mass source terms are not evaluated here; the integrals of them
+ * accumulated by the RK stages are taken with euler2d_point_mass_sources,
+ * which resets them to zero. Returns the number of diagnostics.
+ * @param mesh                The mesh [ni,     nj]
+ * @param primitive_ptr[in]   [-2, -2] [ni + 4, nj + 4] [4]
+ * @param sources_ptr[in,out] [euler2d_source_sums_len(mesh)]
+ * @param scratch_ptr[out]    [euler2d_diagnostics_scratch_len(mesh)]
+ * @param mass_list           A list of point mass objects
+ * @param layout              The field layout of the multi-field arrays
+ * @param mode                The execution mode
+ */
+EXTERN_C int euler2d_diagnostics(
+    struct Mesh mesh,
+    real *primitive_ptr,
+    real *sources_ptr,
+    real *scratch_ptr,
+    struct PointMassList mass_list,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    struct Patch primitive = patch_layout(mesh, NCONS, 2, primitive_ptr, layout);
+    struct Patch interior = patch(mesh, 1, 0, NULL);
+    int m = euler2d_point_mass_sources(mesh, sources_ptr, scratch_ptr, mass_list, mode);
+    real zone_area = mesh.dx * mesh.dy;
+    real sums[NUM_GAS_DIAGNOSTICS];
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        sums[k] = 0.0;
     }
-    return a_max;
+
+    switch (mode) {
+        case CPU: {
+            FOR_EACH(interior) {
+                real diagnostics[NUM_GAS_DIAGNOSTICS];
+                diagnostics_zone(mesh, primitive, i, j, diagnostics);
+
+                for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+                {
+                    sums[k] += diagnostics[k];
+                }
+            }
+            break;
+        }
+
+        case OMP:
+        case Hybrid: {
+            #ifdef _OPENMP
+            #pragma omp parallel for reduction(+:sums[:NUM_GAS_DIAGNOSTICS])
+            FOR_EACH(interior) {
+                real diagnostics[NUM_GAS_DIAGNOSTICS];
+                diagnostics_zone(mesh, primitive, i, j, diagnostics);
+
+                for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+                {
+                    sums[k] += diagnostics[k];
+                }
+            }
+            #endif
+            break;
+        }
+
+        case GPU: {
+            #if defined(__NVCC__) || defined(__ROCM__)
+            dim3 bs = dim3(REDUCE_BLOCK, REDUCE_BLOCK);
+            dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
+            real *block_sums = scratch_ptr + MAX_DIAGNOSTICS;
+            diagnostics_kernel<<<bd, bs>>>(mesh, primitive, block_sums);
+            diagnostics_finish_kernel<<<NUM_GAS_DIAGNOSTICS, REDUCE_BLOCK * REDUCE_BLOCK>>>(block_sums, bd.x * bd.y, zone_area, scratch_ptr + m);
+            #endif
+            return num_diagnostics(&mass_list);
+        }
+    }
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        scratch_ptr[m + k] = sums[k] * zone_area;
+    }
+    return num_diagnostics(&mass_list);
+}
+
+
+/**
+ * Return the number of elements in the scratch buffer of euler2d_diagnostics.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long euler2d_diagnostics_scratch_len(struct Mesh mesh)
+{
+    return (1 + euler2d_max_wavespeed_num_blocks(mesh)) * MAX_DIAGNOSTICS;
 }
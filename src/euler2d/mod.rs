@@ -1,4 +1,4 @@
-use crate::{BoundaryCondition, EquationOfState, ExecutionMode, PointMass, PointMassList, StructuredMesh};
+use crate::{BoundaryCondition, EquationOfState, ExecutionMode, FieldLayout, PointMassList, StructuredMesh};
 
 pub mod solver;
 
@@ -7,6 +7,7 @@ extern "C" {
         mesh: StructuredMesh,
         primitive_ptr: *const f64,
         conserved_ptr: *mut f64,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
@@ -21,36 +22,97 @@ extern "C" {
         alpha: f64,
         a: f64,
         dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
         velocity_ceiling: f64,
         cooling_coefficient: f64,
         mach_ceiling: f64,
         density_floor: f64,
         pressure_floor: f64,
         constant_softening: i32,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
-    pub fn euler2d_point_mass_source_term(
+    pub fn euler2d_advance_rk_region(
         mesh: StructuredMesh,
-        primitive_ptr: *const f64,
-        cons_rate_ptr: *const f64,
+        conserved_rk_ptr: *const f64,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
+        eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
         mass_list: PointMassList,
-        mass: PointMass,
-        mode: ExecutionMode,
+        alpha: f64,
+        a: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
+        velocity_ceiling: f64,
+        cooling_coefficient: f64,
+        mach_ceiling: f64,
+        density_floor: f64,
+        pressure_floor: f64,
         constant_softening: i32,
+        zones: *const i32,
+        layout: FieldLayout,
+        mode: ExecutionMode,
     );
 
-    pub fn euler2d_wavespeed(
+    pub fn euler2d_advance_rk_faces(
         mesh: StructuredMesh,
-        primitive_ptr: *const f64,
-        wavespeed_ptr: *mut f64,
+        conserved_rk_ptr: *const f64,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
+        flux_i_ptr: *mut f64,
+        flux_j_ptr: *mut f64,
         eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
+        mass_list: PointMassList,
+        alpha: f64,
+        a: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
+        velocity_ceiling: f64,
+        cooling_coefficient: f64,
+        mach_ceiling: f64,
+        density_floor: f64,
+        pressure_floor: f64,
+        constant_softening: i32,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
-    pub fn euler2d_maximum(
-        data: *const f64,
-        size: std::os::raw::c_ulong,
+    pub fn euler2d_max_wavespeed(
+        mesh: StructuredMesh,
+        primitive_ptr: *const f64,
+        block_max_ptr: *mut f64,
+        eos: EquationOfState,
+        layout: FieldLayout,
         mode: ExecutionMode,
     ) -> f64;
+
+    pub fn euler2d_max_wavespeed_num_blocks(mesh: StructuredMesh) -> std::os::raw::c_ulong;
+
+    pub fn euler2d_source_sums_len(mesh: StructuredMesh) -> std::os::raw::c_ulong;
+
+    pub fn euler2d_point_mass_sources(
+        mesh: StructuredMesh,
+        sources_ptr: *mut f64,
+        sums_ptr: *mut f64,
+        mass_list: PointMassList,
+        mode: ExecutionMode,
+    ) -> i32;
+
+    pub fn euler2d_diagnostics(
+        mesh: StructuredMesh,
+        primitive_ptr: *const f64,
+        sources_ptr: *mut f64,
+        scratch_ptr: *mut f64,
+        mass_list: PointMassList,
+        layout: FieldLayout,
+        mode: ExecutionMode,
+    ) -> i32;
+
+    pub fn euler2d_diagnostics_scratch_len(mesh: StructuredMesh) -> std::os::raw::c_ulong;
 }
@@ -0,0 +1,210 @@
+//! An in-process guard zone exchange for patch-based solvers, as an
+//! alternative to `gridiron::automaton::execute_rayon`.
+//!
+//! When all of the patches live in host memory in one process, there is no
+//! need to package guard zone data into messages. Instead, each patch copies
+//! its guard zones directly out of its neighbors' primitive arrays, right
+//! before it advances. Scheduling is fine-grained, as it is with the
+//! automaton: a patch starts a stage as soon as its own neighbors have
+//! finished the previous one.
+//!
+//! Every patch has an epoch, the number of stages it has completed. A patch
+//! at epoch `e` may start its next stage when all of its neighbors have
+//! reached epoch `e`. A neighbor can then be at most one epoch ahead, since
+//! it needs this patch to reach epoch `e + 1` before starting another stage.
+//! Solvers write each stage to a second buffer and then swap the two, so the
+//! epoch `e` data stays in one of the neighbor's two buffers until this patch
+//! has finished with it. The address of each patch's epoch `e` buffer is
+//! published in a slot indexed by `e % 2`, before its epoch is incremented.
+//!
+//! Once a patch has completed a stage, it updates the interior zones of its
+//! next stage right away (see `PatchBasedSolve::advance_interior`), while its
+//! neighbors catch up. Those zones are in the buffer holding its epoch `e`
+//! data, but neighbors only read the zones near its edges, which are left for
+//! the next stage's task.
+
+use crate::trace;
+use crate::{IndexSpace, PatchBasedSolve};
+use gridiron::adjacency_list::AdjacencyList;
+use gridiron::rect_map::Rectangle;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+
+/// A guard zone region of one patch, and the neighbor it is copied from.
+struct Pull {
+    source: usize,
+    region: IndexSpace,
+}
+
+/// A raw pointer to a solver, which is sent to the task advancing it. The
+/// scheduling guarantees there is one such task at a time for each solver.
+struct SolverPtr<S>(*mut S);
+
+unsafe impl<S> Send for SolverPtr<S> {}
+unsafe impl<S> Sync for SolverPtr<S> {}
+
+/// The schedule for an in-place guard zone exchange. It is created once for
+/// a set of solvers, and re-used for every time step.
+pub struct InPlaceExchange {
+    /// For each patch, the guard zone regions it copies from its neighbors.
+    pulls: Vec<Vec<Pull>>,
+    /// For each patch, the patches which copy guard zones from it.
+    dependents: Vec<Vec<usize>>,
+    /// The index space of each patch's primitive array, with guard zones.
+    source_spaces: Vec<IndexSpace>,
+    /// The address of each patch's primitive data, for even and odd epochs.
+    sources: Vec<[AtomicPtr<f64>; 2]>,
+    /// For each patch and stage, the number of patches (its neighbors and
+    /// itself) which have yet to complete the previous stage.
+    waiting: Vec<AtomicUsize>,
+    num_stages: usize,
+}
+
+impl InPlaceExchange {
+    /// Creates a schedule for the given solvers and edge list, which is the
+    /// one used to build the solvers. All the solvers must be on the host.
+    pub fn new<S: PatchBasedSolve>(
+        solvers: &[S],
+        edge_list: &AdjacencyList<Rectangle<i64>>,
+    ) -> Self {
+        assert! {
+            solvers.iter().all(|s| s.device().is_none()),
+            "the in-place exchange requires solvers on the host"
+        };
+        let index: HashMap<_, _> = solvers
+            .iter()
+            .enumerate()
+            .map(|(n, s)| (s.key(), n))
+            .collect();
+
+        let pulls: Vec<Vec<_>> = solvers
+            .iter()
+            .map(|s| {
+                let target_space = s.guard_source().index_space();
+                edge_list
+                    .incoming_edges(&s.key())
+                    .map(|rect| Pull {
+                        source: index[rect],
+                        region: IndexSpace::from(rect).intersect(&target_space).unwrap(),
+                    })
+                    .collect()
+            })
+            .collect();
+
+        let mut dependents = vec![vec![]; solvers.len()];
+        for (n, p) in pulls.iter().enumerate() {
+            for pull in p {
+                dependents[pull.source].push(n)
+            }
+        }
+
+        Self {
+            pulls,
+            dependents,
+            source_spaces: solvers
+                .iter()
+                .map(|s| s.guard_source().index_space())
+                .collect(),
+            sources: solvers.iter().map(|_| Default::default()).collect(),
+            waiting: vec![],
+            num_stages: 0,
+        }
+    }
+
+    /// Advances the solvers by the given number of stages, filling their
+    /// guard zones before each one. The solvers must be the ones given to
+    /// `new`, in the same order.
+    pub fn execute<S: PatchBasedSolve>(
+        &mut self,
+        solvers: &mut [S],
+        num_stages: usize,
+        pool: &rayon::ThreadPool,
+    ) {
+        assert_eq!(solvers.len(), self.pulls.len());
+
+        if self.num_stages != num_stages {
+            self.waiting = (0..solvers.len() * num_stages)
+                .map(|_| AtomicUsize::new(0))
+                .collect();
+            self.num_stages = num_stages;
+        }
+        for (n, solver) in solvers.iter_mut().enumerate() {
+            let ptr = solver.guard_target().as_mut_ptr();
+            self.sources[n][0].store(ptr, Ordering::Relaxed);
+
+            for stage in 1..num_stages {
+                self.waiting[n * num_stages + stage]
+                    .store(self.pulls[n].len() + 1, Ordering::Relaxed)
+            }
+        }
+
+        let this = &*self;
+        let solvers: Vec<_> = solvers.iter_mut().map(|s| SolverPtr(s as *mut S)).collect();
+        let solvers = &solvers;
+
+        pool.scope(|scope| {
+            for n in 0..solvers.len() {
+                scope.spawn(move |scope| this.advance(scope, solvers, n, 0))
+            }
+        });
+    }
+
+    /// Fills the guard zones of one solver, advances it by one stage, and
+    /// then spawns the stages of it and its dependents which have become
+    /// ready.
+    fn advance<'a, S: PatchBasedSolve>(
+        &'a self,
+        scope: &rayon::Scope<'a>,
+        solvers: &'a [SolverPtr<S>],
+        n: usize,
+        stage: usize,
+    ) {
+        // Safety: the task for stage `stage` of solver `n` is spawned exactly
+        // once, after the task for the previous stage has completed, so this
+        // is the only reference to the solver. The source regions read here
+        // are not written until this task has completed (see module docs).
+        let solver = unsafe { &mut *solvers[n].0 };
+        let mut span = trace::Span::patch("receive", &solver.key());
+        let target = solver.guard_target();
+
+        for pull in &self.pulls[n] {
+            let src = self.sources[pull.source][stage % 2].load(Ordering::Acquire);
+            unsafe { target.copy_from_raw(src, &self.source_spaces[pull.source], &pull.region) }
+            span.add_bytes(pull.region.len() * target.num_fields() * std::mem::size_of::<f64>());
+        }
+        drop(span);
+        solver.advance_stage();
+
+        if stage + 1 == self.num_stages {
+            return;
+        }
+        let ptr = solver.guard_target().as_mut_ptr();
+        self.sources[n][(stage + 1) % 2].store(ptr, Ordering::Release);
+
+        for &m in &self.dependents[n] {
+            self.release(scope, solvers, m, stage + 1)
+        }
+
+        // The interior of the next stage does not need guard zones, so it is
+        // updated while the neighbors are still finishing this stage. This
+        // solver's own stage is released only afterwards.
+        solver.advance_interior();
+        self.release(scope, solvers, n, stage + 1)
+    }
+
+    /// Records that one of the patches solver `n` is waiting on has
+    /// completed the stage before `stage`, and spawns the task for the
+    /// given stage if it was the last one.
+    fn release<'a, S: PatchBasedSolve>(
+        &'a self,
+        scope: &rayon::Scope<'a>,
+        solvers: &'a [SolverPtr<S>],
+        n: usize,
+        stage: usize,
+    ) {
+        let waiting = &self.waiting[n * self.num_stages + stage];
+        if waiting.fetch_sub(1, Ordering::AcqRel) == 1 {
+            scope.spawn(move |scope| self.advance(scope, solvers, n, stage))
+        }
+    }
+}
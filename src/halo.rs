@@ -0,0 +1,69 @@
+//! Recycled buffers for the guard zone messages exchanged between
+//! patch-based solvers.
+
+use crate::patch::Patch;
+use gridiron::index_space::IndexSpace;
+use gridiron::rect_map::Rectangle;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+
+/// The total number of message buffers allocated by all halo pools.
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+/// Returns the number of guard zone message buffers that have been allocated
+/// since the program started. Once every pool has warmed up (two exchanges),
+/// this number stops increasing.
+pub fn allocation_count() -> usize {
+    ALLOCATIONS.load(Ordering::Relaxed)
+}
+
+/// A pool of guard zone message buffers, owned by the solver which sends the
+/// messages. There is one buffer per outgoing edge and exchange parity. A
+/// message is a shared reference to one of the buffers, which the receiver
+/// drops after copying the guard zones out of it. The buffer is then
+/// re-filled in place two exchanges later. Alternating between two buffers
+/// per edge means a buffer is never re-used in the exchange right after the
+/// one it was sent in. If the receiver is still holding a buffer when it is
+/// due to be re-filled, a new one is allocated and counted.
+#[derive(Default)]
+pub struct HaloPool {
+    buffers: Mutex<HashMap<(Rectangle<i64>, usize), Arc<Patch>>>,
+    exchange: AtomicUsize,
+}
+
+impl HaloPool {
+    /// Returns the messages for one guard zone exchange: for each of the
+    /// given destination patches, the subset of `source` which is inside
+    /// `interior` and within `num_guard` zones of the destination.
+    pub fn messages(
+        &self,
+        source: &Patch,
+        interior: &IndexSpace,
+        destinations: &[Rectangle<i64>],
+        num_guard: usize,
+    ) -> Vec<(Rectangle<i64>, Arc<Patch>)> {
+        let parity = self.exchange.fetch_add(1, Ordering::Relaxed) % 2;
+        let mut buffers = self.buffers.lock().unwrap();
+
+        destinations
+            .iter()
+            .map(|destination| {
+                let key = (destination.clone(), parity);
+
+                match buffers.get_mut(&key).and_then(Arc::get_mut) {
+                    Some(buffer) => source.copy_into(buffer),
+                    None => {
+                        let overlap = IndexSpace::from(destination)
+                            .extend_all(num_guard as i64)
+                            .intersect(interior)
+                            .unwrap();
+                        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+                        buffers.insert(key.clone(), Arc::new(source.extract(&overlap)));
+                    }
+                }
+                (destination.clone(), buffers[&key].clone())
+            })
+            .collect()
+    }
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "../sailfish.h"
 
 
@@ -141,13 +143,20 @@ static __host__ __device__ void point_mass_source_term(
     }
 }
 
+// Adds the source terms of all the point masses to cons. If sums is not NULL,
+// the source terms of mass p, times the weight, are also added to
+// sums[NCONS * p + q], and their torque about the origin to
+// sums[NCONS * n + p], where n is the number of point masses; the RK stages
+// use this to integrate them over time.
 static __host__ __device__ void point_masses_source_term(
     struct PointMassList *mass_list,
     real x1,
     real y1,
     real dt,
     real *prim,
-    real *cons)
+    real *cons,
+    real *sums,
+    real weight)
 {
     for (int p = 0; p < mass_list->count; ++p)
     {
@@ -158,6 +167,14 @@ static __host__ __device__ void point_masses_source_term(
         {
             cons[q] += delta_cons[q];
         }
+        if (sums != NULL)
+        {
+            for (int q = 0; q < NCONS; ++q)
+            {
+                sums[NCONS * p + q] += weight * delta_cons[q];
+            }
+            sums[NCONS * mass_list->count + p] += weight * (x1 * delta_cons[2] - y1 * delta_cons[1]);
+        }
     }
 }
 
@@ -350,11 +367,45 @@ _Pragma("omp parallel for") \
     for (int j = p.start[1]; j < p.start[1] + p.count[1]; ++j)
 #define GET(p, i, j) (p.data + p.jumps[0] * ((i) - p.start[0]) + p.jumps[1] * ((j) - p.start[1]))
 
+// The GPU reductions use square blocks of this many threads on a side. The
+// diagnostics integrated by the reductions kernel are listed at
+// num_diagnostics.
+#define REDUCE_BLOCK 16
+#define MAX_DIAGNOSTICS 16
+
+// Tiles are sized so that a tile's primitive footprint, together with its
+// gradient and face flux scratch arrays, fits comfortably in L2 cache.
+#define TILE_NI 16
+#define TILE_NJ 64
+#define FOR_EACH_TILE(p) \
+    for (int i = p.start[0]; i < p.start[0] + p.count[0]; i += TILE_NI) \
+    for (int j = p.start[1]; j < p.start[1] + p.count[1]; j += TILE_NJ)
+#define FOR_EACH_TILE_OMP(p) \
+_Pragma("omp for collapse(2)") \
+    for (int i = p.start[0]; i < p.start[0] + p.count[0]; i += TILE_NI) \
+    for (int j = p.start[1]; j < p.start[1] + p.count[1]; j += TILE_NJ)
+
+// Tiles for the fused (temporally blocked) advance are larger, because each
+// tile recomputes a halo of up to 2 * rk_order - 2 zones at the early stages.
+#define FUSED_TILE_NI 32
+#define FUSED_TILE_NJ 64
+#define FUSED_MAX_GUARD 6
+#define FOR_EACH_FUSED_TILE(p) \
+    for (int i = p.start[0]; i < p.start[0] + p.count[0]; i += FUSED_TILE_NI) \
+    for (int j = p.start[1]; j < p.start[1] + p.count[1]; j += FUSED_TILE_NJ)
+#define FOR_EACH_FUSED_TILE_OMP(p) \
+_Pragma("omp for collapse(2)") \
+    for (int i = p.start[0]; i < p.start[0] + p.count[0]; i += FUSED_TILE_NI) \
+    for (int j = p.start[1]; j < p.start[1] + p.count[1]; j += FUSED_TILE_NJ)
+
+// The jumps are the memory strides along i, j, and between fields. GET
+// returns a pointer to the first field of a zone; the other fields are at
+// multiples of jumps[2] from there.
 struct Patch
 {
     int start[2];
     int count[2];
-    int jumps[2];
+    int jumps[3];
     int num_fields;
     real *data;
 };
@@ -368,11 +419,92 @@ static struct Patch patch(struct Mesh mesh, int num_fields, int num_guard, real
     patch.count[1] = mesh.nj + 2 * num_guard;
     patch.jumps[0] = num_fields * patch.count[1];
     patch.jumps[1] = num_fields;
+    patch.jumps[2] = 1;
     patch.num_fields = num_fields;
     patch.data = data;
     return patch;
 }
 
+static struct Patch patch_layout(struct Mesh mesh, int num_fields, int num_guard, real *data, enum FieldLayout layout)
+{
+    struct Patch p = patch(mesh, num_fields, num_guard, data);
+
+    if (layout == Planar)
+    {
+        p.jumps[0] = p.count[1];
+        p.jumps[1] = 1;
+        p.jumps[2] = p.count[0] * p.count[1];
+    }
+    return p;
+}
+
+// An index space with no data, for iterating over the zones [i0, i1) x
+// [j0, j1) of a patch, where zones = {i0, i1, j0, j1}.
+static struct Patch zone_region(const int *zones)
+{
+    struct Patch p;
+    p.start[0] = zones[0];
+    p.start[1] = zones[2];
+    p.count[0] = zones[1] - zones[0];
+    p.count[1] = zones[3] - zones[2];
+    p.jumps[0] = 0;
+    p.jumps[1] = 0;
+    p.jumps[2] = 0;
+    p.num_fields = 0;
+    p.data = NULL;
+    return p;
+}
+
+static __host__ __device__ void get_fields(struct Patch p, int i, int j, real *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        y[q] = d[q * p.jumps[2]];
+    }
+}
+
+static __host__ __device__ void set_fields(struct Patch p, int i, int j, const real *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        d[q * p.jumps[2]] = y[q];
+    }
+}
+
+// The point mass source terms are integrated over time by the RK stages into
+// a private array of partial sums in each thread, rather than per zone. The
+// CPU threads add their partial sums to the first MAX_SOURCE_SUMS elements
+// of the sources array when their zones are done. On the GPU, each block of
+// threads reduces its partial sums in shared memory, and block b adds them to
+// the elements at b * MAX_SOURCE_SUMS. There is room for the two point masses
+// of a PointMassList.
+#define MAX_SOURCE_SUMS ((NCONS + 1) * 2)
+
+static __host__ __device__ int num_source_sums(struct PointMassList *mass_list)
+{
+    return (NCONS + 1) * mass_list->count;
+}
+
+static void zero_source_sums(real *sums)
+{
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+}
+
+static void add_source_sums(real *sources, const real *sums, struct PointMassList *mass_list)
+{
+    for (int k = 0; k < num_source_sums(mass_list); ++k)
+    {
+        sources[k] += sums[k];
+    }
+}
+
 
 // ============================ SCHEME ========================================
 // ============================================================================
@@ -382,9 +514,12 @@ static __host__ __device__ void primitive_to_conserved_zone(
     int i,
     int j)
 {
-    real *p = GET(primitive, i, j);
-    real *u = GET(conserved, i, j);
+    real p[NCONS];
+    real u[NCONS];
+
+    get_fields(primitive, i, j, p);
     primitive_to_conserved(p, u);
+    set_fields(conserved, i, j, u);
 }
 
 static __host__ __device__ void advance_rk_zone(
@@ -398,6 +533,8 @@ static __host__ __device__ void advance_rk_zone(
     real nu,
     real a,
     real dt,
+    real *sums,
+    real source_weight,
     real velocity_ceiling,
     int i,
     int j)
@@ -430,20 +567,35 @@ static __host__ __device__ void advance_rk_zone(
     //
     //                 kj
     // ------------------------------------------------------------------------
-    real *un = GET(conserved_rk, i, j);
-    real *pcc = GET(primitive_rd, i, j);
-    real *pli = GET(primitive_rd, i - 1, j);
-    real *pri = GET(primitive_rd, i + 1, j);
-    real *plj = GET(primitive_rd, i, j - 1);
-    real *prj = GET(primitive_rd, i, j + 1);
-    real *pki = GET(primitive_rd, i - 2, j);
-    real *pti = GET(primitive_rd, i + 2, j);
-    real *pkj = GET(primitive_rd, i, j - 2);
-    real *ptj = GET(primitive_rd, i, j + 2);
-    real *pll = GET(primitive_rd, i - 1, j - 1);
-    real *plr = GET(primitive_rd, i - 1, j + 1);
-    real *prl = GET(primitive_rd, i + 1, j - 1);
-    real *prr = GET(primitive_rd, i + 1, j + 1);
+    real un[NCONS];
+    real pcc[NCONS];
+    real pli[NCONS];
+    real pri[NCONS];
+    real plj[NCONS];
+    real prj[NCONS];
+    real pki[NCONS];
+    real pti[NCONS];
+    real pkj[NCONS];
+    real ptj[NCONS];
+    real pll[NCONS];
+    real plr[NCONS];
+    real prl[NCONS];
+    real prr[NCONS];
+
+    get_fields(conserved_rk, i, j, un);
+    get_fields(primitive_rd, i, j, pcc);
+    get_fields(primitive_rd, i - 1, j, pli);
+    get_fields(primitive_rd, i + 1, j, pri);
+    get_fields(primitive_rd, i, j - 1, plj);
+    get_fields(primitive_rd, i, j + 1, prj);
+    get_fields(primitive_rd, i - 2, j, pki);
+    get_fields(primitive_rd, i + 2, j, pti);
+    get_fields(primitive_rd, i, j - 2, pkj);
+    get_fields(primitive_rd, i, j + 2, ptj);
+    get_fields(primitive_rd, i - 1, j - 1, pll);
+    get_fields(primitive_rd, i - 1, j + 1, plr);
+    get_fields(primitive_rd, i + 1, j - 1, prl);
+    get_fields(primitive_rd, i + 1, j + 1, prr);
 
     real plip[NCONS];
     real plim[NCONS];
@@ -528,15 +680,16 @@ static __host__ __device__ void advance_rk_zone(
 
     primitive_to_conserved(pcc, ucc);
     buffer_source_term(&bc, xc, yc, dt, ucc);
-    point_masses_source_term(&mass_list, xc, yc, dt, pcc, ucc);
+    point_masses_source_term(&mass_list, xc, yc, dt, pcc, ucc, sums, source_weight);
 
     for (int q = 0; q < NCONS; ++q)
     {
         ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
         ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
     }
-    real *pout = GET(primitive_wr, i, j);
+    real pout[NCONS];
     conserved_to_primitive(ucc, pout, velocity_ceiling);
+    set_fields(primitive_wr, i, j, pout);
 }
 
 static __host__ __device__ void advance_rk_zone_inviscid(
@@ -549,6 +702,8 @@ static __host__ __device__ void advance_rk_zone_inviscid(
     struct PointMassList mass_list,
     real a,
     real dt,
+    real *sums,
+    real source_weight,
     real velocity_ceiling,
     int i,
     int j)
@@ -562,16 +717,27 @@ static __host__ __device__ void advance_rk_zone_inviscid(
     real yc = mesh.y0 + (j + 0.5) * dy;
     real yr = mesh.y0 + (j + 1.0) * dy;
 
-    real *un = GET(conserved_rk, i, j);
-    real *pcc = GET(primitive_rd, i, j);
-    real *pli = GET(primitive_rd, i - 1, j);
-    real *pri = GET(primitive_rd, i + 1, j);
-    real *plj = GET(primitive_rd, i, j - 1);
-    real *prj = GET(primitive_rd, i, j + 1);
-    real *pki = GET(primitive_rd, i - 2, j);
-    real *pti = GET(primitive_rd, i + 2, j);
-    real *pkj = GET(primitive_rd, i, j - 2);
-    real *ptj = GET(primitive_rd, i, j + 2);
+    real un[NCONS];
+    real pcc[NCONS];
+    real pli[NCONS];
+    real pri[NCONS];
+    real plj[NCONS];
+    real prj[NCONS];
+    real pki[NCONS];
+    real pti[NCONS];
+    real pkj[NCONS];
+    real ptj[NCONS];
+
+    get_fields(conserved_rk, i, j, un);
+    get_fields(primitive_rd, i, j, pcc);
+    get_fields(primitive_rd, i - 1, j, pli);
+    get_fields(primitive_rd, i + 1, j, pri);
+    get_fields(primitive_rd, i, j - 1, plj);
+    get_fields(primitive_rd, i, j + 1, prj);
+    get_fields(primitive_rd, i - 2, j, pki);
+    get_fields(primitive_rd, i + 2, j, pti);
+    get_fields(primitive_rd, i, j - 2, pkj);
+    get_fields(primitive_rd, i, j + 2, ptj);
 
     real plip[NCONS];
     real plim[NCONS];
@@ -627,210 +793,1315 @@ static __host__ __device__ void advance_rk_zone_inviscid(
 
     primitive_to_conserved(pcc, ucc);
     buffer_source_term(&bc, xc, yc, dt, ucc);
-    point_masses_source_term(&mass_list, xc, yc, dt, pcc, ucc);
+    point_masses_source_term(&mass_list, xc, yc, dt, pcc, ucc, sums, source_weight);
 
     for (int q = 0; q < NCONS; ++q)
     {
         ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
         ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
     }
-    real *pout = GET(primitive_wr, i, j);
+    real pout[NCONS];
     conserved_to_primitive(ucc, pout, velocity_ceiling);
+    set_fields(primitive_wr, i, j, pout);
 }
 
-static __host__ __device__ void point_mass_source_term_zone(
-    struct Mesh mesh,
-    struct Patch primitive,
-    struct Patch cons_rate,
-    struct PointMass mass,
-    int i,
-    int j)
-{
-    real *pc = GET(primitive, i, j);
-    real *sc = GET(cons_rate, i, j);
-    real x = mesh.x0 + (i + 0.5) * mesh.dx;
-    real y = mesh.y0 + (j + 0.5) * mesh.dy;
-    point_mass_source_term(&mass, x, y, 1.0, pc, sc);
-}
-
-static __host__ __device__ void wavespeed_zone(
-    struct Mesh mesh,
-    struct EquationOfState eos,
-    struct Patch primitive,
-    struct Patch wavespeed,
-    struct PointMassList mass_list,
-    int i,
-    int j)
-{
-    real *pc = GET(primitive, i, j);
-    real x = mesh.x0 + (i + 0.5) * mesh.dx;
-    real y = mesh.y0 + (j + 0.5) * mesh.dy;
-    real cs2 = sound_speed_squared(&eos, x, y, &mass_list);
-    real a = primitive_max_wavespeed(pc, cs2);
-    GET(wavespeed, i, j)[0] = a;
-}
-
-
-// ============================ KERNELS =======================================
-// ============================================================================
-#if defined(__NVCC__) || defined(__ROCM__)
-
-static void __global__ primitive_to_conserved_kernel(
-    struct Mesh mesh,
-    struct Patch primitive,
-    struct Patch conserved)
+/**
+ * Scratch storage for the tiled advance. Gradients cover the tile plus one
+ * zone on each side (the corners are not used), x-face fluxes are stored at
+ * the TILE_NI + 1 faces in each row, and y-face fluxes at the TILE_NJ + 1
+ * faces in each column.
+ */
+struct TileScratch
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    real gx[(TILE_NI + 2) * (TILE_NJ + 2) * NCONS];
+    real gy[(TILE_NI + 2) * (TILE_NJ + 2) * NCONS];
+    real fx[(TILE_NI + 1) * TILE_NJ * NCONS];
+    real fy[TILE_NI * (TILE_NJ + 1) * NCONS];
+};
 
-    if (i < mesh.ni && j < mesh.nj)
-    {
-        primitive_to_conserved_zone(primitive, conserved, i, j);
-    }
-}
+#define TILE_GRAD(g, ii, jj) (g + ((ii) + 1) * (TILE_NJ + 2) * NCONS + ((jj) + 1) * NCONS)
+#define TILE_FX(s, ii, jj) (s->fx + (ii) * TILE_NJ * NCONS + (jj) * NCONS)
+#define TILE_FY(s, ii, jj) (s->fy + (ii) * (TILE_NJ + 1) * NCONS + (jj) * NCONS)
 
-static void __global__ advance_rk_kernel(
+/**
+ * Advances the zones in the tile starting at (i0, j0). Each PLM gradient and
+ * each face flux is computed once and written to the scratch buffer, rather
+ * than being recomputed by both zones sharing it. The arithmetic is
+ * performed in the same order as in advance_rk_zone and
+ * advance_rk_zone_inviscid, so the results are bitwise identical.
+ */
+static void advance_rk_tile(
     struct Mesh mesh,
     struct Patch conserved_rk,
     struct Patch primitive_rd,
     struct Patch primitive_wr,
     struct EquationOfState eos,
-    struct BoundaryCondition buffer,
+    struct BoundaryCondition bc,
     struct PointMassList mass_list,
     real nu,
     real a,
     real dt,
-    real velocity_ceiling)
+    real *sums,
+    real source_weight,
+    real velocity_ceiling,
+    int i0,
+    int j0,
+    struct TileScratch *scratch)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int ni = min2(TILE_NI, conserved_rk.start[0] + conserved_rk.count[0] - i0);
+    int nj = min2(TILE_NJ, conserved_rk.start[1] + conserved_rk.count[1] - j0);
+    int viscous = nu != 0.0;
+    real dx = mesh.dx;
+    real dy = mesh.dy;
 
-    if (i < mesh.ni && j < mesh.nj)
+    // Gradients: x-gradients are needed one zone beyond the tile along i,
+    // and y-gradients one zone beyond along j. The viscous stress also needs
+    // the transverse gradients in those rims.
+    for (int ii = -1; ii < ni + 1; ++ii)
     {
-        advance_rk_zone(
-            mesh,
-            conserved_rk,
-            primitive_rd,
-            primitive_wr,
-            eos,
-            buffer,
-            mass_list,
-            nu,
-            a,
-            dt,
-            velocity_ceiling,
-            i, j
-        );
+        for (int jj = -1; jj < nj + 1; ++jj)
+        {
+            int in_i = ii >= 0 && ii < ni;
+            int in_j = jj >= 0 && jj < nj;
+
+            if (!in_i && !in_j)
+            {
+                continue;
+            }
+            int i = i0 + ii;
+            int j = j0 + jj;
+            real *pc = GET(primitive_rd, i, j);
+
+            if (in_j || viscous)
+            {
+                plm_gradient(GET(primitive_rd, i - 1, j), pc, GET(primitive_rd, i + 1, j), TILE_GRAD(scratch->gx, ii, jj));
+            }
+            if (in_i || viscous)
+            {
+                plm_gradient(GET(primitive_rd, i, j - 1), pc, GET(primitive_rd, i, j + 1), TILE_GRAD(scratch->gy, ii, jj));
+            }
+        }
+    }
+
+    // Fluxes through the x-faces; face ii is the left face of zone ii.
+    for (int ii = 0; ii < ni + 1; ++ii)
+    {
+        for (int jj = 0; jj < nj; ++jj)
+        {
+            int i = i0 + ii;
+            int j = j0 + jj;
+            real *pl = GET(primitive_rd, i - 1, j);
+            real *pr = GET(primitive_rd, i, j);
+            real *gxl = TILE_GRAD(scratch->gx, ii - 1, jj);
+            real *gxr = TILE_GRAD(scratch->gx, ii, jj);
+            real *f = TILE_FX(scratch, ii, jj);
+            real pm[NCONS];
+            real pp[NCONS];
+
+            for (int q = 0; q < NCONS; ++q)
+            {
+                pm[q] = pl[q] + 0.5 * gxl[q];
+                pp[q] = pr[q] - 0.5 * gxr[q];
+            }
+            real xf = mesh.x0 + (i + 0.0) * dx;
+            real yc = mesh.y0 + (j + 0.5) * dy;
+            real cs2 = sound_speed_squared(&eos, xf, yc, &mass_list);
+            riemann_hlle(pm, pp, f, cs2, 0);
+
+            if (viscous)
+            {
+                real sl[4];
+                real sr[4];
+                shear_strain(gxl, TILE_GRAD(scratch->gy, ii - 1, jj), dx, dy, sl);
+                shear_strain(gxr, TILE_GRAD(scratch->gy, ii, jj), dx, dy, sr);
+                f[1] -= 0.5 * nu * (pl[0] * sl[0] + pr[0] * sr[0]); // x-x
+                f[2] -= 0.5 * nu * (pl[0] * sl[1] + pr[0] * sr[1]); // x-y
+            }
+        }
+    }
+
+    // Fluxes through the y-faces; face jj is the left face of zone jj.
+    for (int ii = 0; ii < ni; ++ii)
+    {
+        for (int jj = 0; jj < nj + 1; ++jj)
+        {
+            int i = i0 + ii;
+            int j = j0 + jj;
+            real *pl = GET(primitive_rd, i, j - 1);
+            real *pr = GET(primitive_rd, i, j);
+            real *gyl = TILE_GRAD(scratch->gy, ii, jj - 1);
+            real *gyr = TILE_GRAD(scratch->gy, ii, jj);
+            real *f = TILE_FY(scratch, ii, jj);
+            real pm[NCONS];
+            real pp[NCONS];
+
+            for (int q = 0; q < NCONS; ++q)
+            {
+                pm[q] = pl[q] + 0.5 * gyl[q];
+                pp[q] = pr[q] - 0.5 * gyr[q];
+            }
+            real xc = mesh.x0 + (i + 0.5) * dx;
+            real yf = mesh.y0 + (j + 0.0) * dy;
+            real cs2 = sound_speed_squared(&eos, xc, yf, &mass_list);
+            riemann_hlle(pm, pp, f, cs2, 1);
+
+            if (viscous)
+            {
+                real sl[4];
+                real sr[4];
+                shear_strain(TILE_GRAD(scratch->gx, ii, jj - 1), gyl, dx, dy, sl);
+                shear_strain(TILE_GRAD(scratch->gx, ii, jj), gyr, dx, dy, sr);
+                f[1] -= 0.5 * nu * (pl[0] * sl[2] + pr[0] * sr[2]); // y-x
+                f[2] -= 0.5 * nu * (pl[0] * sl[3] + pr[0] * sr[3]); // y-y
+            }
+        }
+    }
+
+    // Zone update from the shared face fluxes.
+    for (int ii = 0; ii < ni; ++ii)
+    {
+        for (int jj = 0; jj < nj; ++jj)
+        {
+            int i = i0 + ii;
+            int j = j0 + jj;
+            real xc = mesh.x0 + (i + 0.5) * dx;
+            real yc = mesh.y0 + (j + 0.5) * dy;
+            real *un = GET(conserved_rk, i, j);
+            real *pcc = GET(primitive_rd, i, j);
+            real *fli = TILE_FX(scratch, ii, jj);
+            real *fri = TILE_FX(scratch, ii + 1, jj);
+            real *flj = TILE_FY(scratch, ii, jj);
+            real *frj = TILE_FY(scratch, ii, jj + 1);
+            real ucc[NCONS];
+
+            primitive_to_conserved(pcc, ucc);
+            buffer_source_term(&bc, xc, yc, dt, ucc);
+            point_masses_source_term(&mass_list, xc, yc, dt, pcc, ucc, sums, source_weight);
+
+            for (int q = 0; q < NCONS; ++q)
+            {
+                ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
+                ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
+            }
+            real *pout = GET(primitive_wr, i, j);
+            conserved_to_primitive(ucc, pout, velocity_ceiling);
+        }
     }
 }
 
-static void __global__ advance_rk_kernel_inviscid(
+/**
+ * Scratch storage for the fused advance: two primitive buffers which are
+ * swapped between stages, and the conserved data at the start of the step.
+ * Each covers a tile together with its halo of up to FUSED_MAX_GUARD zones.
+ */
+#define FUSED_SCRATCH_SIZE ((FUSED_TILE_NI + 2 * FUSED_MAX_GUARD) * (FUSED_TILE_NJ + 2 * FUSED_MAX_GUARD) * NCONS)
+
+struct FusedScratch
+{
+    real primitive1[FUSED_SCRATCH_SIZE];
+    real primitive2[FUSED_SCRATCH_SIZE];
+    real conserved0[FUSED_SCRATCH_SIZE];
+};
+
+static struct Patch fused_scratch_patch(int i0, int j0, int ni, int nj, int num_guard, real *data)
+{
+    struct Patch p;
+    p.start[0] = i0 - num_guard;
+    p.start[1] = j0 - num_guard;
+    p.count[0] = ni + 2 * num_guard;
+    p.count[1] = nj + 2 * num_guard;
+    p.jumps[0] = NCONS * p.count[1];
+    p.jumps[1] = NCONS;
+    p.jumps[2] = 1;
+    p.num_fields = NCONS;
+    p.data = data;
+    return p;
+}
+
+/**
+ * Advances the tile starting at (i0, j0) through all of the RK stages. The
+ * tile and a halo of num_guard zones are copied from primitive_rd to the
+ * scratch buffers. Stage s then updates the tile and the innermost
+ * num_guard - 2 * (s + 1) zones of the halo, so that the last stage updates
+ * only the tile, which is written to primitive_wr. Zones outside the domain
+ * bounds (in the patch index space) are boundary zones; they keep their
+ * input values throughout. The point mass source terms are integrated only
+ * in the zones of the tile, so that the halo zones are not counted twice.
+ */
+static void advance_rk_fused_tile(
     struct Mesh mesh,
-    struct Patch conserved_rk,
     struct Patch primitive_rd,
     struct Patch primitive_wr,
     struct EquationOfState eos,
-    struct BoundaryCondition buffer,
-    struct PointMassList mass_list,
-    real a,
+    struct BoundaryCondition bc,
+    struct PointMassList *mass_lists,
+    real *weights,
+    int rk_order,
+    real nu,
     real dt,
-    real velocity_ceiling)
+    real *sums,
+    real *source_weights,
+    real velocity_ceiling,
+    int num_guard,
+    int *domain,
+    int i0,
+    int j0,
+    struct FusedScratch *scratch)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int ni = min2(FUSED_TILE_NI, mesh.ni - i0);
+    int nj = min2(FUSED_TILE_NJ, mesh.nj - j0);
+    struct Patch p1 = fused_scratch_patch(i0, j0, ni, nj, num_guard, scratch->primitive1);
+    struct Patch p2 = fused_scratch_patch(i0, j0, ni, nj, num_guard, scratch->primitive2);
+    struct Patch u0 = fused_scratch_patch(i0, j0, ni, nj, num_guard, scratch->conserved0);
+
+    FOR_EACH(p1) {
+        real p[NCONS];
+        get_fields(primitive_rd, i, j, p);
+        set_fields(p1, i, j, p);
+        set_fields(p2, i, j, p);
+    }
 
-    if (i < mesh.ni && j < mesh.nj)
+    for (int stage = 0; stage < rk_order; ++stage)
     {
-        advance_rk_zone_inviscid(
-            mesh,
-            conserved_rk,
-            primitive_rd,
-            primitive_wr,
-            eos,
-            buffer,
-            mass_list,
-            a,
-            dt,
-            velocity_ceiling,
-            i, j
-        );
+        int e = num_guard - 2 * (stage + 1);
+        struct Patch region = u0;
+        region.start[0] = max2(i0 - e, domain[0]);
+        region.start[1] = max2(j0 - e, domain[2]);
+        region.count[0] = min2(i0 + ni + e, domain[1]) - region.start[0];
+        region.count[1] = min2(j0 + nj + e, domain[3]) - region.start[1];
+
+        if (stage == 0)
+        {
+            FOR_EACH(region) {
+                primitive_to_conserved_zone(p1, u0, i, j);
+            }
+        }
+
+        FOR_EACH(region) {
+            int in_tile = i >= i0 && i < i0 + ni && j >= j0 && j < j0 + nj;
+            real *s = in_tile ? sums : NULL;
+
+            if (nu == 0.0) {
+                advance_rk_zone_inviscid(mesh, u0, p1, p2, eos, bc, mass_lists[stage], weights[stage], dt, s, source_weights[stage], velocity_ceiling, i, j);
+            } else {
+                advance_rk_zone(mesh, u0, p1, p2, eos, bc, mass_lists[stage], nu, weights[stage], dt, s, source_weights[stage], velocity_ceiling, i, j);
+            }
+        }
+        struct Patch p = p1;
+        p1 = p2;
+        p2 = p;
     }
+
+    for (int i = i0; i < i0 + ni; ++i)
+    {
+        for (int j = j0; j < j0 + nj; ++j)
+        {
+            set_fields(primitive_wr, i, j, GET(p1, i, j));
+        }
+    }
+}
+
+// The diagnostics are, for each point mass, the conserved quantities (mass,
+// x and y momentum) added by its source terms since the integrals were last
+// taken, then for each point mass the torque of those source terms about the
+// origin, integrated over the same time, then the total mass, angular
+// momentum about the origin, and kinetic energy.
+#define NUM_GAS_DIAGNOSTICS 3
+
+static __host__ __device__ int num_diagnostics(struct PointMassList *mass_list)
+{
+    return num_source_sums(mass_list) + NUM_GAS_DIAGNOSTICS;
 }
 
-static void __global__ point_mass_source_term_kernel(
+// Writes the NUM_GAS_DIAGNOSTICS integrands of the zone to diagnostics. The
+// source term integrals are not per zone; see iso2d_point_mass_sources.
+static __host__ __device__ void diagnostics_zone(
     struct Mesh mesh,
     struct Patch primitive,
-    struct Patch cons_rate,
-    struct PointMass mass)
+    int i,
+    int j,
+    real *diagnostics)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    real pc[NCONS];
+    real uc[NCONS];
 
-    if (i < mesh.ni && j < mesh.nj)
-    {
-        point_mass_source_term_zone(mesh, primitive, cons_rate, mass, i, j);
-    }    
+    get_fields(primitive, i, j, pc);
+    real x = mesh.x0 + (i + 0.5) * mesh.dx;
+    real y = mesh.y0 + (j + 0.5) * mesh.dy;
+
+    primitive_to_conserved(pc, uc);
+    diagnostics[0] = uc[0];
+    diagnostics[1] = x * uc[2] - y * uc[1];
+    diagnostics[2] = 0.5 * (uc[1] * pc[1] + uc[2] * pc[2]);
 }
 
-static void __global__ wavespeed_kernel(
+static __host__ __device__ real max_wavespeed_zone(
     struct Mesh mesh,
     struct EquationOfState eos,
     struct Patch primitive,
-    struct Patch wavespeed,
-    struct PointMassList mass_list)
+    struct PointMassList mass_list,
+    int i,
+    int j)
 {
-    int i = threadIdx.y + blockIdx.y * blockDim.y;
-    int j = threadIdx.x + blockIdx.x * blockDim.x;
-
-    if (i < mesh.ni && j < mesh.nj)
-    {
-        wavespeed_zone(mesh, eos, primitive, wavespeed, mass_list, i, j);
-    }
+    real pc[NCONS];
+    get_fields(primitive, i, j, pc);
+    real x = mesh.x0 + (i + 0.5) * mesh.dx;
+    real y = mesh.y0 + (j + 0.5) * mesh.dy;
+    real cs2 = sound_speed_squared(&eos, x, y, &mass_list);
+    return primitive_max_wavespeed(pc, cs2);
 }
 
-#endif
-
 
-// ============================ PUBLIC API ====================================
+// ============================ SIMD ==========================================
 // ============================================================================
+// The vector kernel needs __builtin_shufflevector, which is available in clang
+// and in GCC 12 or later. Other compilers use the scalar kernel.
+#if (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 12)) && defined(__x86_64__) && !defined(__NVCC__) && !defined(__ROCM__)
+#define SIMD_ENABLED
+#endif
 
+#ifdef SIMD_ENABLED
+#include <emmintrin.h>
 
 /**
- * Converts an array of primitive data to an array of conserved data. The
- * array index space must follow the descriptions below.
- * @param mesh               The mesh [ni,     nj]
- * @param primitive_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
- * @param conserved_ptr[out] [ 0,  0] [ni,     nj]     [3]
- * @param mode               The execution mode
+ * A vreal holds one field value in each of SIMD_W consecutive zones along j.
+ * It is a GCC vector type, so the same source is compiled once for AVX-512,
+ * where each vreal operation is a single instruction on 8 zones, and once for
+ * AVX2, where it is a pair of instructions on 4 zones each. Comparisons give
+ * all-ones or all-zeros lanes, which are used as blend masks in place of the
+ * branches in min2, max2, sign and fabs.
+ *
+ * The arithmetic below mirrors the scalar functions it replaces operation
+ * for operation, and multiply-adds are not contracted to FMA instructions
+ * (GCC does not contract under -std=c99, and clang is told not to), so the
+ * vector kernel is bitwise identical to advance_rk_zone and
+ * advance_rk_zone_inviscid.
  */
-EXTERN_C void iso2d_primitive_to_conserved(
-    struct Mesh mesh,
-    real *primitive_ptr,
-    real *conserved_ptr,
-    enum ExecutionMode mode)
-{
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch conserved = patch(mesh, NCONS, 0, conserved_ptr);    
+#define SIMD_W 8
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+// Every function returning a vreal is inlined into one of the target-specific
+// row functions, so the psABI warning about returning 64-byte vectors without
+// AVX-512 does not apply. Vectors are passed to functions by pointer for the
+// same reason.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
 
-    switch (mode) {
-        case CPU: {
-            FOR_EACH(conserved) {
-                primitive_to_conserved_zone(primitive, conserved, i, j);
-            }
-            break;
-        }
+typedef real vreal __attribute__((vector_size(SIMD_W * sizeof(real))));
+typedef long long vmask __attribute__((vector_size(SIMD_W * sizeof(long long))));
 
-        case OMP: {
-            #ifdef _OPENMP
-            FOR_EACH_OMP(conserved) {
-                primitive_to_conserved_zone(primitive, conserved, i, j);
-            }
-            #endif
-            break;
-        }
+SIMD_INLINE vreal v_splat(real x)
+{
+    vreal v = {x, x, x, x, x, x, x, x};
+    return v;
+}
 
-        case GPU: {
-            #if defined(__NVCC__) || defined(__ROCM__)
+SIMD_INLINE vreal v_load(const real *p)
+{
+    vreal v;
+    memcpy(&v, p, sizeof(vreal));
+    return v;
+}
+
+SIMD_INLINE void v_store(real *p, const vreal *v)
+{
+    memcpy(p, v, sizeof(vreal));
+}
+
+/**
+ * Square root, two lanes at a time. SSE2 is part of the x86-64 baseline, and
+ * sqrtpd is correctly rounded, like the scalar sqrt.
+ */
+SIMD_INLINE vreal v_sqrt(const vreal *x)
+{
+    vreal y;
+
+    for (int l = 0; l < SIMD_W; l += 2)
+    {
+        _mm_storeu_pd((real *) &y + l, _mm_sqrt_pd(_mm_loadu_pd((const real *) x + l)));
+    }
+    return y;
+}
+
+/**
+ * Lane-wise a < b, as a blend mask. GCC lowers a comparison of vectors wider
+ * than the target supports one element at a time, so the comparison is made
+ * on 4-lane halves, which are native for both AVX2 and AVX-512. The halves
+ * are split and joined with register shuffles.
+ */
+SIMD_INLINE vmask v_less(const vreal *a, const vreal *b)
+{
+    typedef real vhalf __attribute__((vector_size(SIMD_W / 2 * sizeof(real))));
+    vhalf a0 = __builtin_shufflevector(*a, *a, 0, 1, 2, 3);
+    vhalf a1 = __builtin_shufflevector(*a, *a, 4, 5, 6, 7);
+    vhalf b0 = __builtin_shufflevector(*b, *b, 0, 1, 2, 3);
+    vhalf b1 = __builtin_shufflevector(*b, *b, 4, 5, 6, 7);
+    return (vmask) __builtin_shufflevector(a0 < b0, a1 < b1, 0, 1, 2, 3, 4, 5, 6, 7);
+}
+
+#define v_blend(m, a, b) ((vreal) (((vmask) (a) & (m)) | ((vmask) (b) & ~(m))))
+#define v_min(a, b) ({ vreal a_ = (a), b_ = (b); v_blend(v_less(&a_, &b_), a_, b_); })
+#define v_max(a, b) ({ vreal a_ = (a), b_ = (b); v_blend(v_less(&b_, &a_), a_, b_); })
+#define v_abs(x) ((vreal) ((vmask) (x) & ~(vmask) v_splat(-0.0)))
+#define v_sign(x) ((vreal) (((vmask) v_splat(1.0) & ~(vmask) v_splat(-0.0)) | ((vmask) (x) & (vmask) v_splat(-0.0))))
+
+SIMD_INLINE vreal plm_gradient_scalar_simd(const vreal *yl, const vreal *y0, const vreal *yr)
+{
+    vreal a = (*y0 - *yl) * PLM_THETA;
+    vreal b = (*yr - *yl) * 0.5;
+    vreal c = (*yr - *y0) * PLM_THETA;
+    return 0.25 * v_abs(v_sign(a) + v_sign(b)) * (v_sign(a) + v_sign(c)) * v_min(v_abs(a), v_min(v_abs(b), v_abs(c)));
+}
+
+SIMD_INLINE void plm_gradient_simd(const vreal *yl, const vreal *y0, const vreal *yr, vreal *g)
+{
+    for (int q = 0; q < NCONS; ++q)
+    {
+        g[q] = plm_gradient_scalar_simd(&yl[q], &y0[q], &yr[q]);
+    }
+}
+
+SIMD_INLINE void shear_strain_simd(const vreal *gx, const vreal *gy, real dx, real dy, vreal *s)
+{
+    vreal sxx = 4.0 / 3.0 * gx[1] / dx - 2.0 / 3.0 * gy[2] / dy;
+    vreal syy =-2.0 / 3.0 * gx[1] / dx + 4.0 / 3.0 * gy[2] / dy;
+    vreal sxy = 1.0 / 1.0 * gx[2] / dx + 1.0 / 1.0 * gy[1] / dy;
+    vreal syx = sxy;
+    s[0] = sxx;
+    s[1] = sxy;
+    s[2] = syx;
+    s[3] = syy;
+}
+
+SIMD_INLINE void conserved_to_primitive_simd(const vreal *cons, vreal *prim, real velocity_ceiling)
+{
+    vreal rho = cons[0];
+    vreal px = cons[1];
+    vreal py = cons[2];
+    vreal vc = v_splat(velocity_ceiling);
+    vreal vx = v_sign(px) * v_min(v_abs(px / rho), vc);
+    vreal vy = v_sign(py) * v_min(v_abs(py / rho), vc);
+
+    prim[0] = rho;
+    prim[1] = vx;
+    prim[2] = vy;
+}
+
+SIMD_INLINE void primitive_to_conserved_simd(const vreal *prim, vreal *cons)
+{
+    vreal rho = prim[0];
+    vreal vx = prim[1];
+    vreal vy = prim[2];
+    vreal px = vx * rho;
+    vreal py = vy * rho;
+
+    cons[0] = rho;
+    cons[1] = px;
+    cons[2] = py;
+}
+
+SIMD_INLINE void primitive_to_flux_simd(
+    const vreal *prim,
+    const vreal *cons,
+    vreal *flux,
+    const vreal *cs2,
+    int direction)
+{
+    vreal vn = prim[1 + direction];
+    vreal rho = prim[0];
+    vreal pressure = rho * *cs2;
+
+    flux[0] = vn * cons[0];
+    flux[1] = vn * cons[1] + pressure * (real) (direction == 0);
+    flux[2] = vn * cons[2] + pressure * (real) (direction == 1);
+}
+
+/**
+ * Vector form of riemann_hlle. The sound speed is passed in along with its
+ * square, since there is no portable vector square root.
+ */
+SIMD_INLINE void riemann_hlle_simd(
+    const vreal *pl,
+    const vreal *pr,
+    vreal *flux,
+    const vreal *cs2,
+    const vreal *cs,
+    int direction)
+{
+    vreal ul[NCONS];
+    vreal ur[NCONS];
+    vreal fl[NCONS];
+    vreal fr[NCONS];
+
+    primitive_to_conserved_simd(pl, ul);
+    primitive_to_conserved_simd(pr, ur);
+    primitive_to_flux_simd(pl, ul, fl, cs2, direction);
+    primitive_to_flux_simd(pr, ur, fr, cs2, direction);
+
+    vreal al0 = pl[1 + direction] - *cs;
+    vreal al1 = pl[1 + direction] + *cs;
+    vreal ar0 = pr[1 + direction] - *cs;
+    vreal ar1 = pr[1 + direction] + *cs;
+    vreal am = v_min(v_splat(0.0), v_min(al0, ar0));
+    vreal ap = v_max(v_splat(0.0), v_max(al1, ar1));
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        flux[q] = (fl[q] * ap - fr[q] * am - (ul[q] - ur[q]) * ap * am) / (ap - am);
+    }
+}
+
+/**
+ * Sound speeds at SIMD_W face positions. The gravitational potential is
+ * accumulated in the same order as in gravitational_potential.
+ */
+SIMD_INLINE void sound_speed_simd(
+    struct EquationOfState *eos,
+    struct PointMassList *mass_list,
+    const vreal *x,
+    const vreal *y,
+    vreal *cs2,
+    vreal *cs)
+{
+    switch (eos->type)
+    {
+        case Isothermal:
+            *cs2 = v_splat(eos->isothermal.sound_speed_squared);
+            break;
+        case LocallyIsothermal:
+        {
+            vreal phi = v_splat(0.0);
+
+            for (int p = 0; p < mass_list->count; ++p)
+            {
+                real x0 = mass_list->masses[p].x;
+                real y0 = mass_list->masses[p].y;
+                real mp = mass_list->masses[p].mass;
+                real rs = mass_list->masses[p].radius;
+
+                vreal dx = *x - x0;
+                vreal dy = *y - y0;
+                vreal r2 = dx * dx + dy * dy;
+                vreal r2_soft = r2 + rs * rs;
+
+                phi -= mp / v_sqrt(&r2_soft);
+            }
+            *cs2 = -phi / eos->locally_isothermal.mach_number_squared;
+            break;
+        }
+        default:
+            *cs2 = v_splat(1.0); // WARNING
+            break;
+    }
+    *cs = v_sqrt(cs2);
+}
+
+SIMD_INLINE void get_fields_simd(struct Patch p, int i, int j, vreal *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        y[q] = v_load(d + q * p.jumps[2]);
+    }
+}
+
+SIMD_INLINE void set_fields_simd(struct Patch p, int i, int j, const vreal *y)
+{
+    real *d = GET(p, i, j);
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        v_store(d + q * p.jumps[2], &y[q]);
+    }
+}
+
+/**
+ * Advances the SIMD_W zones (i, j) ... (i, j + SIMD_W - 1). The patches must
+ * be planar, so that each field of the row is contiguous along j. The buffer
+ * and point mass source terms are applied lane by lane with the scalar
+ * functions, and only when they are active.
+ */
+SIMD_INLINE void advance_rk_zones_simd(
+    struct Mesh mesh,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct EquationOfState eos,
+    struct BoundaryCondition bc,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sums,
+    real source_weight,
+    real velocity_ceiling,
+    int i,
+    int j)
+{
+    real dx = mesh.dx;
+    real dy = mesh.dy;
+    vreal xl = v_splat(mesh.x0 + (i + 0.0) * dx);
+    vreal xc = v_splat(mesh.x0 + (i + 0.5) * dx);
+    vreal xr = v_splat(mesh.x0 + (i + 1.0) * dx);
+    vreal yl;
+    vreal yc;
+    vreal yr;
+
+    for (int l = 0; l < SIMD_W; ++l)
+    {
+        yl[l] = mesh.y0 + (j + l + 0.0) * dy;
+        yc[l] = mesh.y0 + (j + l + 0.5) * dy;
+        yr[l] = mesh.y0 + (j + l + 1.0) * dy;
+    }
+
+    vreal un[NCONS];
+    vreal pcc[NCONS];
+    vreal pli[NCONS];
+    vreal pri[NCONS];
+    vreal plj[NCONS];
+    vreal prj[NCONS];
+    vreal pki[NCONS];
+    vreal pti[NCONS];
+    vreal pkj[NCONS];
+    vreal ptj[NCONS];
+
+    get_fields_simd(conserved_rk, i, j, un);
+    get_fields_simd(primitive_rd, i, j, pcc);
+    get_fields_simd(primitive_rd, i - 1, j, pli);
+    get_fields_simd(primitive_rd, i + 1, j, pri);
+    get_fields_simd(primitive_rd, i, j - 1, plj);
+    get_fields_simd(primitive_rd, i, j + 1, prj);
+    get_fields_simd(primitive_rd, i - 2, j, pki);
+    get_fields_simd(primitive_rd, i + 2, j, pti);
+    get_fields_simd(primitive_rd, i, j - 2, pkj);
+    get_fields_simd(primitive_rd, i, j + 2, ptj);
+
+    vreal gxli[NCONS];
+    vreal gxri[NCONS];
+    vreal gylj[NCONS];
+    vreal gyrj[NCONS];
+    vreal gxcc[NCONS];
+    vreal gycc[NCONS];
+
+    plm_gradient_simd(pki, pli, pcc, gxli);
+    plm_gradient_simd(pli, pcc, pri, gxcc);
+    plm_gradient_simd(pcc, pri, pti, gxri);
+    plm_gradient_simd(pkj, plj, pcc, gylj);
+    plm_gradient_simd(plj, pcc, prj, gycc);
+    plm_gradient_simd(pcc, prj, ptj, gyrj);
+
+    vreal plip[NCONS];
+    vreal plim[NCONS];
+    vreal prip[NCONS];
+    vreal prim[NCONS];
+    vreal pljp[NCONS];
+    vreal pljm[NCONS];
+    vreal prjp[NCONS];
+    vreal prjm[NCONS];
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        plim[q] = pli[q] + 0.5 * gxli[q];
+        plip[q] = pcc[q] - 0.5 * gxcc[q];
+        prim[q] = pcc[q] + 0.5 * gxcc[q];
+        prip[q] = pri[q] - 0.5 * gxri[q];
+
+        pljm[q] = plj[q] + 0.5 * gylj[q];
+        pljp[q] = pcc[q] - 0.5 * gycc[q];
+        prjm[q] = pcc[q] + 0.5 * gycc[q];
+        prjp[q] = prj[q] - 0.5 * gyrj[q];
+    }
+
+    vreal fli[NCONS];
+    vreal fri[NCONS];
+    vreal flj[NCONS];
+    vreal frj[NCONS];
+    vreal ucc[NCONS];
+    vreal cs2li, cs2ri, cs2lj, cs2rj;
+    vreal csli, csri, cslj, csrj;
+
+    sound_speed_simd(&eos, &mass_list, &xl, &yc, &cs2li, &csli);
+    sound_speed_simd(&eos, &mass_list, &xr, &yc, &cs2ri, &csri);
+    sound_speed_simd(&eos, &mass_list, &xc, &yl, &cs2lj, &cslj);
+    sound_speed_simd(&eos, &mass_list, &xc, &yr, &cs2rj, &csrj);
+
+    riemann_hlle_simd(plim, plip, fli, &cs2li, &csli, 0);
+    riemann_hlle_simd(prim, prip, fri, &cs2ri, &csri, 0);
+    riemann_hlle_simd(pljm, pljp, flj, &cs2lj, &cslj, 1);
+    riemann_hlle_simd(prjm, prjp, frj, &cs2rj, &csrj, 1);
+
+    if (nu != 0.0)
+    {
+        vreal pll[NCONS];
+        vreal plr[NCONS];
+        vreal prl[NCONS];
+        vreal prr[NCONS];
+
+        get_fields_simd(primitive_rd, i - 1, j - 1, pll);
+        get_fields_simd(primitive_rd, i - 1, j + 1, plr);
+        get_fields_simd(primitive_rd, i + 1, j - 1, prl);
+        get_fields_simd(primitive_rd, i + 1, j + 1, prr);
+
+        vreal gyli[NCONS];
+        vreal gyri[NCONS];
+        vreal gxlj[NCONS];
+        vreal gxrj[NCONS];
+
+        plm_gradient_simd(pll, pli, plr, gyli);
+        plm_gradient_simd(prl, pri, prr, gyri);
+        plm_gradient_simd(pll, plj, prl, gxlj);
+        plm_gradient_simd(plr, prj, prr, gxrj);
+
+        vreal sli[4];
+        vreal sri[4];
+        vreal slj[4];
+        vreal srj[4];
+        vreal scc[4];
+
+        shear_strain_simd(gxli, gyli, dx, dy, sli);
+        shear_strain_simd(gxri, gyri, dx, dy, sri);
+        shear_strain_simd(gxlj, gylj, dx, dy, slj);
+        shear_strain_simd(gxrj, gyrj, dx, dy, srj);
+        shear_strain_simd(gxcc, gycc, dx, dy, scc);
+
+        fli[1] -= 0.5 * nu * (pli[0] * sli[0] + pcc[0] * scc[0]); // x-x
+        fli[2] -= 0.5 * nu * (pli[0] * sli[1] + pcc[0] * scc[1]); // x-y
+        fri[1] -= 0.5 * nu * (pcc[0] * scc[0] + pri[0] * sri[0]); // x-x
+        fri[2] -= 0.5 * nu * (pcc[0] * scc[1] + pri[0] * sri[1]); // x-y
+        flj[1] -= 0.5 * nu * (plj[0] * slj[2] + pcc[0] * scc[2]); // y-x
+        flj[2] -= 0.5 * nu * (plj[0] * slj[3] + pcc[0] * scc[3]); // y-y
+        frj[1] -= 0.5 * nu * (pcc[0] * scc[2] + prj[0] * srj[2]); // y-x
+        frj[2] -= 0.5 * nu * (pcc[0] * scc[3] + prj[0] * srj[3]); // y-y
+    }
+
+    primitive_to_conserved_simd(pcc, ucc);
+
+    if (bc.type == KeplerianBuffer || mass_list.count > 0)
+    {
+        for (int l = 0; l < SIMD_W; ++l)
+        {
+            real p[NCONS];
+            real u[NCONS];
+
+            for (int q = 0; q < NCONS; ++q)
+            {
+                p[q] = pcc[q][l];
+                u[q] = ucc[q][l];
+            }
+            buffer_source_term(&bc, xc[l], yc[l], dt, u);
+            point_masses_source_term(&mass_list, xc[l], yc[l], dt, p, u, sums, source_weight);
+
+            for (int q = 0; q < NCONS; ++q)
+            {
+                ucc[q][l] = u[q];
+            }
+        }
+    }
+
+    for (int q = 0; q < NCONS; ++q)
+    {
+        ucc[q] -= ((fri[q] - fli[q]) / dx + (frj[q] - flj[q]) / dy) * dt;
+        ucc[q] = (1.0 - a) * ucc[q] + a * un[q];
+    }
+    vreal pout[NCONS];
+    conserved_to_primitive_simd(ucc, pout, velocity_ceiling);
+    set_fields_simd(primitive_wr, i, j, pout);
+}
+
+/**
+ * Advances row i of the patch, SIMD_W zones at a time. The zones left over
+ * at the end of the row are advanced by the scalar kernel.
+ */
+SIMD_INLINE void advance_rk_row_simd(
+    struct Mesh mesh,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct EquationOfState eos,
+    struct BoundaryCondition bc,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sums,
+    real source_weight,
+    real velocity_ceiling,
+    int i)
+{
+    int j0 = conserved_rk.start[1];
+    int j1 = conserved_rk.start[1] + conserved_rk.count[1];
+    int j = j0;
+
+    for (; j + SIMD_W <= j1; j += SIMD_W)
+    {
+        advance_rk_zones_simd(mesh, conserved_rk, primitive_rd, primitive_wr, eos, bc, mass_list, nu, a, dt, sums, source_weight, velocity_ceiling, i, j);
+    }
+    for (; j < j1; ++j)
+    {
+        if (nu == 0.0)
+        {
+            advance_rk_zone_inviscid(mesh, conserved_rk, primitive_rd, primitive_wr, eos, bc, mass_list, a, dt, sums, source_weight, velocity_ceiling, i, j);
+        }
+        else
+        {
+            advance_rk_zone(mesh, conserved_rk, primitive_rd, primitive_wr, eos, bc, mass_list, nu, a, dt, sums, source_weight, velocity_ceiling, i, j);
+        }
+    }
+}
+
+typedef void (*advance_rk_row_fn)(
+    struct Mesh mesh,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct EquationOfState eos,
+    struct BoundaryCondition bc,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sums,
+    real source_weight,
+    real velocity_ceiling,
+    int i);
+
+#define ADVANCE_RK_ROW_TARGET(name, isa) \
+__attribute__((target(isa))) static void name( \
+    struct Mesh mesh, \
+    struct Patch conserved_rk, \
+    struct Patch primitive_rd, \
+    struct Patch primitive_wr, \
+    struct EquationOfState eos, \
+    struct BoundaryCondition bc, \
+    struct PointMassList mass_list, \
+    real nu, \
+    real a, \
+    real dt, \
+    real *sums, \
+    real source_weight, \
+    real velocity_ceiling, \
+    int i) \
+{ \
+    advance_rk_row_simd(mesh, conserved_rk, primitive_rd, primitive_wr, eos, bc, mass_list, nu, a, dt, sums, source_weight, velocity_ceiling, i); \
+}
+
+ADVANCE_RK_ROW_TARGET(advance_rk_row_avx512, "avx512f")
+ADVANCE_RK_ROW_TARGET(advance_rk_row_avx2, "avx2")
+
+/**
+ * Returns the vector width (in doubles) of the widest instruction set
+ * supported by the CPU, or 1 if neither AVX2 nor AVX-512 is available. The
+ * environment variable SAILFISH_SIMD=avx512|avx2|scalar caps the selection,
+ * which is useful for benchmarking and testing the narrower code paths.
+ */
+static int detect_simd_width(void)
+{
+    const char *cap = getenv("SAILFISH_SIMD");
+    int max_width = 8;
+
+    if (cap && strcmp(cap, "avx2") == 0)
+    {
+        max_width = 4;
+    }
+    else if (cap && strcmp(cap, "scalar") == 0)
+    {
+        max_width = 1;
+    }
+    __builtin_cpu_init();
+
+    if (max_width >= 8 && __builtin_cpu_supports("avx512f"))
+    {
+        return 8;
+    }
+    if (max_width >= 4 && __builtin_cpu_supports("avx2"))
+    {
+        return 4;
+    }
+    return 1;
+}
+
+static int cached_simd_width;
+
+/**
+ * Detects the vector width once, when the library is loaded, so that the
+ * kernels, which may be called from many threads, only read a static.
+ */
+__attribute__((constructor)) static void init_simd_width(void)
+{
+    cached_simd_width = detect_simd_width();
+}
+
+static int simd_width(void)
+{
+    return cached_simd_width;
+}
+
+static advance_rk_row_fn advance_rk_row_select(void)
+{
+    switch (simd_width())
+    {
+        case 8: return advance_rk_row_avx512;
+        case 4: return advance_rk_row_avx2;
+        default: return NULL;
+    }
+}
+
+#else
+
+static int simd_width(void)
+{
+    return 1;
+}
+
+#endif // SIMD_ENABLED
+
+
+// ============================ KERNELS =======================================
+// ============================================================================
+#if defined(__NVCC__) || defined(__ROCM__)
+
+static void __global__ primitive_to_conserved_kernel(
+    struct Mesh mesh,
+    struct Patch primitive,
+    struct Patch conserved)
+{
+    int i = threadIdx.y + blockIdx.y * blockDim.y;
+    int j = threadIdx.x + blockIdx.x * blockDim.x;
+
+    if (i < mesh.ni && j < mesh.nj)
+    {
+        primitive_to_conserved_zone(primitive, conserved, i, j);
+    }
+}
+
+// Reduces the partial source sums of the threads in a block of REDUCE_BLOCK
+// x REDUCE_BLOCK, and adds them to the block's elements of sources. Every
+// thread of the block needs to call this.
+static __device__ void add_source_sums_block(real *sources, const real *sums, struct PointMassList *mass_list)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+    int b = blockIdx.x + blockIdx.y * gridDim.x;
+
+    for (int k = 0; k < num_source_sums(mass_list); ++k)
+    {
+        lds[t] = sums[k];
+        __syncthreads();
+
+        for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+        {
+            if (t < size)
+            {
+                lds[t] += lds[t + size];
+            }
+            __syncthreads();
+        }
+        if (t == 0)
+        {
+            sources[b * MAX_SOURCE_SUMS + k] += lds[0];
+        }
+        __syncthreads();
+    }
+}
+
+static void __global__ advance_rk_kernel(
+    struct Mesh mesh,
+    struct Patch zones,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sources,
+    real source_weight,
+    real velocity_ceiling)
+{
+    int i = zones.start[0] + threadIdx.y + blockIdx.y * blockDim.y;
+    int j = zones.start[1] + threadIdx.x + blockIdx.x * blockDim.x;
+    real sums[MAX_SOURCE_SUMS];
+
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+
+    if (i < zones.start[0] + zones.count[0] && j < zones.start[1] + zones.count[1])
+    {
+        advance_rk_zone(
+            mesh,
+            conserved_rk,
+            primitive_rd,
+            primitive_wr,
+            eos,
+            buffer,
+            mass_list,
+            nu,
+            a,
+            dt,
+            sums,
+            source_weight,
+            velocity_ceiling,
+            i, j
+        );
+    }
+    add_source_sums_block(sources, sums, &mass_list);
+}
+
+static void __global__ advance_rk_kernel_inviscid(
+    struct Mesh mesh,
+    struct Patch zones,
+    struct Patch conserved_rk,
+    struct Patch primitive_rd,
+    struct Patch primitive_wr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList mass_list,
+    real a,
+    real dt,
+    real *sources,
+    real source_weight,
+    real velocity_ceiling)
+{
+    int i = zones.start[0] + threadIdx.y + blockIdx.y * blockDim.y;
+    int j = zones.start[1] + threadIdx.x + blockIdx.x * blockDim.x;
+    real sums[MAX_SOURCE_SUMS];
+
+    for (int k = 0; k < MAX_SOURCE_SUMS; ++k)
+    {
+        sums[k] = 0.0;
+    }
+
+    if (i < zones.start[0] + zones.count[0] && j < zones.start[1] + zones.count[1])
+    {
+        advance_rk_zone_inviscid(
+            mesh,
+            conserved_rk,
+            primitive_rd,
+            primitive_wr,
+            eos,
+            buffer,
+            mass_list,
+            a,
+            dt,
+            sums,
+            source_weight,
+            velocity_ceiling,
+            i, j
+        );
+    }
+    add_source_sums_block(sources, sums, &mass_list);
+}
+
+// Each block of REDUCE_BLOCK x REDUCE_BLOCK threads writes its sum of each
+// diagnostic of diagnostics_zone to block_sums, which has the sums of all the
+// blocks for the first diagnostic, then for the second, and so on.
+static void __global__ diagnostics_kernel(
+    struct Mesh mesh,
+    struct Patch primitive,
+    real *block_sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int i = threadIdx.y + blockIdx.y * blockDim.y;
+    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+    int b = blockIdx.x + blockIdx.y * gridDim.x;
+    int num_blocks = gridDim.x * gridDim.y;
+    real diagnostics[NUM_GAS_DIAGNOSTICS];
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        diagnostics[k] = 0.0;
+    }
+    if (i < mesh.ni && j < mesh.nj)
+    {
+        diagnostics_zone(mesh, primitive, i, j, diagnostics);
+    }
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        lds[t] = diagnostics[k];
+        __syncthreads();
+
+        for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+        {
+            if (t < size)
+            {
+                lds[t] += lds[t + size];
+            }
+            __syncthreads();
+        }
+        if (t == 0)
+        {
+            block_sums[k * num_blocks + b] = lds[0];
+        }
+        __syncthreads();
+    }
+}
+
+// Block k sums the block sums of diagnostic k, and writes the result, times
+// the zone area, to sums[k].
+static void __global__ diagnostics_finish_kernel(
+    const real *block_sums,
+    int num_blocks,
+    real zone_area,
+    real *sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x;
+    int k = blockIdx.x;
+    real sum = 0.0;
+
+    for (int b = t; b < num_blocks; b += blockDim.x)
+    {
+        sum += block_sums[k * num_blocks + b];
+    }
+    lds[t] = sum;
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] += lds[t + size];
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        sums[k] = lds[0] * zone_area;
+    }
+}
+
+// Block k sums source term k over the elements of all the blocks of the
+// advance kernels, resets them to zero, and writes the result, times the
+// zone area, to sums[k].
+static void __global__ point_mass_sources_kernel(
+    real *sources,
+    int num_blocks,
+    real zone_area,
+    real *sums)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int t = threadIdx.x;
+    int k = blockIdx.x;
+    real sum = 0.0;
+
+    for (int b = t; b < num_blocks; b += blockDim.x)
+    {
+        sum += sources[b * MAX_SOURCE_SUMS + k];
+        sources[b * MAX_SOURCE_SUMS + k] = 0.0;
+    }
+    lds[t] = sum;
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] += lds[t + size];
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        sums[k] = lds[0] * zone_area;
+    }
+}
+
+// Each block of REDUCE_BLOCK x REDUCE_BLOCK threads writes the maximum
+// wavespeed over its zones to one element of block_max.
+static void __global__ max_wavespeed_kernel(
+    struct Mesh mesh,
+    struct EquationOfState eos,
+    struct Patch primitive,
+    struct PointMassList mass_list,
+    real *block_max)
+{
+    __shared__ real lds[REDUCE_BLOCK * REDUCE_BLOCK];
+
+    int i = threadIdx.y + blockIdx.y * blockDim.y;
+    int j = threadIdx.x + blockIdx.x * blockDim.x;
+    int t = threadIdx.x + threadIdx.y * blockDim.x;
+
+    lds[t] = 0.0;
+
+    if (i < mesh.ni && j < mesh.nj)
+    {
+        lds[t] = max_wavespeed_zone(mesh, eos, primitive, mass_list, i, j);
+    }
+    __syncthreads();
+
+    for (int size = REDUCE_BLOCK * REDUCE_BLOCK / 2; size > 0; size /= 2)
+    {
+        if (t < size)
+        {
+            lds[t] = max2(lds[t], lds[t + size]);
+        }
+        __syncthreads();
+    }
+    if (t == 0)
+    {
+        block_max[blockIdx.x + blockIdx.y * gridDim.x] = lds[0];
+    }
+}
+
+#endif
+
+
+// ============================ PUBLIC API ====================================
+// ============================================================================
+
+
+/**
+ * Converts an array of primitive data to an array of conserved data. The
+ * array index space must follow the descriptions below.
+ * @param mesh               The mesh [ni,     nj]
+ * @param primitive_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
+ * @param conserved_ptr[out] [ 0,  0] [ni,     nj]     [3]
+ * @param layout             The field layout of the multi-field arrays
+ * @param mode               The execution mode
+ */
+EXTERN_C void iso2d_primitive_to_conserved(
+    struct Mesh mesh,
+    real *primitive_ptr,
+    real *conserved_ptr,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    struct Patch primitive = patch_layout(mesh, NCONS, 2, primitive_ptr, layout);
+    struct Patch conserved = patch_layout(mesh, NCONS, 0, conserved_ptr, layout);    
+
+    switch (mode) {
+        case CPU: {
+            FOR_EACH(conserved) {
+                primitive_to_conserved_zone(primitive, conserved, i, j);
+            }
+            break;
+        }
+
+        case OMP:
+        case Hybrid: {
+            #ifdef _OPENMP
+            FOR_EACH_OMP(conserved) {
+                primitive_to_conserved_zone(primitive, conserved, i, j);
+            }
+            #endif
+            break;
+        }
+
+        case GPU: {
+            #if defined(__NVCC__) || defined(__ROCM__)
             dim3 bs = dim3(16, 16);
             dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
             primitive_to_conserved_kernel<<<bd, bs>>>(mesh, primitive, conserved);
@@ -842,8 +2113,252 @@ EXTERN_C void iso2d_primitive_to_conserved(
 
 
 /**
- * Updates an array of primitive data by advancing it a single Runge-Kutta
- * step.
+ * Same as iso2d_advance_rk, but only the zones in the given region are
+ * updated. The zones at least two away from the patch edges do not read
+ * from the guard zones, so they can be updated before the guard zones are
+ * filled, and the remaining strips afterwards.
+ * @param mesh                  The mesh [ni,     nj]
+ * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [3]
+ * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
+ * @param primitive_wr_ptr[out] [-2, -2] [ni + 4, nj + 4] [3]
+ * @param eos                   The EOS
+ * @param buffer                The buffer region
+ * @param mass_list             A list of point mass objects
+ * @param nu                    The viscosity coefficient
+ * @param a                     The RK averaging parameter
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [iso2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param zones                 The region to update [i0, i1, j0, j1]
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
+ */
+EXTERN_C void iso2d_advance_rk_region(
+    struct Mesh mesh,
+    real *conserved_rk_ptr,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sources_ptr,
+    real source_weight,
+    real velocity_ceiling,
+    int *zones,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    struct Patch conserved_rk = patch_layout(mesh, NCONS, 0, conserved_rk_ptr, layout);
+    struct Patch primitive_rd = patch_layout(mesh, NCONS, 2, primitive_rd_ptr, layout);
+    struct Patch primitive_wr = patch_layout(mesh, NCONS, 2, primitive_wr_ptr, layout);
+    real sums[MAX_SOURCE_SUMS];
+    struct Patch region = zone_region(zones);
+
+    zero_source_sums(sums);
+
+    switch (mode) {
+        case CPU: {
+            if (nu == 0.0) {
+                FOR_EACH(region) {
+                    advance_rk_zone_inviscid(
+                        mesh,
+                        conserved_rk,
+                        primitive_rd,
+                        primitive_wr,
+                        eos,
+                        buffer,
+                        mass_list,
+                        a,
+                        dt,
+                        sums,
+                        source_weight,
+                        velocity_ceiling,
+                        i, j
+                    );
+                }
+            } else {
+                FOR_EACH(region) {
+                    advance_rk_zone(
+                        mesh,
+                        conserved_rk,
+                        primitive_rd,
+                        primitive_wr,
+                        eos,
+                        buffer,
+                        mass_list,
+                        nu,
+                        a,
+                        dt,
+                        sums,
+                        source_weight,
+                        velocity_ceiling,
+                        i, j);
+                }
+            }
+            add_source_sums(sources_ptr, sums, &mass_list);
+            break;
+        }
+
+        case OMP:
+        case Hybrid: {
+            #ifdef _OPENMP
+            if (nu == 0.0) {
+                #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+                FOR_EACH(region) {
+                    advance_rk_zone_inviscid(
+                        mesh,
+                        conserved_rk,
+                        primitive_rd,
+                        primitive_wr,
+                        eos,
+                        buffer,
+                        mass_list,
+                        a,
+                        dt,
+                        sums,
+                        source_weight,
+                        velocity_ceiling,
+                        i, j);
+                }
+            } else {
+                #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+                FOR_EACH(region) {
+                    advance_rk_zone(
+                        mesh,
+                        conserved_rk,
+                        primitive_rd,
+                        primitive_wr,
+                        eos,
+                        buffer,
+                        mass_list,
+                        nu,
+                        a,
+                        dt,
+                        sums,
+                        source_weight,
+                        velocity_ceiling,
+                        i, j);
+                }
+            }
+            add_source_sums(sources_ptr, sums, &mass_list);
+            break;
+            #endif
+            break;
+        }
+
+        case GPU: {
+            #if defined(__NVCC__) || defined(__ROCM__)
+            dim3 bs = dim3(16, 16);
+            dim3 bd = dim3((region.count[1] + bs.x - 1) / bs.x, (region.count[0] + bs.y - 1) / bs.y);
+            if (nu == 0.0) {
+                advance_rk_kernel_inviscid<<<bd, bs>>>(
+                    mesh,
+                    region,
+                    conserved_rk,
+                    primitive_rd,
+                    primitive_wr,
+                    eos,
+                    buffer,
+                    mass_list,
+                    a,
+                    dt,
+                    sources_ptr,
+                    source_weight,
+                    velocity_ceiling
+                );
+            } else {
+                advance_rk_kernel<<<bd, bs>>>(
+                    mesh,
+                    region,
+                    conserved_rk,
+                    primitive_rd,
+                    primitive_wr,
+                    eos,
+                    buffer,
+                    mass_list,
+                    nu,
+                    a,
+                    dt,
+                    sources_ptr,
+                    source_weight,
+                    velocity_ceiling
+                );
+            }
+            #endif
+            break;
+        }
+    }
+}
+
+
+/**
+ * Updates an array of primitive data by advancing it a single Runge-Kutta
+ * step.
+ * @param mesh                  The mesh [ni,     nj]
+ * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [3]
+ * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
+ * @param primitive_wr_ptr[out] [-2, -2] [ni + 4, nj + 4] [3]
+ * @param eos                   The EOS
+ * @param buffer                The buffer region
+ * @param mass_list             A list of point mass objects
+ * @param nu                    The viscosity coefficient
+ * @param a                     The RK averaging parameter
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [iso2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
+ */
+EXTERN_C void iso2d_advance_rk(
+    struct Mesh mesh,
+    real *conserved_rk_ptr,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sources_ptr,
+    real source_weight,
+    real velocity_ceiling,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    int zones[4] = {0, mesh.ni, 0, mesh.nj};
+    iso2d_advance_rk_region(
+        mesh,
+        conserved_rk_ptr,
+        primitive_rd_ptr,
+        primitive_wr_ptr,
+        eos,
+        buffer,
+        mass_list,
+        nu,
+        a,
+        dt,
+        sources_ptr,
+        source_weight,
+        velocity_ceiling,
+        zones,
+        layout,
+        mode);
+}
+
+
+/**
+ * Same as iso2d_advance_rk, but on the CPU the patch is processed in
+ * cache-sized tiles. Each face gradient and flux is computed once per tile,
+ * rather than once by each of the zones sharing it. The result is bitwise
+ * identical to iso2d_advance_rk. There is no tiled GPU kernel, and the tile
+ * scratch arrays assume interleaved fields, so in GPU mode or for planar data
+ * this function calls iso2d_advance_rk.
  * @param mesh                  The mesh [ni,     nj]
  * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [3]
  * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
@@ -854,9 +2369,13 @@ EXTERN_C void iso2d_primitive_to_conserved(
  * @param nu                    The viscosity coefficient
  * @param a                     The RK averaging parameter
  * @param dt                    The time step
+ * @param sources_ptr[in,out]   [iso2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param layout                The field layout of the multi-field arrays
  * @param mode                  The execution mode
  */
-EXTERN_C void iso2d_advance_rk(
+EXTERN_C void iso2d_advance_rk_tiled(
     struct Mesh mesh,
     real *conserved_rk_ptr,
     real *primitive_rd_ptr,
@@ -867,18 +2386,76 @@ EXTERN_C void iso2d_advance_rk(
     real nu,
     real a,
     real dt,
+    real *sources_ptr,
+    real source_weight,
     real velocity_ceiling,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
     struct Patch conserved_rk = patch(mesh, NCONS, 0, conserved_rk_ptr);
     struct Patch primitive_rd = patch(mesh, NCONS, 2, primitive_rd_ptr);
     struct Patch primitive_wr = patch(mesh, NCONS, 2, primitive_wr_ptr);
+    real sums[MAX_SOURCE_SUMS];
+
+    if (mode == GPU || layout == Planar)
+    {
+        iso2d_advance_rk(
+            mesh,
+            conserved_rk_ptr,
+            primitive_rd_ptr,
+            primitive_wr_ptr,
+            eos,
+            buffer,
+            mass_list,
+            nu,
+            a,
+            dt,
+            sources_ptr,
+            source_weight,
+            velocity_ceiling,
+            layout,
+            mode);
+        return;
+    }
+
+    zero_source_sums(sums);
 
     switch (mode) {
         case CPU: {
-            if (nu == 0.0) {
-                FOR_EACH(conserved_rk) {
-                    advance_rk_zone_inviscid(
+            struct TileScratch *scratch = (struct TileScratch *) malloc(sizeof(struct TileScratch));
+
+            FOR_EACH_TILE(conserved_rk) {
+                advance_rk_tile(
+                    mesh,
+                    conserved_rk,
+                    primitive_rd,
+                    primitive_wr,
+                    eos,
+                    buffer,
+                    mass_list,
+                    nu,
+                    a,
+                    dt,
+                    sums,
+                    source_weight,
+                    velocity_ceiling,
+                    i, j,
+                    scratch);
+            }
+            free(scratch);
+            add_source_sums(sources_ptr, sums, &mass_list);
+            break;
+        }
+
+        case OMP:
+        case Hybrid: {
+            #ifdef _OPENMP
+            #pragma omp parallel reduction(+:sums[:MAX_SOURCE_SUMS])
+            {
+                struct TileScratch *scratch = (struct TileScratch *) malloc(sizeof(struct TileScratch));
+
+                FOR_EACH_TILE_OMP(conserved_rk) {
+                    advance_rk_tile(
                         mesh,
                         conserved_rk,
                         primitive_rd,
@@ -886,37 +2463,223 @@ EXTERN_C void iso2d_advance_rk(
                         eos,
                         buffer,
                         mass_list,
+                        nu,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
-                        i, j
-                    );
+                        i, j,
+                        scratch);
                 }
-            } else {
-                FOR_EACH(conserved_rk) {
-                    advance_rk_zone(
+                free(scratch);
+            }
+            add_source_sums(sources_ptr, sums, &mass_list);
+            #endif
+            break;
+        }
+
+        case GPU: break; // Handled above
+    }
+}
+
+
+/**
+ * Advances an array of primitive data by a full Runge-Kutta step, with all of
+ * the stages fused into a single pass over memory (temporal blocking). The
+ * patch is processed in tiles. Each tile is copied to a scratch buffer
+ * together with a halo of num_guard zones, all of the stages are performed
+ * on the scratch data while it is in cache, and the tile is written back.
+ * Every stage consumes two zones of the halo, so the guard zones need to be
+ * num_guard >= 2 * rk_order deep, but they only need to be filled once per
+ * time step rather than once per stage. Halo zones are recomputed by each
+ * tile that needs them, in the same way as by the tile that owns them, so
+ * on a single patch the result is bitwise identical to rk_order calls to
+ * iso2d_advance_rk. Halo zones owned by a neighboring patch are evaluated
+ * with the coordinates of this patch's mesh rather than the neighbor's, so
+ * with more than one patch the result agrees with the per-stage kernels
+ * only to round-off (about 1e-13). Not implemented for GPU execution; use
+ * iso2d_advance_rk once per stage.
+ *
+ * @param mesh                  The mesh [ni,     nj]
+ * @param primitive_rd_ptr[in]  [-g, -g] [ni + 2g, nj + 2g] [3]
+ * @param primitive_wr_ptr[out] [-g, -g] [ni + 2g, nj + 2g] [3]
+ * @param eos                   The EOS
+ * @param buffer                The buffer region
+ * @param mass_lists            The point masses at the start of each stage [rk_order]
+ * @param weights               The RK averaging parameter of each stage [rk_order]
+ * @param rk_order              The number of RK stages (1, 2, or 3)
+ * @param nu                    The viscosity coefficient
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [iso2d_source_sums_len(mesh)]
+ * @param source_weights        The weight of each stage's point mass source
+ *                              terms in the integral over the step [rk_order]
+ * @param num_guard             The guard zone depth g, at least 2 * rk_order
+ * @param domain                The global domain in the patch index space
+ *                              [i0, i1, j0, j1]. Zones outside of it are
+ *                              boundary zones, which are not updated.
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
+ */
+EXTERN_C void iso2d_advance_rk_fused(
+    struct Mesh mesh,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList *mass_lists,
+    real *weights,
+    int rk_order,
+    real nu,
+    real dt,
+    real *sources_ptr,
+    real *source_weights,
+    real velocity_ceiling,
+    int num_guard,
+    int *domain,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    struct Patch primitive_rd = patch_layout(mesh, NCONS, num_guard, primitive_rd_ptr, layout);
+    struct Patch primitive_wr = patch_layout(mesh, NCONS, num_guard, primitive_wr_ptr, layout);
+    struct Patch interior = patch(mesh, NCONS, 0, NULL);
+    real sums[MAX_SOURCE_SUMS];
+
+    if (num_guard < 2 * rk_order || num_guard > FUSED_MAX_GUARD)
+    {
+        printf("[FATAL] iso2d_advance_rk_fused got num_guard=%d for rk_order=%d\n", num_guard, rk_order);
+        exit(1);
+    }
+
+    zero_source_sums(sums);
+
+    switch (mode) {
+        case CPU: {
+            struct FusedScratch *scratch = (struct FusedScratch *) malloc(sizeof(struct FusedScratch));
+
+            FOR_EACH_FUSED_TILE(interior) {
+                advance_rk_fused_tile(
+                    mesh,
+                    primitive_rd,
+                    primitive_wr,
+                    eos,
+                    buffer,
+                    mass_lists,
+                    weights,
+                    rk_order,
+                    nu,
+                    dt,
+                    sums,
+                    source_weights,
+                    velocity_ceiling,
+                    num_guard,
+                    domain,
+                    i, j,
+                    scratch);
+            }
+            free(scratch);
+            add_source_sums(sources_ptr, sums, &mass_lists[0]);
+            break;
+        }
+
+        case OMP:
+        case Hybrid: {
+            #ifdef _OPENMP
+            #pragma omp parallel reduction(+:sums[:MAX_SOURCE_SUMS])
+            {
+                struct FusedScratch *scratch = (struct FusedScratch *) malloc(sizeof(struct FusedScratch));
+
+                FOR_EACH_FUSED_TILE_OMP(interior) {
+                    advance_rk_fused_tile(
                         mesh,
-                        conserved_rk,
                         primitive_rd,
                         primitive_wr,
                         eos,
                         buffer,
-                        mass_list,
+                        mass_lists,
+                        weights,
+                        rk_order,
                         nu,
-                        a,
                         dt,
+                        sums,
+                        source_weights,
                         velocity_ceiling,
-                        i, j);
+                        num_guard,
+                        domain,
+                        i, j,
+                        scratch);
                 }
+                free(scratch);
             }
+            add_source_sums(sources_ptr, sums, &mass_lists[0]);
+            #endif
             break;
         }
 
-        case OMP: {
-            #ifdef _OPENMP
-            if (nu == 0.0) {
-                FOR_EACH_OMP(conserved_rk) {
-                    advance_rk_zone_inviscid(
+        case GPU: {
+            printf("[FATAL] iso2d_advance_rk_fused is not implemented for GPU execution\n");
+            exit(1);
+        }
+    }
+}
+
+
+/**
+ * Same as iso2d_advance_rk, but on the CPU each row of the patch is advanced
+ * with an explicitly vectorized kernel, SIMD_W zones at a time. The
+ * instruction set (AVX-512 or AVX2) is selected at run time, see
+ * iso2d_simd_width. The result is bitwise identical to iso2d_advance_rk. The
+ * vector loads require each field to be contiguous along j, so in GPU mode,
+ * for interleaved data, or on a CPU without AVX2, this function calls
+ * iso2d_advance_rk.
+ * @param mesh                  The mesh [ni,     nj]
+ * @param conserved_rk_ptr[in]  [ 0,  0] [ni,     nj]     [3]
+ * @param primitive_rd_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
+ * @param primitive_wr_ptr[out] [-2, -2] [ni + 4, nj + 4] [3]
+ * @param eos                   The EOS
+ * @param buffer                The buffer region
+ * @param mass_list             A list of point mass objects
+ * @param nu                    The viscosity coefficient
+ * @param a                     The RK averaging parameter
+ * @param dt                    The time step
+ * @param sources_ptr[in,out]   [iso2d_source_sums_len(mesh)]
+ * @param source_weight         The weight of this stage's point mass source
+ *                              terms in the integral over the step
+ * @param layout                The field layout of the multi-field arrays
+ * @param mode                  The execution mode
+ */
+EXTERN_C void iso2d_advance_rk_simd(
+    struct Mesh mesh,
+    real *conserved_rk_ptr,
+    real *primitive_rd_ptr,
+    real *primitive_wr_ptr,
+    struct EquationOfState eos,
+    struct BoundaryCondition buffer,
+    struct PointMassList mass_list,
+    real nu,
+    real a,
+    real dt,
+    real *sources_ptr,
+    real source_weight,
+    real velocity_ceiling,
+    enum FieldLayout layout,
+    enum ExecutionMode mode)
+{
+    #ifdef SIMD_ENABLED
+    advance_rk_row_fn advance_rk_row = mode == GPU || layout != Planar ? NULL : advance_rk_row_select();
+
+    if (advance_rk_row != NULL)
+    {
+        struct Patch conserved_rk = patch_layout(mesh, NCONS, 0, conserved_rk_ptr, layout);
+        struct Patch primitive_rd = patch_layout(mesh, NCONS, 2, primitive_rd_ptr, layout);
+        struct Patch primitive_wr = patch_layout(mesh, NCONS, 2, primitive_wr_ptr, layout);
+        real sums[MAX_SOURCE_SUMS];
+        zero_source_sums(sums);
+
+        switch (mode) {
+            case CPU: {
+                for (int i = conserved_rk.start[0]; i < conserved_rk.start[0] + conserved_rk.count[0]; ++i) {
+                    advance_rk_row(
                         mesh,
                         conserved_rk,
                         primitive_rd,
@@ -924,14 +2687,24 @@ EXTERN_C void iso2d_advance_rk(
                         eos,
                         buffer,
                         mass_list,
+                        nu,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
-                        i, j);
+                        i);
                 }
-            } else {
-                FOR_EACH_OMP(conserved_rk) {
-                    advance_rk_zone(
+                add_source_sums(sources_ptr, sums, &mass_list);
+                break;
+            }
+
+            case OMP:
+            case Hybrid: {
+                #ifdef _OPENMP
+                #pragma omp parallel for reduction(+:sums[:MAX_SOURCE_SUMS])
+                for (int i = conserved_rk.start[0]; i < conserved_rk.start[0] + conserved_rk.count[0]; ++i) {
+                    advance_rk_row(
                         mesh,
                         conserved_rk,
                         primitive_rd,
@@ -942,87 +2715,98 @@ EXTERN_C void iso2d_advance_rk(
                         nu,
                         a,
                         dt,
+                        sums,
+                        source_weight,
                         velocity_ceiling,
-                        i, j);
+                        i);
                 }
+                add_source_sums(sources_ptr, sums, &mass_list);
+                #endif
+                break;
             }
-            break;
-            #endif
-            break;
-        }
 
-        case GPU: {
-            #if defined(__NVCC__) || defined(__ROCM__)
-            dim3 bs = dim3(16, 16);
-            dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
-            if (nu == 0.0) {
-                advance_rk_kernel_inviscid<<<bd, bs>>>(
-                    mesh,
-                    conserved_rk,
-                    primitive_rd,
-                    primitive_wr,
-                    eos,
-                    buffer,
-                    mass_list,
-                    a,
-                    dt,
-                    velocity_ceiling
-                );
-            } else {
-                advance_rk_kernel<<<bd, bs>>>(
-                    mesh,
-                    conserved_rk,
-                    primitive_rd,
-                    primitive_wr,
-                    eos,
-                    buffer,
-                    mass_list,
-                    nu,
-                    a,
-                    dt,
-                    velocity_ceiling
-                );
-            }
-            #endif
-            break;
+            case GPU: break; // Handled above
         }
+        return;
     }
+    #endif
+
+    iso2d_advance_rk(
+        mesh,
+        conserved_rk_ptr,
+        primitive_rd_ptr,
+        primitive_wr_ptr,
+        eos,
+        buffer,
+        mass_list,
+        nu,
+        a,
+        dt,
+        sources_ptr,
+        source_weight,
+        velocity_ceiling,
+        layout,
+        mode);
+}
+
+
+/**
+ * Returns the number of zones advanced per vector instruction by
+ * iso2d_advance_rk_simd on this CPU: 8 with AVX-512, 4 with AVX2, or 1 if
+ * the scalar kernel is used.
+ */
+EXTERN_C int iso2d_simd_width(void)
+{
+    return simd_width();
 }
 
 
+
+
 /**
- * Fill a buffer with the source terms that would result from a single point
- * mass. The result is the rate of surface density addition (will be negative
- * for positive sink rate), and the gravitational force surface densities in
- * each zone.
+ * Return the maximum wavespeed over all zones of a patch. The wavespeed of
+ * each zone is computed and reduced in the same pass, without writing it to
+ * an array. In GPU mode, each block of REDUCE_BLOCK x REDUCE_BLOCK zones
+ * writes its maximum to block_max_ptr, and the
+ * return value is zero; the caller reduces the block maxima on the device.
+ * The block_max_ptr may be NULL in the other modes.
  * @param mesh                The mesh [ni,     nj]
- * @param primitive_ptr[in]   [-2, -2] [ni + 4, nj + 4] [3]
- * @param cons_rate_ptr[out]  [ 0,  0] [ni,     nj]     [1]
- * @param mass                A point mass
+ * @param primitive_ptr[in]   [-g, -g] [ni + 2g, nj + 2g] [3]
+ * @param block_max_ptr[out]  [iso2d_max_wavespeed_num_blocks(mesh)]
+ * @param eos                 The EOS
+ * @param mass_list           A list of point mass objects
+ * @param num_guard           The number of guard zones g in the primitive array
+ * @param layout              The field layout of the multi-field arrays
  * @param mode                The execution mode
  */
-EXTERN_C void iso2d_point_mass_source_term(
+EXTERN_C real iso2d_max_wavespeed(
     struct Mesh mesh,
     real *primitive_ptr,
-    real *cons_rate_ptr,
-    struct PointMass mass,
+    real *block_max_ptr,
+    struct EquationOfState eos,
+    struct PointMassList mass_list,
+    int num_guard,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch cons_rate = patch(mesh, NCONS, 0, cons_rate_ptr);
+    struct Patch primitive = patch_layout(mesh, NCONS, num_guard, primitive_ptr, layout);
+    struct Patch interior = patch(mesh, 1, 0, NULL);
+    real a_max = 0.0;
 
     switch (mode) {
         case CPU: {
-            FOR_EACH(cons_rate) {
-                point_mass_source_term_zone(mesh, primitive, cons_rate, mass, i, j);
+            FOR_EACH(interior) {
+                a_max = max2(a_max, max_wavespeed_zone(mesh, eos, primitive, mass_list, i, j));
             }
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
-            FOR_EACH_OMP(cons_rate) {
-                point_mass_source_term_zone(mesh, primitive, cons_rate, mass, i, j);
+            #pragma omp parallel for reduction(max:a_max)
+            FOR_EACH(interior) {
+                a_max = max2(a_max, max_wavespeed_zone(mesh, eos, primitive, mass_list, i, j));
             }
             #endif
             break;
@@ -1030,102 +2814,189 @@ EXTERN_C void iso2d_point_mass_source_term(
 
         case GPU: {
             #if defined(__NVCC__) || defined(__ROCM__)
-            dim3 bs = dim3(16, 16);
+            dim3 bs = dim3(REDUCE_BLOCK, REDUCE_BLOCK);
             dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
-            point_mass_source_term_kernel<<<bd, bs>>>(mesh, primitive, cons_rate, mass);
+            max_wavespeed_kernel<<<bd, bs>>>(mesh, eos, primitive, mass_list, block_max_ptr);
+            #else
+            (void) block_max_ptr;
             #endif
             break;
         }
     }
+    return a_max;
 }
 
 
 /**
- * Fill a buffer with the maximum wavespeed in each zone.
- * @param  mesh               The mesh [ni,     nj]
- * @param  primitive_ptr[in]  [-2, -2] [ni + 4, nj + 4] [3]
- * @param  wavespeed_ptr[out] [ 0,  0] [ni,     nj]     [1]
- * @param eos                 The EOS
+ * Return the number of block maxima written by iso2d_max_wavespeed in GPU
+ * mode.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long iso2d_max_wavespeed_num_blocks(struct Mesh mesh)
+{
+    unsigned long bi = (mesh.ni + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    unsigned long bj = (mesh.nj + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    return bi * bj;
+}
+
+
+/**
+ * Take the point mass source terms integrated by the RK stages since they
+ * were last taken, and reset them to zero. For each point mass, these are
+ * the conserved quantities (mass, x and y momentum) added to the gas by its
+ * source terms, then for each point mass their torque about the origin. The
+ * partial sums of the CPU threads or GPU blocks are reduced where they live,
+ * and the totals are written to sums_ptr, which is on the device in GPU
+ * mode. Returns the number of totals.
+ * @param mesh                The mesh [ni,     nj]
+ * @param sources_ptr[in,out] [iso2d_source_sums_len(mesh)]
+ * @param sums_ptr[out]       [4 * mass_list.count]
  * @param mass_list           A list of point mass objects
  * @param mode                The execution mode
  */
-EXTERN_C void iso2d_wavespeed(
+EXTERN_C int iso2d_point_mass_sources(
     struct Mesh mesh,
-    real *primitive_ptr,
-    real *wavespeed_ptr,
-    struct EquationOfState eos,
+    real *sources_ptr,
+    real *sums_ptr,
     struct PointMassList mass_list,
     enum ExecutionMode mode)
 {
-    struct Patch primitive = patch(mesh, NCONS, 2, primitive_ptr);
-    struct Patch wavespeed = patch(mesh, 1,     0, wavespeed_ptr);
+    int n = num_source_sums(&mass_list);
+    real zone_area = mesh.dx * mesh.dy;
 
     switch (mode) {
-        case CPU: {
-            FOR_EACH(wavespeed) {
-                wavespeed_zone(mesh, eos, primitive, wavespeed, mass_list, i, j);
-            }
-            break;
-        }
-
-        case OMP: {
-            #ifdef _OPENMP
-            FOR_EACH_OMP(wavespeed) {
-                wavespeed_zone(mesh, eos, primitive, wavespeed, mass_list, i, j);
+        case CPU:
+        case OMP:
+        case Hybrid: {
+            for (int k = 0; k < n; ++k)
+            {
+                sums_ptr[k] = sources_ptr[k] * zone_area;
+                sources_ptr[k] = 0.0;
             }
-            #endif
             break;
         }
 
         case GPU: {
             #if defined(__NVCC__) || defined(__ROCM__)
-            dim3 bs = dim3(16, 16);
-            dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
-            wavespeed_kernel<<<bd, bs>>>(mesh, eos, primitive, wavespeed, mass_list);
+            if (n > 0)
+            {
+                int num_blocks = iso2d_max_wavespeed_num_blocks(mesh);
+                point_mass_sources_kernel<<<n, REDUCE_BLOCK * REDUCE_BLOCK>>>(sources_ptr, num_blocks, zone_area, sums_ptr);
+            }
             #endif
             break;
         }
     }
+    return n;
 }
 
 
 /**
- * Obtain the maximum value in an array of double's, using either a sequential
- * or an OpenMP reduction. Not implemented for GPU execution.
- * 
- * @param data          The data [size]
- * @param size          The number of elements
- * @param mode          The execution mode
+ * Return the number of elements in the sources array of the iso2d_advance_rk
+ * functions, which has room for the partial sums of each GPU thread block.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long iso2d_source_sums_len(struct Mesh mesh)
+{
+    return iso2d_max_wavespeed_num_blocks(mesh) * MAX_SOURCE_SUMS;
+}
+
+
+/**
+ * Integrate diagnostic quantities over the zones of a patch (see
+ * num_diagnostics), in a single pass which reduces them as they are computed.
+ * The integrals are written to the start of the scratch buffer, which is on
+ * the device in GPU mode, so that only they need to be copied to the host.
+ * The rest of the scratch buffer holds the partial sums of the GPU blocks.
+ * The point mass source terms are not evaluated here; the integrals of them
+ * accumulated by the RK stages are taken with iso2d_point_mass_sources,
+ * which resets them to zero. Returns the number of diagnostics.
+ * @param mesh                The mesh [ni,     nj]
+ * @param primitive_ptr[in]   [-g, -g] [ni + 2g, nj + 2g] [3]
+ * @param sources_ptr[in,out] [iso2d_source_sums_len(mesh)]
+ * @param scratch_ptr[out]    [iso2d_diagnostics_scratch_len(mesh)]
+ * @param mass_list           A list of point mass objects
+ * @param num_guard           The number of guard zones g in the primitive array
+ * @param layout              The field layout of the multi-field arrays
+ * @param mode                The execution mode
  */
-EXTERN_C real iso2d_maximum(
-    real *data,
-    unsigned long size,
+EXTERN_C int iso2d_diagnostics(
+    struct Mesh mesh,
+    real *primitive_ptr,
+    real *sources_ptr,
+    real *scratch_ptr,
+    struct PointMassList mass_list,
+    int num_guard,
+    enum FieldLayout layout,
     enum ExecutionMode mode)
 {
-    real a_max = 0.0;
+    struct Patch primitive = patch_layout(mesh, NCONS, num_guard, primitive_ptr, layout);
+    struct Patch interior = patch(mesh, 1, 0, NULL);
+    int m = iso2d_point_mass_sources(mesh, sources_ptr, scratch_ptr, mass_list, mode);
+    real zone_area = mesh.dx * mesh.dy;
+    real sums[NUM_GAS_DIAGNOSTICS];
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        sums[k] = 0.0;
+    }
 
     switch (mode) {
         case CPU: {
-            for (unsigned long i = 0; i < size; ++i)
-            {
-                a_max = max2(a_max, data[i]);
+            FOR_EACH(interior) {
+                real diagnostics[NUM_GAS_DIAGNOSTICS];
+                diagnostics_zone(mesh, primitive, i, j, diagnostics);
+
+                for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+                {
+                    sums[k] += diagnostics[k];
+                }
             }
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
-            #pragma omp parallel for reduction(max:a_max)
-            for (unsigned long i = 0; i < size; ++i)
-            {
-                a_max = max2(a_max, data[i]);
+            #pragma omp parallel for reduction(+:sums[:NUM_GAS_DIAGNOSTICS])
+            FOR_EACH(interior) {
+                real diagnostics[NUM_GAS_DIAGNOSTICS];
+                diagnostics_zone(mesh, primitive, i, j, diagnostics);
+
+                for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+                {
+                    sums[k] += diagnostics[k];
+                }
             }
             #endif
             break;
         }
 
-        case GPU: break; // Not implemented, use iso2d_wavespeed
-                         // followed by a GPU reduction.
+        case GPU: {
+            #if defined(__NVCC__) || defined(__ROCM__)
+            dim3 bs = dim3(REDUCE_BLOCK, REDUCE_BLOCK);
+            dim3 bd = dim3((mesh.nj + bs.x - 1) / bs.x, (mesh.ni + bs.y - 1) / bs.y);
+            real *block_sums = scratch_ptr + MAX_DIAGNOSTICS;
+            diagnostics_kernel<<<bd, bs>>>(mesh, primitive, block_sums);
+            diagnostics_finish_kernel<<<NUM_GAS_DIAGNOSTICS, REDUCE_BLOCK * REDUCE_BLOCK>>>(block_sums, bd.x * bd.y, zone_area, scratch_ptr + m);
+            #endif
+            return num_diagnostics(&mass_list);
+        }
     }
-    return a_max;
+
+    for (int k = 0; k < NUM_GAS_DIAGNOSTICS; ++k)
+    {
+        scratch_ptr[m + k] = sums[k] * zone_area;
+    }
+    return num_diagnostics(&mass_list);
+}
+
+
+/**
+ * Return the number of elements in the scratch buffer of iso2d_diagnostics.
+ * @param mesh          The mesh [ni,     nj]
+ */
+EXTERN_C unsigned long iso2d_diagnostics_scratch_len(struct Mesh mesh)
+{
+    return (1 + iso2d_max_wavespeed_num_blocks(mesh)) * MAX_DIAGNOSTICS;
 }
@@ -1,6 +1,7 @@
 use crate::{
-    BoundaryCondition, EquationOfState, ExecutionMode, PointMass, PointMassList, StructuredMesh,
+    BoundaryCondition, EquationOfState, ExecutionMode, FieldLayout, PointMassList, StructuredMesh,
 };
+use std::os::raw::c_int;
 
 pub mod solver;
 
@@ -9,6 +10,7 @@ extern "C" {
         mesh: StructuredMesh,
         primitive_ptr: *const f64,
         conserved_ptr: *mut f64,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
@@ -23,27 +25,123 @@ extern "C" {
         nu: f64,
         a: f64,
         dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
         velocity_ceiling: f64,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
-    pub fn iso2d_point_mass_source_term(
+    pub fn iso2d_advance_rk_region(
         mesh: StructuredMesh,
-        primitive_ptr: *const f64,
-        cons_rate_ptr: *const f64,
-        mass: PointMass,
+        conserved_rk_ptr: *const f64,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
+        eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
+        mass_list: PointMassList,
+        nu: f64,
+        a: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
+        velocity_ceiling: f64,
+        zones: *const c_int,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
-    pub fn iso2d_wavespeed(
+    pub fn iso2d_advance_rk_tiled(
         mesh: StructuredMesh,
-        primitive_ptr: *const f64,
-        wavespeed_ptr: *mut f64,
+        conserved_rk_ptr: *const f64,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
         eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
         mass_list: PointMassList,
+        nu: f64,
+        a: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
+        velocity_ceiling: f64,
+        layout: FieldLayout,
         mode: ExecutionMode,
     );
 
-    pub fn iso2d_maximum(data: *const f64, size: std::os::raw::c_ulong, mode: ExecutionMode)
-        -> f64;
+    pub fn iso2d_advance_rk_simd(
+        mesh: StructuredMesh,
+        conserved_rk_ptr: *const f64,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
+        eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
+        mass_list: PointMassList,
+        nu: f64,
+        a: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weight: f64,
+        velocity_ceiling: f64,
+        layout: FieldLayout,
+        mode: ExecutionMode,
+    );
+
+    pub fn iso2d_advance_rk_fused(
+        mesh: StructuredMesh,
+        primitive_rd_ptr: *const f64,
+        primitive_wr_ptr: *mut f64,
+        eos: EquationOfState,
+        boundary_condition: BoundaryCondition,
+        mass_lists: *const PointMassList,
+        weights: *const f64,
+        rk_order: c_int,
+        nu: f64,
+        dt: f64,
+        sources_ptr: *mut f64,
+        source_weights: *const f64,
+        velocity_ceiling: f64,
+        num_guard: c_int,
+        domain: *const c_int,
+        layout: FieldLayout,
+        mode: ExecutionMode,
+    );
+
+    pub fn iso2d_max_wavespeed(
+        mesh: StructuredMesh,
+        primitive_ptr: *const f64,
+        block_max_ptr: *mut f64,
+        eos: EquationOfState,
+        mass_list: PointMassList,
+        num_guard: c_int,
+        layout: FieldLayout,
+        mode: ExecutionMode,
+    ) -> f64;
+
+    pub fn iso2d_max_wavespeed_num_blocks(mesh: StructuredMesh) -> std::os::raw::c_ulong;
+
+    pub fn iso2d_simd_width() -> c_int;
+
+    pub fn iso2d_source_sums_len(mesh: StructuredMesh) -> std::os::raw::c_ulong;
+
+    pub fn iso2d_point_mass_sources(
+        mesh: StructuredMesh,
+        sources_ptr: *mut f64,
+        sums_ptr: *mut f64,
+        mass_list: PointMassList,
+        mode: ExecutionMode,
+    ) -> c_int;
+
+    pub fn iso2d_diagnostics(
+        mesh: StructuredMesh,
+        primitive_ptr: *const f64,
+        sources_ptr: *mut f64,
+        scratch_ptr: *mut f64,
+        mass_list: PointMassList,
+        num_guard: c_int,
+        layout: FieldLayout,
+        mode: ExecutionMode,
+    ) -> c_int;
+
+    pub fn iso2d_diagnostics_scratch_len(mesh: StructuredMesh) -> std::os::raw::c_ulong;
 }
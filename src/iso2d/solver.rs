@@ -1,17 +1,23 @@
 use crate::iso2d;
 use crate::mesh;
+use crate::halo::HaloPool;
 use crate::patch::Patch;
-use crate::{ExecutionMode, PatchBasedBuild, PatchBasedSolve, Setup, StructuredMesh};
+use crate::trace;
+use crate::{
+    ExecutionMode, FieldLayout, KernelVariant, PatchBasedBuild, PatchBasedSolve, Setup,
+    StructuredMesh,
+};
 use cfg_if::cfg_if;
-use gpu_core::Device;
+use gpu_core::{Device, Reduction};
 use gridiron::adjacency_list::AdjacencyList;
 use gridiron::automaton::{Automaton, Status};
 use gridiron::index_space::{Axis, IndexSpace};
 use gridiron::rect_map::Rectangle;
 use std::mem::swap;
 use std::ops::DerefMut;
-use std::os::raw::c_ulong;
+use std::os::raw::c_int;
 use std::sync::{Arc, Mutex};
+use std::time::Instant;
 
 enum SolverState {
     NotReady,
@@ -27,25 +33,87 @@ pub struct Solver {
     primitive1: Patch,
     primitive2: Patch,
     conserved0: Patch,
-    source_buf: Arc<Mutex<Patch>>,
-    wavespeeds: Arc<Mutex<Patch>>,
+    /// The source terms of each point mass, integrated over the patch and
+    /// over time by the RK stages, as partial sums for each GPU thread
+    /// block. They are taken, and reset to zero, by `reductions` and
+    /// `point_mass_sources`.
+    sources: Patch,
+    /// The source terms taken by `point_mass_sources` since the last call to
+    /// `reductions`, which adds them to the ones it takes.
+    sources_taken: Vec<f64>,
+    /// The diagnostics integrated over the patch for the time series, followed
+    /// by the partial sums of each GPU thread block.
+    diagnostics: Arc<Mutex<Patch>>,
+    /// The maximum wavespeed of each GPU thread block, which is reduced on
+    /// the device in `max_wavespeed`.
+    #[cfg_attr(not(feature = "gpu"), allow(dead_code))]
+    block_max: Arc<Mutex<Patch>>,
     index_space: IndexSpace,
+    num_guard: usize,
+    domain: [c_int; 4],
     incoming_count: usize,
     received_count: usize,
     outgoing_edges: Vec<Rectangle<i64>>,
+    halo_pool: HaloPool,
     mesh: StructuredMesh,
     mode: ExecutionMode,
+    kernel: KernelVariant,
+    fused: bool,
+    /// The interior region and boundary strips of the patch, if the RK stages
+    /// are split so the interior can be updated before the guard zones are
+    /// filled. Only the in-place and MPI exchanges use the split; the
+    /// automaton does not send a patch's messages until `value` returns, so
+    /// it always advances whole stages.
+    split_zones: Option<([c_int; 4], [[c_int; 4]; 4])>,
+    /// Whether the interior zones of the current RK stage have already been
+    /// updated by `advance_interior`.
+    interior_advanced: bool,
+    /// Wall time spent in `advance_stage` and `advance_interior`, in seconds,
+    /// since it was last taken by the driver.
+    elapsed: f64,
     device: Option<Device>,
     setup: Arc<dyn Setup>,
 }
 
+fn runge_kutta_weight(rk_order: usize, stage: usize) -> f64 {
+    match rk_order {
+        1 => match stage {
+            0 => 0.0,
+            _ => panic!(),
+        },
+        2 => match stage {
+            0 => 0.0,
+            1 => 0.5,
+            _ => panic!(),
+        },
+        3 => match stage {
+            0 => 0.0,
+            1 => 3.0 / 4.0,
+            2 => 1.0 / 3.0,
+            _ => panic!(),
+        },
+        _ => panic!(),
+    }
+}
+
+/// Returns the weight of the source terms of an RK stage in the update over
+/// the whole step, which is the product of `1 - a` for that stage and the
+/// stages after it.
+fn runge_kutta_source_weight(rk_order: usize, stage: usize) -> f64 {
+    (stage..rk_order)
+        .map(|s| 1.0 - runge_kutta_weight(rk_order, s))
+        .product()
+}
+
 impl Solver {
     pub fn new_timestep(&mut self) {
+        let _span = trace::Span::patch("new_timestep", &self.key());
         gpu_core::scope(self.device, || unsafe {
             iso2d::iso2d_primitive_to_conserved(
                 self.mesh,
                 self.primitive1.as_ptr(),
                 self.conserved0.as_mut_ptr(),
+                self.primitive1.layout(),
                 self.mode,
             );
         });
@@ -54,89 +122,167 @@ impl Solver {
     }
 
     pub fn advance_rk(&mut self, stage: usize) {
+        let _span = trace::Span::patch("advance_rk", &self.key());
         let dt = self.dt.unwrap();
+        let a = runge_kutta_weight(self.rk_order, stage);
 
-        let a = match self.rk_order {
-            1 => match stage {
-                0 => 0.0,
-                _ => panic!(),
-            },
-            2 => match stage {
-                0 => 0.0,
-                1 => 0.5,
-                _ => panic!(),
-            },
-            3 => match stage {
-                0 => 0.0,
-                1 => 3.0 / 4.0,
-                2 => 1.0 / 3.0,
-                _ => panic!(),
-            },
-            _ => panic!(),
+        match self.split_zones {
+            Some((_, strips)) if self.interior_advanced => {
+                for zones in &strips {
+                    self.advance_rk_zones(stage, Some(zones))
+                }
+            }
+            _ => self.advance_rk_zones(stage, None),
+        }
+        swap(&mut self.primitive1, &mut self.primitive2);
+
+        self.interior_advanced = false;
+        self.time = self.time0 * a + (self.time + dt) * (1.0 - a);
+        self.state = if stage == self.rk_order - 1 {
+            SolverState::NotReady
+        } else {
+            SolverState::RungeKuttaStage(stage + 1)
+        }
+    }
+
+    /// Updates the given region `[i0, i1, j0, j1]` of the second primitive
+    /// buffer for an RK stage, or the whole patch if the region is `None`.
+    /// Only the zone kernel can update part of a patch.
+    fn advance_rk_zones(&mut self, stage: usize, zones: Option<&[c_int; 4]>) {
+        let dt = self.dt.unwrap();
+        let a = runge_kutta_weight(self.rk_order, stage);
+        let source_weight = runge_kutta_source_weight(self.rk_order, stage);
+        let advance_rk = match self.kernel {
+            KernelVariant::Zone | KernelVariant::FaceSweep | KernelVariant::Fused => {
+                iso2d::iso2d_advance_rk
+            }
+            KernelVariant::Tiled => iso2d::iso2d_advance_rk_tiled,
+            KernelVariant::Simd => iso2d::iso2d_advance_rk_simd,
         };
 
         gpu_core::scope(self.device, || unsafe {
-            iso2d::iso2d_advance_rk(
+            match zones {
+                Some(zones) => iso2d::iso2d_advance_rk_region(
+                    self.mesh,
+                    self.conserved0.as_ptr(),
+                    self.primitive1.as_ptr(),
+                    self.primitive2.as_mut_ptr(),
+                    self.setup.equation_of_state(),
+                    self.setup.boundary_condition(),
+                    self.setup.masses(self.time),
+                    self.setup.viscosity().unwrap_or(0.0),
+                    a,
+                    dt,
+                    self.sources.as_mut_ptr(),
+                    source_weight,
+                    self.setup.velocity_ceiling().unwrap_or(f64::MAX),
+                    zones.as_ptr(),
+                    self.primitive1.layout(),
+                    self.mode,
+                ),
+                None => advance_rk(
+                    self.mesh,
+                    self.conserved0.as_ptr(),
+                    self.primitive1.as_ptr(),
+                    self.primitive2.as_mut_ptr(),
+                    self.setup.equation_of_state(),
+                    self.setup.boundary_condition(),
+                    self.setup.masses(self.time),
+                    self.setup.viscosity().unwrap_or(0.0),
+                    a,
+                    dt,
+                    self.sources.as_mut_ptr(),
+                    source_weight,
+                    self.setup.velocity_ceiling().unwrap_or(f64::MAX),
+                    self.primitive1.layout(),
+                    self.mode,
+                ),
+            }
+        });
+    }
+
+    /// Advances all of the RK stages in a single pass, using the guard zones
+    /// (2 * rk_order deep) received at the start of the time step. The point
+    /// masses are evaluated at the same times as they are by `advance_rk`.
+    pub fn advance_rk_fused(&mut self) {
+        let _span = trace::Span::patch("advance_rk_fused", &self.key());
+        let dt = self.dt.unwrap();
+        let mut mass_lists = vec![];
+        let mut weights = vec![];
+        let mut source_weights = vec![];
+
+        self.time0 = self.time;
+
+        for stage in 0..self.rk_order {
+            let a = runge_kutta_weight(self.rk_order, stage);
+            mass_lists.push(self.setup.masses(self.time));
+            weights.push(a);
+            source_weights.push(runge_kutta_source_weight(self.rk_order, stage));
+            self.time = self.time0 * a + (self.time + dt) * (1.0 - a);
+        }
+
+        unsafe {
+            iso2d::iso2d_advance_rk_fused(
                 self.mesh,
-                self.conserved0.as_ptr(),
                 self.primitive1.as_ptr(),
                 self.primitive2.as_mut_ptr(),
                 self.setup.equation_of_state(),
                 self.setup.boundary_condition(),
-                self.setup.masses(self.time),
+                mass_lists.as_ptr(),
+                weights.as_ptr(),
+                self.rk_order as c_int,
                 self.setup.viscosity().unwrap_or(0.0),
-                a,
                 dt,
+                self.sources.as_mut_ptr(),
+                source_weights.as_ptr(),
                 self.setup.velocity_ceiling().unwrap_or(f64::MAX),
+                self.num_guard as c_int,
+                self.domain.as_ptr(),
+                self.primitive1.layout(),
                 self.mode,
             );
-        });
-        swap(&mut self.primitive1, &mut self.primitive2);
-
-        self.time = self.time0 * a + (self.time + dt) * (1.0 - a);
-        self.state = if stage == self.rk_order - 1 {
-            SolverState::NotReady
-        } else {
-            SolverState::RungeKuttaStage(stage + 1)
         }
+        swap(&mut self.primitive1, &mut self.primitive2);
+        self.state = SolverState::NotReady;
     }
 }
 
 impl PatchBasedSolve for Solver {
     fn primitive(&self) -> Patch {
-        self.primitive1.extract(&self.index_space)
+        self.primitive1
+            .extract(&self.index_space)
+            .into_layout(FieldLayout::Interleaved)
     }
 
-    fn max_wavespeed(&self) -> f64 {
-        let setup = &self.setup;
-        let eos = setup.equation_of_state();
-        let mut lock = self.wavespeeds.lock().unwrap();
-        let wavespeeds = lock.deref_mut();
-
-        gpu_core::scope(self.device, || unsafe {
-            iso2d::iso2d_wavespeed(
-                self.mesh,
-                self.primitive1.as_ptr(),
-                wavespeeds.as_mut_ptr(),
-                eos,
-                self.setup.masses(self.time),
-                self.mode,
-            )
-        });
-
-        match self.mode {
-            ExecutionMode::CPU | ExecutionMode::OMP => unsafe {
-                iso2d::iso2d_maximum(
-                    wavespeeds.as_ptr(),
-                    wavespeeds.as_slice().unwrap().len() as c_ulong,
+    fn max_wavespeed(&self) -> Reduction {
+        let _span = trace::Span::patch("max_wavespeed", &self.key());
+        let max_wavespeed = |block_max_ptr: *mut f64| {
+            gpu_core::scope(self.device, || unsafe {
+                iso2d::iso2d_max_wavespeed(
+                    self.mesh,
+                    self.primitive1.as_ptr(),
+                    block_max_ptr,
+                    self.setup.equation_of_state(),
+                    self.setup.masses(self.time),
+                    self.num_guard as c_int,
+                    self.primitive1.layout(),
                     self.mode,
                 )
-            },
+            })
+        };
+
+        match self.mode {
+            ExecutionMode::CPU | ExecutionMode::OMP | ExecutionMode::Hybrid => {
+                Reduction::ready(Some(max_wavespeed(std::ptr::null_mut())))
+            }
             ExecutionMode::GPU => {
                 cfg_if! {
                     if #[cfg(feature = "gpu")] {
-                        use gpu_core::Reduce;
-                        wavespeeds.as_device_buffer().unwrap().maximum().unwrap()
+                        use gpu_core::{Reduce, ReduceOp};
+                        let mut lock = self.block_max.lock().unwrap();
+                        let block_max = lock.deref_mut();
+                        max_wavespeed(block_max.as_mut_ptr());
+                        block_max.as_device_buffer().unwrap().reduce(ReduceOp::Max)
                     } else {
                         unreachable!()
                     }
@@ -145,35 +291,73 @@ impl PatchBasedSolve for Solver {
         }
     }
 
-    fn reductions(&self) -> Vec<f64> {
-        let mut lock = self.source_buf.lock().unwrap();
-        let cons_rate = lock.deref_mut();
-        let mut result = vec![];
+    /// Returns, for each point mass, the mass and momentum added to the gas
+    /// by its source terms since the last call, then for each point mass the
+    /// angular momentum added by those source terms, then the total mass,
+    /// angular momentum, and kinetic energy of the gas on this patch. The
+    /// integrals are computed where the data lives, and only they are copied
+    /// to the host.
+    fn reductions(&mut self) -> Vec<f64> {
+        let _span = trace::Span::patch("reductions", &self.key());
+        let sources_ptr = self.sources.as_mut_ptr();
+        let mut lock = self.diagnostics.lock().unwrap();
+        let scratch = lock.deref_mut();
+        let n = gpu_core::scope(self.device, || unsafe {
+            iso2d::iso2d_diagnostics(
+                self.mesh,
+                self.primitive1.as_ptr(),
+                sources_ptr,
+                scratch.as_mut_ptr(),
+                self.setup.masses(self.time),
+                self.num_guard as c_int,
+                self.primitive1.layout(),
+                self.mode,
+            )
+        });
+        let mut reductions = scratch
+            .extract(&IndexSpace::new(0..n as i64, 0..1))
+            .into_host()
+            .as_slice()
+            .unwrap()
+            .to_vec();
 
-        for mass in self.setup.masses(self.time).to_vec() {
-            gpu_core::scope(self.device, || unsafe {
-                iso2d::iso2d_point_mass_source_term(
-                    self.mesh,
-                    self.primitive1.as_ptr(),
-                    cons_rate.as_ptr(),
-                    mass,
-                    self.mode,
-                )
-            });
-            let mut udot = cons_rate
-                .to_host()
-                .as_slice()
-                .unwrap()
-                .chunks_exact(3)
-                .fold([0.0, 0.0, 0.0], |a: [f64; 3], b: &[f64]| {
-                    [a[0] + b[0], a[1] + b[1], a[2] + b[2]]
-                });
-            for ud in &mut udot {
-                *ud *= self.mesh.dx * self.mesh.dy;
-            }
-            result.extend(udot)
+        for (r, t) in reductions.iter_mut().zip(self.sources_taken.drain(..)) {
+            *r += t
         }
-        result
+        reductions
+    }
+
+    /// Takes the point mass source terms from the partial sums the RK stages
+    /// have accumulated, without evaluating the other diagnostics. Only the
+    /// totals are copied to the host. They are kept, to be added to the next
+    /// `reductions`.
+    fn point_mass_sources(&mut self) -> Vec<f64> {
+        let _span = trace::Span::patch("point_mass_sources", &self.key());
+        let sources_ptr = self.sources.as_mut_ptr();
+        let mut lock = self.diagnostics.lock().unwrap();
+        let scratch = lock.deref_mut();
+        let n = gpu_core::scope(self.device, || unsafe {
+            iso2d::iso2d_point_mass_sources(
+                self.mesh,
+                sources_ptr,
+                scratch.as_mut_ptr(),
+                self.setup.masses(self.time),
+                self.mode,
+            )
+        });
+        let sources = scratch
+            .extract(&IndexSpace::new(0..n as i64, 0..1))
+            .into_host()
+            .as_slice()
+            .unwrap()
+            .to_vec();
+
+        self.sources_taken.resize(sources.len(), 0.0);
+
+        for (t, s) in self.sources_taken.iter_mut().zip(&sources) {
+            *t += s
+        }
+        sources
     }
 
     fn set_timestep(&mut self, dt: f64) {
@@ -183,30 +367,74 @@ impl PatchBasedSolve for Solver {
     fn device(&self) -> Option<Device> {
         self.device
     }
+
+    fn guard_source(&self) -> &Patch {
+        &self.primitive1
+    }
+
+    fn guard_target(&mut self) -> &mut Patch {
+        &mut self.primitive1
+    }
+
+    fn advance_stage(&mut self) {
+        let start = Instant::now();
+
+        if self.fused {
+            self.advance_rk_fused();
+        } else {
+            if let SolverState::NotReady = self.state {
+                self.new_timestep()
+            }
+            if let SolverState::RungeKuttaStage(stage) = self.state {
+                self.advance_rk(stage)
+            }
+        }
+        self.elapsed += start.elapsed().as_secs_f64();
+    }
+
+    fn advance_interior(&mut self) {
+        if self.split_zones.is_none() || self.interior_advanced {
+            return;
+        }
+        let _span = trace::Span::patch("advance_interior", &self.key());
+        let start = Instant::now();
+
+        if let SolverState::NotReady = self.state {
+            self.new_timestep()
+        }
+        if let (Some((interior, _)), SolverState::RungeKuttaStage(stage)) =
+            (self.split_zones, &self.state)
+        {
+            self.advance_rk_zones(*stage, Some(&interior));
+            self.interior_advanced = true;
+        }
+        self.elapsed += start.elapsed().as_secs_f64();
+    }
+
+    fn take_elapsed(&mut self) -> f64 {
+        std::mem::take(&mut self.elapsed)
+    }
 }
 
 impl Automaton for Solver {
     type Key = gridiron::rect_map::Rectangle<i64>;
     type Value = Self;
-    type Message = Patch;
+    type Message = Arc<Patch>;
 
     fn key(&self) -> Self::Key {
         self.index_space.to_rect()
     }
 
     fn messages(&self) -> Vec<(Self::Key, Self::Message)> {
-        self.outgoing_edges
-            .iter()
-            .map(IndexSpace::from)
-            .map(|neighbor_space| {
-                let overlap = neighbor_space
-                    .extend_all(2)
-                    .intersect(&self.index_space)
-                    .unwrap();
-                let guard_patch = self.primitive1.extract(&overlap);
-                (neighbor_space.to_rect(), guard_patch)
-            })
-            .collect()
+        let mut span = trace::Span::patch("messages", &self.key());
+        let messages = self.halo_pool.messages(
+            &self.primitive1,
+            &self.index_space,
+            &self.outgoing_edges,
+            self.num_guard,
+        );
+        span.add_bytes(messages.iter().map(|(_, m)| m.num_bytes()).sum());
+        messages
     }
 
     fn independent(&self) -> bool {
@@ -214,18 +442,15 @@ impl Automaton for Solver {
     }
 
     fn receive(&mut self, neighbor_patch: Self::Message) -> gridiron::automaton::Status {
+        let mut span = trace::Span::patch("receive", &self.key());
+        span.add_bytes(neighbor_patch.num_bytes());
         neighbor_patch.copy_into(&mut self.primitive1);
         self.received_count = (self.received_count + 1) % self.incoming_count;
         Status::eligible_if(self.received_count == 0)
     }
 
     fn value(mut self) -> Self::Value {
-        if let SolverState::NotReady = self.state {
-            self.new_timestep()
-        }
-        if let SolverState::RungeKuttaStage(stage) = self.state {
-            self.advance_rk(stage)
-        }
+        self.advance_stage();
         self
     }
 }
@@ -235,6 +460,10 @@ pub struct Builder;
 impl PatchBasedBuild for Builder {
     type Solver = Solver;
 
+    fn fuses_rk_stages(&self, mode: ExecutionMode, kernel: KernelVariant) -> bool {
+        kernel == KernelVariant::Fused && !std::matches!(mode, ExecutionMode::GPU)
+    }
+
     fn build(
         &self,
         time: f64,
@@ -243,11 +472,13 @@ impl PatchBasedBuild for Builder {
         edge_list: &AdjacencyList<Rectangle<i64>>,
         rk_order: usize,
         mode: ExecutionMode,
+        kernel: KernelVariant,
+        layout: FieldLayout,
         device: Option<Device>,
         setup: Arc<dyn Setup>,
     ) -> Self::Solver {
         assert! {
-            (device.is_none() && std::matches!(mode, ExecutionMode::CPU | ExecutionMode::OMP)) ||
+            (device.is_none() && !std::matches!(mode, ExecutionMode::GPU)) ||
             (device.is_some() && std::matches!(mode, ExecutionMode::GPU)),
             "device must be Some if and only if execution mode is GPU"
         };
@@ -257,23 +488,34 @@ impl PatchBasedBuild for Builder {
             "this solver is hard-coded for 3 primitive variable fields"
         };
 
+        let fused = self.fuses_rk_stages(mode, kernel);
+        let num_guard = if fused { 2 * rk_order } else { 2 };
+        let ng = num_guard as i64;
         let rect = primitive.rect();
         let local_space = primitive.index_space();
-        let local_space_ext = local_space.extend_all(2);
+        let local_space_ext = local_space.extend_all(ng);
         let global_mesh = mesh::Mesh::Structured(global_structured_mesh);
-        let global_space_ext = global_mesh.index_space().extend_all(2);
+        let global_space = global_mesh.index_space();
+        let global_space_ext = global_space.extend_all(ng);
 
         let guard_spaces = [
-            global_space_ext.keep_lower(2, Axis::I),
-            global_space_ext.keep_upper(2, Axis::I),
-            global_space_ext.keep_lower(2, Axis::J),
-            global_space_ext.keep_upper(2, Axis::J),
+            global_space_ext.keep_lower(ng, Axis::I),
+            global_space_ext.keep_upper(ng, Axis::I),
+            global_space_ext.keep_lower(ng, Axis::J),
+            global_space_ext.keep_upper(ng, Axis::J),
+        ];
+        let (di, dj) = global_space.to_rect();
+        let domain = [
+            (di.start - rect.0.start) as c_int,
+            (di.end - rect.0.start) as c_int,
+            (dj.start - rect.1.start) as c_int,
+            (dj.end - rect.1.start) as c_int,
         ];
 
-        let primitive1 = Patch::zeros(3, &local_space.extend_all(2)).on(device);
-        let conserved0 = Patch::zeros(3, &local_space).on(device);
-        let source_buf = Patch::zeros(3, &local_space).on(device);
-        let wavespeeds = Patch::zeros(1, &local_space).on(device);
+        let primitive1 = Patch::zeros(3, &local_space_ext)
+            .into_layout(layout)
+            .on(device);
+        let conserved0 = Patch::zeros(3, &local_space).into_layout(layout).on(device);
 
         let mut primitive1 = primitive1;
         primitive.copy_into(&mut primitive1);
@@ -286,6 +528,21 @@ impl PatchBasedBuild for Builder {
             }
         }
 
+        let mesh = global_structured_mesh.sub_mesh(rect.0.clone(), rect.1.clone());
+        let num_blocks = unsafe { iso2d::iso2d_max_wavespeed_num_blocks(mesh) } as i64;
+        let block_max = Patch::zeros(1, &IndexSpace::new(0..num_blocks, 0..1)).on(device);
+        let sources_len = unsafe { iso2d::iso2d_source_sums_len(mesh) } as i64;
+        let sources = Patch::zeros(1, &IndexSpace::new(0..sources_len, 0..1)).on(device);
+        let scratch_len = unsafe { iso2d::iso2d_diagnostics_scratch_len(mesh) } as i64;
+        let diagnostics = Patch::zeros(1, &IndexSpace::new(0..scratch_len, 0..1)).on(device);
+        let incoming_count = edge_list.incoming_edges(&rect).count();
+        let split_zones = match kernel {
+            KernelVariant::Zone | KernelVariant::FaceSweep if !fused && incoming_count > 0 => {
+                mesh.interior_and_strips(2)
+            }
+            _ => None,
+        };
+
         Solver {
             time,
             time0: time,
@@ -295,15 +552,25 @@ impl PatchBasedBuild for Builder {
             primitive2: primitive1.clone(),
             primitive1,
             conserved0,
-            source_buf: Arc::new(Mutex::new(source_buf)),
-            wavespeeds: Arc::new(Mutex::new(wavespeeds)),
+            sources,
+            sources_taken: vec![],
+            diagnostics: Arc::new(Mutex::new(diagnostics)),
+            block_max: Arc::new(Mutex::new(block_max)),
             outgoing_edges: edge_list.outgoing_edges(&rect).cloned().collect(),
-            incoming_count: edge_list.incoming_edges(&rect).count(),
+            halo_pool: HaloPool::default(),
+            incoming_count,
             received_count: 0,
             index_space: local_space,
+            num_guard,
+            domain,
             mode,
+            kernel,
+            fused,
+            split_zones,
+            interior_advanced: false,
+            elapsed: 0.0,
             device,
-            mesh: global_structured_mesh.sub_mesh(rect.0, rect.1),
+            mesh,
             setup,
         }
     }
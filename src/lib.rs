@@ -1,20 +1,31 @@
+pub mod balance;
+pub mod checkpoint;
 pub mod cmdline;
+pub mod codec;
 pub mod error;
 pub mod euler1d;
 pub mod euler2d;
+pub mod exchange;
+pub mod halo;
 pub mod iso2d;
 pub mod sr1d;
 pub mod lookup_table;
 pub mod mesh;
+pub mod mmap;
+pub mod mpi;
+pub mod numa;
+pub mod orbit;
 pub mod parse;
 pub mod patch;
+pub mod products;
 pub mod setups;
 pub mod state;
+pub mod trace;
 pub mod traits;
 
 pub use crate::cmdline::CommandLine;
 pub use crate::patch::Patch;
-pub use crate::state::{Recurrence, RecurringTask, State};
+pub use crate::state::{Recurrence, RecurringTask, Restart, State};
 pub use crate::traits::{PatchBasedBuild, PatchBasedSolve, Setup, Solve};
 pub use gpu_core::Device;
 pub use gridiron::index_space::IndexSpace;
@@ -43,6 +54,101 @@ pub enum ExecutionMode {
     OMP,
     /// Solver execution is performed on a GPU device, if available.
     GPU,
+    /// Patches are distributed over a thread-pool as in `CPU` mode, and each
+    /// kernel call is parallelized with OpenMP as in `OMP` mode. The OpenMP
+    /// team size is that of the calling thread, which the driver sets for
+    /// each pool worker with [`set_omp_num_threads`].
+    Hybrid,
+}
+
+/// Variants of the hydrodynamics update kernels. These are selected on the
+/// command line, and are meant to give identical results; they differ only in
+/// how the work is organized.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum KernelVariant {
+    /// Each zone computes all of the gradients and face fluxes it needs,
+    /// independently of its neighbors.
+    Zone,
+    /// On the CPU, the patch is processed in cache-sized tiles, and each
+    /// gradient and face flux is computed once per tile. Falls back to the
+    /// zone kernel on the GPU, with the planar field layout, or in solvers
+    /// without a tiled kernel.
+    Tiled,
+    /// The fluxes through all of the x-faces and y-faces are computed in a
+    /// first pass, and the zones are updated from those in a second pass.
+    /// Unlike the tiled kernel, this variant is not bitwise identical to the
+    /// zone kernel, because each face flux is computed only once. Falls back
+    /// to the zone kernel in solvers without a face sweep.
+    FaceSweep,
+    /// On the CPU, rows of zones are advanced with explicit AVX2 or AVX-512
+    /// vector instructions, selected at run time. Requires the planar field
+    /// layout, and falls back to the zone kernel on the GPU, with the
+    /// interleaved layout, on CPUs without AVX2, or in solvers without a SIMD
+    /// kernel.
+    Simd,
+    /// On the CPU, all of the Runge-Kutta stages of a time step are performed
+    /// in a single pass over each patch (temporal blocking). The guard zones
+    /// are made 2 * rk_order deep, and exchanged once per time step instead
+    /// of once per stage. Falls back to the zone kernel on the GPU, or in
+    /// solvers without a fused kernel.
+    Fused,
+}
+
+impl FromStr for KernelVariant {
+    type Err = error::Error;
+    /// Tries to create a `KernelVariant` from a string description. Returns
+    /// an error if no match is found.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "zone" => Ok(KernelVariant::Zone),
+            "tiled" => Ok(KernelVariant::Tiled),
+            "faces" => Ok(KernelVariant::FaceSweep),
+            "simd" => Ok(KernelVariant::Simd),
+            "fused" => Ok(KernelVariant::Fused),
+            _ => Err(error::Error::UnknownEnumVariant {
+                enum_type: "kernel variant".to_owned(),
+                variant: s.to_owned(),
+            }),
+        }
+    }
+}
+
+/// Memory layout of the fields in a multi-field patch. Referenced by Rust
+/// driver code, and by solver code written in C.
+///
+/// C equivalent is defined in sailfish.h.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, serde::Serialize, serde::Deserialize)]
+pub enum FieldLayout {
+    /// The fields of each zone are contiguous (array-of-structs). This is the
+    /// layout of the patches in a `State`, and in msgpack checkpoint files.
+    Interleaved,
+    /// Each field is stored in its own contiguous plane (struct-of-arrays),
+    /// so that a row of zones can be loaded into vector registers. This is
+    /// the layout of the patch data in chunked checkpoint files.
+    Planar,
+}
+
+impl Default for FieldLayout {
+    fn default() -> Self {
+        FieldLayout::Interleaved
+    }
+}
+
+impl FromStr for FieldLayout {
+    type Err = error::Error;
+    /// Tries to create a `FieldLayout` from a string description. Returns an
+    /// error if no match is found.
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "interleaved" => Ok(FieldLayout::Interleaved),
+            "planar" => Ok(FieldLayout::Planar),
+            _ => Err(error::Error::UnknownEnumVariant {
+                enum_type: "field layout".to_owned(),
+                variant: s.to_owned(),
+            }),
+        }
+    }
 }
 
 /// Description of sink model to model accretion onto a gravitating object.
@@ -260,6 +366,26 @@ impl StructuredMesh {
             dy: self.dy,
         }
     }
+
+    /// Splits the zones of this mesh into an interior region, whose zones
+    /// are at least `depth` zones away from every edge, and four strips
+    /// containing the rest of the zones. Each region is given as
+    /// `[i0, i1, j0, j1]`. Returns `None` if the interior would be empty.
+    pub fn interior_and_strips(&self, depth: i64) -> Option<([i32; 4], [[i32; 4]; 4])> {
+        let (ni, nj, d) = (self.ni as i32, self.nj as i32, depth as i32);
+
+        if ni <= 2 * d || nj <= 2 * d {
+            return None;
+        }
+        let interior = [d, ni - d, d, nj - d];
+        let strips = [
+            [0, d, 0, nj],
+            [ni - d, ni, 0, nj],
+            [d, ni - d, 0, d],
+            [d, ni - d, nj - d, nj],
+        ];
+        Some((interior, strips))
+    }
 }
 
 /// Describes a st of curvilinear coordinates to use.
@@ -287,6 +413,22 @@ pub fn compiled_with_omp() -> bool {
     }
 }
 
+/// Sets the number of OpenMP threads used by parallel regions which are
+/// entered from the calling thread. This has no effect if the code was
+/// compiled without OpenMP support.
+pub fn set_omp_num_threads(num_threads: usize) {
+    cfg_if! {
+        if #[cfg(feature = "omp")] {
+            extern "C" {
+                fn omp_set_num_threads(num_threads: std::os::raw::c_int);
+            }
+            unsafe { omp_set_num_threads(num_threads as std::os::raw::c_int) }
+        } else {
+            std::convert::identity(num_threads); // black-box
+        }
+    }
+}
+
 /// Returns whether the code has been compiled with GPU support
 /// (`feature=gpu`) either via CUDA or HIP.
 pub fn compiled_with_gpu() -> bool {
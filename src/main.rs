@@ -3,20 +3,38 @@ extern crate openmp_sys;
 
 use cfg_if::cfg_if;
 use rayon::prelude::*;
+use std::collections::HashMap;
+use std::ops::Range;
 use std::sync::Arc;
 
 use gridiron::adjacency_list::AdjacencyList;
 use gridiron::automaton;
 use gridiron::rect_map::{Rectangle, RectangleMap};
 
+use sailfish::balance;
+use sailfish::checkpoint;
 use sailfish::error::{self, Error::*};
+use sailfish::exchange::InPlaceExchange;
+use sailfish::mpi::{self, exchange::DistributedExchange, Communicator};
+use sailfish::numa::{self, Topology};
+use sailfish::orbit::Orbit;
+use sailfish::products;
 use sailfish::setups;
+use sailfish::trace;
 use sailfish::{euler1d, euler2d, iso2d, sr1d};
 use sailfish::{
-    CommandLine, ExecutionMode, Mesh, Patch, PatchBasedBuild, PatchBasedSolve, Recurrence,
-    RecurringTask, Setup, State,
+    CommandLine, ExecutionMode, IndexSpace, Mesh, Patch, PatchBasedBuild, PatchBasedSolve,
+    Recurrence, RecurringTask, Restart, Setup, State, StructuredMesh,
 };
 
+/// Number of time steps timed for each candidate decomposition in
+/// `--autotune` mode, following a single warm-up step.
+const AUTOTUNE_STEPS: usize = 5;
+
+/// The fraction by which the cost of the most loaded rank, NUMA node, or
+/// device must be reduced for `--rebalance` to move the patches.
+const REBALANCE_THRESHOLD: f64 = 0.05;
+
 fn time_exec<F>(device: Option<i32>, mut f: F) -> std::time::Duration
 where
     F: FnMut(),
@@ -35,40 +53,128 @@ where
 }
 
 fn adjacency_list(
-    patches: &RectangleMap<i64, Patch>,
+    spaces: &RectangleMap<i64, IndexSpace>,
     num_guard: usize,
 ) -> AdjacencyList<Rectangle<i64>> {
     let mut edges = AdjacencyList::new();
-    for (b, q) in patches.iter() {
-        for (a, p) in patches.query_rect(q.index_space().extend_all(num_guard as i64)) {
+    for (b, q) in spaces.iter() {
+        for (a, p) in spaces.query_rect(q.extend_all(num_guard as i64)) {
             if a != b {
-                edges.insert(p.rect(), q.rect())
+                edges.insert(p.to_rect(), q.to_rect())
             }
         }
     }
     edges
 }
 
+/// Splits the index space into patches with the shape given by
+/// `--patch-shape` if there is one, or otherwise into the number of patches
+/// given by `--patches`. Patches with a fixed shape are truncated at the
+/// upper edges of the index space.
+fn decompose(space: &IndexSpace, command_line: &CommandLine) -> Vec<IndexSpace> {
+    match command_line.patch_shape() {
+        Some((mi, mj)) => {
+            let (di, dj) = space.to_rect();
+            let mut tiles = vec![];
+            for i0 in di.clone().step_by(mi) {
+                for j0 in dj.clone().step_by(mj) {
+                    tiles.push(IndexSpace::new(
+                        i0..(i0 + mi as i64).min(di.end),
+                        j0..(j0 + mj as i64).min(dj.end),
+                    ))
+                }
+            }
+            tiles
+        }
+        None => space.tile(command_line.num_patches()),
+    }
+}
+
+/// Copies the data from a set of patches into new patches covering the given
+/// tiles. The tiles must be covered by the original patches.
+fn retile(patches: &[Patch], tiles: &[IndexSpace]) -> Vec<Patch> {
+    let patch_map: RectangleMap<_, _> = patches.iter().map(|p| (p.rect(), p)).collect();
+    tiles
+        .iter()
+        .map(|tile| {
+            let mut patch = Patch::zeros(patches[0].num_fields(), tile);
+            for (_, source) in patch_map.query_rect(tile) {
+                source.copy_into(&mut patch)
+            }
+            patch
+        })
+        .collect()
+}
+
+/// Orders the tiles along a space-filling curve, and returns the contiguous
+/// segment of them assigned to this rank. The segments have nearly equal zone
+/// counts. Returns an error if there are fewer tiles than ranks.
+fn rank_block<T, F>(
+    mut tiles: Vec<T>,
+    space: F,
+    comm: &Communicator,
+) -> Result<Vec<T>, error::Error>
+where
+    F: Fn(&T) -> IndexSpace,
+{
+    if tiles.len() < comm.size() {
+        return Err(Cmdline(format!(
+            "{} grid patches cannot be distributed over {} MPI ranks",
+            tiles.len(),
+            comm.size()
+        )));
+    }
+    balance::sort_along_curve(&mut tiles, &space);
+
+    let costs: Vec<_> = tiles.iter().map(|t| space(t).len() as f64).collect();
+    let block = balance::partition(&costs, comm.size())[comm.rank()].clone();
+    tiles.truncate(block.end);
+    Ok(tiles.split_off(block.start))
+}
+
+/// Returns the initial cost estimate of each patch, which is its zone count.
+fn zone_counts(patches: &[Patch]) -> Vec<f64> {
+    patches
+        .iter()
+        .map(|p| p.index_space().len() as f64)
+        .collect()
+}
+
+/// Splits this rank's patches, with the given costs, into contiguous blocks:
+/// one per NUMA node if there is a topology, one per GPU device if the patches
+/// are spread over all devices, or otherwise a single block.
+fn local_blocks(
+    costs: &[f64],
+    cline: &CommandLine,
+    topology: &Option<Topology>,
+) -> Vec<Range<usize>> {
+    match topology {
+        Some(topology) => topology.partition(costs),
+        None if cline.use_gpu() && cline.device.is_none() => {
+            balance::partition(costs, gpu_core::all_devices().count())
+        }
+        None => vec![0..costs.len()],
+    }
+}
+
 fn new_state(
     command_line: CommandLine,
     setup_name: &str,
     parameters: &str,
+    comm: &Communicator,
 ) -> Result<State, error::Error> {
     let setup = setups::make_setup(setup_name, parameters)?;
     let mesh = setup.mesh(command_line.resolution.unwrap_or(1024));
-    let num_patches = match command_line.execution_mode() {
-        ExecutionMode::CPU => 512, // TODO: get patch count from command line
-        ExecutionMode::OMP => 1,
-        ExecutionMode::GPU => gpu_core::all_devices().count(),
-    };
 
     let primitive_patches = match mesh {
-        Mesh::Structured(_) => mesh
-            .index_space()
-            .tile(num_patches)
-            .into_iter()
-            .map(|s| setup.initial_primitive_patch(&s, &mesh))
-            .collect(),
+        Mesh::Structured(_) => rank_block(
+            decompose(&mesh.index_space(), &command_line),
+            IndexSpace::clone,
+            comm,
+        )?
+        .into_iter()
+        .map(|s| setup.initial_primitive_patch(&s, &mesh))
+        .collect(),
         Mesh::FacePositions1D(_) => vec![],
     };
 
@@ -87,26 +193,74 @@ fn new_state(
         primitive_patches,
         checkpoint: RecurringTask::new(),
         time_series: RecurringTask::new(),
+        products: RecurringTask::new(),
         time_series_data: vec![],
+        compression: None,
         setup_name: setup_name.to_string(),
         parameters: parameters.to_string(),
         masses: setup.masses(setup.initial_time()).to_vec(),
         version: sailfish::sailfish_version(),
+        rank_file: None,
+    };
+    Ok(state)
+}
+
+/// Loads a checkpoint, and re-decomposes the grid patches if a new patch
+/// count or shape was given on the command line. Each rank works out its own
+/// segment of the patches from the checkpoint's index, and reads only the
+/// patches which overlap that segment.
+fn restart_state(
+    filename: &str,
+    parameters: &str,
+    cline: &CommandLine,
+    comm: &Communicator,
+) -> Result<State, error::Error> {
+    let restart = Restart::open(filename, parameters, cline)?;
+    let stored = restart.spaces();
+
+    if stored.is_empty() {
+        return restart.read(|_| false);
+    }
+    let retiled = cline.patches.is_some() || cline.patch_shape.is_some();
+    let tiles = if retiled {
+        decompose(
+            &restart.state().mesh.index_space(),
+            &restart.state().command_line,
+        )
+    } else {
+        stored
+    };
+    let tiles = rank_block(tiles, IndexSpace::clone, comm)?;
+    let tile_map: RectangleMap<_, _> = tiles.iter().map(|t| (t.to_rect(), ())).collect();
+    let mut state = restart.read(|space| tile_map.query_rect(space).next().is_some())?;
+
+    state.primitive_patches = if retiled {
+        retile(&state.primitive_patches, &tiles)
+    } else {
+        let mut patches: HashMap<_, _> = state
+            .primitive_patches
+            .drain(..)
+            .map(|p| (p.rect(), p))
+            .collect();
+        tiles
+            .iter()
+            .map(|t| patches.remove(&t.to_rect()).unwrap())
+            .collect()
     };
     Ok(state)
 }
 
-fn make_state(cline: &CommandLine) -> Result<State, error::Error> {
+fn make_state(cline: &CommandLine, comm: &Communicator) -> Result<State, error::Error> {
     let state = if let Some(ref setup_string) = cline.setup {
         let (name, parameters) = sailfish::parse::split_pair(setup_string, ':');
         let (name, parameters) = (name.unwrap_or(""), parameters.unwrap_or(""));
 
         if name.ends_with(".sf") {
-            State::from_checkpoint(name, &parameters, cline)?
+            restart_state(name, &parameters, cline, comm)?
         } else if let Some(ref file) = sailfish::parse::last_in_dir_ending_with(name, ".sf") {
-            State::from_checkpoint(file, &parameters, cline)?
+            restart_state(file, &parameters, cline, comm)?
         } else {
-            new_state(cline.clone(), name, &parameters)?
+            new_state(cline.clone(), name, &parameters, comm)?
         }
     } else {
         return Err(setups::possible_setups_info());
@@ -118,128 +272,671 @@ fn make_state(cline: &CommandLine) -> Result<State, error::Error> {
     }
 }
 
-fn global_reduction<Solver: PatchBasedSolve>(solvers: &[Solver]) -> Vec<f64> {
-    let patch_reductions: Vec<_> = solvers.iter().map(Solver::reductions).collect();
+/// Starts a live orbit from the point masses in the state, which were either
+/// evaluated by the setup at the initial time, or restored from a checkpoint.
+/// Checkpoints which have no point masses, or a different number of them,
+/// restart from the setup's prescribed orbit.
+fn start_orbit(orbit: &Orbit, state: &State, setup: &dyn Setup) {
+    let masses = setup.masses(state.time).to_vec();
+
+    if state.masses.len() == masses.len() {
+        orbit.reset(state.time, &state.masses)
+    } else {
+        orbit.reset(state.time, &masses)
+    }
+}
+
+/// Sums the vectors returned by `reduce` for each solver over all of the
+/// patches and ranks.
+fn global_reduction<Solver: PatchBasedSolve>(
+    solvers: &mut [Solver],
+    reduce: fn(&mut Solver) -> Vec<f64>,
+    comm: &Communicator,
+) -> Vec<f64> {
+    let patch_reductions: Vec<_> = solvers.iter_mut().map(reduce).collect();
     let start = vec![0.0; patch_reductions[0].len()];
 
-    patch_reductions.iter().fold(start, |a, b| {
+    let mut reductions = patch_reductions.iter().fold(start, |a, b| {
         a.into_iter().zip(b).map(|(a, b)| a + b).collect()
-    })
+    });
+    comm.all_sum(&mut reductions);
+    reductions
 }
 
+/// Appends a sample of the global reductions to the time series. If `always`
+/// is false, no sample is taken if one was already taken at this time. That
+/// is used before a checkpoint is written, or the solvers are rebuilt, so
+/// that the source terms the solvers have integrated since the last sample
+/// are recorded rather than lost. If the setup has a live orbit, the
+/// position, velocity, and mass of each point mass are appended to the
+/// sample.
+fn record_time_series<Solver: PatchBasedSolve>(
+    state: &mut State,
+    solvers: &mut [Solver],
+    setup: &dyn Setup,
+    comm: &Communicator,
+    always: bool,
+) {
+    if !always && state.time_series_data.last().map(|s| s[0]) == Some(state.time) {
+        return;
+    }
+    let mut reductions = global_reduction(solvers, Solver::reductions, comm);
+
+    if let Some(orbit) = setup.orbit() {
+        for m in orbit.current().1 {
+            reductions.extend([m.x, m.y, m.vx, m.vy, m.mass])
+        }
+    }
+    reductions.insert(0, state.time);
+    state.time_series_data.push(reductions);
+    if comm.is_root() {
+        println!("record time series sample {}", state.time_series_data.len(),);
+    }
+}
+
+/// Advances the live orbit of the point masses, if the setup has one, over
+/// the time step of size `dt` which the solvers have just taken, using the
+/// mass and momentum each point mass exchanged with the gas during the step.
+/// Only the point mass source terms are reduced; the solvers keep them for
+/// the next time series sample.
+fn advance_orbit<Solver: PatchBasedSolve>(
+    setup: &dyn Setup,
+    solvers: &mut [Solver],
+    dt: f64,
+    comm: &Communicator,
+) {
+    if let Some(orbit) = setup.orbit() {
+        let _span = trace::Span::new("advance_orbit");
+        let num_cons = setup.num_primitives();
+        let num_masses = orbit.current().1.len();
+        let sources = global_reduction(solvers, Solver::point_mass_sources, comm);
+        orbit.advance(dt, &sources[..num_cons * num_masses], num_cons);
+    }
+}
+
+/// Returns the largest wavespeed on any of the solvers. The reductions are all
+/// started before any of them is waited on, so on GPUs they overlap with one
+/// another, and with the kernels still running from the last time step.
 fn max_wavespeed<Solver: PatchBasedSolve>(
     solvers: &[Solver],
     pool: &Option<rayon::ThreadPool>,
 ) -> f64 {
-    if let Some(pool) = pool {
-        pool.install(|| {
-            solvers
-                .par_iter()
-                .map(|s| s.max_wavespeed())
-                .reduce(|| 0.0, f64::max)
-        })
+    let reductions: Vec<_> = if let Some(pool) = pool {
+        pool.install(|| solvers.par_iter().map(|s| s.max_wavespeed()).collect())
     } else {
+        solvers.iter().map(|s| s.max_wavespeed()).collect()
+    };
+    reductions
+        .into_iter()
+        .filter_map(|r| r.wait())
+        .fold(0.0, f64::max)
+}
+
+/// Advances a set of patch-based solvers through time steps, by way of either
+/// the gridiron automaton, the in-place guard zone exchange, or the
+/// distributed exchange when there is more than one MPI rank. The number of
+/// exchanges per time step is one if the solver fuses its Runge-Kutta
+/// stages, and the RK order otherwise.
+struct Stepper {
+    exchanges_per_step: usize,
+    in_place: Option<InPlaceExchange>,
+    distributed: Option<DistributedExchange>,
+}
+
+impl Stepper {
+    /// Advances the solvers through one time step, which is assumed to have
+    /// been set already.
+    fn advance<Solver: PatchBasedSolve>(
+        &mut self,
+        mut solvers: Vec<Solver>,
+        pool: &Option<rayon::ThreadPool>,
+    ) -> Vec<Solver> {
+        if let Some(ref mut exchange) = self.in_place {
+            exchange.execute(
+                &mut solvers,
+                self.exchanges_per_step,
+                pool.as_ref().unwrap(),
+            );
+            return solvers;
+        }
+        if let Some(ref mut exchange) = self.distributed {
+            exchange.execute(&mut solvers, self.exchanges_per_step, pool);
+            return solvers;
+        }
+        for _ in 0..self.exchanges_per_step {
+            solvers = match pool {
+                Some(ref pool) => pool.scope(|s| automaton::execute_rayon(s, solvers).collect()),
+                None => automaton::execute(solvers).collect(),
+            };
+        }
         solvers
-            .iter()
-            .map(|s| s.max_wavespeed())
-            .fold(0.0, f64::max)
     }
 }
 
+/// Builds one solver for each of the given patches, and the stepper to
+/// advance them with. The patches are this rank's share of the grid, in curve
+/// order, and the guard zone edges are found from the patches on all ranks.
+/// The `blocks` are from `local_blocks`. If a NUMA topology is given, each
+/// block is built on a thread pinned to its node, so that the solver's memory
+/// is first touched there. In GPU mode, each block goes to one device,
+/// starting from the one numbered by the rank.
+fn build_solvers<Builder, Solver>(
+    builder: &Builder,
+    primitive_patches: Vec<Patch>,
+    time: f64,
+    structured_mesh: StructuredMesh,
+    cline: &CommandLine,
+    setup: &Arc<dyn Setup>,
+    topology: &Option<Topology>,
+    blocks: &[Range<usize>],
+    comm: &Communicator,
+) -> (Vec<Solver>, Stepper)
+where
+    Builder: PatchBasedBuild<Solver = Solver> + Sync,
+    Solver: PatchBasedSolve,
+{
+    let rk_order = cline.rk_order();
+    let fused = builder.fuses_rk_stages(cline.execution_mode(), cline.kernel_variant());
+    let (num_guard, exchanges_per_step) = if fused {
+        (2 * rk_order, 1)
+    } else {
+        (2, rk_order)
+    };
+    let local: Vec<_> = primitive_patches.iter().map(Patch::index_space).collect();
+    let spaces = comm.all_gather_spaces(&local);
+    let space_map: RectangleMap<_, _> = spaces
+        .iter()
+        .map(|(s, _)| (s.to_rect(), s.clone()))
+        .collect();
+    let edge_list = adjacency_list(&space_map, num_guard);
+    let devices = if cline.use_gpu() {
+        match cline.device {
+            Some(device) => vec![Some(gpu_core::Device::with_id(device).unwrap())],
+            None => gpu_core::all_devices().map(Some).collect::<Vec<_>>(),
+        }
+    } else {
+        vec![None]
+    };
+
+    let build = |patch: Patch, device| {
+        builder.build(
+            time,
+            patch,
+            structured_mesh,
+            &edge_list,
+            rk_order,
+            cline.execution_mode(),
+            cline.kernel_variant(),
+            cline.field_layout(),
+            device,
+            setup.clone(),
+        )
+    };
+    let mut patches = primitive_patches;
+
+    let solvers: Vec<_> = match topology {
+        None => patches
+            .into_iter()
+            .enumerate()
+            .map(|(n, patch)| {
+                let block = blocks.iter().position(|b| b.contains(&n)).unwrap();
+                build(patch, devices[(block + comm.rank()) % devices.len()])
+            })
+            .collect(),
+        Some(topology) => {
+            let blocks: Vec<Vec<_>> = blocks
+                .iter()
+                .rev()
+                .map(|range| patches.split_off(range.start))
+                .collect();
+            std::thread::scope(|scope| {
+                let handles: Vec<_> = blocks
+                    .into_iter()
+                    .rev()
+                    .enumerate()
+                    .map(|(node, block)| {
+                        let build = &build;
+                        scope.spawn(move || {
+                            numa::pin_current_thread(topology.cpus(node));
+                            block
+                                .into_iter()
+                                .map(|patch| build(patch, None))
+                                .collect::<Vec<_>>()
+                        })
+                    })
+                    .collect();
+                handles
+                    .into_iter()
+                    .flat_map(|handle| handle.join().unwrap())
+                    .collect()
+            })
+        }
+    };
+    let in_place = if cline.in_place_exchange() {
+        Some(InPlaceExchange::new(&solvers, &edge_list))
+    } else {
+        None
+    };
+    let distributed = if comm.is_distributed() {
+        Some(DistributedExchange::new(
+            *comm, &solvers, &spaces, &edge_list, num_guard,
+        ))
+    } else {
+        None
+    };
+    let stepper = Stepper {
+        exchanges_per_step,
+        in_place,
+        distributed,
+    };
+    (solvers, stepper)
+}
+
+/// Times a few steps with several candidate patch decompositions of the
+/// current state, and returns the fastest one. The candidate patch counts are
+/// multiples of the number of pool workers in CPU and hybrid mode, and powers
+/// of four in OMP mode, where each patch is itself threaded. Patches narrower
+/// than 16 zones are not considered. Returns `None` if there are fewer than two
+/// candidates, which is always the case for GPU runs, where there is one
+/// patch per device.
+fn autotune_decomposition<Builder, Solver>(
+    state: &State,
+    setup: &Arc<dyn Setup>,
+    cline: &CommandLine,
+    builder: &Builder,
+    pool: &Option<rayon::ThreadPool>,
+    topology: &Option<Topology>,
+    comm: &Communicator,
+) -> Option<Vec<IndexSpace>>
+where
+    Builder: PatchBasedBuild<Solver = Solver> + Sync,
+    Solver: PatchBasedSolve,
+{
+    let space = state.mesh.index_space();
+    let structured_mesh = match state.mesh {
+        Mesh::Structured(mesh) => mesh,
+        Mesh::FacePositions1D(_) => panic!("the patch-based solver requires a StructuredMesh"),
+    };
+    let candidates: Vec<usize> = match cline.execution_mode() {
+        ExecutionMode::CPU | ExecutionMode::Hybrid => {
+            let num_threads = pool.as_ref().unwrap().current_num_threads();
+            [1, 2, 4, 8, 16, 32, 64]
+                .iter()
+                .map(|n| n * num_threads)
+                .collect()
+        }
+        ExecutionMode::OMP => vec![1, 4, 16, 64, 256],
+        ExecutionMode::GPU => vec![cline.num_patches()],
+    };
+    let candidates: Vec<_> = candidates
+        .into_iter()
+        .map(|n| {
+            let mut tiles = space.tile(n);
+            balance::sort_along_curve(&mut tiles, IndexSpace::clone);
+            tiles
+        })
+        .filter(|tiles| {
+            tiles.iter().all(|t| {
+                let (mi, mj) = t.dim();
+                mi >= 16 && mj >= 16
+            })
+        })
+        .collect();
+
+    if candidates.len() < 2 {
+        println!("autotune: fewer than two candidate decompositions, skipping");
+        return None;
+    }
+    let mut best = (0.0, vec![]);
+
+    for tiles in candidates {
+        let patches = retile(&state.primitive_patches, &tiles);
+        let blocks = local_blocks(&zone_counts(&patches), cline, topology);
+        let (mut solvers, mut stepper) = build_solvers(
+            builder,
+            patches,
+            state.time,
+            structured_mesh,
+            cline,
+            setup,
+            topology,
+            &blocks,
+            comm,
+        );
+        let mut elapsed = std::time::Duration::ZERO;
+
+        for step in 0..AUTOTUNE_STEPS + 1 {
+            let start = std::time::Instant::now();
+            let dt = cline.cfl_number() * state.mesh.min_spacing() / max_wavespeed(&solvers, pool);
+            for solver in &mut solvers {
+                solver.set_timestep(dt)
+            }
+            solvers = stepper.advance(solvers, pool);
+            if step > 0 {
+                elapsed += start.elapsed()
+            }
+        }
+        let mzps = (space.len() * AUTOTUNE_STEPS) as f64 / 1e6 / elapsed.as_secs_f64();
+        println!("autotune: {} patches Mzps={:.3}", tiles.len(), mzps);
+
+        if mzps > best.0 {
+            best = (mzps, tiles)
+        }
+    }
+    println!("autotune: selected {} patches", best.1.len());
+    Some(best.1)
+}
+
+/// Takes a snapshot of the current data from the solvers, and hands it to
+/// the checkpoint writer. With more than one MPI rank, each rank writes its
+/// own file, so that no rank holds the whole grid, unless collective
+/// checkpoints were requested, in which case the patches are gathered onto
+/// the root rank, which writes a single file.
+fn write_checkpoint<Solver: PatchBasedSolve>(
+    state: &mut State,
+    solvers: &[Solver],
+    setup: &dyn Setup,
+    outdir: &str,
+    comm: &Communicator,
+    spaces: &[(IndexSpace, usize)],
+    writer: &mut checkpoint::Writer,
+) -> Result<(), error::Error> {
+    let primitive_patches: Vec<_> = solvers.iter().map(|s| s.primitive()).collect();
+
+    if comm.is_distributed() && state.command_line.per_rank_checkpoints() {
+        let rank_file = Some((comm.rank(), comm.size()));
+        let (snapshot, filename) =
+            state.checkpoint_snapshot(setup, outdir, rank_file, primitive_patches)?;
+        writer.write(snapshot, filename)
+    } else {
+        let primitive_patches = comm.gather_patches(primitive_patches, spaces);
+        if comm.is_root() {
+            let (snapshot, filename) =
+                state.checkpoint_snapshot(setup, outdir, None, primitive_patches)?;
+            writer.write(snapshot, filename)
+        } else {
+            state.advance_checkpoint(setup);
+            Ok(())
+        }
+    }
+}
+
+/// Makes an output product of the current data from the solvers, on the
+/// root rank, and hands it to the writer. Each rank averages and encodes its
+/// own patches, so only the encoded product is gathered onto the root rank.
+fn write_products<Solver: PatchBasedSolve>(
+    state: &mut State,
+    solvers: &[Solver],
+    mesh: &StructuredMesh,
+    rule: Recurrence,
+    outdir: &str,
+    comm: &Communicator,
+    spaces: &[(IndexSpace, usize)],
+    writer: &mut checkpoint::Writer,
+) -> Result<(), error::Error> {
+    let primitive_patches: Vec<_> = solvers.iter().map(|s| s.primitive()).collect();
+    let product = products::Product::gather(
+        state,
+        mesh,
+        &primitive_patches,
+        spaces,
+        comm,
+        state.command_line.products_format(),
+        state.command_line.products_downsample(),
+    )?;
+
+    if let Some(product) = product {
+        let filename = format!("{}/prods.{:04}.sfp", outdir, state.products.number);
+        println!("write {}", filename);
+        std::fs::create_dir_all(outdir).map_err(error::Error::IOError)?;
+        writer.write_product(product, filename)?;
+    }
+    state.products.next(state.time, rule);
+    Ok(())
+}
+
+/// Waits for the checkpoint writer to finish, and prints how much of the
+/// time it spent writing was hidden behind the time steps.
+fn finish_checkpoints(writer: checkpoint::Writer, comm: &Communicator) -> Result<(), error::Error> {
+    let report = writer.finish()?;
+
+    if comm.is_root() && report.files > 0 {
+        println!(
+            "checkpoints: wrote {} files in {:.3}s, stalled {:.3}s ({:.3}s hidden), compression ratio {:.2}",
+            report.files,
+            report.writing.as_secs_f64(),
+            report.stalled.as_secs_f64(),
+            report.hidden().as_secs_f64(),
+            report.compression_ratio(),
+        );
+    }
+    if comm.is_root() && report.products > 0 {
+        println!("products: wrote {} files", report.products);
+    }
+    Ok(())
+}
+
+/// Writes the spans recorded on this rank to a trace file, and prints the
+/// per-patch summary tables of all the ranks, in rank order. With more than
+/// one rank, the rank number is added to the file name.
+fn write_trace(filename: &str, comm: &Communicator) -> Result<(), error::Error> {
+    let filename = match filename.strip_suffix(".json") {
+        _ if !comm.is_distributed() => filename.to_string(),
+        Some(stem) => format!("{}.r{:04}.json", stem, comm.rank()),
+        None => format!("{}.r{:04}", filename, comm.rank()),
+    };
+    let summary = trace::write(&filename, comm.rank())?;
+
+    for rank in 0..comm.size() {
+        if rank == comm.rank() {
+            println!("write {}", filename);
+            print!("{}", summary);
+        }
+        comm.barrier()
+    }
+    Ok(())
+}
+
+/// Decides whether to move patches between ranks, NUMA nodes, or devices.
+/// The `costs` are the measured costs of all the patches since the last time,
+/// in curve order, and `before` is the largest total cost of a block under
+/// the current assignment. The new assignment splits the patches into
+/// contiguous segments of nearly equal cost: first over the ranks, and then
+/// into `num_blocks` blocks within each rank. It is used if it reduces the
+/// cost of the most loaded block by more than `REBALANCE_THRESHOLD`. Returns
+/// the new owner of each patch and the new largest block cost, or `None` if
+/// the patches should stay where they are. Every rank returns the same
+/// result.
+fn plan_rebalance(
+    costs: &[f64],
+    before: f64,
+    num_blocks: usize,
+    comm: &Communicator,
+) -> Option<(Vec<usize>, f64)> {
+    let num_blocks = comm.all_max(num_blocks as f64) as usize;
+    let ranks = balance::partition(costs, comm.size());
+    let after = ranks
+        .iter()
+        .map(|r| {
+            let costs = &costs[r.clone()];
+            balance::max_cost(costs, &balance::partition(costs, num_blocks))
+        })
+        .fold(0.0, f64::max);
+
+    if after >= before * (1.0 - REBALANCE_THRESHOLD) {
+        return None;
+    }
+    let mut owners = vec![0; costs.len()];
+    for (rank, range) in ranks.into_iter().enumerate() {
+        for owner in &mut owners[range] {
+            *owner = rank
+        }
+    }
+    Some((owners, after))
+}
+
 fn launch_patch_based<Builder, Solver>(
     mut state: State,
     setup: Arc<dyn Setup>,
     cline: CommandLine,
     builder: Builder,
+    comm: &Communicator,
 ) -> Result<(), error::Error>
 where
-    Builder: PatchBasedBuild<Solver = Solver>,
+    Builder: PatchBasedBuild<Solver = Solver> + Sync,
     Solver: PatchBasedSolve,
 {
-    let (cfl, fold, rk_order, checkpoint_rule, time_series_rule, dt_each_iter, end_time, outdir) = (
+    let (cfl, fold, checkpoint_rule, time_series_rule, dt_each_iter, end_time, outdir) = (
         cline.cfl_number(),
         cline.fold(),
-        cline.rk_order(),
         cline.checkpoint_rule(setup.as_ref()),
         cline.time_series_rule(setup.as_ref()),
         cline.recompute_dt_each_iteration(),
         cline.simulation_end_time(setup.as_ref()),
         cline.output_directory(&state.restart_file),
     );
-    let patch_map: RectangleMap<_, _> = state
-        .primitive_patches
-        .iter()
-        .map(|p| (p.rect(), p.clone()))
-        .collect();
-
+    let products_rule = cline.products_rule(setup.as_ref());
     let min_spacing = state.mesh.min_spacing();
-    let edge_list = adjacency_list(&patch_map, 2);
-    let mut solvers = vec![];
-    let mut devices = if cline.use_gpu() {
-        match cline.device {
-            Some(device) => vec![Some(gpu_core::Device::with_id(device).unwrap())],
-            None => gpu_core::all_devices().map(Some).collect::<Vec<_>>(),
-        }
-    } else {
-        vec![None]
-    }
-    .into_iter()
-    .cycle();
-
     let structured_mesh = match state.mesh {
         Mesh::Structured(mesh) => mesh,
         Mesh::FacePositions1D(_) => panic!("the patch-based solver requires a StructuredMesh"),
     };
 
-    for (_, patch) in patch_map.into_iter() {
-        let solver = builder.build(
-            state.time,
-            patch,
-            structured_mesh,
-            &edge_list,
-            rk_order,
-            cline.execution_mode(),
-            devices.next().flatten(),
-            setup.clone(),
-        );
-        solvers.push(solver)
-    }
-
     if std::matches!(checkpoint_rule, Recurrence::Log(_)) && setup.initial_time() <= 0.0 {
         return Err(InvalidSetup(
             "checkpoints can only be log-spaced if the initial time is > 0.0".to_string(),
         ));
     }
-    setup.print_parameters();
+    if comm.is_distributed() && (cline.autotune() || cline.in_place_exchange()) {
+        return Err(Cmdline(
+            "--autotune and --exchange in-place require a single MPI rank".to_string(),
+        ));
+    }
+    if comm.is_root() {
+        setup.print_parameters();
+    }
+
+    let topology = if cline.use_numa() {
+        Some(Topology::discover())
+    } else {
+        None
+    };
 
     let pool: Option<rayon::ThreadPool> = match cline.execution_mode() {
-        ExecutionMode::CPU => Some(rayon::ThreadPoolBuilder::new().build().unwrap()),
         ExecutionMode::OMP => None,
         ExecutionMode::GPU => None,
+        mode => {
+            let (num_workers, team_size) = cline.hybrid_split();
+            let hybrid = std::matches!(mode, ExecutionMode::Hybrid);
+            let topology = topology.clone();
+            if hybrid && comm.is_root() {
+                println!(
+                    "hybrid mode: {} workers x {} OpenMP threads",
+                    num_workers, team_size
+                );
+            }
+            Some(
+                rayon::ThreadPoolBuilder::new()
+                    .num_threads(num_workers)
+                    .start_handler(move |worker| {
+                        if let Some(ref topology) = topology {
+                            let node = topology.node_of_worker(worker, num_workers);
+                            numa::pin_current_thread(topology.cpus(node));
+                        }
+                        if hybrid {
+                            sailfish::set_omp_num_threads(team_size)
+                        }
+                    })
+                    .build()
+                    .unwrap(),
+            )
+        }
     };
 
+    if cline.autotune() {
+        if let Some(tiles) =
+            autotune_decomposition(&state, &setup, &cline, &builder, &pool, &topology, comm)
+        {
+            state.primitive_patches = retile(&state.primitive_patches, &tiles);
+            state.command_line.patches = Some(tiles.len());
+            state.command_line.patch_shape = None;
+        }
+    }
+
+    let memory_before = topology.as_ref().map(Topology::memory_usage);
+    let mut blocks = local_blocks(&zone_counts(&state.primitive_patches), &cline, &topology);
+    let (mut solvers, mut stepper) = build_solvers(
+        &builder,
+        std::mem::take(&mut state.primitive_patches),
+        state.time,
+        structured_mesh,
+        &cline,
+        &setup,
+        &topology,
+        &blocks,
+        comm,
+    );
+    if let (Some(topology), Some(before)) = (&topology, &memory_before) {
+        if comm.is_root() {
+            topology.print_memory_report(before, &blocks)
+        }
+    }
+    let local: Vec<_> = solvers.iter().map(|s| IndexSpace::from(&s.key())).collect();
+    let mut spaces = comm.all_gather_spaces(&local);
+    let mut last_rebalance = state.iteration;
+    let mut writer = checkpoint::Writer::new(checkpoint::MAX_IN_FLIGHT);
+
+    if let Some(orbit) = setup.orbit() {
+        start_orbit(orbit, &state, setup.as_ref())
+    }
+
     let set_timestep = |solvers: &mut [Solver]| {
-        let dt = cfl * min_spacing / max_wavespeed(solvers, &pool);
+        let _span = trace::Span::new("set_timestep");
+        let dt = cfl * min_spacing / comm.all_max(max_wavespeed(solvers, &pool));
         for solver in solvers {
             solver.set_timestep(dt)
         }
         dt
     };
 
+    if cline.trace.is_some() {
+        trace::enable()
+    }
+
     while state.time < end_time {
         if state.time_series.is_due(state.time, time_series_rule) {
-            let mut reductions = global_reduction(&solvers);
-            reductions.insert(0, state.time);
-            state.time_series_data.push(reductions);
+            record_time_series(&mut state, &mut solvers, setup.as_ref(), comm, true);
             state.time_series.next(state.time, time_series_rule);
-            println!("record time series sample {}", state.time_series_data.len(),);
         }
         if state.checkpoint.is_due(state.time, checkpoint_rule) {
-            state.primitive_patches = solvers.iter().map(|s| s.primitive()).collect();
-            state.write_checkpoint(setup.as_ref(), &outdir)?
+            record_time_series(&mut state, &mut solvers, setup.as_ref(), comm, false);
+            write_checkpoint(
+                &mut state,
+                &solvers,
+                setup.as_ref(),
+                &outdir,
+                comm,
+                &spaces,
+                &mut writer,
+            )?
+        }
+        if let Some(rule) = products_rule {
+            if state.products.is_due(state.time, rule) {
+                write_products(
+                    &mut state,
+                    &solvers,
+                    &structured_mesh,
+                    rule,
+                    &outdir,
+                    comm,
+                    &spaces,
+                    &mut writer,
+                )?
+            }
         }
 
         let start = std::time::Instant::now();
+        let allocations = sailfish::halo::allocation_count();
         let mut dt = 0.0;
 
         if !dt_each_iter {
@@ -250,32 +947,90 @@ where
             if dt_each_iter {
                 dt = set_timestep(&mut solvers);
             }
-            for _ in 0..rk_order {
-                solvers = match pool {
-                    Some(ref pool) => {
-                        pool.scope(|s| automaton::execute_rayon(s, solvers).collect())
-                    }
-                    None => automaton::execute(solvers).collect(),
-                };
-            }
+            solvers = stepper.advance(solvers, &pool);
+            advance_orbit(setup.as_ref(), &mut solvers, dt, comm);
             state.time += dt;
             state.iteration += 1;
         }
         let mzps =
             (state.mesh.num_total_zones() * fold) as f64 / 1e6 / start.elapsed().as_secs_f64();
+        let allocs_per_step =
+            (sailfish::halo::allocation_count() - allocations) as f64 / fold as f64;
 
-        println!(
-            "[{}] t={:.3} dt={:.3e} Mzps={:.3}",
-            state.iteration,
-            state.time / setup.unit_time(),
-            dt / setup.unit_time(),
-            mzps,
-        );
+        if comm.is_root() {
+            println!(
+                "[{}] t={:.3} dt={:.3e} Mzps={:.3} allocs/step={:.1}",
+                state.iteration,
+                state.time / setup.unit_time(),
+                dt / setup.unit_time(),
+                mzps,
+                allocs_per_step,
+            );
+        }
+
+        if let Some(interval) = cline.rebalance_interval() {
+            if state.iteration >= last_rebalance + interval {
+                let costs: Vec<_> = solvers.iter_mut().map(|s| s.take_elapsed()).collect();
+                let before = comm.all_max(balance::max_cost(&costs, &blocks));
+                let costs = comm.all_gather_f64(&costs);
+
+                if let Some((owners, after)) = plan_rebalance(&costs, before, blocks.len(), comm) {
+                    if comm.is_root() {
+                        println!(
+                            "rebalance: max cost per block {:.3e} s -> {:.3e} s",
+                            before, after
+                        );
+                    }
+                    record_time_series(&mut state, &mut solvers, setup.as_ref(), comm, false);
+                    let patches: Vec<_> = solvers.drain(..).map(|s| s.primitive()).collect();
+                    let patches = comm.redistribute(patches, &spaces, &owners);
+                    let costs: Vec<_> = costs
+                        .into_iter()
+                        .zip(&owners)
+                        .filter(|(_, &owner)| owner == comm.rank())
+                        .map(|(cost, _)| cost)
+                        .collect();
+                    blocks = local_blocks(&costs, &cline, &topology);
+
+                    let (new_solvers, new_stepper) = build_solvers(
+                        &builder,
+                        patches,
+                        state.time,
+                        structured_mesh,
+                        &cline,
+                        &setup,
+                        &topology,
+                        &blocks,
+                        comm,
+                    );
+                    solvers = new_solvers;
+                    stepper = new_stepper;
+                    spaces = owners
+                        .into_iter()
+                        .zip(spaces)
+                        .map(|(owner, (space, _))| (space, owner))
+                        .collect();
+                }
+                last_rebalance = state.iteration;
+            }
+        }
     }
 
-    state.primitive_patches = solvers.iter().map(|s| s.primitive()).collect();
-    state.write_checkpoint(setup.as_ref(), &outdir)?;
+    record_time_series(&mut state, &mut solvers, setup.as_ref(), comm, false);
+    write_checkpoint(
+        &mut state,
+        &solvers,
+        setup.as_ref(),
+        &outdir,
+        comm,
+        &spaces,
+        &mut writer,
+    )?;
+    finish_checkpoints(writer, comm)?;
 
+    if let Some(ref filename) = cline.trace {
+        write_trace(filename, comm)?
+    }
     Ok(())
 }
 
@@ -283,7 +1038,13 @@ fn launch_single_patch(
     mut state: State,
     setup: Arc<dyn Setup>,
     cline: CommandLine,
+    comm: &Communicator,
 ) -> Result<(), error::Error> {
+    if comm.is_distributed() {
+        return Err(Cmdline(
+            "1D setups run on a single patch, and require a single MPI rank".to_string(),
+        ));
+    }
     let (cfl, fold, rk_order, checkpoint_rule, dt_each_iter, end_time, outdir) = (
         cline.cfl_number(),
         cline.fold(),
@@ -365,23 +1126,41 @@ fn launch_single_patch(
     Ok(())
 }
 
-fn run() -> Result<(), error::Error> {
+fn run(comm: &Communicator) -> Result<(), error::Error> {
     let cline = sailfish::CommandLine::parse()?;
-    let state = make_state(&cline)?;
+    let state = make_state(&cline, comm)?;
     let setup = setups::make_setup(&state.setup_name, &state.parameters)?;
     let cline = state.command_line.clone();
 
     match setup.solver_name().as_str() {
-        "iso2d" => launch_patch_based(state, setup, cline, iso2d::solver::Builder),
-        "euler1d" => launch_single_patch(state, setup, cline),
-        "euler2d" => launch_patch_based(state, setup, cline, euler2d::solver::Builder),
-        "sr1d" => launch_single_patch(state, setup, cline),
+        "iso2d" => launch_patch_based(state, setup, cline, iso2d::solver::Builder, comm),
+        "euler1d" => launch_single_patch(state, setup, cline, comm),
+        "euler2d" => launch_patch_based(state, setup, cline, euler2d::solver::Builder, comm),
+        "sr1d" => launch_single_patch(state, setup, cline, comm),
         _ => panic!("unknown solver name"),
     }
 }
 
 fn main() {
-    if let Err(e) = run() {
-        print!("{}", e)
+    let comm = mpi::init();
+
+    if let Err(e) = run(&comm) {
+        // Command line errors occur on every rank, so they are printed once.
+        // Other errors might occur on only some of the ranks, which then take
+        // down the others rather than leaving them waiting.
+        match e {
+            PrintUserInformation(_) | Cmdline(_) => {
+                if comm.is_root() {
+                    print!("{}", e)
+                }
+            }
+            _ => {
+                print!("{}", e);
+                if comm.is_distributed() {
+                    comm.abort(1)
+                }
+            }
+        }
     }
+    mpi::finalize()
 }
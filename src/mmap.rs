@@ -0,0 +1,127 @@
+//! Read-only memory mappings of files, used to load checkpoints without
+//! first reading them into memory.
+//!
+//! The pages of a mapped file are read on demand, are shared with the page
+//! cache, and can be dropped from the process's resident set once they have
+//! been copied out. On platforms without `mmap`, the file is read into memory
+//! instead.
+
+use crate::error::Error;
+use std::ops::Range;
+
+#[cfg(unix)]
+mod sys {
+    use std::os::raw::{c_int, c_void};
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_PRIVATE: c_int = 2;
+    pub const MADV_DONTNEED: c_int = 4;
+
+    /// Pages are assumed to be this size when releasing parts of a mapping.
+    /// If the pages are larger, releasing them may fail, which is harmless.
+    pub const PAGE_SIZE: usize = 4096;
+
+    extern "C" {
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+        pub fn madvise(addr: *mut c_void, len: usize, advice: c_int) -> c_int;
+    }
+}
+
+/// The contents of a file, mapped read-only into memory.
+pub struct Mapping {
+    #[cfg(unix)]
+    ptr: *mut std::os::raw::c_void,
+    #[cfg(unix)]
+    len: usize,
+    #[cfg(not(unix))]
+    data: Vec<u8>,
+}
+
+// The mapping is read-only, so it can be read from any thread.
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    /// Maps the whole of the given file. The file must not be modified while
+    /// the mapping exists.
+    pub fn open(filename: &str) -> Result<Self, Error> {
+        let file = std::fs::File::open(filename).map_err(Error::IOError)?;
+
+        cfg_if::cfg_if! {
+            if #[cfg(unix)] {
+                use std::os::unix::io::AsRawFd;
+                let len = file.metadata().map_err(Error::IOError)?.len() as usize;
+
+                if len == 0 {
+                    return Ok(Self { ptr: std::ptr::null_mut(), len })
+                }
+                let ptr = unsafe {
+                    sys::mmap(std::ptr::null_mut(), len, sys::PROT_READ, sys::MAP_PRIVATE, file.as_raw_fd(), 0)
+                };
+                if ptr as isize == -1 {
+                    return Err(Error::IOError(std::io::Error::last_os_error()))
+                }
+                Ok(Self { ptr, len })
+            } else {
+                use std::io::Read;
+                let mut data = Vec::new();
+                let mut file = file;
+                file.read_to_end(&mut data).map_err(Error::IOError)?;
+                Ok(Self { data })
+            }
+        }
+    }
+
+    /// Returns the mapped bytes. The start of the mapping is page-aligned.
+    pub fn bytes(&self) -> &[u8] {
+        cfg_if::cfg_if! {
+            if #[cfg(unix)] {
+                if self.len == 0 {
+                    &[]
+                } else {
+                    unsafe { std::slice::from_raw_parts(self.ptr as *const u8, self.len) }
+                }
+            } else {
+                &self.data
+            }
+        }
+    }
+
+    /// Tells the OS that the given range of bytes will not be read again, so
+    /// that the whole pages within it can be dropped from the resident set.
+    /// If they are read anyway, they are mapped again from the file.
+    pub fn release(&self, range: Range<usize>) {
+        cfg_if::cfg_if! {
+            if #[cfg(unix)] {
+                let start = (range.start + sys::PAGE_SIZE - 1) / sys::PAGE_SIZE * sys::PAGE_SIZE;
+                let end = range.end.min(self.len) / sys::PAGE_SIZE * sys::PAGE_SIZE;
+
+                if start < end {
+                    unsafe {
+                        let addr = (self.ptr as *mut u8).add(start);
+                        sys::madvise(addr as *mut _, end - start, sys::MADV_DONTNEED);
+                    }
+                }
+            } else {
+                std::convert::identity(range); // black-box
+            }
+        }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        #[cfg(unix)]
+        if self.len > 0 {
+            unsafe { sys::munmap(self.ptr, self.len) };
+        }
+    }
+}
@@ -0,0 +1,196 @@
+//! A guard zone exchange for patch-based solvers which are distributed over
+//! MPI ranks.
+//!
+//! Each rank advances its own patches one stage at a time. The guard zone
+//! messages of a stage are created with `Automaton::messages`, as they are
+//! for the automaton. Messages to patches on the same rank are delivered
+//! directly, and the others are sent with nonblocking MPI calls, into
+//! receive buffers which are allocated once and re-used for every stage.
+//! While the messages are in flight, each solver updates the zones of its
+//! next stage which do not depend on guard zones (see
+//! `PatchBasedSolve::advance_interior`). The remaining zones are updated
+//! once all the receives have completed.
+//!
+//! Every remote message is matched by a tag, which is its index among the
+//! messages between the same pair of ranks. The tags are computed on both
+//! ends from the global edge list, so no setup communication is needed
+//! beyond gathering the patch index spaces. All of the MPI calls are made
+//! from the main thread.
+
+use crate::mpi::Communicator;
+use crate::trace;
+use crate::{IndexSpace, Patch, PatchBasedSolve};
+use gridiron::adjacency_list::AdjacencyList;
+use gridiron::rect_map::Rectangle;
+use rayon::prelude::*;
+use std::collections::HashMap;
+use std::sync::Arc;
+
+/// A guard zone message expected from a patch on another rank.
+struct Receive {
+    rank: usize,
+    tag: i32,
+    target: usize,
+    buffer: Arc<Patch>,
+}
+
+/// The schedule for a distributed guard zone exchange. It is created once for
+/// the solvers on this rank, and re-used for every time step.
+pub struct DistributedExchange {
+    comm: Communicator,
+    /// The index of each local solver, by its key.
+    local: HashMap<Rectangle<i64>, usize>,
+    /// The rank and tag of each message sent from a local patch (the first
+    /// key) to a patch on another rank (the second key).
+    sends: HashMap<(Rectangle<i64>, Rectangle<i64>), (usize, i32)>,
+    /// The messages received by local patches from other ranks.
+    receives: Vec<Receive>,
+}
+
+impl DistributedExchange {
+    /// Creates a schedule for the given solvers on this rank. The `spaces`
+    /// are the index spaces of all the patches, and their owners, as returned
+    /// by `Communicator::all_gather_spaces`, and `edge_list` is the global
+    /// one used to build the solvers.
+    pub fn new<S: PatchBasedSolve>(
+        comm: Communicator,
+        solvers: &[S],
+        spaces: &[(IndexSpace, usize)],
+        edge_list: &AdjacencyList<Rectangle<i64>>,
+        num_guard: usize,
+    ) -> Self {
+        let owner: HashMap<_, _> = spaces.iter().map(|(s, r)| (s.to_rect(), *r)).collect();
+        let local: HashMap<_, _> = solvers
+            .iter()
+            .enumerate()
+            .map(|(n, s)| (s.key(), n))
+            .collect();
+        let corners = |r: &Rectangle<i64>| (r.0.start, r.1.start);
+
+        let mut tags = HashMap::new();
+        let mut sends = HashMap::new();
+        let mut receives = vec![];
+
+        for (space, dst_rank) in spaces {
+            let dst = space.to_rect();
+            let mut sources: Vec<_> = edge_list.incoming_edges(&dst).cloned().collect();
+            sources.sort_by_key(corners);
+
+            for src in sources {
+                let src_rank = owner[&src];
+                if src_rank == *dst_rank {
+                    continue;
+                }
+                let tag = tags.entry((src_rank, *dst_rank)).or_insert(0);
+
+                if src_rank == comm.rank() {
+                    sends.insert((src.clone(), dst.clone()), (*dst_rank, *tag));
+                }
+                if *dst_rank == comm.rank() {
+                    let target = local[&dst];
+                    let source = solvers[target].guard_source();
+                    let region = IndexSpace::from(&dst)
+                        .extend_all(num_guard as i64)
+                        .intersect(&IndexSpace::from(&src))
+                        .unwrap();
+                    receives.push(Receive {
+                        rank: src_rank,
+                        tag: *tag,
+                        target,
+                        buffer: Arc::new(
+                            Patch::zeros(source.num_fields(), &region).into_layout(source.layout()),
+                        ),
+                    });
+                }
+                *tag += 1;
+            }
+        }
+
+        Self {
+            comm,
+            local,
+            sends,
+            receives,
+        }
+    }
+
+    /// Advances the solvers by the given number of stages, filling their
+    /// guard zones before each one. The solvers must be the ones given to
+    /// `new`, in the same order.
+    pub fn execute<S: PatchBasedSolve>(
+        &mut self,
+        solvers: &mut [S],
+        num_stages: usize,
+        pool: &Option<rayon::ThreadPool>,
+    ) {
+        assert_eq!(solvers.len(), self.local.len());
+
+        for _ in 0..num_stages {
+            let comm = self.comm;
+            let recv_requests: Vec<_> = self
+                .receives
+                .iter_mut()
+                .map(|r| {
+                    let buffer = Arc::get_mut(&mut r.buffer).unwrap();
+                    let count = buffer.index_space().len() * buffer.num_fields();
+                    unsafe { comm.irecv(buffer.as_mut_ptr(), count, r.rank, r.tag) }
+                })
+                .collect();
+
+            // The remote messages are kept alive until their sends complete.
+            let mut outgoing = vec![];
+            let mut send_requests = vec![];
+
+            for n in 0..solvers.len() {
+                let src = solvers[n].key();
+                for (dst, message) in solvers[n].messages() {
+                    match self.local.get(&dst) {
+                        Some(&m) => {
+                            solvers[m].receive(message);
+                        }
+                        None => {
+                            let (rank, tag) = self.sends[&(src.clone(), dst)];
+                            let message = match message.device() {
+                                Some(_) => Arc::new(message.to_host()),
+                                None => message,
+                            };
+                            let data = message.as_slice().unwrap();
+                            send_requests
+                                .push(unsafe { comm.isend(data.as_ptr(), data.len(), rank, tag) });
+                            outgoing.push(message);
+                        }
+                    }
+                }
+            }
+
+            for_each_solver(solvers, pool, |s| s.advance_interior());
+
+            let span = trace::Span::new("wait_receives");
+            comm.wait_all(recv_requests);
+            drop(span);
+
+            for r in &self.receives {
+                solvers[r.target].receive(r.buffer.clone());
+            }
+            for_each_solver(solvers, pool, |s| s.advance_stage());
+
+            let span = trace::Span::new("wait_sends");
+            comm.wait_all(send_requests);
+            drop(span);
+            drop(outgoing);
+        }
+    }
+}
+
+/// Applies a function to each of the solvers, in parallel on the thread pool
+/// if there is one. In OMP and GPU modes, the solvers are visited in turn.
+fn for_each_solver<S, F>(solvers: &mut [S], pool: &Option<rayon::ThreadPool>, f: F)
+where
+    S: PatchBasedSolve,
+    F: Fn(&mut S) + Send + Sync,
+{
+    match pool {
+        Some(pool) => pool.install(|| solvers.par_iter_mut().for_each(f)),
+        None => solvers.iter_mut().for_each(f),
+    }
+}
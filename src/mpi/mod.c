@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+
+// ============================ MPI WRAPPERS ==================================
+// ============================================================================
+//
+// Thin wrappers around the MPI calls used by the distributed driver, so that
+// the Rust code does not depend on the ABI of a particular MPI library (the
+// MPI_Request and MPI_Comm types differ between Open MPI and MPICH). All of
+// the functions operate on MPI_COMM_WORLD, and are called from the main thread
+// only. Requests are heap-allocated, and freed by sf_mpi_waitall.
+
+
+void sf_mpi_init(void)
+{
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+
+    if (provided < MPI_THREAD_FUNNELED)
+    {
+        printf("[FATAL] MPI library does not provide MPI_THREAD_FUNNELED\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+void sf_mpi_finalize(void)
+{
+    MPI_Finalize();
+}
+
+void sf_mpi_abort(int code)
+{
+    MPI_Abort(MPI_COMM_WORLD, code);
+}
+
+int sf_mpi_rank(void)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    return rank;
+}
+
+int sf_mpi_size(void)
+{
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    return size;
+}
+
+/**
+ * Returns the largest tag value the MPI library accepts. The standard only
+ * guarantees 32767.
+ */
+int sf_mpi_tag_ub(void)
+{
+    int *tag_ub;
+    int flag;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_ub, &flag);
+    return flag ? *tag_ub : 32767;
+}
+
+void sf_mpi_barrier(void)
+{
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+double sf_mpi_allreduce_max(double x)
+{
+    double result;
+    MPI_Allreduce(&x, &result, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    return result;
+}
+
+void sf_mpi_allreduce_sum(double *data, int count)
+{
+    MPI_Allreduce(MPI_IN_PLACE, data, count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+/**
+ * Gathers a variable number of 64-bit integers from every rank, in rank
+ * order.
+ * @param data[in]     The integers on this rank [count]
+ * @param count        The number of integers on this rank
+ * @param counts[out]  The number of integers on each rank [size]
+ * @param result[out]  The integers from all ranks, or NULL to only get the
+ *                     counts [sum(counts)]
+ */
+void sf_mpi_allgather_long(const long long *data, int count, int *counts, long long *result)
+{
+    MPI_Allgather(&count, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+    if (result == NULL)
+    {
+        return;
+    }
+    int size = sf_mpi_size();
+    int *displs = (int *) malloc(size * sizeof(int));
+
+    for (int n = 0, d = 0; n < size; ++n)
+    {
+        displs[n] = d;
+        d += counts[n];
+    }
+    MPI_Allgatherv(data, count, MPI_LONG_LONG, result, counts, displs, MPI_LONG_LONG, MPI_COMM_WORLD);
+    free(displs);
+}
+
+void *sf_mpi_isend(const double *data, int count, int dest, int tag)
+{
+    MPI_Request *request = (MPI_Request *) malloc(sizeof(MPI_Request));
+    MPI_Isend(data, count, MPI_DOUBLE, dest, tag, MPI_COMM_WORLD, request);
+    return request;
+}
+
+void *sf_mpi_irecv(double *data, int count, int source, int tag)
+{
+    MPI_Request *request = (MPI_Request *) malloc(sizeof(MPI_Request));
+    MPI_Irecv(data, count, MPI_DOUBLE, source, tag, MPI_COMM_WORLD, request);
+    return request;
+}
+
+void *sf_mpi_isend_bytes(const void *data, int count, int dest, int tag)
+{
+    MPI_Request *request = (MPI_Request *) malloc(sizeof(MPI_Request));
+    MPI_Isend(data, count, MPI_BYTE, dest, tag, MPI_COMM_WORLD, request);
+    return request;
+}
+
+void *sf_mpi_irecv_bytes(void *data, int count, int source, int tag)
+{
+    MPI_Request *request = (MPI_Request *) malloc(sizeof(MPI_Request));
+    MPI_Irecv(data, count, MPI_BYTE, source, tag, MPI_COMM_WORLD, request);
+    return request;
+}
+
+void sf_mpi_waitall(void **requests, int count)
+{
+    for (int n = 0; n < count; ++n)
+    {
+        MPI_Wait((MPI_Request *) requests[n], MPI_STATUS_IGNORE);
+        free(requests[n]);
+    }
+}
@@ -0,0 +1,455 @@
+//! Distributed-memory parallelism with MPI.
+//!
+//! With the `mpi` feature, the functions here call into a small C wrapper
+//! around the MPI library, which is compiled with `mpicc`. Without it, there
+//! is a single rank, and the collective operations are trivial. The driver
+//! can then use the same code paths whether or not it was built with MPI.
+
+use crate::Patch;
+use cfg_if::cfg_if;
+use gridiron::index_space::IndexSpace;
+use std::os::raw::c_void;
+
+#[cfg(feature = "mpi")]
+use std::os::raw::c_int;
+
+pub mod exchange;
+
+#[cfg(feature = "mpi")]
+extern "C" {
+    fn sf_mpi_init();
+    fn sf_mpi_finalize();
+    fn sf_mpi_abort(code: c_int);
+    fn sf_mpi_rank() -> c_int;
+    fn sf_mpi_size() -> c_int;
+    fn sf_mpi_tag_ub() -> c_int;
+    fn sf_mpi_barrier();
+    fn sf_mpi_allreduce_max(x: f64) -> f64;
+    fn sf_mpi_allreduce_sum(data: *mut f64, count: c_int);
+    fn sf_mpi_allgather_long(data: *const i64, count: c_int, counts: *mut c_int, result: *mut i64);
+    fn sf_mpi_isend(data: *const f64, count: c_int, dest: c_int, tag: c_int) -> *mut c_void;
+    fn sf_mpi_irecv(data: *mut f64, count: c_int, source: c_int, tag: c_int) -> *mut c_void;
+    fn sf_mpi_isend_bytes(
+        data: *const c_void,
+        count: c_int,
+        dest: c_int,
+        tag: c_int,
+    ) -> *mut c_void;
+    fn sf_mpi_irecv_bytes(
+        data: *mut c_void,
+        count: c_int,
+        source: c_int,
+        tag: c_int,
+    ) -> *mut c_void;
+    fn sf_mpi_waitall(requests: *mut *mut c_void, count: c_int);
+}
+
+/// Returns whether the code has been compiled with MPI support,
+/// `feature=mpi`.
+pub fn compiled_with_mpi() -> bool {
+    cfg_if! {
+        if #[cfg(feature = "mpi")] {
+            true
+        } else {
+            false
+        }
+    }
+}
+
+/// A pending nonblocking send or receive. It must be completed with
+/// `Communicator::wait_all` before the buffer it refers to is touched.
+#[cfg_attr(not(feature = "mpi"), allow(dead_code))]
+pub struct Request(*mut c_void);
+
+/// A handle to the ranks of the world communicator. It is obtained from
+/// `init`, and is only used from the main thread.
+#[derive(Clone, Copy, Debug)]
+pub struct Communicator {
+    rank: usize,
+    size: usize,
+    tag_ub: i32,
+}
+
+/// The tag of the messages sent by `gather_patches`, `gather_bytes` and
+/// `redistribute`. The patches sent between a pair of ranks are received in
+/// the order they are sent (MPI messages with the same source and tag do not
+/// overtake one another), so the tag does not need to identify the patch.
+const PATCH_TAG: i32 = 0;
+
+/// Initializes MPI, if the code was compiled with MPI support, and returns
+/// the world communicator. This function must be called once, before any
+/// other thread is started.
+pub fn init() -> Communicator {
+    cfg_if! {
+        if #[cfg(feature = "mpi")] {
+            unsafe {
+                sf_mpi_init();
+                Communicator {
+                    rank: sf_mpi_rank() as usize,
+                    size: sf_mpi_size() as usize,
+                    tag_ub: sf_mpi_tag_ub(),
+                }
+            }
+        } else {
+            Communicator {
+                rank: 0,
+                size: 1,
+                tag_ub: i32::MAX,
+            }
+        }
+    }
+}
+
+/// Shuts down MPI. No MPI function may be called afterwards.
+pub fn finalize() {
+    #[cfg(feature = "mpi")]
+    unsafe {
+        sf_mpi_finalize()
+    }
+}
+
+impl Communicator {
+    pub fn rank(&self) -> usize {
+        self.rank
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    /// Returns true on rank 0, which prints the progress messages and writes
+    /// the collective checkpoints.
+    pub fn is_root(&self) -> bool {
+        self.rank == 0
+    }
+
+    /// Returns true if there is more than one rank.
+    pub fn is_distributed(&self) -> bool {
+        self.size > 1
+    }
+
+    /// Terminates all of the ranks. This is called if an error occurs on any
+    /// rank, since the others would otherwise wait for it indefinitely.
+    pub fn abort(&self, code: i32) {
+        #[cfg(feature = "mpi")]
+        unsafe {
+            sf_mpi_abort(code)
+        }
+        std::process::exit(code)
+    }
+
+    pub fn barrier(&self) {
+        #[cfg(feature = "mpi")]
+        unsafe {
+            sf_mpi_barrier()
+        }
+    }
+
+    /// Returns the maximum of a value over all ranks.
+    pub fn all_max(&self, x: f64) -> f64 {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                unsafe { sf_mpi_allreduce_max(x) }
+            } else {
+                x
+            }
+        }
+    }
+
+    /// Sums each element of a slice over all ranks, in place. The slice
+    /// must have the same length on every rank.
+    pub fn all_sum(&self, data: &mut [f64]) {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                unsafe { sf_mpi_allreduce_sum(data.as_mut_ptr(), data.len() as c_int) }
+            } else {
+                std::convert::identity(data); // black-box
+            }
+        }
+    }
+
+    /// Gathers the given integers from every rank, and returns them in rank
+    /// order, together with the number of integers from each rank.
+    pub fn all_gather(&self, data: &[i64]) -> (Vec<i64>, Vec<usize>) {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                let mut counts = vec![0; self.size];
+                unsafe {
+                    let count = data.len() as c_int;
+                    sf_mpi_allgather_long(data.as_ptr(), count, counts.as_mut_ptr(), std::ptr::null_mut());
+                    let mut result = vec![0; counts.iter().map(|&c| c as usize).sum()];
+                    sf_mpi_allgather_long(data.as_ptr(), count, counts.as_mut_ptr(), result.as_mut_ptr());
+                    (result, counts.into_iter().map(|c| c as usize).collect())
+                }
+            } else {
+                (data.to_vec(), vec![data.len()])
+            }
+        }
+    }
+
+    /// Gathers floating-point numbers from every rank, in rank order.
+    pub fn all_gather_f64(&self, data: &[f64]) -> Vec<f64> {
+        let bits: Vec<_> = data.iter().map(|x| x.to_bits() as i64).collect();
+        let (bits, _) = self.all_gather(&bits);
+        bits.into_iter().map(|b| f64::from_bits(b as u64)).collect()
+    }
+
+    /// Returns the largest message tag the MPI library accepts.
+    pub fn tag_ub(&self) -> i32 {
+        self.tag_ub
+    }
+
+    /// Panics with a clear message if a tag is larger than the MPI library
+    /// accepts, rather than leaving the behavior of the send or receive
+    /// undefined.
+    #[cfg(feature = "mpi")]
+    fn check_tag(&self, tag: i32) {
+        assert!(
+            (0..=self.tag_ub()).contains(&tag),
+            "MPI tag {} is outside of the range [0, MPI_TAG_UB = {}]; there are too many messages between a pair of ranks for this MPI library",
+            tag,
+            self.tag_ub()
+        )
+    }
+
+    /// Starts sending the elements of a host buffer to another rank.
+    ///
+    /// # Safety
+    ///
+    /// `data` must point to `count` elements, which stay valid and unchanged
+    /// until the request is completed.
+    pub unsafe fn isend(&self, data: *const f64, count: usize, dest: usize, tag: i32) -> Request {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                self.check_tag(tag);
+                Request(sf_mpi_isend(data, count as c_int, dest as c_int, tag))
+            } else {
+                std::convert::identity((data, count, dest, tag)); // black-box
+                unreachable!("there are no other ranks without MPI support")
+            }
+        }
+    }
+
+    /// Starts receiving elements from another rank into a host buffer.
+    ///
+    /// # Safety
+    ///
+    /// `data` must point to `count` elements, which stay valid and are not
+    /// accessed until the request is completed.
+    pub unsafe fn irecv(&self, data: *mut f64, count: usize, source: usize, tag: i32) -> Request {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                self.check_tag(tag);
+                Request(sf_mpi_irecv(data, count as c_int, source as c_int, tag))
+            } else {
+                std::convert::identity((data, count, source, tag)); // black-box
+                unreachable!("there are no other ranks without MPI support")
+            }
+        }
+    }
+
+    /// Starts sending a host buffer of bytes to another rank.
+    ///
+    /// # Safety
+    ///
+    /// `data` must point to `count` bytes, which stay valid and unchanged
+    /// until the request is completed.
+    pub unsafe fn isend_bytes(
+        &self,
+        data: *const u8,
+        count: usize,
+        dest: usize,
+        tag: i32,
+    ) -> Request {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                self.check_tag(tag);
+                Request(sf_mpi_isend_bytes(data as *const c_void, count as c_int, dest as c_int, tag))
+            } else {
+                std::convert::identity((data, count, dest, tag)); // black-box
+                unreachable!("there are no other ranks without MPI support")
+            }
+        }
+    }
+
+    /// Starts receiving bytes from another rank into a host buffer.
+    ///
+    /// # Safety
+    ///
+    /// `data` must point to `count` bytes, which stay valid and are not
+    /// accessed until the request is completed.
+    pub unsafe fn irecv_bytes(
+        &self,
+        data: *mut u8,
+        count: usize,
+        source: usize,
+        tag: i32,
+    ) -> Request {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                self.check_tag(tag);
+                Request(sf_mpi_irecv_bytes(data as *mut c_void, count as c_int, source as c_int, tag))
+            } else {
+                std::convert::identity((data, count, source, tag)); // black-box
+                unreachable!("there are no other ranks without MPI support")
+            }
+        }
+    }
+
+    /// Blocks until all of the given requests have completed.
+    pub fn wait_all(&self, requests: Vec<Request>) {
+        cfg_if! {
+            if #[cfg(feature = "mpi")] {
+                let mut requests: Vec<_> = requests.into_iter().map(|r| r.0).collect();
+                unsafe { sf_mpi_waitall(requests.as_mut_ptr(), requests.len() as c_int) }
+            } else {
+                assert!(requests.is_empty())
+            }
+        }
+    }
+
+    /// Returns the index spaces of the patches on all ranks, in rank order,
+    /// together with the rank that owns each one.
+    pub fn all_gather_spaces(&self, local: &[IndexSpace]) -> Vec<(IndexSpace, usize)> {
+        let corners: Vec<_> = local
+            .iter()
+            .flat_map(|space| {
+                let (di, dj) = space.to_rect();
+                [di.start, di.end, dj.start, dj.end]
+            })
+            .collect();
+        let (corners, counts) = self.all_gather(&corners);
+        let owners = counts
+            .iter()
+            .enumerate()
+            .flat_map(|(rank, &count)| std::iter::repeat(rank).take(count / 4));
+
+        corners
+            .chunks_exact(4)
+            .map(|c| IndexSpace::new(c[0]..c[1], c[2]..c[3]))
+            .zip(owners)
+            .collect()
+    }
+
+    /// Gathers the given patches from every rank onto the root rank. The
+    /// patches are in host memory, with the interleaved layout, and the
+    /// `spaces` are the index spaces of all the patches and their owners,
+    /// as returned by `all_gather_spaces`. Returns all of the patches in
+    /// that order on the root, and an empty vector on the other ranks.
+    pub fn gather_patches(&self, local: Vec<Patch>, spaces: &[(IndexSpace, usize)]) -> Vec<Patch> {
+        if !self.is_distributed() {
+            return local;
+        }
+        if !self.is_root() {
+            let requests = local
+                .iter()
+                .map(|patch| {
+                    let data = patch.as_slice().unwrap();
+                    unsafe { self.isend(data.as_ptr(), data.len(), 0, PATCH_TAG) }
+                })
+                .collect();
+            self.wait_all(requests);
+            return vec![];
+        }
+        let num_fields = local[0].num_fields();
+        let mut local = local.into_iter();
+        let mut requests = vec![];
+
+        let mut patches: Vec<_> = spaces
+            .iter()
+            .map(|(space, rank)| match rank {
+                0 => local.next().unwrap(),
+                _ => Patch::zeros(num_fields, space),
+            })
+            .collect();
+
+        for (patch, (_, rank)) in patches.iter_mut().zip(spaces) {
+            if *rank != 0 {
+                let count = patch.index_space().len() * num_fields;
+                requests.push(unsafe { self.irecv(patch.as_mut_ptr(), count, *rank, PATCH_TAG) });
+            }
+        }
+        self.wait_all(requests);
+        patches
+    }
+
+    /// Gathers buffers of bytes from every rank onto the root rank. The
+    /// `sizes` are the length of every buffer on any rank and the rank which
+    /// has it, in a global order, and the `local` buffers are this rank's
+    /// ones, in that order. Returns all of the buffers in that order on the
+    /// root, and an empty vector on the other ranks.
+    pub fn gather_bytes(&self, local: Vec<Vec<u8>>, sizes: &[(usize, usize)]) -> Vec<Vec<u8>> {
+        if !self.is_distributed() {
+            return local;
+        }
+        if !self.is_root() {
+            let requests = local
+                .iter()
+                .map(|data| unsafe { self.isend_bytes(data.as_ptr(), data.len(), 0, PATCH_TAG) })
+                .collect();
+            self.wait_all(requests);
+            return vec![];
+        }
+        let mut local = local.into_iter();
+        let mut requests = vec![];
+
+        let mut buffers: Vec<_> = sizes
+            .iter()
+            .map(|&(size, rank)| match rank {
+                0 => local.next().unwrap(),
+                _ => vec![0; size],
+            })
+            .collect();
+
+        for (data, &(_, rank)) in buffers.iter_mut().zip(sizes) {
+            if rank != 0 {
+                requests.push(unsafe {
+                    self.irecv_bytes(data.as_mut_ptr(), data.len(), rank, PATCH_TAG)
+                });
+            }
+        }
+        self.wait_all(requests);
+        buffers
+    }
+
+    /// Moves patches between ranks. The `spaces` are the index spaces of all
+    /// the patches and their current owners, and `owners` are the new owner
+    /// of each one. The `local` patches are this rank's current ones, in the
+    /// order of `spaces`. Returns this rank's patches under the new owners,
+    /// in the same order. The patches are in host memory.
+    pub fn redistribute(
+        &self,
+        local: Vec<Patch>,
+        spaces: &[(IndexSpace, usize)],
+        owners: &[usize],
+    ) -> Vec<Patch> {
+        if !self.is_distributed() {
+            return local;
+        }
+        let num_fields = local[0].num_fields();
+        let mut local = local.into_iter();
+        let mut patches = vec![];
+        let mut sent = vec![];
+        let mut requests = vec![];
+
+        // Moving a patch does not move its data, so the buffers stay valid
+        // while the requests are pending.
+        for ((space, old), &new) in spaces.iter().zip(owners) {
+            if *old == self.rank && new == self.rank {
+                patches.push(local.next().unwrap())
+            } else if *old == self.rank {
+                let patch = local.next().unwrap();
+                let data = patch.as_slice().unwrap();
+                requests.push(unsafe { self.isend(data.as_ptr(), data.len(), new, PATCH_TAG) });
+                sent.push(patch)
+            } else if new == self.rank {
+                let mut patch = Patch::zeros(num_fields, space);
+                let count = space.len() * num_fields;
+                requests.push(unsafe { self.irecv(patch.as_mut_ptr(), count, *old, PATCH_TAG) });
+                patches.push(patch)
+            }
+        }
+        self.wait_all(requests);
+        patches
+    }
+}
@@ -0,0 +1,167 @@
+//! Helper functions for NUMA-aware placement of threads and memory.
+//!
+//! The topology is read from Linux sysfs. On other platforms, or if sysfs is
+//! unavailable, the machine is treated as a single node containing all of
+//! the available cores. Memory placement relies on the operating system's
+//! default first-touch policy: a page is placed on the node of the thread
+//! that first writes to it.
+
+use std::fs::read_to_string;
+use std::ops::Range;
+
+const NODE_DIR: &str = "/sys/devices/system/node";
+
+/// The NUMA nodes of the machine, and the CPUs belonging to each of them.
+#[derive(Clone, Debug)]
+pub struct Topology {
+    nodes: Vec<(usize, Vec<usize>)>,
+}
+
+impl Topology {
+    /// Reads the NUMA topology from sysfs. Nodes without CPUs (e.g. memory
+    /// expansion devices) are ignored.
+    pub fn discover() -> Self {
+        let mut nodes: Vec<_> = std::fs::read_dir(NODE_DIR)
+            .into_iter()
+            .flatten()
+            .filter_map(Result::ok)
+            .filter_map(|entry| {
+                let name = entry.file_name().into_string().ok()?;
+                let id: usize = name.strip_prefix("node")?.parse().ok()?;
+                let cpus = parse_cpu_list(&read_to_string(entry.path().join("cpulist")).ok()?);
+                Some((id, cpus)).filter(|(_, cpus)| !cpus.is_empty())
+            })
+            .collect();
+
+        if nodes.is_empty() {
+            let num_cpus = std::thread::available_parallelism().map_or(1, usize::from);
+            nodes.push((0, (0..num_cpus).collect()))
+        }
+        nodes.sort();
+        Self { nodes }
+    }
+
+    /// Returns the number of NUMA nodes.
+    pub fn num_nodes(&self) -> usize {
+        self.nodes.len()
+    }
+
+    /// Returns the CPUs belonging to the node at the given index.
+    pub fn cpus(&self, node: usize) -> &[usize] {
+        &self.nodes[node].1
+    }
+
+    /// Returns the node index that the given worker of a pool is assigned
+    /// to. Workers are assigned to nodes in contiguous blocks.
+    pub fn node_of_worker(&self, worker: usize, num_workers: usize) -> usize {
+        worker * self.num_nodes() / num_workers.max(1)
+    }
+
+    /// Splits a sequence of items (e.g. grid patches) into contiguous
+    /// ranges, one per node, with nearly equal total cost.
+    pub fn partition(&self, costs: &[f64]) -> Vec<Range<usize>> {
+        crate::balance::partition(costs, self.num_nodes())
+    }
+
+    /// Returns the number of bytes of memory used and free on each node, if
+    /// those are available.
+    pub fn memory_usage(&self) -> Vec<Option<(u64, u64)>> {
+        self.nodes
+            .iter()
+            .map(|(id, _)| {
+                let meminfo = read_to_string(format!("{}/node{}/meminfo", NODE_DIR, id)).ok()?;
+                let field = |key: &str| -> Option<u64> {
+                    let line = meminfo.lines().find(|l| l.contains(key))?;
+                    let kb: u64 = line.split_whitespace().rev().nth(1)?.parse().ok()?;
+                    Some(kb * 1024)
+                };
+                Some((field("MemUsed:")?, field("MemFree:")?))
+            })
+            .collect()
+    }
+
+    /// Prints, for each node, its CPU count, the number of patches assigned
+    /// to it (`blocks`, as returned by `partition`), and the change in its
+    /// used memory since the `before` sample was taken.
+    pub fn print_memory_report(&self, before: &[Option<(u64, u64)>], blocks: &[Range<usize>]) {
+        let after = self.memory_usage();
+
+        for (k, range) in blocks.iter().enumerate() {
+            let mb = |bytes: u64| bytes as f64 / 1e6;
+            let usage = match (before[k], after[k]) {
+                (Some((used0, _)), Some((used1, free))) => format!(
+                    "{:.1} MB placed, {:.1} MB free",
+                    mb(used1.saturating_sub(used0)),
+                    mb(free)
+                ),
+                _ => "memory usage unavailable".to_string(),
+            };
+            println!(
+                "numa node {}: {} cpus, {} patches, {}",
+                self.nodes[k].0,
+                self.cpus(k).len(),
+                range.len(),
+                usage
+            );
+        }
+    }
+}
+
+/// Restricts the calling thread to run on the given CPUs. Returns `false` if
+/// the affinity could not be set, which is always the case on non-Linux
+/// platforms.
+pub fn pin_current_thread(cpus: &[usize]) -> bool {
+    cfg_if::cfg_if! {
+        if #[cfg(target_os = "linux")] {
+            extern "C" {
+                fn sched_setaffinity(pid: i32, cpusetsize: usize, mask: *const u64) -> i32;
+            }
+            const MAX_CPUS: usize = 1024;
+            let mut mask = [0u64; MAX_CPUS / 64];
+
+            for &cpu in cpus.iter().filter(|&&cpu| cpu < MAX_CPUS) {
+                mask[cpu / 64] |= 1 << (cpu % 64)
+            }
+            unsafe { sched_setaffinity(0, std::mem::size_of_val(&mask), mask.as_ptr()) == 0 }
+        } else {
+            std::convert::identity(cpus); // black-box
+            false
+        }
+    }
+}
+
+/// Parses a Linux CPU list string, such as `0-3,8,10-11`.
+fn parse_cpu_list(string: &str) -> Vec<usize> {
+    string
+        .trim()
+        .split(',')
+        .filter(|s| !s.is_empty())
+        .filter_map(|s| match crate::parse::split_pair(s, '-') {
+            (Some(a), Some(b)) => Some(a.parse().ok()?..=b.parse().ok()?),
+            (Some(a), None) => Some(a.parse().ok()?..=a.parse().ok()?),
+            _ => None,
+        })
+        .flatten()
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn cpu_list_is_parsed_correctly() {
+        assert_eq!(parse_cpu_list("0-3,8,10-11\n"), vec![0, 1, 2, 3, 8, 10, 11]);
+        assert_eq!(parse_cpu_list(""), Vec::<usize>::new());
+    }
+
+    #[test]
+    fn partition_covers_all_items() {
+        let topology = Topology {
+            nodes: vec![(0, vec![0]), (1, vec![1]), (2, vec![2])],
+        };
+        let ranges = topology.partition(&[1.0; 10]);
+        assert_eq!(ranges.iter().map(Range::len).sum::<usize>(), 10);
+        assert_eq!(ranges.last().unwrap().end, 10);
+    }
+}
@@ -1,3 +1,4 @@
+use crate::FieldLayout;
 use cfg_if::cfg_if;
 use gpu_core::{Buffer, Device};
 use gridiron::index_space::IndexSpace;
@@ -19,11 +20,20 @@ mod serde_buffer {
             formatter.write_str("a buffer of bytes")
         }
         fn visit_bytes<E>(self, v: &[u8]) -> Result<Self::Value, E> {
-            let data = v
-                .chunks_exact(8)
-                .map(|c| [c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7]])
-                .map(f64::from_le_bytes)
-                .collect();
+            let mut data = vec![0.0; v.len() / size_of::<f64>()];
+
+            if cfg!(target_endian = "little") {
+                // The bytes are already little-endian doubles, so they are
+                // copied in one go rather than converted one at a time.
+                let bytes = data.len() * size_of::<f64>();
+                unsafe {
+                    std::ptr::copy_nonoverlapping(v.as_ptr(), data.as_mut_ptr() as *mut u8, bytes)
+                }
+            } else {
+                for (x, c) in data.iter_mut().zip(v.chunks_exact(8)) {
+                    *x = f64::from_le_bytes([c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7]])
+                }
+            }
             Ok(Host(data))
         }
     }
@@ -65,6 +75,10 @@ pub struct Patch {
     /// The number of fields stored at each zone.
     num_fields: usize,
 
+    /// Whether the fields are interleaved or stored in separate planes.
+    #[serde(default)]
+    layout: FieldLayout,
+
     /// The backing array of data on this patch.
     #[serde(with = "serde_buffer")]
     data: Buffer<f64>,
@@ -72,11 +86,17 @@ pub struct Patch {
 
 impl Patch {
     /// Generates a patch in host memory of zeros over the given index space.
+    /// The zeros are written explicitly, rather than obtained from zeroed
+    /// pages, so that under a first-touch policy the memory is placed on the
+    /// NUMA node of the calling thread.
     pub fn zeros(num_fields: usize, space: &IndexSpace) -> Self {
+        let mut data = Vec::with_capacity(space.len() * num_fields);
+        data.resize(space.len() * num_fields, 0.0);
         Self {
             rect: space.into(),
             num_fields,
-            data: Host(vec![0.0; space.len() * num_fields]),
+            layout: FieldLayout::Interleaved,
+            data: Host(data),
         }
     }
 
@@ -114,6 +134,28 @@ impl Patch {
         Self {
             rect: space.into(),
             num_fields,
+            layout: FieldLayout::Interleaved,
+            data: Host(data),
+        }
+    }
+
+    /// Generates a patch in host memory covering the given space, from data
+    /// arranged in the given layout.
+    pub fn from_vec(
+        space: &IndexSpace,
+        num_fields: usize,
+        layout: FieldLayout,
+        data: Vec<f64>,
+    ) -> Self {
+        assert_eq!(
+            data.len(),
+            space.len() * num_fields,
+            "the data does not fit the index space"
+        );
+        Self {
+            rect: space.into(),
+            num_fields,
+            layout,
             data: Host(data),
         }
     }
@@ -128,6 +170,21 @@ impl Patch {
         self.rect.clone()
     }
 
+    /// Returns the number of fields stored at each zone.
+    pub fn num_fields(&self) -> usize {
+        self.num_fields
+    }
+
+    /// Returns the size of the patch data in bytes.
+    pub fn num_bytes(&self) -> usize {
+        self.index_space().len() * self.num_fields * std::mem::size_of::<f64>()
+    }
+
+    /// Returns the memory layout of the fields in this patch.
+    pub fn layout(&self) -> FieldLayout {
+        self.layout
+    }
+
     /// Returns the device where the data buffer lives, if it's a device
     /// buffer, and `None` otherwise.
     pub fn device(&self) -> Option<Device> {
@@ -170,6 +227,7 @@ impl Patch {
                 Self {
                     rect: self.rect.clone(),
                     num_fields: self.num_fields,
+                    layout: self.layout,
                     data: self.data.to_device(device),
                 }
             } else {
@@ -189,6 +247,7 @@ impl Patch {
                 Self {
                     rect: self.rect.clone(),
                     num_fields: self.num_fields,
+                    layout: self.layout,
                     data: self.data.into_device(device),
                 }
             } else {
@@ -206,6 +265,7 @@ impl Patch {
                 Self {
                     rect: self.rect.clone(),
                     num_fields: self.num_fields,
+                    layout: self.layout,
                     data: self.data.to_host(),
                 }
             } else {
@@ -223,6 +283,7 @@ impl Patch {
                 Self {
                     rect: self.rect.clone(),
                     num_fields: self.num_fields,
+                    layout: self.layout,
                     data: self.data.into_host(),
                 }
             } else {
@@ -242,6 +303,56 @@ impl Patch {
         }
     }
 
+    /// Makes a deep copy of this patch with its fields arranged in the given
+    /// layout. The result resides on the same device as this patch, but the
+    /// transposition is done on the CPU, so for device patches this involves
+    /// a D -> H -> D round trip.
+    pub fn to_layout(&self, layout: FieldLayout) -> Self {
+        match &self.data {
+            Host(ref data) => {
+                let nq = self.num_fields;
+                let nz = self.index_space().len();
+                let mut result = vec![0.0; data.len()];
+
+                match (self.layout, layout) {
+                    (FieldLayout::Interleaved, FieldLayout::Planar) => {
+                        for (n, zone) in data.chunks_exact(nq).enumerate() {
+                            for (q, x) in zone.iter().enumerate() {
+                                result[q * nz + n] = *x
+                            }
+                        }
+                    }
+                    (FieldLayout::Planar, FieldLayout::Interleaved) => {
+                        for (q, plane) in data.chunks_exact(nz).enumerate() {
+                            for (n, x) in plane.iter().enumerate() {
+                                result[n * nq + q] = *x
+                            }
+                        }
+                    }
+                    _ => result.copy_from_slice(data),
+                }
+                Self {
+                    rect: self.rect.clone(),
+                    num_fields: nq,
+                    layout,
+                    data: Host(result),
+                }
+            }
+            #[cfg(feature = "gpu")]
+            Device(ref data) => self.to_host().to_layout(layout).to_device(data.device()),
+        }
+    }
+
+    /// Ensures the fields of this patch are arranged in the given layout,
+    /// transposing them if necessary.
+    pub fn into_layout(self, layout: FieldLayout) -> Self {
+        if self.layout == layout {
+            self
+        } else {
+            self.to_layout(layout)
+        }
+    }
+
     /// Extracts a subset of this patch and returns it, with memory residing
     /// in the same location as this buffer. This method panics if the given
     /// space is not fully contained within this patch.
@@ -253,7 +364,12 @@ impl Patch {
 
         match &self.data {
             Host(_) => {
-                let mut result = Patch::zeros(self.num_fields, dst_space);
+                let mut result = Self {
+                    rect: dst_space.into(),
+                    num_fields: self.num_fields,
+                    layout: self.layout,
+                    data: Host(vec![0.0; dst_space.len() * self.num_fields]),
+                };
                 self.copy_into(&mut result);
                 result
             }
@@ -263,6 +379,7 @@ impl Patch {
                 let mut result = Self {
                     rect: dst_space.into(),
                     num_fields: self.num_fields,
+                    layout: self.layout,
                     data: Device(unsafe {
                         src_data
                             .device()
@@ -280,8 +397,9 @@ impl Patch {
     /// index space. Only the elements at the overlapping part of the index
     /// spaces are copied; the non-overlapping part of the target patch is
     /// unchanged. Memory will be migrated from host to device, device to
-    /// host, or between devices as needed. This method panics if the source
-    /// and destination index spaces do not overlap.
+    /// host, or between devices as needed, and the fields are transposed if
+    /// the two patches have different layouts. This method panics if the
+    /// source and destination index spaces do not overlap.
     pub fn copy_into(&self, target: &mut Self) {
         assert!(self.num_fields == target.num_fields);
 
@@ -293,28 +411,60 @@ impl Patch {
         let dst_reg = overlap.memory_region_in(&target.index_space());
         let nq = self.num_fields;
 
+        if self.layout != target.layout {
+            return self
+                .extract(&overlap)
+                .into_layout(target.layout)
+                .copy_into(target);
+        }
         if self.device() != target.device() {
             return self.extract(&overlap).on(target.device()).copy_into(target);
         }
 
         match (&self.data, &mut target.data) {
-            (Host(ref src), Host(ref mut dst)) => src_reg
-                .iter_slice(src, nq)
-                .zip(dst_reg.iter_slice_mut(dst, nq))
-                .for_each(|(s, d)| d.copy_from_slice(s)),
+            (Host(ref src), Host(ref mut dst)) => match self.layout {
+                FieldLayout::Interleaved => src_reg
+                    .iter_slice(src, nq)
+                    .zip(dst_reg.iter_slice_mut(dst, nq))
+                    .for_each(|(s, d)| d.copy_from_slice(s)),
+                FieldLayout::Planar => {
+                    let src_planes = src.chunks_exact(src_reg.shape.0 * src_reg.shape.1);
+                    let dst_planes = dst.chunks_exact_mut(dst_reg.shape.0 * dst_reg.shape.1);
+                    for (src_plane, dst_plane) in src_planes.zip(dst_planes) {
+                        src_reg
+                            .iter_slice(src_plane, 1)
+                            .zip(dst_reg.iter_slice_mut(dst_plane, 1))
+                            .for_each(|(s, d)| d.copy_from_slice(s))
+                    }
+                }
+            },
 
             #[cfg(feature = "gpu")]
             (Device(ref src), Device(ref mut dst)) => {
-                let dst_start = [dst_reg.start.0, dst_reg.start.1, 0];
-                let dst_shape = [dst_reg.shape.0, dst_reg.shape.1, 1];
-                let dst_count = [dst_reg.count.0, dst_reg.count.1, 1];
-                let src_start = [src_reg.start.0, src_reg.start.1, 0];
-                let src_shape = [src_reg.shape.0, src_reg.shape.1, 1];
-                let src_count = [src_reg.count.0, src_reg.count.1, 1];
-                assert_eq!(src_count, dst_count);
+                // Planar data is copied as a 3D array with the field index
+                // as the slowest axis.
+                let (dst_start, dst_shape, src_start, src_shape, count, elems) = match self.layout {
+                    FieldLayout::Interleaved => (
+                        [dst_reg.start.0, dst_reg.start.1, 0],
+                        [dst_reg.shape.0, dst_reg.shape.1, 1],
+                        [src_reg.start.0, src_reg.start.1, 0],
+                        [src_reg.shape.0, src_reg.shape.1, 1],
+                        [src_reg.count.0, src_reg.count.1, 1],
+                        nq,
+                    ),
+                    FieldLayout::Planar => (
+                        [0, dst_reg.start.0, dst_reg.start.1],
+                        [nq, dst_reg.shape.0, dst_reg.shape.1],
+                        [0, src_reg.start.0, src_reg.start.1],
+                        [nq, src_reg.shape.0, src_reg.shape.1],
+                        [nq, src_reg.count.0, src_reg.count.1],
+                        1,
+                    ),
+                };
+                assert_eq!(src_reg.count, dst_reg.count);
 
                 dst.memcpy_3d(
-                    dst_start, dst_shape, src, src_start, src_shape, src_count, nq,
+                    dst_start, dst_shape, src, src_start, src_shape, count, elems,
                 )
             }
 
@@ -323,6 +473,58 @@ impl Patch {
         }
     }
 
+    /// Copies the elements in `subset` out of a raw host buffer spanning
+    /// `src_space`, which has the same number of fields and layout as this
+    /// patch, into this patch. The source is read one contiguous row segment
+    /// at a time, and nothing outside of `subset` is accessed, so other
+    /// parts of the source buffer may be written to concurrently. This
+    /// method panics if `subset` is not contained in both index spaces, or
+    /// if this patch is not in host memory.
+    ///
+    /// # Safety
+    ///
+    /// `src` must point to at least `src_space.len() * num_fields` valid
+    /// elements, and the elements in `subset` must not be modified while this
+    /// function runs.
+    pub unsafe fn copy_from_raw(
+        &mut self,
+        src: *const f64,
+        src_space: &IndexSpace,
+        subset: &IndexSpace,
+    ) {
+        assert! {
+            src_space.contains_space(subset) && self.index_space().contains_space(subset),
+            "the index space is out of bounds"
+        }
+        let src_reg = subset.memory_region_in(src_space);
+        let dst_reg = subset.memory_region_in(&self.index_space());
+        let (nq, layout) = (self.num_fields, self.layout);
+
+        let dst = match self.data {
+            Host(ref mut data) => data,
+            #[cfg(feature = "gpu")]
+            Device(_) => panic!("Patch::copy_from_raw requires a host patch"),
+        };
+        let (planes, nf, src_plane, dst_plane) = match layout {
+            FieldLayout::Interleaved => (1, nq, 0, 0),
+            FieldLayout::Planar => (
+                nq,
+                1,
+                src_reg.shape.0 * src_reg.shape.1,
+                dst_reg.shape.0 * dst_reg.shape.1,
+            ),
+        };
+        let len = src_reg.count.1 * nf;
+
+        for q in 0..planes {
+            for r in 0..src_reg.count.0 {
+                let s = q * src_plane + ((src_reg.start.0 + r) * src_reg.shape.1 + src_reg.start.1) * nf;
+                let d = q * dst_plane + ((dst_reg.start.0 + r) * dst_reg.shape.1 + dst_reg.start.1) * nf;
+                dst[d..d + len].copy_from_slice(std::slice::from_raw_parts(src.add(s), len))
+            }
+        }
+    }
+
     pub fn map_mut<F>(&mut self, subset: &IndexSpace, f: F)
     where
         F: Fn((i64, i64), &mut [f64]),
@@ -338,6 +540,10 @@ impl Patch {
     /// function bears the penalty of the dreaded D -> H -> D round trip.
     pub fn upsample(&self) -> Self {
         match &self.data {
+            Host(_) if self.layout == FieldLayout::Planar => self
+                .to_layout(FieldLayout::Interleaved)
+                .upsample()
+                .into_layout(FieldLayout::Planar),
             Host(ref data) => {
                 let (_i, nj) = self.index_space().dim();
                 let (i0, j0) = self.index_space().start();
@@ -394,6 +600,62 @@ mod tests {
         fill_guard_regions_impl(Device::with_id(0))
     }
 
+    #[test]
+    fn copy_patch_subset_between_layouts_on_host() {
+        copy_patch_subset_between_layouts_impl(None)
+    }
+
+    #[test]
+    fn copy_patch_subset_between_layouts_on_device() {
+        copy_patch_subset_between_layouts_impl(Device::with_id(0))
+    }
+
+    fn copy_patch_subset_between_layouts_impl(device: Option<Device>) {
+        let src_space = range2d(0..12, 0..20);
+        let dst_space = range2d(4..30, 8..16);
+        let src = Patch::from_vector_function(&src_space, |(i, j)| [i as f64, j as f64, 1.0]);
+        let mut dst = Patch::zeros(3, &dst_space)
+            .into_layout(FieldLayout::Planar)
+            .on(device);
+        src.copy_into(&mut dst);
+
+        let overlap = src_space.intersect(&dst_space).unwrap();
+        let planar = dst.extract(&overlap);
+        assert_eq!(planar.layout(), FieldLayout::Planar);
+        assert_eq!(
+            src.extract(&overlap).as_slice(),
+            planar
+                .into_host()
+                .into_layout(FieldLayout::Interleaved)
+                .as_slice()
+        );
+    }
+
+    #[test]
+    fn copy_patch_subset_from_raw_buffer() {
+        for layout in [FieldLayout::Interleaved, FieldLayout::Planar] {
+            let src_space = range2d(0..12, 0..20);
+            let dst_space = range2d(8..16, 4..30);
+            let subset = range2d(8..12, 4..20);
+            let src = Patch::from_vector_function(&src_space, |(i, j)| [i as f64, j as f64, 1.0])
+                .into_layout(layout);
+            let mut dst = Patch::zeros(3, &dst_space).into_layout(layout);
+            unsafe { dst.copy_from_raw(src.as_ptr(), &src_space, &subset) };
+            assert_eq!(src.extract(&subset).as_slice(), dst.extract(&subset).as_slice());
+        }
+    }
+
+    #[test]
+    fn deserialize_buffer_from_bytes() {
+        use serde::de::value::{BytesDeserializer, Error};
+        let values = [1.5, -2.0, 1e-300, f64::MAX];
+        let bytes: Vec<_> = values.iter().flat_map(|x| x.to_le_bytes()).collect();
+        let buffer = |b| serde_buffer::deserialize(BytesDeserializer::<Error>::new(b)).unwrap();
+
+        assert_eq!(buffer(&bytes).as_slice(), Some(&values[..]));
+        assert_eq!(buffer(&bytes[1..]).as_slice().map(<[f64]>::len), Some(3));
+    }
+
     fn fill_guard_regions_impl(device: Option<Device>) {
         let setup = |(i, j)| [i as f64, j as f64, 0.0];
 
@@ -0,0 +1,541 @@
+//! Output products: reduced-precision snapshots of the primitive variables,
+//! for plots and movies rather than restarts.
+//!
+//! Products are written on their own cadence, usually much more often than
+//! checkpoints. The fields may be averaged onto a mesh coarser by a factor
+//! of 2 or 4 on each axis, and are stored either as 32-bit floats, or
+//! quantized to 16 bits. A product file holds the fields of the whole mesh:
+//!
+//! | offset     | size   | contents                                         |
+//! |------------|--------|--------------------------------------------------|
+//! | 0          | 8      | the magic bytes `SFPROD01`                       |
+//! | 8          | 8      | the length `H` of the header                     |
+//! | 16         | H      | the header: a msgpack-encoded `Header`           |
+//! | ≥ 16 + H   | ...    | the data, starting at a multiple of 64 bytes     |
+//!
+//! The data is one array per field, with the zones of the header's mesh in
+//! row-major order, little-endian. In the `u16` format, a value `x` of field
+//! `q` is stored as the integer nearest to `(x - offset[q]) / step[q]`, where
+//! the offset and step are in the header, so the error is at most half the
+//! step, which is 1/131070 of the range of the field.
+//!
+//! With more than one rank, each rank averages and encodes its own patches,
+//! and only the encoded data is gathered onto the root rank, which writes
+//! the file (see `Product::gather`).
+
+use crate::checkpoint::{field_values, on_host};
+use crate::error::Error;
+use crate::mpi::Communicator;
+use crate::state::State;
+use crate::{FieldLayout, IndexSpace, Patch, StructuredMesh};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{BufWriter, ErrorKind, Write};
+
+/// The first bytes of a product file.
+const MAGIC: &[u8; 8] = b"SFPROD01";
+
+/// The alignment in bytes of the data in a product file.
+const DATA_ALIGN: usize = 64;
+
+/// How the values in a product are stored.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum Format {
+    /// 32-bit floats.
+    F32,
+    /// 16-bit integers, spanning the range of each field.
+    U16,
+}
+
+impl Format {
+    fn name(self) -> &'static str {
+        match self {
+            Format::F32 => "f32",
+            Format::U16 => "u16",
+        }
+    }
+}
+
+/// The header of a product file.
+#[derive(Clone, Debug, serde::Serialize, serde::Deserialize)]
+pub struct Header {
+    pub setup_name: String,
+    pub parameters: String,
+    pub version: String,
+    pub time: f64,
+    pub iteration: u64,
+    /// The mesh the fields are on, which is coarser than the simulation
+    /// mesh by the downsampling factor.
+    pub mesh: StructuredMesh,
+    pub downsample: u32,
+    pub num_fields: usize,
+    pub format: String,
+    /// For the `u16` format, the value of 0 and the value of a unit step in
+    /// each field.
+    pub offset: Vec<f64>,
+    pub step: Vec<f64>,
+}
+
+/// A product, encoded and ready to be written to a file.
+pub struct Product {
+    header: Header,
+    data: Vec<u8>,
+}
+
+impl Product {
+    /// Makes a product of the given grid patches, which cover the whole
+    /// mesh. Each zone of the product is the average of the `downsample` ×
+    /// `downsample` zones of the mesh it covers.
+    pub fn new(
+        state: &State,
+        mesh: &StructuredMesh,
+        patches: &[Patch],
+        format: Format,
+        downsample: u32,
+    ) -> Result<Self, Error> {
+        let coarse = coarse_mesh(mesh, downsample)?;
+        let num_fields = patches.first().map_or(0, Patch::num_fields);
+        let nz = (coarse.ni * coarse.nj) as usize;
+        let mut values = vec![0.0; num_fields * nz];
+
+        for patch in patches {
+            add_into(&self::downsample(patch, downsample), &coarse, &mut values);
+        }
+        let mut ranges = vec![EMPTY_RANGE; num_fields];
+
+        for (q, plane) in values.chunks_exact(nz).enumerate() {
+            widen(&mut ranges[q], plane)
+        }
+        let encoding = Encoding::new(format, &ranges);
+        let mut data = vec![0; values.len() * encoding.size()];
+
+        for (q, bytes) in data.chunks_exact_mut(nz * encoding.size()).enumerate() {
+            encoding.encode(q, &values[q * nz..(q + 1) * nz], bytes)
+        }
+        Ok(Self::from_parts(
+            state, coarse, downsample, num_fields, encoding, data,
+        ))
+    }
+
+    /// Makes a product of the patches on all ranks, on the root rank, and
+    /// returns `None` on the other ranks. The `patches` are this rank's, in
+    /// any order, and the `spaces` are the index spaces of all the patches
+    /// and their owners, as returned by `Communicator::all_gather_spaces`.
+    ///
+    /// Each rank averages its own patches onto the product mesh. A patch
+    /// whose edges fall between zones of the product covers its product
+    /// zones alone, and it is also encoded locally, so only the encoded data
+    /// is gathered. The partial averages of the other patches are gathered
+    /// and summed on the root, before the rest are encoded, because the
+    /// `u16` format needs the range of the completed zones.
+    pub fn gather(
+        state: &State,
+        mesh: &StructuredMesh,
+        patches: &[Patch],
+        spaces: &[(IndexSpace, usize)],
+        comm: &Communicator,
+        format: Format,
+        downsample: u32,
+    ) -> Result<Option<Self>, Error> {
+        let f = downsample as i64;
+        let coarse = coarse_mesh(mesh, downsample)?;
+        let num_fields = comm.all_max(patches.first().map_or(0, Patch::num_fields) as f64) as usize;
+        let nz = (coarse.ni * coarse.nj) as usize;
+        let coarse_spaces = |aligned| {
+            spaces
+                .iter()
+                .filter(move |(space, _)| is_aligned(space, f) == aligned)
+                .map(move |(space, rank)| (coarse_space(space, f), *rank))
+        };
+        let by_rect: HashMap<_, _> = patches.iter().map(|patch| (patch.rect(), patch)).collect();
+        let (aligned, straddling): (Vec<_>, Vec<_>) = spaces
+            .iter()
+            .filter(|(_, rank)| *rank == comm.rank())
+            .map(|(space, _)| by_rect[&space.to_rect()])
+            .partition(|patch| is_aligned(&patch.index_space(), f));
+
+        let sizes: Vec<_> = coarse_spaces(false)
+            .map(|(space, rank)| (space.len() * num_fields * 8, rank))
+            .collect();
+        let local = straddling
+            .iter()
+            .map(|patch| {
+                let partial = self::downsample(patch, downsample);
+                partial
+                    .as_slice()
+                    .unwrap()
+                    .iter()
+                    .flat_map(|x| x.to_le_bytes())
+                    .collect()
+            })
+            .collect();
+        let partials = comm.gather_bytes(local, &sizes);
+        let root_zones = if comm.is_root() { nz } else { 0 };
+        let mut values = vec![0.0; num_fields * root_zones];
+        let mut shared = vec![false; root_zones];
+
+        for (bytes, (space, _)) in partials.iter().zip(coarse_spaces(false)) {
+            let data = bytes
+                .chunks_exact(8)
+                .map(|b| f64::from_le_bytes(b.try_into().unwrap()));
+            let partial = Patch::from_vec(&space, num_fields, FieldLayout::Planar, data.collect());
+            add_into(&partial, &coarse, &mut values);
+
+            for (i, j) in space.iter() {
+                shared[(i * coarse.nj + j) as usize] = true
+            }
+        }
+        let aligned: Vec<_> = aligned
+            .iter()
+            .map(|patch| self::downsample(patch, downsample))
+            .collect();
+        let mut ranges = vec![EMPTY_RANGE; num_fields];
+
+        for (q, plane) in values.chunks_exact(nz).enumerate() {
+            let zones: Vec<_> = plane
+                .iter()
+                .zip(&shared)
+                .filter(|(_, s)| **s)
+                .map(|(x, _)| *x)
+                .collect();
+            widen(&mut ranges[q], &zones)
+        }
+        for partial in &aligned {
+            for (q, plane) in planes(partial).enumerate() {
+                widen(&mut ranges[q], plane)
+            }
+        }
+        for range in &mut ranges {
+            *range = (-comm.all_max(-range.0), comm.all_max(range.1))
+        }
+        let encoding = Encoding::new(format, &ranges);
+        let size = encoding.size();
+
+        let sizes: Vec<_> = coarse_spaces(true)
+            .map(|(space, rank)| (space.len() * num_fields * size, rank))
+            .collect();
+        let local = aligned
+            .iter()
+            .map(|partial| {
+                let nz = partial.index_space().len();
+                let mut bytes = vec![0; nz * num_fields * size];
+
+                for (q, (plane, b)) in planes(partial)
+                    .zip(bytes.chunks_exact_mut(nz * size))
+                    .enumerate()
+                {
+                    encoding.encode(q, plane, b)
+                }
+                bytes
+            })
+            .collect();
+        let encoded = comm.gather_bytes(local, &sizes);
+
+        if !comm.is_root() {
+            return Ok(None);
+        }
+        let mut data = vec![0; num_fields * nz * size];
+
+        for (q, plane) in values.chunks_exact(nz).enumerate() {
+            for (n, x) in plane.iter().enumerate().filter(|(n, _)| shared[*n]) {
+                let k = (q * nz + n) * size;
+                encoding.encode(q, std::slice::from_ref(x), &mut data[k..k + size])
+            }
+        }
+        for (bytes, (space, _)) in encoded.iter().zip(coarse_spaces(true)) {
+            let (di, dj) = space.to_rect();
+            let row = (dj.end - dj.start) as usize * size;
+            let mut rows = bytes.chunks_exact(row);
+
+            for q in 0..num_fields {
+                for i in di.clone() {
+                    let k = (q * nz + (i * coarse.nj + dj.start) as usize) * size;
+                    data[k..k + row].copy_from_slice(rows.next().unwrap())
+                }
+            }
+        }
+        Ok(Some(Self::from_parts(
+            state, coarse, downsample, num_fields, encoding, data,
+        )))
+    }
+
+    fn from_parts(
+        state: &State,
+        mesh: StructuredMesh,
+        downsample: u32,
+        num_fields: usize,
+        encoding: Encoding,
+        data: Vec<u8>,
+    ) -> Self {
+        let header = Header {
+            setup_name: state.setup_name.clone(),
+            parameters: state.parameters.clone(),
+            version: state.version.clone(),
+            time: state.time,
+            iteration: state.iteration,
+            mesh,
+            downsample,
+            num_fields,
+            format: encoding.format.name().to_string(),
+            offset: encoding.offset,
+            step: encoding.step,
+        };
+        Self { header, data }
+    }
+
+    /// Returns the product's header.
+    pub fn header(&self) -> &Header {
+        &self.header
+    }
+
+    /// Writes the product to a file.
+    pub fn write(&self, filename: &str) -> Result<(), Error> {
+        let header = rmp_serde::to_vec_named(&self.header)
+            .map_err(|e| Error::IOError(std::io::Error::new(ErrorKind::Other, e)))?;
+        let start = (16 + header.len() + DATA_ALIGN - 1) / DATA_ALIGN * DATA_ALIGN;
+        let file = File::create(filename).map_err(Error::IOError)?;
+        let mut writer = BufWriter::new(file);
+
+        writer.write_all(MAGIC).map_err(Error::IOError)?;
+        writer
+            .write_all(&(header.len() as u64).to_le_bytes())
+            .map_err(Error::IOError)?;
+        writer.write_all(&header).map_err(Error::IOError)?;
+        writer
+            .write_all(&vec![0; start - 16 - header.len()])
+            .map_err(Error::IOError)?;
+        writer.write_all(&self.data).map_err(Error::IOError)?;
+        writer.flush().map_err(Error::IOError)
+    }
+}
+
+/// The range of a field before any values have been seen.
+const EMPTY_RANGE: (f64, f64) = (f64::INFINITY, f64::NEG_INFINITY);
+
+/// How the values of each field are stored in a product.
+struct Encoding {
+    format: Format,
+    offset: Vec<f64>,
+    step: Vec<f64>,
+}
+
+impl Encoding {
+    /// Makes the encoding of fields whose values span the given ranges. In
+    /// the `u16` format, the 16-bit integers span the range of each field.
+    fn new(format: Format, ranges: &[(f64, f64)]) -> Self {
+        let (mut offset, mut step) = (vec![], vec![]);
+
+        if format == Format::U16 {
+            for &(min, max) in ranges {
+                offset.push(min);
+                step.push(if max > min {
+                    (max - min) / u16::MAX as f64
+                } else {
+                    1.0
+                });
+            }
+        }
+        Self {
+            format,
+            offset,
+            step,
+        }
+    }
+
+    /// Returns the number of bytes each value is stored in.
+    fn size(&self) -> usize {
+        match self.format {
+            Format::F32 => 4,
+            Format::U16 => 2,
+        }
+    }
+
+    /// Encodes values of field `q` into a buffer of `size()` bytes per value.
+    fn encode(&self, q: usize, values: &[f64], bytes: &mut [u8]) {
+        let bytes = bytes.chunks_exact_mut(self.size());
+
+        match self.format {
+            Format::F32 => {
+                for (x, b) in values.iter().zip(bytes) {
+                    b.copy_from_slice(&(*x as f32).to_le_bytes())
+                }
+            }
+            Format::U16 => {
+                let (min, unit) = (self.offset[q], self.step[q]);
+
+                for (x, b) in values.iter().zip(bytes) {
+                    let n = ((x - min) / unit).round().max(0.0).min(u16::MAX as f64);
+                    b.copy_from_slice(&(n as u16).to_le_bytes())
+                }
+            }
+        }
+    }
+}
+
+/// Returns the mesh of a product, which is coarser than the given mesh by
+/// the downsampling factor, or an error if the mesh cannot be downsampled.
+fn coarse_mesh(mesh: &StructuredMesh, downsample: u32) -> Result<StructuredMesh, Error> {
+    let f = downsample as i64;
+
+    if mesh.ni % f != 0 || mesh.nj % f != 0 {
+        return Err(Error::InvalidSetup(format!(
+            "the mesh ({}x{}) cannot be downsampled by {}",
+            mesh.ni, mesh.nj, downsample
+        )));
+    }
+    Ok(StructuredMesh {
+        ni: mesh.ni / f,
+        nj: mesh.nj / f,
+        dx: mesh.dx * f as f64,
+        dy: mesh.dy * f as f64,
+        ..*mesh
+    })
+}
+
+/// Returns the index space of the product zones which overlap the given
+/// space, when it is downsampled by a factor `f`.
+fn coarse_space(space: &IndexSpace, f: i64) -> IndexSpace {
+    let (di, dj) = space.to_rect();
+    IndexSpace::new(
+        di.start / f..(di.end + f - 1) / f,
+        dj.start / f..(dj.end + f - 1) / f,
+    )
+}
+
+/// Returns whether the edges of a space fall between the product zones,
+/// when it is downsampled by a factor `f`. The product zones it overlaps are
+/// then not overlapped by any other patch.
+fn is_aligned(space: &IndexSpace, f: i64) -> bool {
+    let (di, dj) = space.to_rect();
+    [di.start, di.end, dj.start, dj.end]
+        .iter()
+        .all(|n| n % f == 0)
+}
+
+/// Averages a patch onto the product mesh. The result covers the product
+/// zones the patch overlaps, in the planar layout, and each zone is the sum
+/// of the patch zones it covers, divided by the number of zones it covers in
+/// the mesh. A product zone which straddles patches is the sum of these
+/// partial averages.
+fn downsample(patch: &Patch, downsample: u32) -> Patch {
+    let f = downsample as i64;
+    let patch = on_host(patch);
+    let (di, dj) = patch.rect();
+    let space = coarse_space(&patch.index_space(), f);
+    let (ci, cj) = space.to_rect();
+    let nz = space.len();
+    let weight = 1.0 / (f * f) as f64;
+    let mut values = vec![0.0; patch.num_fields() * nz];
+
+    for (q, plane) in values.chunks_exact_mut(nz).enumerate() {
+        let field = field_values(&patch, q);
+        let mut zones = field.iter();
+
+        for i in di.clone() {
+            let row = ((i / f - ci.start) * (cj.end - cj.start)) as usize;
+            for j in dj.clone() {
+                plane[row + (j / f - cj.start) as usize] += weight * zones.next().unwrap();
+            }
+        }
+    }
+    Patch::from_vec(&space, patch.num_fields(), FieldLayout::Planar, values)
+}
+
+/// Returns the fields of a patch with the planar layout.
+fn planes(patch: &Patch) -> std::slice::ChunksExact<'_, f64> {
+    let nz = patch.index_space().len();
+    patch.as_slice().unwrap().chunks_exact(nz)
+}
+
+/// Adds the partial averages from `downsample` to the fields of the whole
+/// product mesh, which are stored one after another.
+fn add_into(partial: &Patch, mesh: &StructuredMesh, values: &mut [f64]) {
+    let nz = (mesh.ni * mesh.nj) as usize;
+    let (ci, cj) = partial.rect();
+
+    for (plane, source) in values.chunks_exact_mut(nz).zip(planes(partial)) {
+        let mut zones = source.iter();
+
+        for i in ci.clone() {
+            let row = (i * mesh.nj) as usize;
+            for j in cj.clone() {
+                plane[row + j as usize] += zones.next().unwrap();
+            }
+        }
+    }
+}
+
+/// Widens a range to include the given values.
+fn widen(range: &mut (f64, f64), values: &[f64]) {
+    range.0 = values.iter().cloned().fold(range.0, f64::min);
+    range.1 = values.iter().cloned().fold(range.1, f64::max);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{CommandLine, IndexSpace, Mesh, RecurringTask};
+
+    #[test]
+    fn products_are_averaged_and_quantized() {
+        let mesh = StructuredMesh::centered_square(1.0, 8);
+        let patches: Vec<_> = [(0..8, 0..2), (0..8, 2..8)]
+            .iter()
+            .map(|rect| {
+                Patch::from_vector_function(&IndexSpace::from(rect), |(i, j)| {
+                    [i as f64, (i * 8 + j) as f64]
+                })
+            })
+            .collect();
+        let state = State {
+            command_line: CommandLine::default(),
+            restart_file: None,
+            mesh: Mesh::Structured(mesh),
+            setup_name: "test".to_string(),
+            parameters: String::new(),
+            primitive: vec![],
+            primitive_patches: vec![],
+            time: 0.0,
+            iteration: 0,
+            checkpoint: RecurringTask::new(),
+            time_series: RecurringTask::new(),
+            products: RecurringTask::new(),
+            masses: vec![],
+            time_series_data: vec![],
+            version: String::new(),
+            compression: None,
+            rank_file: None,
+        };
+
+        let product = Product::new(&state, &mesh, &patches, Format::F32, 2).unwrap();
+        let values: Vec<_> = product
+            .data
+            .chunks_exact(4)
+            .map(|b| f32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+            .collect();
+        assert_eq!((product.header.mesh.ni, product.header.mesh.dx), (4, 0.5));
+        assert_eq!(values[..5], [0.5, 0.5, 0.5, 0.5, 2.5]);
+        assert_eq!(values[16..18], [4.5, 6.5]);
+
+        let product = Product::new(&state, &mesh, &patches, Format::F32, 4).unwrap();
+        let values: Vec<_> = product
+            .data
+            .chunks_exact(4)
+            .map(|b| f32::from_le_bytes([b[0], b[1], b[2], b[3]]))
+            .collect();
+        assert_eq!(values[4..6], [13.5, 17.5]);
+
+        let product = Product::new(&state, &mesh, &patches, Format::U16, 1).unwrap();
+        let (offset, step) = (product.header.offset[1], product.header.step[1]);
+        let values: Vec<_> = product.data[128..]
+            .chunks_exact(2)
+            .map(|b| offset + step * u16::from_le_bytes([b[0], b[1]]) as f64)
+            .collect();
+        assert!(values
+            .iter()
+            .enumerate()
+            .all(|(n, x)| (x - n as f64).abs() <= 0.5 * step));
+        assert!(Product::new(&state, &mesh, &patches, Format::F32, 3).is_err());
+    }
+}
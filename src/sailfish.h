@@ -5,6 +5,12 @@ enum ExecutionMode {
     CPU,
     OMP,
     GPU,
+    Hybrid,
+};
+
+enum FieldLayout {
+    Interleaved,
+    Planar,
 };
 
 enum SinkModel {
@@ -3,6 +3,7 @@
 use crate::error::{self, Error::*};
 use crate::lookup_table::LookupTable;
 use crate::mesh::Mesh;
+use crate::orbit::Orbit;
 use crate::{
     BoundaryCondition, Coordinates, EquationOfState, PointMass, PointMassList, Setup, SinkModel,
     StructuredMesh,
@@ -177,6 +178,7 @@ pub struct Binary {
     pub sink_rate1: f64,
     pub sink_rate2: f64,
     pub sink_model: SinkModel,
+    pub orbit: Option<Orbit>,
     form: kind_config::Form,
 }
 
@@ -194,6 +196,7 @@ impl FromStr for Binary {
             .item("sink_rate",   "10.0", "rate(s) of mass subtraction in the sink (Omega)")
             .item("q",              1.0, "system mass ratio: [0-1]")
             .item("e",              0.0, "orbital eccentricity: [0-1]")
+            .item("live_orbit",   false, "evolve the orbit with the forces and accretion from the gas")
             .merge_string_args_allowing_duplicates(parameters.split(':').filter(|s| !s.is_empty()))
             .map_err(|e| InvalidSetup(format!("{}", e)))?;
 
@@ -212,6 +215,7 @@ impl FromStr for Binary {
             sink_rate1: srate1.unwrap(),
             sink_rate2: srate2.or(srate1).unwrap(),
             sink_model: SinkModel::from_str(form.get("sink_model").into())?,
+            orbit: bool::from(form.get("live_orbit")).then(Orbit::new),
             form,
         })
     }
@@ -295,7 +299,16 @@ impl Setup for Binary {
             radius: self.sink_radius2,
             model: self.sink_model,
         };
-        PointMassList::from_slice(&[mass1, mass2])
+        let masses = PointMassList::from_slice(&[mass1, mass2]);
+
+        match self.orbit {
+            Some(ref orbit) => orbit.masses(time, masses),
+            None => masses,
+        }
+    }
+
+    fn orbit(&self) -> Option<&Orbit> {
+        self.orbit.as_ref()
     }
 
     fn equation_of_state(&self) -> EquationOfState {
@@ -343,6 +356,7 @@ pub struct BinaryWithThermodynamics {
     pub test_model: bool,
     pub one_body: bool,
     pub constant_softening: bool,
+    pub orbit: Option<Orbit>,
     form: kind_config::Form,
 }
 
@@ -370,6 +384,7 @@ impl FromStr for BinaryWithThermodynamics {
             .item("test_model",        false, "use test model")
             .item("one_body",          false, "use one point mass")
             .item("constant_softening",false, "use constant gravitational softening = sink_radius")
+            .item("live_orbit",        false, "evolve the orbit with the forces and accretion from the gas")
             .merge_string_args_allowing_duplicates(parameters.split(':').filter(|s| !s.is_empty()))
             .map_err(|e| InvalidSetup(format!("{}", e)))?;
 
@@ -398,6 +413,7 @@ impl FromStr for BinaryWithThermodynamics {
             test_model: form.get("test_model").into(),
             one_body: form.get("one_body").into(),
             constant_softening: form.get("constant_softening").into(),
+            orbit: bool::from(form.get("live_orbit")).then(Orbit::new),
             form,
         })
     }
@@ -483,7 +499,7 @@ impl Setup for BinaryWithThermodynamics {
     }
 
     fn masses(&self, time: f64) -> PointMassList {
-        if !self.one_body {
+        let masses = if !self.one_body {
             let a: f64 = 1.0;
             let m: f64 = 1.0;
             let q: f64 = self.form.get("q").into();
@@ -523,9 +539,18 @@ impl Setup for BinaryWithThermodynamics {
                 model: self.sink_model,
             };
             PointMassList::from_slice(&[mass1])
+        };
+
+        match self.orbit {
+            Some(ref orbit) => orbit.masses(time, masses),
+            None => masses,
         }
     }
 
+    fn orbit(&self) -> Option<&Orbit> {
+        self.orbit.as_ref()
+    }
+
     fn equation_of_state(&self) -> EquationOfState {
         EquationOfState::GammaLaw {
             gamma_law_index: self.gamma_law_index,
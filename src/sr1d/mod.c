@@ -542,7 +542,8 @@ EXTERN_C void sr1d_primitive_to_conserved(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved) {
                 primitive_to_conserved_zone(face_positions, primitive, conserved, scale_factor, coords, i);
@@ -592,7 +593,8 @@ EXTERN_C void sr1d_conserved_to_primitive(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved) {
                 conserved_to_primitive_zone(face_positions, conserved, primitive, scale_factor, coords, i);
@@ -659,7 +661,8 @@ EXTERN_C void sr1d_advance_rk(
             break;
         }
 
-        case OMP: {
+        case OMP:
+        case Hybrid: {
             #ifdef _OPENMP
             FOR_EACH_OMP(conserved_rk) {
                 advance_rk_zone(face_positions, conserved_rk, primitive_rd, conserved_rd, conserved_wr, bc, coords, a0, adot, t, a, dt, i);
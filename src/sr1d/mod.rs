@@ -61,7 +61,7 @@ pub fn solver(
             coords,
             scale_factor,
         ))),
-        ExecutionMode::OMP => {
+        ExecutionMode::OMP | ExecutionMode::Hybrid => {
             cfg_if! {
                 if #[cfg(feature = "omp")] {
                     Ok(Box::new(omp::Solver::new(
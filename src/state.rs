@@ -1,9 +1,10 @@
+use crate::checkpoint;
 use crate::cmdline::CommandLine;
 use crate::error;
-use crate::{Mesh, Patch, PointMass, Setup};
-use std::fs::{create_dir_all, File};
-use std::io::prelude::*;
-use std::io::Write;
+use crate::mmap::Mapping;
+use crate::{IndexSpace, Mesh, Patch, PointMass, Setup};
+use std::fs::create_dir_all;
+use std::path::Path;
 
 #[derive(Debug, Clone, Copy)]
 pub enum Recurrence {
@@ -65,6 +66,9 @@ pub struct State {
     #[serde(default)]
     pub time_series: RecurringTask,
 
+    #[serde(default)]
+    pub products: RecurringTask,
+
     #[serde(default)]
     pub masses: Vec<PointMass>,
 
@@ -73,22 +77,114 @@ pub struct State {
 
     #[serde(default)]
     pub version: String,
+
+    #[serde(default)]
+    pub compression: Option<checkpoint::Compression>,
+
+    /// The rank which wrote this state, and the number of ranks, if it is
+    /// the header of one of a set of per-rank checkpoint files.
+    #[serde(default)]
+    pub rank_file: Option<(usize, usize)>,
 }
 
-impl State {
-    pub fn from_checkpoint(
+/// Returns the prefix of a per-rank checkpoint file name, e.g.
+/// `chkpt.0000` for `chkpt.0000.r0001.sf`, or `None` if the file is not one.
+fn rank_file_prefix(name: &str) -> Option<&str> {
+    name.strip_suffix(".sf")
+        .and_then(|stem| stem.rsplit_once(".r"))
+        .filter(|(_, rank)| !rank.is_empty() && rank.bytes().all(|c| c.is_ascii_digit()))
+        .map(|(prefix, _)| prefix)
+}
+
+/// If the given file is one of a set of per-rank checkpoint files, named
+/// like `chkpt.0000.r0001.sf`, opens all of the files in the set, in rank
+/// order. The number of files is read from the header of the given one, and
+/// every file from `r0000` up to that number must exist and record the same
+/// set, so that files left in the directory by an earlier run with more
+/// ranks are not mixed in.
+fn open_rank_files(filename: &str) -> Result<Option<Vec<checkpoint::Reader>>, error::Error> {
+    let path = Path::new(filename);
+    let name = path.file_name().and_then(|name| name.to_str());
+    let prefix = match name.and_then(rank_file_prefix) {
+        Some(prefix) => prefix,
+        None => return Ok(None),
+    };
+    let invalid = |what| error::Error::InvalidCheckpoint(format!("{}: {}", filename, what));
+    let header = checkpoint::Reader::open(filename)?.header().clone();
+    let num_ranks = match header.rank_file {
+        Some((_, num_ranks)) => num_ranks,
+        None => {
+            return Err(invalid(
+                "per-rank file does not record its rank".to_string(),
+            ))
+        }
+    };
+    let mut readers = vec![];
+
+    for rank in 0..num_ranks {
+        let file = path.with_file_name(format!("{}.r{:04}.sf", prefix, rank));
+        let file = file.to_string_lossy();
+
+        if !Path::new(file.as_ref()).exists() {
+            return Err(invalid(format!(
+                "{} of the {} rank files is missing",
+                file, num_ranks
+            )));
+        }
+        let reader = checkpoint::Reader::open(&file)?;
+        let other = reader.header();
+
+        if other.rank_file != Some((rank, num_ranks))
+            || other.iteration != header.iteration
+            || other.time != header.time
+        {
+            return Err(invalid(format!(
+                "{} is from a different set of rank files",
+                file
+            )));
+        }
+        readers.push(reader)
+    }
+    Ok(Some(readers))
+}
+
+/// Reads an older checkpoint file, which is one msgpack-encoded `State`.
+fn read_msgpack_checkpoint(filename: &str) -> Result<State, error::Error> {
+    let map = Mapping::open(filename)?;
+    rmp_serde::from_read_ref(map.bytes())
+        .map_err(|e| error::Error::InvalidCheckpoint(format!("{}", e)))
+}
+
+/// A checkpoint opened for a restart, whose grid patches have not been read
+/// yet. The patches of chunked checkpoints are read individually, so each
+/// MPI rank reads only the ones it needs, and never holds the whole grid.
+/// The patches of older msgpack checkpoints are all read when they are
+/// opened.
+pub struct Restart {
+    state: State,
+    readers: Vec<checkpoint::Reader>,
+}
+
+impl Restart {
+    /// Opens a checkpoint file. If it is one of a set of per-rank files, all
+    /// of the files in the set are opened. The model parameters are extended
+    /// with the given ones, and the command line is updated with the given
+    /// one.
+    pub fn open(
         filename: &str,
         new_parameters: &str,
         command_line: &CommandLine,
-    ) -> Result<State, error::Error> {
+    ) -> Result<Self, error::Error> {
         println!("read {}", filename);
 
-        let mut f = File::open(filename).map_err(error::Error::IOError)?;
-        let mut bytes = Vec::new();
-        f.read_to_end(&mut bytes).map_err(error::Error::IOError)?;
-
-        let mut state: State = rmp_serde::from_read_ref(&bytes)
-            .map_err(|e| error::Error::InvalidCheckpoint(format!("{}", e)))?;
+        let (mut state, readers) = match open_rank_files(filename)? {
+            Some(readers) => (readers[0].header().clone(), readers),
+            None if checkpoint::is_chunked(filename)? => {
+                let reader = checkpoint::Reader::open(filename)?;
+                (reader.header().clone(), vec![reader])
+            }
+            None => (read_msgpack_checkpoint(filename)?, vec![]),
+        };
 
         if !state.parameters.is_empty() && !new_parameters.is_empty() {
             state.parameters += ":";
@@ -97,9 +193,67 @@ impl State {
         state.restart_file = Some(filename.to_string());
         state.command_line.update(&command_line)?;
         state.version = crate::sailfish_version();
+        state.rank_file = None;
+
+        Ok(Self { state, readers })
+    }
 
+    /// Returns the state, without its grid patches unless the checkpoint is
+    /// an older msgpack file.
+    pub fn state(&self) -> &State {
+        &self.state
+    }
+
+    /// Returns the index spaces of all of the grid patches in the checkpoint.
+    pub fn spaces(&self) -> Vec<IndexSpace> {
+        if self.readers.is_empty() {
+            return self
+                .state
+                .primitive_patches
+                .iter()
+                .map(Patch::index_space)
+                .collect();
+        }
+        self.readers
+            .iter()
+            .flat_map(|r| r.chunks().iter().map(|c| IndexSpace::from(&c.rect)))
+            .collect()
+    }
+
+    /// Reads the grid patches for which `keep` returns true, in the order of
+    /// `spaces`, and returns the state holding them.
+    pub fn read<F>(self, keep: F) -> Result<State, error::Error>
+    where
+        F: Fn(&IndexSpace) -> bool,
+    {
+        let mut state = self.state;
+
+        if self.readers.is_empty() {
+            state.primitive_patches.retain(|p| keep(&p.index_space()));
+            return Ok(state);
+        }
+        for reader in &self.readers {
+            let wanted: Vec<_> = (0..reader.chunks().len())
+                .filter(|&n| keep(&IndexSpace::from(&reader.chunks()[n].rect)))
+                .collect();
+            state
+                .primitive_patches
+                .extend(reader.read_patches(&wanted)?)
+        }
         Ok(state)
     }
+}
+
+impl State {
+    /// Loads a checkpoint file, with all of its grid patches. If it is one
+    /// of a set of per-rank files, the patches from the whole set are loaded.
+    pub fn from_checkpoint(
+        filename: &str,
+        new_parameters: &str,
+        command_line: &CommandLine,
+    ) -> Result<State, error::Error> {
+        Restart::open(filename, new_parameters, command_line)?.read(|_| true)
+    }
 
     pub fn set_primitive(&mut self, primitive: Vec<f64>) {
         assert!(
@@ -109,24 +263,88 @@ impl State {
         self.primitive = primitive;
     }
 
+    /// Returns the name of the next checkpoint file, or if a rank is given,
+    /// of that rank's part of a set of per-rank checkpoint files.
+    fn checkpoint_filename(&self, outdir: &str, rank: Option<usize>) -> String {
+        match rank {
+            Some(rank) => format!(
+                "{}/chkpt.{:04}.r{:04}.sf",
+                outdir, self.checkpoint.number, rank
+            ),
+            None => format!("{}/chkpt.{:04}.sf", outdir, self.checkpoint.number),
+        }
+    }
+
     pub fn write_checkpoint(
         &mut self,
         setup: &dyn Setup,
         outdir: &str,
     ) -> Result<(), error::Error> {
-        let filename = format!("{}/chkpt.{:04}.sf", outdir, self.checkpoint.number);
+        let filename = self.checkpoint_filename(outdir, None);
         println!("write {}", filename);
+        self.advance_checkpoint(setup);
 
+        create_dir_all(outdir).map_err(error::Error::IOError)?;
+        self.write_file(&filename, None)
+    }
+
+    /// Advances the checkpoint counter, and returns a snapshot of this state
+    /// holding the given grid patches, together with the name of the file it
+    /// is to be written to, e.g. by a `checkpoint::Writer`. If a rank and
+    /// the number of ranks are given, the patches are only that rank's, and
+    /// the file is its part of a set of per-rank checkpoint files, which is
+    /// read back as one state by `Restart`. This state's own grid patches,
+    /// which are out of date once the solvers have been started, are
+    /// released.
+    pub fn checkpoint_snapshot(
+        &mut self,
+        setup: &dyn Setup,
+        outdir: &str,
+        rank_file: Option<(usize, usize)>,
+        primitive_patches: Vec<Patch>,
+    ) -> Result<(State, String), error::Error> {
+        let rank = rank_file.map(|(rank, _)| rank);
+        let filename = self.checkpoint_filename(outdir, rank);
+        match rank {
+            Some(0) => println!("write {}", filename.replace(".r0000.", ".r*.")),
+            Some(_) => {}
+            None => println!("write {}", filename),
+        }
+        self.advance_checkpoint(setup);
+        self.primitive_patches.clear();
+
+        create_dir_all(outdir).map_err(error::Error::IOError)?;
+        let mut snapshot = self.clone();
+        snapshot.primitive_patches = primitive_patches;
+        snapshot.rank_file = rank_file;
+        Ok((snapshot, filename))
+    }
+
+    /// Advances the checkpoint counter as `write_checkpoint` would, without
+    /// writing a file. This is done on the ranks which do not write a
+    /// collective checkpoint, to keep their states in step with the root.
+    pub fn advance_checkpoint(&mut self, setup: &dyn Setup) {
         self.masses = setup.masses(self.time).to_vec();
         self.parameters = setup.model_parameter_string();
         self.checkpoint
             .next(self.time, self.command_line.checkpoint_rule(setup));
+    }
 
-        create_dir_all(outdir).map_err(error::Error::IOError)?;
-        let bytes = rmp_serde::to_vec_named(self).unwrap();
-        let mut file = File::create(&filename).map_err(error::Error::IOError)?;
-        file.write_all(&bytes).map_err(error::Error::IOError)?;
-        Ok(())
+    /// Writes this state to a chunked checkpoint file (see the `checkpoint`
+    /// module), compressing the grid patches with the codec given on the
+    /// command line, or as a delta against the given reference file and its
+    /// patches. Uncompressed patches are written one field at a time, rather
+    /// than first being encoded into memory.
+    pub fn write_file(
+        &mut self,
+        filename: &str,
+        reference: Option<(&str, &[Patch])>,
+    ) -> Result<(), error::Error> {
+        let codec = self.command_line.checkpoint_codec();
+        let patches = std::mem::take(&mut self.primitive_patches);
+        let result = checkpoint::write_chunked(filename, self, &patches, codec, reference);
+        self.primitive_patches = patches;
+        result
     }
 
     pub fn upsample(mut self) -> Self {
@@ -0,0 +1,229 @@
+//! Opt-in instrumentation of the per-patch work done by the solvers.
+//!
+//! When tracing is enabled, each instrumented call records a span: its name,
+//! the patch it worked on, the thread it ran on, its start time and duration,
+//! and the number of bytes it copied. Spans are buffered per thread, so that
+//! recording them does not contend on a lock. At exit the driver writes the
+//! spans as a Chrome trace (which Perfetto also reads), and prints a summary
+//! table of the time spent on each patch. When tracing is disabled, a span is
+//! a single atomic load.
+
+use crate::error::Error;
+use gridiron::rect_map::Rectangle;
+use std::cell::RefCell;
+use std::collections::BTreeMap;
+use std::fmt::Write as _;
+use std::io::Write as _;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex, OnceLock};
+use std::time::Instant;
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+static ORIGIN: OnceLock<Instant> = OnceLock::new();
+static BUFFERS: Mutex<Vec<Arc<Mutex<Vec<Event>>>>> = Mutex::new(Vec::new());
+
+thread_local! {
+    /// This thread's index in `BUFFERS`, and its span buffer.
+    static BUFFER: RefCell<Option<(usize, Arc<Mutex<Vec<Event>>>)>> = RefCell::new(None);
+}
+
+/// A completed span.
+struct Event {
+    name: &'static str,
+    patch: Option<Rectangle<i64>>,
+    thread: usize,
+    start: f64,
+    duration: f64,
+    bytes: usize,
+}
+
+/// Turns on recording of spans for the rest of the run.
+pub fn enable() {
+    ORIGIN.get_or_init(Instant::now);
+    ENABLED.store(true, Ordering::Relaxed)
+}
+
+/// Returns whether spans are being recorded.
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// A timed section of code. The span is recorded when it is dropped.
+pub struct Span {
+    name: &'static str,
+    patch: Option<Rectangle<i64>>,
+    start: Option<Instant>,
+    bytes: usize,
+}
+
+impl Span {
+    /// Starts a span for work which is not specific to one patch.
+    pub fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            patch: None,
+            start: enabled().then(Instant::now),
+            bytes: 0,
+        }
+    }
+
+    /// Starts a span for work done on the given patch.
+    pub fn patch(name: &'static str, patch: &Rectangle<i64>) -> Self {
+        let mut span = Self::new(name);
+        if span.start.is_some() {
+            span.patch = Some(patch.clone())
+        }
+        span
+    }
+
+    /// Adds to the number of bytes copied in this span.
+    pub fn add_bytes(&mut self, bytes: usize) {
+        self.bytes += bytes
+    }
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        if let Some(start) = self.start {
+            let origin = *ORIGIN.get().unwrap();
+            let duration = start.elapsed().as_secs_f64();
+            let start = start.duration_since(origin).as_secs_f64();
+
+            BUFFER.with(|buffer| {
+                let mut buffer = buffer.borrow_mut();
+                let (thread, events) = buffer.get_or_insert_with(|| {
+                    let mut buffers = BUFFERS.lock().unwrap();
+                    buffers.push(Arc::default());
+                    (buffers.len() - 1, buffers.last().unwrap().clone())
+                });
+                events.lock().unwrap().push(Event {
+                    name: self.name,
+                    patch: self.patch.take(),
+                    thread: *thread,
+                    start,
+                    duration,
+                    bytes: self.bytes,
+                });
+            })
+        }
+    }
+}
+
+/// Removes and returns the spans recorded so far on all threads, in order of
+/// their start times.
+fn take_events() -> Vec<Event> {
+    let mut events: Vec<_> = BUFFERS
+        .lock()
+        .unwrap()
+        .iter()
+        .flat_map(|buffer| std::mem::take(&mut *buffer.lock().unwrap()))
+        .collect();
+    events.sort_by(|a, b| a.start.partial_cmp(&b.start).unwrap());
+    events
+}
+
+fn patch_label(patch: &Rectangle<i64>) -> String {
+    format!(
+        "[{}, {}) x [{}, {})",
+        patch.0.start, patch.0.end, patch.1.start, patch.1.end
+    )
+}
+
+/// Writes the recorded spans to a Chrome trace file, and returns a summary
+/// table with the total time and bytes copied for each patch, by span name.
+/// The `process` is used as the process id in the trace, so the files from
+/// several MPI ranks can be loaded together.
+pub fn write(filename: &str, process: usize) -> Result<String, Error> {
+    let events = take_events();
+    let mut json = String::from("{\"traceEvents\":[\n");
+
+    for (n, e) in events.iter().enumerate() {
+        let args = match &e.patch {
+            Some(patch) => format!(
+                "{{\"patch\":\"{}\",\"bytes\":{}}}",
+                patch_label(patch),
+                e.bytes
+            ),
+            None => format!("{{\"bytes\":{}}}", e.bytes),
+        };
+        writeln!(
+            json,
+            "{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3},\"dur\":{:.3},\"args\":{}}}{}",
+            e.name,
+            process,
+            e.thread,
+            e.start * 1e6,
+            e.duration * 1e6,
+            args,
+            if n + 1 < events.len() { "," } else { "" }
+        )
+        .unwrap();
+    }
+    json += "]}\n";
+
+    let mut file = std::fs::File::create(filename).map_err(Error::IOError)?;
+    file.write_all(json.as_bytes()).map_err(Error::IOError)?;
+
+    Ok(summary(&events))
+}
+
+/// Formats the per-patch summary table. Times are in milliseconds; the
+/// columns are the names of the per-patch spans, in alphabetical order.
+fn summary(events: &[Event]) -> String {
+    let mut names: Vec<_> = events
+        .iter()
+        .filter(|e| e.patch.is_some())
+        .map(|e| e.name)
+        .collect();
+    names.sort_unstable();
+    names.dedup();
+
+    let mut patches: BTreeMap<_, (Vec<f64>, usize)> = BTreeMap::new();
+    for e in events {
+        if let Some(patch) = &e.patch {
+            let key = (patch.0.start, patch.1.start, patch.0.end, patch.1.end);
+            let entry = patches
+                .entry(key)
+                .or_insert_with(|| (vec![0.0; names.len()], 0));
+            entry.0[names.binary_search(&e.name).unwrap()] += e.duration * 1e3;
+            entry.1 += e.bytes;
+        }
+    }
+
+    let mut table = format!("{:<28}", "patch");
+    for name in &names {
+        write!(table, " {:>16}", name).unwrap();
+    }
+    writeln!(table, " {:>10} {:>10}", "total", "MB copied").unwrap();
+
+    let totals: Vec<f64> = patches.values().map(|(t, _)| t.iter().sum()).collect();
+    for ((i0, j0, i1, j1), (times, bytes)) in &patches {
+        write!(table, "{:<28}", patch_label(&(*i0..*i1, *j0..*j1))).unwrap();
+        for t in times {
+            write!(table, " {:>16.3}", t).unwrap();
+        }
+        writeln!(
+            table,
+            " {:>10.3} {:>10.3}",
+            times.iter().sum::<f64>(),
+            *bytes as f64 / 1e6
+        )
+        .unwrap();
+    }
+    if !totals.is_empty() {
+        let max = totals.iter().cloned().fold(0.0, f64::max);
+        let min = totals.iter().cloned().fold(f64::MAX, f64::min);
+        let mean = totals.iter().sum::<f64>() / totals.len() as f64;
+        writeln!(
+            table,
+            "{} patches, total ms per patch: min {:.3} mean {:.3} max {:.3} (max/mean {:.2})",
+            totals.len(),
+            min,
+            mean,
+            max,
+            max / mean
+        )
+        .unwrap();
+    }
+    table
+}
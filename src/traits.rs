@@ -1,8 +1,10 @@
+use crate::orbit::Orbit;
 use crate::{
-    BoundaryCondition, Coordinates, Device, EquationOfState, ExecutionMode, IndexSpace, Mesh,
-    Patch, PointMassList, StructuredMesh,
+    BoundaryCondition, Coordinates, Device, EquationOfState, ExecutionMode, FieldLayout,
+    IndexSpace, KernelVariant, Mesh, Patch, PointMassList, StructuredMesh,
 };
 
+use gpu_core::Reduction;
 use gridiron::adjacency_list::AdjacencyList;
 use gridiron::automaton::Automaton;
 use gridiron::rect_map::Rectangle;
@@ -72,9 +74,20 @@ pub trait PatchBasedBuild {
         edge_list: &AdjacencyList<Rectangle<i64>>,
         rk_order: usize,
         mode: ExecutionMode,
+        kernel: KernelVariant,
+        layout: FieldLayout,
         device: Option<Device>,
         setup: Arc<dyn Setup>,
     ) -> Self::Solver;
+
+    /// Returns true if the solvers built for this execution mode and kernel
+    /// variant perform all of the Runge-Kutta stages of a time step in a
+    /// single automaton pass. The driver then exchanges guard zones
+    /// 2 * rk_order deep once per time step, rather than two zones deep once
+    /// per stage.
+    fn fuses_rk_stages(&self, _mode: ExecutionMode, _kernel: KernelVariant) -> bool {
+        false
+    }
 }
 
 /// A trait for 2D solvers which operate on grid patches.
@@ -82,30 +95,64 @@ pub trait PatchBasedBuild {
 /// These solvers implement message passing and task-based parallelism via the
 /// `Automaton` trait.
 pub trait PatchBasedSolve:
-    Automaton<Key = Rectangle<i64>, Value = Self, Message = Patch> + Send + Sync
+    Automaton<Key = Rectangle<i64>, Value = Self, Message = Arc<Patch>> + Send + Sync
 {
     /// Returns the primitive variable array for this solver.
     ///
-    /// The data is row-major with contiguous primitive variable components.
-    /// The array does not include guard zones.
+    /// The data is row-major with contiguous primitive variable components
+    /// (the interleaved layout), regardless of the layout used internally by
+    /// the solver. The array does not include guard zones.
     fn primitive(&self) -> Patch;
 
     /// Sets the time step size to be used in subsequent advance stages.
     fn set_timestep(&mut self, dt: f64);
 
-    /// Returns the largest wavespeed among the zones in the solver's current
-    /// primitive array.
+    /// Starts a reduction for the largest wavespeed among the zones in the
+    /// solver's current primitive array. On a GPU, the reduction completes
+    /// asynchronously, so it can be started on every patch before waiting for
+    /// any of the results.
     ///
     /// This function should be as performant as possible, although if the
     /// reduction required to obtain the maximum wavespeed is slow, the effect
     /// might be mitigated by living on the edge and re-computing the timestep
     /// less frequently than every time step.
-    fn max_wavespeed(&self) -> f64;
+    fn max_wavespeed(&self) -> Reduction;
 
     /// Returns the GPU device this patch should be computed on, or `None` if
     /// the execution should be on the CPU.
     fn device(&self) -> Option<Device>;
 
+    /// Returns the patch holding the solver's current primitive data,
+    /// including guard zones. Neighboring patches read their guard zone data
+    /// directly from its interior when the in-place halo exchange is used.
+    fn guard_source(&self) -> &Patch;
+
+    /// Returns the same patch as `guard_source`, for its guard zones to be
+    /// filled in place.
+    fn guard_target(&mut self) -> &mut Patch;
+
+    /// Performs the work that is done in `Automaton::value` once all guard
+    /// zones have been received, without consuming the solver. The data in
+    /// `guard_source` must not be overwritten by this function; solvers write
+    /// each stage to a second buffer, and swap the two afterwards.
+    fn advance_stage(&mut self);
+
+    /// Updates the zones of the next Runge-Kutta stage which do not depend on
+    /// guard zones, starting a new time step if the last one has completed.
+    /// The remaining zones are then updated by `advance_stage`, once the
+    /// guard zones have been filled. This function writes only to the second
+    /// buffer, and not to zones which neighbors read as guard zones, so it
+    /// may run while the guard zone exchange is in progress. The time step
+    /// size must already be set when a new time step is started.
+    fn advance_interior(&mut self) {}
+
+    /// Returns the wall time, in seconds, this solver has spent advancing
+    /// its data since the last call. The driver uses it as the measured cost
+    /// of the patch, to balance the patches over MPI ranks and NUMA nodes.
+    fn take_elapsed(&mut self) -> f64 {
+        0.0
+    }
+
     /// Returns a short sequence of floating-point numbers summarizing the
     /// solver state.
     ///
@@ -120,7 +167,22 @@ pub trait PatchBasedSolve:
     /// reason, all grid patches must return a vector of the same length. The
     /// driver will append the user time to the start of the vector before
     /// recording a time series entry.
-    fn reductions(&self) -> Vec<f64> {
+    ///
+    /// Quantities integrated over time, rather than sampled, may be
+    /// accumulated by the solver as it advances, and reset when they are
+    /// returned. The driver takes a sample before the solvers are rebuilt or
+    /// a checkpoint is written, so that none of them is lost.
+    fn reductions(&mut self) -> Vec<f64> {
+        vec![]
+    }
+
+    /// Returns, for each point mass, the conserved quantities its source
+    /// terms have added to the gas on this patch since the last call, in the
+    /// same order as at the start of `reductions`. The driver calls this
+    /// after every time step to advance a live orbit, so it should only read
+    /// the integrals the solver already keeps. They are still included in
+    /// the next `reductions`.
+    fn point_mass_sources(&mut self) -> Vec<f64> {
         vec![]
     }
 }
@@ -227,6 +289,15 @@ pub trait Setup: Send + Sync {
         PointMassList::default()
     }
 
+    /// May be implemented by setups whose point masses are evolved by the
+    /// driver, rather than following a prescribed trajectory. The setup's
+    /// `masses` method should then return the point masses of this orbit.
+    /// The driver starts the orbit from the point masses in the initial
+    /// state or checkpoint, and advances it after every time step.
+    fn orbit(&self) -> Option<&Orbit> {
+        None
+    }
+
     /// Invoked by solver modules which support a wave-damping zone.
     fn boundary_condition(&self) -> BoundaryCondition {
         BoundaryCondition::Default
@@ -1,10 +1,13 @@
+import os
 import sys
 import numpy as np
-import msgpack
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+import checkpoint
 import re
 
 def reconstitute(filename, fieldnum):
-    chkpt = msgpack.load(open(filename, 'rb'))
+    chkpt = checkpoint.load(filename)
     mesh = chkpt[b'mesh']
     primitive = np.zeros([mesh[b'ni'], mesh[b'nj'], 4])
     for patch in chkpt[b'primitive_patches']:
@@ -38,7 +41,7 @@ def reconstitute(filename, fieldnum):
         return v/cs
 
 nstr       = str(np.char.zfill(str(Nchkpts[0]),4))
-d          = msgpack.load(open(fn+'chkpt.'+nstr+'.sf', 'rb'))
+d          = checkpoint.load(fn+'chkpt.'+nstr+'.sf')
 print(d[b'parameters'])
 DR         = np.float(re.search('domain_radius=(.+?):', d[b'parameters'].decode()).group(1))
 N          = d[b'mesh'][b'ni']
@@ -248,7 +251,7 @@ vx_nm1  = reconstitute(fn+'chkpt.'+nstr+'.sf',1)
 vy_nm1  = reconstitute(fn+'chkpt.'+nstr+'.sf',2)
 pres_nm1= reconstitute(fn+'chkpt.'+nstr+'.sf',3)
 eps_nm1 = reconstitute(fn+'chkpt.'+nstr+'.sf',4)
-t_nm1   = msgpack.load(open(fn+'chkpt.'+nstr+'.sf', 'rb'))[b'time']
+t_nm1   = checkpoint.load(fn+'chkpt.'+nstr+'.sf')[b'time']
 
 rho0    =  rho_nm1*1 #Keep for buffer source terms
 vx0     =   vx_nm1*1
@@ -258,7 +261,7 @@ eps0    =  eps_nm1*1
 
 n       = Nchkpts[1]
 nstr    = str(np.char.zfill(str(n),4))
-d_n     = msgpack.load(open(fn+'chkpt.'+nstr+'.sf', 'rb'))
+d_n     = checkpoint.load(fn+'chkpt.'+nstr+'.sf')
 rho_n   = reconstitute(fn+'chkpt.'+nstr+'.sf',0)
 vx_n    = reconstitute(fn+'chkpt.'+nstr+'.sf',1)
 vy_n    = reconstitute(fn+'chkpt.'+nstr+'.sf',2)
@@ -275,7 +278,7 @@ t.append(t_n)
 
 n       = Nchkpts[2]
 nstr    = str(np.char.zfill(str(n),4))
-d_np1   = msgpack.load(open(fn+'chkpt.'+nstr+'.sf', 'rb'))
+d_np1   = checkpoint.load(fn+'chkpt.'+nstr+'.sf')
 rho_np1 = reconstitute(fn+'chkpt.'+nstr+'.sf',0)
 vx_np1  = reconstitute(fn+'chkpt.'+nstr+'.sf',1)
 vy_np1  = reconstitute(fn+'chkpt.'+nstr+'.sf',2)
@@ -344,7 +347,7 @@ for i in range(3,len(Nchkpts)-1):
 
 	n       = Nchkpts[i]
 	nstr    = str(np.char.zfill(str(n),4))
-	d_np1   = msgpack.load(open(fn+'chkpt.'+nstr+'.sf','rb'))
+	d_np1   = checkpoint.load(fn+'chkpt.'+nstr+'.sf')
 	rho_np1 = reconstitute(fn+'chkpt.'+nstr+'.sf',0)
 	vx_np1  = reconstitute(fn+'chkpt.'+nstr+'.sf',1)
 	vy_np1  = reconstitute(fn+'chkpt.'+nstr+'.sf',2)